@@ -8,39 +8,597 @@
  * This simple client opens a socket at hostname:port and then reads
  * stdin and passes whatever you type to the server using the socket. 
  *
- * Note that it only sends data to the server, it does not receive any data from the
- * server (that would be an easy extension to the demo)
+ * With -w it is two-way: it waits for the server's answer to each line (server -r
+ * sends it back) and prints it. With -k n it sends up to n lines ahead of their
+ * answers (pipelining), which makes a difference with input from a file or pipe.
+ *
+ * With -f each line is sent as one length-prefixed message (for server -f).
+ *
+ * With -C ca.pem it talks TLS (to a server -C), and only to a server whose
+ * certificate is signed by one in ca.pem (for a self-signed server, its own).
+ *
+ * With -d each line is sent as one UDP datagram (for server -d).
+ *
+ * With -l path it connects to a server -l on the same machine, over a Unix domain
+ * socket, instead.
+ *
+ * With -r rate it doesn't read stdin, it generates load instead: rate requests per
+ * second of -s bytes each, spread over -c connections on -t threads, for -D seconds,
+ * against a server -r that sends every byte back. Requests go out on a fixed
+ * schedule whether or not the answers keep up (open loop), up to -k of them in
+ * flight per connection, written together when several are due at once. Latency
+ * is counted from when a request was DUE, not from when it was finally sent, so a
+ * server stall shows up in full instead of just slowing the sender down (the
+ * "coordinated omission" closed-loop testers suffer from). At the end both are
+ * printed as percentiles. A request that never got sent (its connection was at -k,
+ * or failed) or never got answered counts too, as late as the end of the run. With -f the requests are framed messages, which server
+ * -r -f answers in batches.
  *
  */
 
+#define _GNU_SOURCE	/* ppoll() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
 
 #include "ssocklib.h"
 
 #define BUFFER_SIZE	(256)
+#define CONNECT_TIMEOUT	(5000)	/* ms */
+#define LOAD_IO_SIZE	(64 * 1024)
+#define LOAD_DRAIN_NS	(2000000000LL)	/* wait this long for answers after the last request */
 
-int main(int argc, char *argv[])
+#define USAGE	"usage: client [-C ca.pem] [-d] [-f] [-l path] [-p profile] [-w [-k in flight]] host port\n" \
+		"       client -r rate [-c connections] [-t threads] [-s size] [-k in flight]\n" \
+		"              [-D seconds] [-f] [-p profile] host port\n"
+
+/*
+ * -r mode: one connection, its schedule and the requests in flight on it
+ */
+typedef struct {
+    int		fd;
+    long long	next_ns;	/* when the next request is due */
+    long long	*due;		/* ring of depth: when each request in flight was due */
+    long long	*sent;		/* ... and when it was actually sent */
+    int		head;
+    int		inflight;
+    long long	wleft;		/* bytes of requests not written yet */
+    int		woff;		/* where the next write starts in a request */
+    long long	rgot;		/* bytes of the oldest answer received so far */
+} LoadConn;
+
+typedef struct {
+    char	*host;
+    int		port;
+    int		nconns;
+    double	rate;		/* this thread's share */
+    LoadConn	*conns;
+    SockHist	*hist;		/* latency from when each request was due */
+    SockHist	*raw;		/* ... from when it was sent, what a closed loop sees */
+    long long	due;		/* on the schedule, sent or not */
+    long long	sent;
+    long long	done;
+    long long	errors;
+    long long	lost;		/* due but not answered by the end, sent or not */
+    pthread_t	thread;
+} LoadThread;
+
+static int	load_size = 64;
+static int	load_depth = 8;
+static int	load_secs = 10;
+static int	load_wire;		/* bytes per request (and answer) on the wire */
+static char	*load_reqs;		/* as many requests back to back as fit in one write */
+static int	load_reqs_len;
+
+static SockTls	*tls = NULL;		/* -C */
+
+/*
+ * -d mode: one datagram per line
+ */
+static void runUdpClient(char *server_host, int port)
+{
+    struct sockaddr_storage	addr;
+    SockDgram			*d;
+    char			*s;
+    int				fd;
+
+    if (ResolveHost(server_host, port, AF_UNSPEC, &addr, 1) < 0) {
+        fprintf(stderr,"ERROR : %s : error looking up [%s] errno = %d.\n",
+		__FILE__,server_host,errno);
+	exit (EXIT_FAILURE);
+    }
+
+    fd = CreateUdpSocket(addr.ss_family, 0);
+    d = CreateDgrams(1, BUFFER_SIZE);
+    if (fd < 0 || d == NULL) {
+        fprintf(stderr,"ERROR : %s : error creating UDP socket errno = %d.\n",__FILE__,errno);
+	exit (EXIT_FAILURE);
+    }
+
+    *d->addr = addr;
+    d->addr_len = SockAddrLen(&addr);
+
+    while ((s = fgets(d->data, d->size, stdin)) != NULL) {
+	d->len = strlen(d->data) - 1;	/* without the newline */
+	if (SendDgrams(fd, d, 1) < 0) {
+	    fprintf(stderr,"ERROR : %s : error sending [%s] to socket [%d] errno = %d\n",
+		    __FILE__,d->data,fd,errno);
+	    exit (EXIT_FAILURE);
+	}
+    }
+
+    CloseDgrams(d);
+    CloseSocket(fd);
+}
+
+/*
+ * the argument that goes with an option, e.g. the "500" in "-c 500"
+ */
+static char *nextArg(int *argc, char ***argv, char *what)
+{
+    char	*arg;
+
+    if (*argc < 2) {
+	fprintf(stderr,"option -%c needs %s\n",**argv[0],what);
+	exit (EXIT_FAILURE);
+    }
+    arg = *++(*argv);
+    --(*argc);
+    **argv += strlen(**argv) - 1;	/* consumed the whole argument */
+
+    return (arg);
+}
+
+static long long nowNs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+ * -r mode: write what is owed on a connection, as far as the socket takes it
+ */
+static int loadWrite(LoadConn *c)
+{
+    int		n, len;
+
+    while (c->wleft > 0) {
+	len = load_reqs_len - c->woff;
+	if (len > c->wleft)
+	    len = (int) c->wleft;
+	n = SendSocket(c->fd, load_reqs + c->woff, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return ((errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1);
+	}
+	c->wleft -= n;
+	c->woff = (c->woff + n) % load_wire;
+    }
+
+    return (0);
+}
+
+/*
+ * -r mode: take in answers, each one completes the oldest request in flight
+ */
+static int loadRead(LoadThread *lt, LoadConn *c)
+{
+    static __thread char	buf[LOAD_IO_SIZE];
+    long long			now;
+    int				n;
+
+    while (1) {
+	n = RecvSocket(c->fd, buf, LOAD_IO_SIZE);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return (0);
+	if (n <= 0)
+	    return (-1);	/* server hung up, or an error */
+
+	now = nowNs();
+	c->rgot += n;
+	while (c->rgot >= load_wire) {
+	    if (c->inflight == 0) {
+		errno = EPROTO;	/* more came back than we sent, is it a server -r? */
+		return (-1);
+	    }
+	    RecordHist(lt->hist, now - c->due[c->head]);
+	    RecordHist(lt->raw, now - c->sent[c->head]);
+	    c->head = (c->head + 1) % load_depth;
+	    c->inflight--;
+	    c->rgot -= load_wire;
+	    lt->done++;
+	}
+    }
+}
+
+static void loadDrop(LoadThread *lt, LoadConn *c)
+{
+    fprintf(stderr,"ERROR : %s : connection [%d] failed errno = %d\n",__FILE__,c->fd,errno);
+    lt->errors++;
+    CloseSocket(c->fd);
+    c->fd = -1;		/* what it had in flight and still had to send is missed */
+}
+
+/*
+ * -r mode, the run is over: every request that was due and not answered gets its
+ * latency as of now, whether it was in flight or never got out (the connection
+ * was at depth, the server stalled; or the connection failed), so a stall costs
+ * the percentiles all it should instead of hiding in a short sent count
+ */
+static void loadMissed(LoadThread *lt, LoadConn *c, long long interval, long long end)
+{
+    long long	now = nowNs(), t, n;
+    int		i, k;
+
+    for (i = 0; i < c->inflight; i++) {
+	k = (c->head + i) % load_depth;
+	RecordHist(lt->hist, now - c->due[k]);
+	RecordHist(lt->raw, now - c->sent[k]);
+    }
+    lt->lost += c->inflight;
+
+    for (n = 0, t = c->next_ns; t < end; t += interval, n++)
+	RecordHist(lt->hist, now - t);
+    lt->lost += n;
+    lt->due += n;
+}
+
+/*
+ * -r mode: one thread's connections, on an open loop schedule
+ */
+static void *loadMain(void *arg)
+{
+    LoadThread		*lt = (LoadThread *) arg;
+    struct pollfd	*pfds;
+    struct timespec	ts;
+    LoadConn		*c;
+    long long		interval, start, end, now, wake;
+    int			i, n, due, live;
+
+	/* the default 50us timer slack would make every request late, and count it */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    lt->conns = calloc(lt->nconns, sizeof(LoadConn));
+    pfds = calloc(lt->nconns, sizeof(struct pollfd));
+    if (lt->conns == NULL || pfds == NULL) {
+	fprintf(stderr,"ERROR : %s : out of memory for %d connections\n",__FILE__,lt->nconns);
+	exit (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < lt->nconns; i++) {
+	c = &lt->conns[i];
+	c->due = calloc(load_depth, sizeof(long long));
+	c->sent = calloc(load_depth, sizeof(long long));
+	c->fd = ConnectHostSocket(lt->host, lt->port, CONNECT_TIMEOUT);
+	if (c->fd < 0 || SetNonBlockSocket(c->fd) < 0 || c->due == NULL || c->sent == NULL) {
+	    fprintf(stderr,"ERROR : %s : error connecting to [%s:%d] errno = %d.\n",
+		    __FILE__,lt->host,lt->port,errno);
+	    exit (EXIT_FAILURE);
+	}
+    }
+
+	/* each connection sends every interval, the connections staggered evenly */
+    interval = (long long) (1e9 * lt->nconns / lt->rate);
+    start = nowNs();
+    end = start + load_secs * 1000000000LL;
+    for (i = 0; i < lt->nconns; i++)
+	lt->conns[i].next_ns = start + interval * i / lt->nconns;
+
+    for (now = start; ; now = nowNs()) {
+	wake = (now < end) ? end : end + LOAD_DRAIN_NS;
+	live = 0;
+
+	for (i = 0; i < lt->nconns; i++) {
+	    c = &lt->conns[i];
+	    if (c->fd < 0)
+		continue;
+
+		/* everything due goes out in one write (pipelined), up to depth in flight */
+	    for (due = 0; now < end && c->next_ns <= now && c->next_ns < end &&
+			  c->inflight < load_depth; due++) {
+		n = (c->head + c->inflight) % load_depth;
+		c->due[n] = c->next_ns;
+		c->sent[n] = now;
+		c->inflight++;
+		c->next_ns += interval;
+	    }
+	    if (due > 0) {
+		c->wleft += (long long) due * load_wire;
+		lt->due += due;
+		lt->sent += due;
+		if (loadWrite(c) < 0) {
+		    loadDrop(lt, c);
+		    continue;
+		}
+	    }
+
+		/* if it is at depth, an answer has to come before anything else is sent */
+	    if (now < end && c->next_ns < end && c->inflight < load_depth && c->next_ns < wake)
+		wake = c->next_ns;
+
+	    pfds[i].fd = c->fd;
+	    pfds[i].events = POLLIN | ((c->wleft > 0) ? POLLOUT : 0);
+	    pfds[i].revents = 0;
+	    if (now < end || c->inflight > 0)
+		live++;
+	}
+
+	if (live == 0 || now >= end + LOAD_DRAIN_NS)
+	    break;
+
+	for (i = 0; i < lt->nconns; i++) {
+	    if (lt->conns[i].fd < 0)
+		pfds[i].fd = -1;	/* poll() skips it */
+	}
+
+	wake = (wake > now) ? wake - now : 0;
+	ts.tv_sec = wake / 1000000000LL;
+	ts.tv_nsec = wake % 1000000000LL;
+	n = ppoll(pfds, lt->nconns, &ts, NULL);
+	if (n < 0 && errno != EINTR) {
+	    fprintf(stderr,"ERROR : %s : poll failed errno = %d\n",__FILE__,errno);
+	    exit (EXIT_FAILURE);
+	}
+
+	for (i = 0; n > 0 && i < lt->nconns; i++) {
+	    c = &lt->conns[i];
+	    if (c->fd < 0 || pfds[i].revents == 0)
+		continue;
+	    if (((pfds[i].revents & POLLOUT) && loadWrite(c) < 0) ||
+		((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && loadRead(lt, c) < 0))
+		loadDrop(lt, c);
+	}
+    }
+
+    for (i = 0; i < lt->nconns; i++) {
+	c = &lt->conns[i];
+	loadMissed(lt, c, interval, end);
+	if (c->fd >= 0)
+	    CloseSocket(c->fd);
+	free(c->due);
+	free(c->sent);
+    }
+    free(lt->conns);
+    free(pfds);
+
+    return (NULL);
+}
+
+/*
+ * -r mode: start the threads, wait for them, print what they measured
+ */
+static void runLoad(char *host, int port, double rate, int nconns, int nthreads, bool framed)
 {
-    char	server_host[BUFFER_SIZE], line[BUFFER_SIZE], *s;
-    int		port, sockfd, n;
+    static double	percentiles[] = { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 100.0 };
+    LoadThread		*lts;
+    SockHist		*hist, *raw;
+    long long		due = 0, sent = 0, done = 0, errors = 0, lost = 0;
+    unsigned int	hdr = htonl((unsigned int) load_size);
+    int			i;
 
-    if (argc < 2) {
-	fprintf(stderr,"usage: %s server port\n",argv[0]);
+	/* what a request says doesn't matter, with -f it just needs its length in front */
+    load_wire = load_size + (framed ? (int) sizeof(hdr) : 0);
+    load_reqs_len = (LOAD_IO_SIZE > load_wire) ? LOAD_IO_SIZE / load_wire * load_wire : load_wire;
+    load_reqs = calloc(load_reqs_len, 1);
+
+    lts = calloc(nthreads, sizeof(LoadThread));
+    hist = CreateHist();
+    raw = CreateHist();
+    if (lts == NULL || hist == NULL || raw == NULL || load_reqs == NULL) {
+	fprintf(stderr,"ERROR : %s : out of memory for %d threads\n",__FILE__,nthreads);
 	exit (EXIT_FAILURE);
     }
 
-	/* template code, this program has no command line arguments yet... */
+    for (i = 0; framed && i < load_reqs_len; i += load_wire)
+	memcpy(load_reqs + i, &hdr, sizeof(hdr));
+
+    fprintf(stderr,"%.0f %srequests/s of %d bytes, %d connections, %d threads, up to %d in flight "
+	    "per connection, for %d s\n",rate,framed ? "framed " : "",load_size,nconns,nthreads,
+	    load_depth,load_secs);
+
+    for (i = 0; i < nthreads; i++) {
+	lts[i].host = host;
+	lts[i].port = port;
+	lts[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+	lts[i].rate = rate * lts[i].nconns / nconns;
+	lts[i].hist = CreateHist();
+	lts[i].raw = CreateHist();
+	if (lts[i].hist == NULL || lts[i].raw == NULL ||
+	    pthread_create(&lts[i].thread, NULL, loadMain, &lts[i]) != 0) {
+	    fprintf(stderr,"ERROR : %s : error starting thread %d errno = %d\n",__FILE__,i,errno);
+	    exit (EXIT_FAILURE);
+	}
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(lts[i].thread, NULL);
+	MergeHist(hist, lts[i].hist);
+	MergeHist(raw, lts[i].raw);
+	CloseHist(lts[i].hist);
+	CloseHist(lts[i].raw);
+	due += lts[i].due;
+	sent += lts[i].sent;
+	done += lts[i].done;
+	errors += lts[i].errors;
+	lost += lts[i].lost;
+    }
+
+    fprintf(stdout,"%lld requests due, %lld sent, %lld answered (%.0f/s), %lld unanswered, "
+	    "%lld connection errors\n\n",due,sent,done,done / (double) load_secs,lost,errors);
+    fprintf(stdout,"%10s  %14s  %14s\n","percentile","latency us","from send us");
+    for (i = 0; i < (int) (sizeof(percentiles) / sizeof(percentiles[0])); i++) {
+	fprintf(stdout,"%9.3f%%  %14.1f  %14.1f\n",percentiles[i],
+		HistPercentile(hist, percentiles[i]) / 1e3,HistPercentile(raw, percentiles[i]) / 1e3);
+    }
+    fprintf(stdout,"%10s  %14.1f  %14.1f\n","mean",HistMean(hist) / 1e3,HistMean(raw) / 1e3);
+
+    CloseHist(hist);
+    CloseHist(raw);
+    free(lts);
+    free(load_reqs);
+}
+
+/*
+ * -C: ReadFullSocket() through TLS
+ */
+static int readFullTls(char *buffer, int buffer_sz)
+{
+    int	n, got = 0;
+
+    while (got < buffer_sz) {
+	n = ReadTls(tls, buffer + got, buffer_sz - got);
+	if (n <= 0)
+	    return ((got > 0) ? got : n);
+	got += n;
+    }
+
+    return (got);
+}
+
+/*
+ * -w mode: send lines, up to depth ahead of their answers, and print the answers
+ *
+ * server -r sends back exactly what it got, so unframed the answer to a line is
+ * the next strlen(line) bytes, framed it is the next message.
+ */
+static void runTwoWay(int sockfd, bool framed, int depth)
+{
+    SockFramer	*framer = NULL;
+    char	line[BUFFER_SIZE], answer[BUFFER_SIZE], *msg;
+    int		*sizes, head = 0, inflight = 0, n, msg_sz;
+    bool	eof = false;
+
+    sizes = calloc(depth, sizeof(int));
+    if (sizes == NULL || (framed && (framer = CreateFramer(BUFFER_SIZE)) == NULL)) {
+	fprintf(stderr,"ERROR : %s : out of memory\n",__FILE__);
+	exit (EXIT_FAILURE);
+    }
+
+    while (!eof || inflight > 0) {
+	/* send ahead, as far as there is input and room in flight */
+	while (!eof && inflight < depth) {
+	    if (fgets(line, BUFFER_SIZE, stdin) == NULL) {
+		eof = true;	/* control-D, or the end of the file */
+		break;
+	    }
+	    line[strcspn(line, "\n")] = '\0';
+	    msg_sz = strlen(line);
+	    if (!framed && msg_sz == 0)
+		continue;	/* nothing sent, nothing will come back */
+
+	    if (framed)
+		n = SendMessageSocket(sockfd, line, msg_sz);
+	    else
+		n = (tls != NULL) ? WriteTls(tls, line, msg_sz) : WriteFullSocket(sockfd, line, msg_sz);
+	    if (n < 0) {
+		fprintf(stderr,"ERROR : %s : error writing [%s] to socket [%d] errno = %d\n",
+			__FILE__,line,sockfd,errno);
+		exit (EXIT_FAILURE);
+	    }
+	    sizes[(head + inflight) % depth] = msg_sz;
+	    inflight++;
+	}
+
+	if (inflight == 0)
+	    continue;
+
+	/* then the oldest answer */
+	if (framed) {
+	    n = RecvMessageSocket(sockfd, framer, &msg, &msg_sz);
+	} else {
+	    msg = answer;
+	    msg_sz = sizes[head];
+	    n = (tls != NULL) ? readFullTls(answer, msg_sz) : ReadFullSocket(sockfd, answer, msg_sz);
+	    n = (n == msg_sz) ? 1 : -1;
+	}
+	if (n <= 0) {
+	    fprintf(stderr,"ERROR : %s : no answer from socket [%d] (is it a server -r?) errno = %d\n",
+		    __FILE__,sockfd,errno);
+	    exit (EXIT_FAILURE);
+	}
+	fprintf(stdout,"%.*s\n",msg_sz,msg);
+
+	head = (head + 1) % depth;
+	inflight--;
+    }
+
+    if (framer != NULL)
+	CloseFramer(framer);
+    free(sizes);
+}
+
+int main(int argc, char *argv[])
+{
+    char	server_host[BUFFER_SIZE], line[BUFFER_SIZE], *s, *unix_path = NULL, *name, *ca_path = NULL;
+    SockTlsContext	*tls_ctx;
+    int		port = 0, sockfd, n, nconns = 16, nthreads = 1;
+    double	rate = 0;
+    bool	framed = false, udp = false, profile_set = false, two_way = false, depth_set = false;
+
     while (--argc > 0 && (*++argv)[0] == '-') {
         int	c;
-	while ((c = (*++argv)[0])) {
+	while ((c = *++argv[0])) {
 	    switch (c) {
+		case 'C':
+		    ca_path = nextArg(&argc, &argv, "a certificate file");
+		    break;
+		case 'd':
+		    udp = true;
+		    break;
+		case 'f':
+		    framed = true;
+		    break;
+		case 'p':
+		    name = nextArg(&argc, &argv, "a profile name");
+		    if (SetDefaultSocketProfile(SocketProfileByName(name)) < 0) {
+			fprintf(stderr,"unknown profile [%s]\n",name);
+			exit (EXIT_FAILURE);
+		    }
+		    profile_set = true;
+		    break;
+		case 'l':
+		    unix_path = nextArg(&argc, &argv, "a socket path");
+		    break;
+		case 'r':
+		    rate = atof(nextArg(&argc, &argv, "a request rate"));
+		    break;
+		case 'c':
+		    nconns = atoi(nextArg(&argc, &argv, "a connection count"));
+		    break;
+		case 't':
+		    nthreads = atoi(nextArg(&argc, &argv, "a thread count"));
+		    break;
+		case 's':
+		    load_size = atoi(nextArg(&argc, &argv, "a request size"));
+		    break;
+		case 'k':
+		    load_depth = atoi(nextArg(&argc, &argv, "a number of requests"));
+		    depth_set = true;
+		    break;
+		case 'D':
+		    load_secs = atoi(nextArg(&argc, &argv, "a number of seconds"));
+		    break;
+		case 'w':
+		    two_way = true;
+		    break;
 		case 'h':
 		case 'u':
-		    fprintf(stderr,"usage: client host port\n");
+		    fprintf(stderr,"%s",USAGE);
 		    exit (EXIT_SUCCESS);
 		    break;
 		default:
@@ -50,24 +608,94 @@ int main(int argc, char *argv[])
 	}
     }
 
+    if (argc < 2 && unix_path == NULL) {
+	fprintf(stderr,"%s",USAGE);
+	exit (EXIT_FAILURE);
+    }
+
+    if (rate > 0 && (udp || two_way || unix_path != NULL)) {
+	fprintf(stderr,"-r does not go with -d, -w or -l\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (ca_path != NULL && (rate > 0 || udp || framed || unix_path != NULL)) {
+	fprintf(stderr,"-C does not go with -r, -d, -f or -l\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (two_way && udp) {
+	fprintf(stderr,"-w does not go with -d\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (depth_set && load_depth < 1) {
+	fprintf(stderr,"-k needs 1 or more\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (rate > 0 && (nconns < 1 || nthreads < 1 || nthreads > nconns || load_size < 1 ||
+		     load_depth < 1 || load_secs < 1)) {
+	fprintf(stderr,"-r needs at least one connection per thread, and sizes and counts of 1 or more\n");
+	exit (EXIT_FAILURE);
+    }
+
 	/* after processing options, hostname and port are left here */
-    strcpy(server_host, argv[0]);
-    port = atoi(argv[1]);
+    if (unix_path == NULL) {
+	strcpy(server_host, argv[0]);
+	port = atoi(argv[1]);
+    } else {
+	snprintf(server_host, sizeof(server_host), "%s", unix_path);
+    }
 
     fprintf(stderr,"client connecting to [%s] port [%d]\n",server_host, port);
 
-    sockfd = CreateSocket();
-    if (sockfd < 0) {
-        fprintf(stderr,"ERROR : %s : error creating socket errno = %d.\n",__FILE__,errno);
-	exit (EXIT_FAILURE);
+    if (udp && unix_path == NULL) {
+	runUdpClient(server_host, port);
+	exit (EXIT_SUCCESS);
     }
 
-    if (ConnectSocket(sockfd, server_host, port) < 0) {
+    if (rate > 0) {
+	if (!profile_set)
+	    SetDefaultSocketProfile(SOCK_PROFILE_LOW_LATENCY);	/* no Nagle delays in the numbers */
+	runLoad(server_host, port, rate, nconns, nthreads, framed);
+	exit (EXIT_SUCCESS);
+    }
+
+    if (unix_path != NULL) {
+	/* same machine: ConnectSocket() takes the path in place of the host */
+	sockfd = CreateUnixSocket();
+	if (sockfd >= 0 && ConnectSocket(sockfd, unix_path, 0) < 0) {
+	    CloseSocket(sockfd);
+	    sockfd = -1;
+	}
+    } else {
+	/* any of the host's IPv4/IPv6 addresses, and don't hang on a dead one */
+	sockfd = ConnectHostSocket(server_host, port, CONNECT_TIMEOUT);
+    }
+    if (sockfd < 0) {
         fprintf(stderr,"ERROR : %s : error connecting to socket [%s:%d] errno = %d.\n",
 		__FILE__,server_host,port,errno);
 	exit (EXIT_FAILURE);
     }
 
+    /* -C: TLS, trusting the certificates in ca_path (the server's own, if self-signed) */
+    if (ca_path != NULL) {
+	tls_ctx = CreateTlsClientContext(ca_path);
+	if (tls_ctx == NULL || (tls = StartTlsSocket(tls_ctx, sockfd, server_host, CONNECT_TIMEOUT)) == NULL) {
+	    fprintf(stderr,"ERROR : %s : TLS with [%s:%d] failed errno = %d\n",__FILE__,server_host,port,errno);
+	    exit (EXIT_FAILURE);
+	}
+	fprintf(stderr,"TLS, encrypted by the %s\n",(TlsOffload(tls) & SOCK_TLS_KERNEL_SEND) ? "kernel" : "client (no kTLS)");
+    }
+
+    if (two_way) {
+	runTwoWay(sockfd, framed, depth_set ? load_depth : 1);
+	if (tls != NULL)
+	    CloseTls(tls);
+	CloseSocket(sockfd);
+	exit (EXIT_SUCCESS);
+    }
+
     while (true) {
 	if ((s = fgets(line, BUFFER_SIZE, stdin)) == NULL) {
 	    break;	/* user typed control-D to end the input */
@@ -75,7 +703,12 @@ int main(int argc, char *argv[])
 
 	line[strlen(line)-1] = '\0';	/* remove the newline from the input */
 
-        n = SendSocket(sockfd, line, strlen(line));
+	if (framed)
+	    n = SendMessageSocket(sockfd, line, strlen(line));
+	else if (tls != NULL)
+	    n = WriteTls(tls, line, strlen(line));
+	else
+	    n = SendSocket(sockfd, line, strlen(line));
         if (n < 0) {
 	    fprintf(stderr,"ERROR : %s : error writing [%s] to socket [%d] errno = %d\n",
 		__FILE__,line,sockfd,errno);
@@ -83,6 +716,9 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (tls != NULL)
+	CloseTls(tls);
+
     n = CloseSocket(sockfd);
     if (n < 0) {
 	fprintf(stderr,"ERROR : %s : error closing socket [%d] errno = %d\n",
@@ -6,10 +6,55 @@
  *
  *
  * This simple server program that listens on a port for connections, and then
- * it receives some data (text) and echos it to stdout.
- * 
- * Note that it only reads data sent by the client, it does not send any data to the
- * client (that would be an easy extension to the demo)
+ * it receives some data (text) and echos it to stdout (or with -r, back to the
+ * client).
+ *
+ * By default it serves one client at a time. With -e it uses the library event loop
+ * instead and serves any number of clients at once from a single thread, and with
+ * -t threads it runs that many event loops, one per core, sharing the port.
+ *
+ * With -U it serves any number of clients from one thread on the batched I/O engine
+ * (ssockuring.c, io_uring where the kernel has it): one multishot accept, and one
+ * multishot receive per client, into the engine's own buffers.
+ *
+ * With -f the client's text arrives as length-prefixed messages (client -f), so
+ * each line is printed exactly as it was typed, however TCP splits or merges it.
+ *
+ * With -6 it listens on an IPv6 socket, which takes IPv4 clients too.
+ *
+ * With -d it receives UDP datagrams (client -d) instead, one line each.
+ *
+ * With -l path it listens on a Unix domain socket (a path, or @name for an
+ * abstract one) instead of a TCP port, for clients on the same machine.
+ *
+ * With -r it sends everything it receives straight back instead of printing it,
+ * for client -w to show and client -r to measure round trips against. It answers
+ * everything one read brought in with one write: with -f, all the complete
+ * requests a pipelining client had in flight are answered together.
+ * In the event loop
+ * modes answers go out through a write queue per client (ssockqueue.c): a client that
+ * doesn't read them gets no more of its requests read until it has taken most of
+ * what is queued, instead of stalling every other client on the thread.
+ *
+ * With -S seconds it prints the library's statistics to stderr that often: calls,
+ * bytes, EAGAINs and errors per second for each kind of call, and how long they took.
+ *
+ * With -i seconds it drops clients that have said nothing for that long, so one
+ * that connects and goes quiet can't tie the server up (or, with many of them, run
+ * it out of file descriptors).
+ *
+ * The listen backlog is SOMAXCONN unless -b says otherwise. With -m clients the event
+ * loop modes reset new connections once that many are being served (-S shows how
+ * many were turned away), and with -D seconds the kernel only hands over connections
+ * whose client has sent something, or has waited that long.
+ *
+ * With -C cert.pem (certificate and key) clients talk TLS, encrypted by the kernel
+ * (kTLS) where it can, and with -F file every client is sent the file, with
+ * sendfile() (encrypted too with -C), and hung up on. Both serve one client at a time.
+ *
+ * With -T file it traces every socket call the library makes (ssocktrace.c): kill -USR1
+ * turns the trace off and on again, kill -USR2 or a control-C writes it to file, for
+ * ssock_tracedump to print.
  *
  */
 
@@ -19,13 +64,43 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "ssocklib.h"
 
 #define BUFFER_SIZE	(256)
 #define HOST_NAME_MAX	BUFFER_SIZE	/* _POSIX_HOST_NAME_MAX is 255 */
+#define LISTEN_QUEUE	SOMAXCONN	/* default backlog, the kernel caps it at net.core.somaxconn */
+#define MAX_MESSAGE	(64 * 1024)	/* biggest framed message we accept */
+#define UDP_BATCH	(32)		/* datagrams per RecvDgrams() */
+#define MAX_DATAGRAM	(64 * 1024)	/* room for a GRO receive */
+#define ECHO_SIZE	(64 * 1024)	/* -r: read this much at a time */
+#define PIPELINE_MAX	(256)		/* -r -f: most answers sent in one go */
+#define QUEUE_LOW	(64 * 1024)	/* -r, event loop: answers queued for a client... */
+#define QUEUE_HIGH	(1024 * 1024)	/* ...stop reading its requests past this, until this */
+#define TLS_TIMEOUT	(5000)		/* ms for a client's TLS handshake */
+#define URING_BUFS	(512)		/* -U: receive buffers... */
+#define URING_BUF_SIZE	(16 * 1024)	/* ...of this size */
+#define URING_EVENTS	(64)		/* -U: completions handled per wait */
 
 static int sockfd;
+static bool framed = false;
+static bool reply = false;
+static int stats_secs = 0;
+static int idle_secs = 0;
+static char *trace_path = NULL;
+static int backlog = LISTEN_QUEUE;
+static int max_clients = 0;
+static int defer_secs = 0;
+static SockEventLoop *event_loop = NULL;	/* -e, for -S */
+static SockWorkers *workers = NULL;		/* -t, for -S */
+static SockUring *uring = NULL;			/* -U */
+static bool accept_parked = false;		/* -U: out of fds, accept again on the next close */
 
 /* catch SIGINT to clean up before exit... */
 static void intHandler(int sig)
@@ -34,30 +109,755 @@ static void intHandler(int sig)
 
     CloseSocket(sockfd); /* ignore errors, we are exiting... */
 
+    if (trace_path != NULL)
+	(void) DumpSockTrace(trace_path);
+
     exit (EXIT_SUCCESS);
 }
 
+/* -T: SIGUSR1 turns tracing off and on, SIGUSR2 dumps what has been traced so far */
+static void traceHandler(int sig)
+{
+    if (sig == SIGUSR1)
+	SetSockTrace(!SockTraceOn());
+    else
+	(void) DumpSockTrace(trace_path);
+}
 
-int main(int argc, char *argv[])
+/*
+ * -r -f: answer msg and every other request that came in with the same read,
+ * all in one write; a pipelining client has many requests in flight, this is
+ * one syscall for all of them instead of one each
+ */
+static int replyMessages(int fd, SockFramer *framer, char *msg, int msg_sz)
 {
-    char	server_host[HOST_NAME_MAX], buffer[BUFFER_SIZE];
-    int		port, newsockfd, n;
-    bool	connection_alive = false;
+    char	*msgs[PIPELINE_MAX];
+    int		sizes[PIPELINE_MAX], n = 0, more = 0;
 
+    msgs[n] = msg;
+    sizes[n++] = msg_sz;
 
-    if (argc < 2) {
-	fprintf(stderr,"usage: %s hostname port\n",argv[0]);
-	exit (EXIT_FAILURE);
+	/* "processing" a request is sending it back; they all point into the framer */
+    while (n < PIPELINE_MAX && (more = NextMessageFramer(framer, &msgs[n], &sizes[n])) > 0)
+	n++;
+
+    if (n < PIPELINE_MAX && more < 0)
+	return (-1);
+
+    return (SendMessagesSocket(fd, msgs, sizes, n));
+}
+
+/*
+ * event loop mode: one client
+ */
+typedef struct {
+    SockFramer		*framer;	/* -f */
+    SockWriteQueue	*wq;		/* -r: the answers it hasn't taken yet */
+    bool		resume;		/* -r: wq drained, read its requests again */
+} Client;
+
+static void dropClient(SockEventLoop *loop, int fd, Client *c)
+{
+    RemoveEventLoop(loop, fd);
+    CloseSocket(fd);
+    if (c->framer != NULL)
+	CloseFramer(c->framer);
+    if (c->wq != NULL)
+	CloseWriteQueue(c->wq);
+    free(c);
+}
+
+/*
+ * -r -f: queue the answer to one request (the request itself, framed)
+ */
+static int queueMessage(Client *c, char *msg, int msg_sz)
+{
+    unsigned int	hdr = htonl((unsigned int) msg_sz);
+
+    if (QueueWrite(c->wq, (char *) &hdr, sizeof(hdr)) < 0)
+	return (-1);
+
+    return (QueueWrite(c->wq, msg, msg_sz));
+}
+
+/*
+ * event loop mode: a client has data for us (or hung up)
+ *
+ * The socket is edge-triggered so keep reading until the kernel says EAGAIN. With
+ * -r the answers to everything one read brought in go out with one send, and if the
+ * client isn't taking its answers, its requests are left unread until it does.
+ */
+static void readClient(SockEventLoop *loop, int fd, void *arg)
+{
+    Client	*c = (Client *) arg;
+    SockBuf	*buf;
+    char	buffer[BUFFER_SIZE], *msg;
+    int		n, msg_sz;
+
+    while (true) {
+	if (c->wq != NULL && WriteQueueFull(c->wq))
+	    return;		/* backpressure: writeClient() picks up again */
+
+	if (c->framer != NULL) {
+	    n = RecvMessageSocket(fd, c->framer, &msg, &msg_sz);
+	    if (n > 0 && reply) {
+		/* this one, and every other whole request the same read brought in */
+		do {
+		    if (queueMessage(c, msg, msg_sz) < 0)
+			break;
+		} while ((n = NextMessageFramer(c->framer, &msg, &msg_sz)) > 0);
+		if (n == 0 && FlushWriteQueue(c->wq) >= 0)
+		    continue;
+		n = -1;
+	    } else if (n > 0) {
+		fprintf(stdout,"%.*s\n",msg_sz,msg);
+		continue;
+	    }
+	} else if (reply) {
+	    n = RecvSockBuf(fd, &buf, ECHO_SIZE);
+	    if (n > 0) {
+		/* sent back as it is, no copy */
+		if (QueueSockBuf(c->wq, buf) < 0 || FlushWriteQueue(c->wq) < 0)
+		    n = -1;
+		else
+		    continue;
+	    }
+	} else {
+	    n = RecvSocket(fd, buffer, BUFFER_SIZE-1);
+	    if (n > 0) {
+		buffer[n] = '\0';
+		fprintf(stdout,"%s\n",buffer);
+		continue;
+	    }
+	}
+
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return;		/* drained, wait for the next event */
+
+	if (n < 0) {
+	    fprintf(stderr,"ERROR : %s : error receiving from socket [%d] errno = %d\n",
+		    __FILE__,fd,errno);
+	}
+
+	/* client closed the connection (or it broke), forget about it */
+	dropClient(loop, fd, c);
+	return;
+    }
+}
+
+/*
+ * event loop mode -r: the client made room, send it more of its answers
+ */
+static void writeClient(SockEventLoop *loop, int fd, void *arg)
+{
+    Client	*c = (Client *) arg;
+
+    if (FlushWriteQueue(c->wq) < 0) {
+	dropClient(loop, fd, c);
+	return;
     }
 
-	/* template code, this program has no command line arguments yet... */
+    if (c->resume) {
+	c->resume = false;
+	readClient(loop, fd, c);	/* requests left unread while it was over */
+    }
+}
+
+/*
+ * -r: a client's answers crossed a watermark
+ */
+static void queueMark(SockWriteQueue *q, int over, void *arg)
+{
+    ((Client *) arg)->resume = !over;
+}
+
+/*
+ * event loop mode -i: a client said nothing for idle_secs, drop it
+ */
+static void idleClient(SockEventLoop *loop, int fd, void *arg)
+{
+    fprintf(stderr,"closing idle client [%d]\n",fd);
+
+    dropClient(loop, fd, (Client *) arg);
+}
+
+/*
+ * event loop mode: a new client connected
+ */
+static void acceptClient(SockEventLoop *loop, int fd, void *arg)
+{
+    Client	*c;
+    char	peer[64];
+
+    SockAddrName(EventLoopPeer(loop), peer, sizeof(peer));
+
+    c = calloc(1, sizeof(Client));
+    if (c == NULL || (framed && (c->framer = CreateFramer(MAX_MESSAGE)) == NULL) ||
+	(reply && (c->wq = CreateWriteQueue(fd, QUEUE_LOW, QUEUE_HIGH, queueMark, c)) == NULL)) {
+	fprintf(stderr,"ERROR : %s : out of memory for socket [%d] from %s\n",__FILE__,fd,peer);
+	CloseSocket(fd);
+	if (c != NULL && c->framer != NULL)
+	    CloseFramer(c->framer);
+	free(c);
+	return;
+    }
+
+    if (AddEventLoop(loop, fd, readClient, reply ? writeClient : NULL, c) < 0) {
+	fprintf(stderr,"ERROR : %s : error watching socket [%d] from %s errno = %d\n",
+		__FILE__,fd,peer,errno);
+	CloseSocket(fd);
+	if (c->framer != NULL)
+	    CloseFramer(c->framer);
+	if (c->wq != NULL)
+	    CloseWriteQueue(c->wq);
+	free(c);
+	return;
+    }
+
+    if (idle_secs > 0 && SetIdleEventLoop(loop, fd, idle_secs * 1000, idleClient) < 0)
+	fprintf(stderr,"ERROR : %s : no idle timeout for socket [%d] errno = %d\n",__FILE__,fd,errno);
+}
+
+static void runEventServer(int listenfd)
+{
+    SockEventLoop	*loop;
+
+    loop = CreateEventLoop();
+    if (loop == NULL) {
+	fprintf(stderr,"ERROR : %s : error creating event loop errno = %d\n",__FILE__,errno);
+	exit(EXIT_FAILURE);
+    }
+
+    if (AddListenEventLoop(loop, listenfd, acceptClient, NULL) < 0) {
+	fprintf(stderr,"ERROR : %s : error watching socket [%d] errno = %d\n",
+		__FILE__,listenfd,errno);
+	exit(EXIT_FAILURE);
+    }
+
+	/* -m: past that many clients, new ones are reset at once */
+    (void) SetAcceptLimitEventLoop(loop, max_clients);
+    event_loop = loop;
+
+    if (RunEventLoop(loop) < 0) {
+	fprintf(stderr,"ERROR : %s : event loop failed errno = %d\n",__FILE__,errno);
+	exit(EXIT_FAILURE);
+    }
+
+    CloseEventLoop(loop);
+}
+
+/*
+ * -U mode: one client, with the operations it has queued on the engine
+ */
+typedef struct {
+    int		fd;
+    int		ops;		/* queued and not yet reported for the last time */
+    bool	closing;
+} UringClient;
+
+/*
+ * -U -r: an answer on its way back, straight out of the receive buffer
+ */
+typedef struct {
+    UringClient	*c;
+    int		bufid;
+    char	*data;
+    int		len;
+} UringSend;
+
+/*
+ * -U: stop taking anything more from a client (cancel: what is queued too), and
+ * close it once its last operation is over, the kernel still has the fd until then
+ */
+static void closeUringClient(UringClient *c, bool cancel)
+{
+    if (cancel && !c->closing && c->ops > 0)
+	(void) CancelUring(uring, c->fd);
+    c->closing = true;
+
+    if (c->ops > 0)
+	return;
+
+    CloseSocket(c->fd);
+    free(c);
+
+    if (accept_parked && QueueAcceptUring(uring, sockfd, 1, NULL) == 0)
+	accept_parked = false;
+}
+
+/*
+ * -U: a new client, its receive stays queued for as long as it is connected
+ */
+static void uringAccept(SockUringEvent *ev)
+{
+    UringClient	*c;
+
+    if (ev->result >= 0) {
+	c = calloc(1, sizeof(UringClient));
+	if (c == NULL || QueueRecvUring(uring, ev->result, 1, c) < 0) {
+	    fprintf(stderr,"ERROR : %s : can't take socket [%d] errno = %d\n",
+		    __FILE__,ev->result,(c == NULL) ? ENOMEM : errno);
+	    CloseSocket(ev->result);
+	    free(c);
+	} else {
+	    c->fd = ev->result;
+	    c->ops = 1;
+	}
+    } else {
+	fprintf(stderr,"ERROR : %s : error accepting socket [%d] errno = %d\n",
+		__FILE__,ev->fd,-ev->result);
+    }
+
+    if (ev->more)
+	return;
+
+	/* out of fds: accepting again right away would only fail again */
+    if (ev->result == -EMFILE || ev->result == -ENFILE)
+	accept_parked = true;
+    else if (QueueAcceptUring(uring, sockfd, 1, NULL) < 0)
+	accept_parked = true;
+}
+
+/*
+ * -U: data from a client (or it hung up): print it, or with -r send it back
+ */
+static void uringRecv(SockUringEvent *ev)
+{
+    UringClient	*c = (UringClient *) ev->arg;
+    UringSend	*snd;
+
+    if (ev->result > 0 && reply && !c->closing) {
+	snd = malloc(sizeof(UringSend));
+	if (snd != NULL) {
+	    snd->c = c;
+	    snd->bufid = ev->bufid;
+	    snd->data = ev->buffer;
+	    snd->len = ev->result;
+	}
+	if (snd == NULL || QueueSendUring(uring, c->fd, snd->data, snd->len, snd) < 0) {
+	    fprintf(stderr,"ERROR : %s : can't answer socket [%d]\n",__FILE__,c->fd);
+	    (void) ReleaseUringBuffer(uring, ev->bufid);
+	    free(snd);
+	    closeUringClient(c, true);
+	    return;
+	}
+	c->ops++;
+    } else if (ev->result > 0) {
+	if (!c->closing)
+	    fprintf(stdout,"%.*s\n",ev->result,ev->buffer);
+	(void) ReleaseUringBuffer(uring, ev->bufid);
+    } else if (ev->result < 0 && ev->result != -ECANCELED) {
+	fprintf(stderr,"ERROR : %s : error receiving from socket [%d] errno = %d\n",
+		__FILE__,c->fd,-ev->result);
+    }
+
+    if (ev->more)
+	return;
+
+	/* the receive is over: hung up, failed or cancelled; answers still going finish */
+    c->ops--;
+    closeUringClient(c, ev->result < 0);
+}
+
+/*
+ * -U -r: an answer went out (or some of it did)
+ */
+static void uringSend(SockUringEvent *ev)
+{
+    UringSend	*snd = (UringSend *) ev->arg;
+    UringClient	*c = snd->c;
+
+    if (ev->result > 0 && ev->result < snd->len && !c->closing) {
+	snd->data += ev->result;
+	snd->len -= ev->result;
+	if (QueueSendUring(uring, c->fd, snd->data, snd->len, snd) == 0)
+	    return;
+    }
+
+    (void) ReleaseUringBuffer(uring, snd->bufid);
+    free(snd);
+    c->ops--;
+
+    if (ev->result < 0 || c->closing)
+	closeUringClient(c, ev->result < 0);
+}
+
+static void runUringServer(int listenfd)
+{
+    SockUringEvent	events[URING_EVENTS];
+    int			i, n;
+
+    uring = CreateUring(256, URING_BUFS, URING_BUF_SIZE);
+    if (uring == NULL) {
+	fprintf(stderr,"ERROR : %s : error creating the I/O engine errno = %d\n",__FILE__,errno);
+	exit(EXIT_FAILURE);
+    }
+    fprintf(stderr,"running on %s\n",UringIsNative(uring) ? "io_uring" : "poll() (no io_uring here)");
+
+    if (QueueAcceptUring(uring, listenfd, 1, NULL) < 0) {
+	fprintf(stderr,"ERROR : %s : error accepting on socket [%d] errno = %d\n",
+		__FILE__,listenfd,errno);
+	exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+	n = WaitUring(uring, events, URING_EVENTS, -1);
+	if (n < 0) {
+	    fprintf(stderr,"ERROR : %s : waiting for completions failed errno = %d\n",__FILE__,errno);
+	    exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+	    if (events[i].op == SOCK_URING_ACCEPT)
+		uringAccept(&events[i]);
+	    else if (events[i].op == SOCK_URING_RECV)
+		uringRecv(&events[i]);
+	    else
+		uringSend(&events[i]);
+	}
+    }
+}
+
+/*
+ * -f mode without the event loop: print whole messages until the client hangs up
+ */
+static void runFramedClient(int fd)
+{
+    SockFramer	*framer;
+    char	*msg;
+    int		n, msg_sz;
+
+    framer = CreateFramer(MAX_MESSAGE);
+    if (framer == NULL) {
+	fprintf(stderr,"ERROR : %s : out of memory for socket [%d]\n",__FILE__,fd);
+	exit(EXIT_FAILURE);
+    }
+
+    while ((n = RecvMessageSocket(fd, framer, &msg, &msg_sz)) > 0) {
+	if (reply && replyMessages(fd, framer, msg, msg_sz) < 0) {
+	    n = -1;
+	    break;
+	}
+	if (!reply)
+	    fprintf(stdout,"%.*s\n",msg_sz,msg);
+    }
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	fprintf(stderr,"closing idle client [%d]\n",fd);
+    else if (n < 0 && errno == ETIMEDOUT)	/* -i: it stopped reading our replies */
+	fprintf(stderr,"closing client [%d], not taking replies\n",fd);
+    else if (n < 0) {
+	fprintf(stderr,"ERROR : %s : error receiving from socket [%d] errno = %d\n",
+		__FILE__,fd,errno);
+    }
+
+    CloseFramer(framer);
+}
+
+/*
+ * -C mode: RecvSockBuf() through TLS
+ */
+static int recvTlsBuf(SockTls *tls, SockBuf **bufp, int size)
+{
+    SockBuf	*buf;
+    int		n;
+
+    buf = GetSockBuf(size);
+    if (buf == NULL)
+	return (-1);
+
+    n = ReadTls(tls, buf->data, size);
+    if (n <= 0) {
+	PutSockBuf(buf);
+	return (n);
+    }
+    buf->len = n;
+    *bufp = buf;
+
+    return (n);
+}
+
+/*
+ * -F mode: send the whole file (encrypted with -C) and hang up
+ */
+static void sendFile(int fd, SockTls *tls, char *path)
+{
+    struct timespec	t0, t1;
+    long long		n, offset = 0;
+    int			filefd;
+
+    filefd = open(path, O_RDONLY | O_CLOEXEC);
+    if (filefd < 0) {
+	fprintf(stderr,"ERROR : %s : can't open [%s] errno = %d\n",__FILE__,path,errno);
+	return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    n = (tls != NULL) ? SendFileTls(tls, filefd, &offset, -1) : SendFileSocket(fd, filefd, &offset, -1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (n < 0)
+	fprintf(stderr,"ERROR : %s : error sending [%s] to socket [%d] errno = %d\n",__FILE__,path,fd,errno);
+    else
+	fprintf(stderr,"sent %lld bytes to client [%d] in %.3f s%s\n",n,fd,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+		(tls == NULL) ? "" : (TlsOffload(tls) & SOCK_TLS_KERNEL_SEND) ? ", kernel TLS" : ", user space TLS");
+
+    close(filefd);
+}
+
+/*
+ * -d mode: print datagrams, received in batches, until killed
+ */
+static void runUdpServer(int port, int family)
+{
+    SockDgram	*d;
+    int		n, i, off, len;
+
+    sockfd = CreateUdpSocket(family, port);
+    if (sockfd < 0) {
+	fprintf(stderr,"ERROR : %s : error creating UDP socket on [%d] errno = %d\n",
+		__FILE__,port,errno);
+	exit(EXIT_FAILURE);
+    }
+
+    (void) SetUdpGro(sockfd, 1);	/* fine if the kernel can't */
+
+    d = CreateDgrams(UDP_BATCH, MAX_DATAGRAM);
+    if (d == NULL) {
+	fprintf(stderr,"ERROR : %s : out of memory for datagrams\n",__FILE__);
+	exit(EXIT_FAILURE);
+    }
+
+    while ((n = RecvDgrams(sockfd, d, UDP_BATCH, -1)) >= 0) {
+	for (i = 0; i < n; i++) {
+	    /* with GRO one buffer may hold several datagrams */
+	    for (off = 0; off < d[i].len; off += len) {
+		len = (d[i].segment > 0 && d[i].len - off > d[i].segment) ?
+			d[i].segment : d[i].len - off;
+		fprintf(stdout,"%.*s\n",len,d[i].data + off);
+	    }
+	}
+    }
+
+    fprintf(stderr,"ERROR : %s : error receiving from socket [%d] errno = %d\n",
+	    __FILE__,sockfd,errno);
+    CloseDgrams(d);
+}
+
+/*
+ * -t mode: every worker thread has its own listener and event loop
+ */
+static void runThreadedServer(int nthreads, int port, int family)
+{
+    workers = StartWorkersFamily(nthreads, family, port, backlog, acceptClient, NULL);
+    if (workers == NULL) {
+	fprintf(stderr,"ERROR : %s : error starting %d workers on [%d] errno = %d\n",
+		__FILE__,nthreads,port,errno);
+	exit(EXIT_FAILURE);
+    }
+
+    if (SetAcceptLimitWorkers(workers, max_clients) < 0) {
+	fprintf(stderr,"ERROR : %s : -m %d is fewer clients than the %d threads\n",
+		__FILE__,max_clients,nthreads);
+	exit(EXIT_FAILURE);
+    }
+    if (defer_secs > 0 && SetDeferAcceptWorkers(workers, defer_secs) < 0)
+	fprintf(stderr,"ERROR : %s : no TCP_DEFER_ACCEPT errno = %d\n",__FILE__,errno);
+
+    if (WaitWorkers(workers) < 0) {
+	fprintf(stderr,"ERROR : %s : worker event loop failed errno = %d\n",__FILE__,errno);
+	exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * -S mode: every stats_secs, what the library did since the last time
+ */
+static void *statsMain(void *arg)
+{
+    SockStats	now, last;
+    SockOpStats	*o, *l, d;
+    double	secs;
+    long long	shed, last_shed = 0;
+    int		i, b, e;
+
+    GetSockStats(&last);
+
+    while (true) {
+	sleep(stats_secs);
+	GetSockStats(&now);
+	secs = (now.when_ns - last.when_ns) / 1e9;
+
+	for (i = 0; i < SOCK_STAT_OPS; i++) {
+	    o = &now.op[i];
+	    l = &last.op[i];
+	    if (o->calls == l->calls)
+		continue;
+	    for (b = 0; b < SOCK_STAT_BUCKETS; b++)
+		d.latency[b] = o->latency[b] - l->latency[b];	/* just this interval's */
+	    fprintf(stderr,"stats: %-7s %9.0f calls/s %11.0f bytes/s %7.0f eagain/s %5.0f errors/s"
+		    "  p50 %lld p99 %lld ns\n",SockStatName(i),(o->calls - l->calls) / secs,
+		    (o->bytes - l->bytes) / secs,(o->eagain - l->eagain) / secs,
+		    (o->errors - l->errors) / secs,SockStatPercentile(&d, 50.0),
+		    SockStatPercentile(&d, 99.0));
+	}
+	for (e = 0; e < SOCK_STAT_ERRNOS; e++) {
+	    if (now.errnos[e] != last.errnos[e])
+		fprintf(stderr,"stats: errno %d x %lld\n",e,now.errnos[e] - last.errnos[e]);
+	}
+	shed = (workers != NULL) ? WorkersShed(workers) : EventLoopShed(event_loop);
+	if (shed != last_shed)
+	    fprintf(stderr,"stats: shed    %9.0f clients/s (over -m)\n",(shed - last_shed) / secs);
+	last_shed = shed;
+
+	last = now;
+    }
+
+    return (arg);
+}
+
+int main(int argc, char *argv[])
+{
+    char	server_host[HOST_NAME_MAX], *unix_path = NULL, *cert_path = NULL, *send_path = NULL;
+    SockTlsContext	*tls_ctx = NULL;
+    SockTls	*tls = NULL;
+    SockBuf	*buf;
+    int		port = 0, newsockfd, n;
+    int		nthreads = 0;
+    bool	connection_alive = false, event_mode = false, ipv6 = false, udp = false, uring_mode = false;
+
+
     while (--argc > 0 && (*++argv)[0] == '-') {
         int	c;
-	while ((c = (*++argv)[0])) {
+	while ((c = *++argv[0])) {
 	    switch (c) {
+		case '6':
+		    ipv6 = true;
+		    break;
+		case 'b':
+		    if (argc < 2) {
+			fprintf(stderr,"option -b needs a backlog length\n");
+			exit (EXIT_FAILURE);
+		    }
+		    backlog = atoi(*++argv);
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'C':
+		    if (argc < 2) {
+			fprintf(stderr,"option -C needs a certificate file\n");
+			exit (EXIT_FAILURE);
+		    }
+		    cert_path = *++argv;
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'D':
+		    if (argc < 2) {
+			fprintf(stderr,"option -D needs a number of seconds\n");
+			exit (EXIT_FAILURE);
+		    }
+		    defer_secs = atoi(*++argv);
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'd':
+		    udp = true;
+		    break;
+		case 'e':
+		    event_mode = true;
+		    break;
+		case 'F':
+		    if (argc < 2) {
+			fprintf(stderr,"option -F needs a file to send\n");
+			exit (EXIT_FAILURE);
+		    }
+		    send_path = *++argv;
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'f':
+		    framed = true;
+		    break;
+		case 'p':
+		    if (argc < 2) {
+			fprintf(stderr,"option -p needs a profile name\n");
+			exit (EXIT_FAILURE);
+		    }
+		    if (SetDefaultSocketProfile(SocketProfileByName(*++argv)) < 0) {
+			fprintf(stderr,"unknown profile [%s]\n",*argv);
+			exit (EXIT_FAILURE);
+		    }
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'i':
+		    if (argc < 2) {
+			fprintf(stderr,"option -i needs a number of seconds\n");
+			exit (EXIT_FAILURE);
+		    }
+		    idle_secs = atoi(*++argv);
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'm':
+		    if (argc < 2) {
+			fprintf(stderr,"option -m needs a number of clients\n");
+			exit (EXIT_FAILURE);
+		    }
+		    max_clients = atoi(*++argv);
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'l':
+		    if (argc < 2) {
+			fprintf(stderr,"option -l needs a socket path\n");
+			exit (EXIT_FAILURE);
+		    }
+		    unix_path = *++argv;
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'r':
+		    reply = true;
+		    break;
+		case 'S':
+		    if (argc < 2) {
+			fprintf(stderr,"option -S needs a number of seconds\n");
+			exit (EXIT_FAILURE);
+		    }
+		    stats_secs = atoi(*++argv);
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 'U':
+		    uring_mode = true;
+		    break;
+		case 'T':
+		    if (argc < 2) {
+			fprintf(stderr,"option -T needs a trace file\n");
+			exit (EXIT_FAILURE);
+		    }
+		    trace_path = *++argv;
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
+		case 't':
+		    if (argc < 2) {
+			fprintf(stderr,"option -t needs a thread count\n");
+			exit (EXIT_FAILURE);
+		    }
+		    nthreads = atoi(*++argv);
+		    --argc;
+		    *argv += strlen(*argv) - 1;	/* consumed the whole argument */
+		    break;
                 case 'h':
                 case 'u':
-                    fprintf(stderr,"usage: server host port\n");
+                    fprintf(stderr,"usage: server [-6] [-b backlog] [-C cert.pem] [-D seconds] [-d] [-e] [-F file] [-f] [-i seconds] [-l path] [-m clients] [-p profile] [-r] [-S seconds] [-t threads] [-T trace file] [-U] host port\n");
                     exit (EXIT_SUCCESS);
 		    break;
 		default:
@@ -67,34 +867,125 @@ int main(int argc, char *argv[])
 	}
     }
 
+    if (argc < 2 && unix_path == NULL) {
+	fprintf(stderr,"usage: server [-6] [-b backlog] [-C cert.pem] [-D seconds] [-d] [-e] [-F file] [-f] [-i seconds] [-l path] [-m clients] [-p profile] [-r] [-S seconds] [-t threads] [-T trace file] [-U] hostname port\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (reply && udp) {
+	fprintf(stderr,"-r does not go with -d\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if ((cert_path != NULL || send_path != NULL) && (udp || event_mode || nthreads > 0 || framed)) {
+	fprintf(stderr,"-C and -F don't go with -d, -e, -t or -f\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (uring_mode && (udp || event_mode || nthreads > 0 || framed || cert_path != NULL ||
+		       send_path != NULL || idle_secs > 0 || max_clients > 0)) {
+	fprintf(stderr,"-U does not go with -d, -e, -t, -f, -C, -F, -i or -m\n");
+	exit (EXIT_FAILURE);
+    }
+
+    if (unix_path != NULL && (udp || nthreads > 0)) {
+	fprintf(stderr,"-l does not go with -d or -t\n");
+	exit (EXIT_FAILURE);
+    }
+
 	/* after processing options, hostname and port are left here: */
-    strcpy(server_host, argv[0]);
-    port = atoi(argv[1]);
+    if (unix_path == NULL) {
+	strcpy(server_host, argv[0]);
+	port = atoi(argv[1]);
+    } else {
+	snprintf(server_host, sizeof(server_host), "%s", unix_path);
+    }
 
     /* catch the SIGINT (control-C on Unix) so when we kill the server
      * with control-C we exit gracefully and dump out the data that was dispatched.
      */
     signal(SIGINT, intHandler);
 
+    if (trace_path != NULL) {
+	signal(SIGUSR1, traceHandler);
+	signal(SIGUSR2, traceHandler);
+	SetSockTrace(1);
+    }
+
+    if (stats_secs > 0) {
+	pthread_t	stats_thread;
+
+	if (pthread_create(&stats_thread, NULL, statsMain, NULL) != 0) {
+	    fprintf(stderr,"ERROR : %s : error starting the statistics thread\n",__FILE__);
+	    exit (EXIT_FAILURE);
+	}
+    }
+
     fprintf(stderr,"server running on [%s] listening to port [%d]\n\n",server_host, port);
 
-    sockfd = CreateSocket();
+    if (udp) {
+	runUdpServer(port, ipv6 ? AF_INET6 : AF_INET);
+	exit (EXIT_FAILURE);
+    }
+
+    if (nthreads > 0) {
+	runThreadedServer(nthreads, port, ipv6 ? AF_INET6 : AF_INET);
+	exit (EXIT_SUCCESS);
+    }
+
+	/* an IPv6 socket takes IPv4 clients as well */
+    if (unix_path != NULL)
+	sockfd = CreateUnixSocket();
+    else
+	sockfd = ipv6 ? CreateSocketFamily(AF_INET6) : CreateSocket();
     if (sockfd < 0) {
 	fprintf(stderr,"ERROR : %s : error creating socket errno = %d\n",__FILE__,errno);
 	exit(EXIT_FAILURE);
     }
 
-    if (BindSocket(sockfd, port) < 0) {
+	/* a restart mustn't fail on the last run's connections in TIME_WAIT */
+    if (unix_path == NULL)
+	(void) SetReuseAddrSocket(sockfd, 1);
+    n = (unix_path != NULL) ? BindUnixSocket(sockfd, unix_path) : BindSocket(sockfd, port);
+    if (n < 0) {
 	fprintf(stderr,"ERROR : %s : error binding socket [%d] on [%d] errno = %d\n",
 		__FILE__,sockfd,port,errno);
 	exit(EXIT_FAILURE);
     }
 
+    if (ListenSocket(sockfd, backlog) < 0) {
+	fprintf(stderr,"ERROR : %s : error listening on socket [%d] errno = %d\n",
+		__FILE__,sockfd,errno);
+	exit(EXIT_FAILURE);
+    }
+
+	/* -D: a client that connects and says nothing isn't even accepted */
+    if (defer_secs > 0 && unix_path == NULL && SetDeferAcceptSocket(sockfd, defer_secs) < 0)
+	fprintf(stderr,"ERROR : %s : no TCP_DEFER_ACCEPT errno = %d\n",__FILE__,errno);
+
+    if (event_mode) {
+	runEventServer(sockfd);
+	CloseSocket(sockfd);
+	exit (EXIT_SUCCESS);
+    }
+
+    if (uring_mode) {
+	runUringServer(sockfd);
+	exit (EXIT_FAILURE);
+    }
+
+    if (cert_path != NULL) {
+	tls_ctx = CreateTlsServerContext(cert_path, NULL);
+	if (tls_ctx == NULL) {
+	    fprintf(stderr,"ERROR : %s : can't use certificate and key in [%s] errno = %d\n",
+		    __FILE__,cert_path,errno);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
 	/* loop forever, accepting any socket connections and reading/echoing what they send us */
 
     while (true) {
- 
-        ListenSocket(sockfd, 5); 	/* max of 5 clients waiting in the queue... */
 
         newsockfd = AcceptSocket(sockfd);	/* take the next client in the queue waiting to connect */
         if (newsockfd < 0) {
@@ -105,26 +996,68 @@ int main(int argc, char *argv[])
 	
 	connection_alive = true;
 
-	while (connection_alive) {
+	/*
+	 * -i: a silent client gets EAGAIN from its read instead of the server forever,
+	 * one that doesn't read gets ETIMEDOUT from the -f -r replies
+	 */
+	if (idle_secs > 0)
+	    (void) SetSocketTimeouts(newsockfd, idle_secs * 1000, idle_secs * 1000);
 
-	    bzero(buffer, BUFFER_SIZE);	/* clear the buffer of any previous data */
+	/* -C: encrypted, by the kernel if it can (then -F is still a sendfile()) */
+	if (tls_ctx != NULL) {
+	    tls = StartTlsSocket(tls_ctx, newsockfd, NULL, TLS_TIMEOUT);
+	    if (tls == NULL) {
+		fprintf(stderr,"ERROR : %s : TLS handshake on socket [%d] failed errno = %d\n",
+			__FILE__,newsockfd,errno);
+		CloseSocket(newsockfd);
+		continue;
+	    }
+	}
 
-	    /* don't read the whole BUFFER_SIZE... guarentees no overflow and that the text
-	     * will be NULL-terminated 
-	     */
-	    n = RecvSocket(newsockfd, buffer, BUFFER_SIZE-2);
+	if (send_path != NULL) {
+	    sendFile(newsockfd, tls, send_path);
+	    connection_alive = false;
+	} else if (framed) {
+	    runFramedClient(newsockfd);
+	    connection_alive = false;
+	}
+
+	while (connection_alive) {
+
+	    /* a pool buffer, nothing to clear: we print exactly the n bytes received */
+	    n = (tls != NULL) ? recvTlsBuf(tls, &buf, reply ? ECHO_SIZE : BUFFER_SIZE) :
+				RecvSockBuf(newsockfd, &buf, reply ? ECHO_SIZE : BUFFER_SIZE);
             if (n == 0) { 	
 		/* client closed the connetion, exit this loop */
 		connection_alive = false;
+	    } else if (n < 0 && idle_secs > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		fprintf(stderr,"closing idle client [%d]\n",newsockfd);
+		connection_alive = false;
 	    } else if (n < 0) {
 	        fprintf(stderr,"ERROR : %s : error receiving from socket [%d] errno = %d\n",
 			__FILE__,sockfd,errno);
 	        exit(EXIT_FAILURE);
- 	    } else {		/* echo the data that was received over the socket */
-	        fprintf(stdout,"%s\n",buffer);
+ 	    } else if (reply) {	/* send it back */
+		if (tls != NULL)
+		    n = WriteTls(tls, buf->data, buf->len);
+		else if (idle_secs > 0)
+		    n = WriteFullTimeoutSocket(newsockfd, buf->data, buf->len, idle_secs * 1000);
+		else
+		    n = WriteFullSocket(newsockfd, buf->data, buf->len);
+		if (n != buf->len)
+		    connection_alive = false;
+		PutSockBuf(buf);
+	    } else {		/* echo the data that was received over the socket */
+	        fprintf(stdout,"%.*s\n",buf->len,buf->data);
+		PutSockBuf(buf);
    	    }
    	}
 
+	if (tls != NULL) {
+	    CloseTls(tls);
+	    tls = NULL;
+	}
+
  	n = CloseSocket(newsockfd);
         if (n < 0) {
  	    fprintf(stderr,"ERROR : %s : error closing socket [%d] errno = %d\n",
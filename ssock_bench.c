@@ -0,0 +1,654 @@
+/*
+ * Benchmark for Steve's Simple Socket Library.
+ *
+ * (c) Copyright 2012, Steve Anderson.
+ *
+ *
+ * Runs a set of tests over loopback, against servers built from the library's own
+ * worker threads and event loops, with each socket tuning profile (or just the one
+ * given with -p):
+ *
+ *	pingpong	one message back and forth per connection at a time:
+ *			round trip times
+ *	stream		one way bulk transfer: MB per second, and how long each
+ *			write takes
+ *	connrate	connect, one round trip, close, over and over: connections
+ *			per second and how long each one took
+ *	manyconn	ping-pong spread over many open connections, a different
+ *			one each time: round trips, and kernel memory per connection
+ *	idle		many connections whose peers stopped reading: how much
+ *			kernel memory each one ends up holding
+ *
+ * Times are counted in HDR histograms (ssockhist.c) and reported as percentiles,
+ * as a table, or with -j as one JSON object per line for scripts to compare.
+ *
+ * usage: ssock_bench [-j] [-p profile|all] [-x tests] [-s message size]
+ *		      [-c connections] [-t threads] [-d seconds] [-P port]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "ssocklib.h"
+
+#define USAGE	"usage: ssock_bench [-j] [-p profile|all] [-x tests] [-s message size]\n" \
+		"                   [-c connections] [-t threads] [-d seconds] [-P port]\n" \
+		"tests: pingpong,stream,connrate,manyconn,idle (default all)\n"
+
+#define LISTEN_QUEUE	(4096)
+#define RECV_SIZE	(64 * 1024)
+#define MANY_CONNS	(1000)		/* manyconn default */
+#define IDLE_CONNS	(200)		/* idle default */
+#define IDLE_FILL	(1024 * 1024)	/* try to queue this much on each idle connection */
+#define DRAIN_MS	(2000)		/* how long to wait for the servers to close up */
+
+static int	msg_size = 64;
+static int	nconns = 0;		/* 0: each test's own default */
+static int	nthreads = 1;
+static int	seconds = 1;
+static int	base_port = 7700;	/* echo server; the sink is on the next port */
+static int	json = 0;
+
+/*
+ * the servers: how many connections they have open, what the sink received
+ */
+static int		server_conns = 0;
+static long long	sink_bytes = 0;
+
+typedef struct {
+    char	*test;
+    int		profile;
+    int		conns;
+    long long	ops;		/* round trips, writes, connections */
+    long long	bytes;		/* one way */
+    double	secs;
+    double	kb_per_conn;	/* < 0: not measured */
+    SockHist	*hist;		/* ns */
+} Result;
+
+/*
+ * one client thread's share of a test
+ */
+typedef struct {
+    int			nconns;
+    int			*fds;
+    char		*buf;
+    long long		ops;
+    long long		bytes;
+    long long		ns;
+    SockHist		*hist;
+    pthread_t		thread;
+} Client;
+
+static pthread_barrier_t	ready;	/* clients set up / main measured, go */
+
+static long long nowNs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static void fail(char *what)
+{
+    fprintf(stderr,"ERROR : %s : %s failed errno = %d\n",__FILE__,what,errno);
+    exit (EXIT_FAILURE);
+}
+
+/*
+ * the argument that goes with an option, e.g. the "500" in "-c 500"
+ */
+static char *nextArg(int *argc, char ***argv, char *what)
+{
+    char	*arg;
+
+    if (*argc < 2) {
+	fprintf(stderr,"option -%c needs %s\n",**argv[0],what);
+	exit (EXIT_FAILURE);
+    }
+    arg = *++(*argv);
+    --(*argc);
+    **argv += strlen(**argv) - 1;	/* consumed the whole argument */
+
+    return (arg);
+}
+
+/*
+ * the servers, on worker threads: echo everything back, or just count it
+ */
+static void serverRead(SockEventLoop *loop, int fd, void *arg)
+{
+    static __thread char	buf[RECV_SIZE];
+    int				n, sink = (arg != NULL);
+
+    while (1) {
+	n = RecvSocket(fd, buf, sizeof(buf));
+	if (n > 0) {
+	    if (sink)
+		__atomic_add_fetch(&sink_bytes, n, __ATOMIC_RELAXED);
+	    else if (WriteFullSocket(fd, buf, n) != n)
+		break;
+	    continue;
+	}
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return;
+	break;		/* EOF or error */
+    }
+
+    RemoveEventLoop(loop, fd);
+    CloseSocket(fd);
+    __atomic_sub_fetch(&server_conns, 1, __ATOMIC_RELAXED);
+}
+
+static void serverAccept(SockEventLoop *loop, int fd, void *arg)
+{
+    __atomic_add_fetch(&server_conns, 1, __ATOMIC_RELAXED);
+
+    if (AddEventLoop(loop, fd, serverRead, NULL, arg) < 0) {
+	CloseSocket(fd);
+	__atomic_sub_fetch(&server_conns, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * wait for the servers to close every connection the last test left
+ */
+static void drainServers(void)
+{
+    int	ms;
+
+    for (ms = 0; ms < DRAIN_MS && __atomic_load_n(&server_conns, __ATOMIC_RELAXED) > 0; ms++)
+	usleep(1000);
+}
+
+static int connectLoopback(int port)
+{
+    int	fd;
+
+    fd = CreateSocket();	/* with the default profile */
+    if (fd < 0 || ConnectSocket(fd, "127.0.0.1", port) < 0)
+	fail("connect");
+
+    return (fd);
+}
+
+/*
+ * close without leaving TIME_WAIT behind, which would use up the local ports
+ */
+static void abortSocket(int fd)
+{
+    struct linger	lg = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    CloseSocket(fd);
+}
+
+/*
+ * pages of memory all TCP sockets hold, from /proc/net/sockstat
+ */
+static long tcpMemPages(void)
+{
+    FILE	*fp;
+    char	line[256], *p;
+    long	pages = -1;
+
+    fp = fopen("/proc/net/sockstat", "r");
+    if (fp == NULL)
+	return (-1);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (strncmp(line, "TCP:", 4) == 0 && (p = strstr(line, " mem ")) != NULL)
+	    pages = atol(p + 5);
+    }
+    fclose(fp);
+
+    return (pages);
+}
+
+static double kbPerConn(long before, long after, int conns)
+{
+    if (before < 0 || after < 0 || conns <= 0)
+	return (-1);
+
+    return ((after - before) * (sysconf(_SC_PAGESIZE) / 1024.0) / conns);
+}
+
+/*
+ * the client threads: open this thread's connections, wait for the others,
+ * then run until the time is up
+ */
+static void openConns(Client *c, int port)
+{
+    int	i;
+
+    c->fds = malloc(c->nconns * sizeof(int));
+    c->buf = calloc(1, msg_size);
+    if (c->fds == NULL || c->buf == NULL)
+	fail("malloc");
+
+    for (i = 0; i < c->nconns; i++)
+	c->fds[i] = connectLoopback(port);
+}
+
+static void closeConns(Client *c)
+{
+    int	i;
+
+    for (i = 0; i < c->nconns; i++)
+	CloseSocket(c->fds[i]);
+    free(c->fds);
+    free(c->buf);
+}
+
+/*
+ * pingpong and manyconn: a round trip on each connection in turn
+ */
+static void *pingPongMain(void *arg)
+{
+    Client	*c = (Client *) arg;
+    long long	start, end, t, now;
+    int		i = 0;
+
+    openConns(c, base_port);
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&ready);
+
+    start = nowNs();
+    end = start + seconds * 1000000000LL;
+    for (now = start; now < end; i = (i + 1) % c->nconns) {
+	t = now;
+	if (WriteFullSocket(c->fds[i], c->buf, msg_size) != msg_size ||
+	    ReadFullSocket(c->fds[i], c->buf, msg_size) != msg_size)
+	    fail("round trip");
+	now = nowNs();
+	RecordHist(c->hist, now - t);
+	c->ops++;
+    }
+    c->ns = now - start;
+    c->bytes = c->ops * msg_size;
+
+    closeConns(c);
+
+    return (NULL);
+}
+
+/*
+ * stream: keep writing, the sink counts what arrives
+ */
+static void *streamMain(void *arg)
+{
+    Client	*c = (Client *) arg;
+    long long	start, end, t, now;
+    int		i = 0;
+
+    openConns(c, base_port + 1);
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&ready);
+
+    start = nowNs();
+    end = start + seconds * 1000000000LL;
+    for (now = start; now < end; i = (i + 1) % c->nconns) {
+	t = now;
+	if (WriteFullSocket(c->fds[i], c->buf, msg_size) != msg_size)
+	    fail("stream");
+	now = nowNs();
+	RecordHist(c->hist, now - t);
+	c->ops++;
+    }
+    c->ns = now - start;
+
+    closeConns(c);
+
+    return (NULL);
+}
+
+/*
+ * connrate: a new connection for every round trip
+ */
+static void *connRateMain(void *arg)
+{
+    Client	*c = (Client *) arg;
+    long long	start, end, t, now;
+    char	*buf;
+    int		fd;
+
+    buf = calloc(1, msg_size);
+    if (buf == NULL)
+	fail("malloc");
+
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&ready);
+
+    start = nowNs();
+    end = start + seconds * 1000000000LL;
+    for (now = start; now < end; ) {
+	t = now;
+	fd = connectLoopback(base_port);
+	if (WriteFullSocket(fd, buf, msg_size) != msg_size ||
+	    ReadFullSocket(fd, buf, msg_size) != msg_size)
+	    fail("connrate round trip");
+	abortSocket(fd);
+	now = nowNs();
+	RecordHist(c->hist, now - t);
+	c->ops++;
+    }
+    c->ns = now - start;
+    c->bytes = c->ops * msg_size;
+
+    free(buf);
+
+    return (NULL);
+}
+
+/*
+ * run a test on nthreads client threads, sharing conns connections
+ */
+static void runClients(Result *r, void *(*client_main)(void *), int conns)
+{
+    Client	*clients;
+    long	before, after;
+    int		i;
+
+    clients = calloc(nthreads, sizeof(Client));
+    if (clients == NULL)
+	fail("malloc");
+
+    pthread_barrier_init(&ready, NULL, nthreads + 1);
+
+    before = tcpMemPages();
+    for (i = 0; i < nthreads; i++) {
+	clients[i].nconns = conns / nthreads + (i < conns % nthreads);
+	if (clients[i].nconns < 1)
+	    clients[i].nconns = 1;
+	clients[i].hist = CreateHist();
+	if (clients[i].hist == NULL)
+	    fail("CreateHist");
+	if (pthread_create(&clients[i].thread, NULL, client_main, &clients[i]) != 0)
+	    fail("pthread_create");
+    }
+
+    pthread_barrier_wait(&ready);	/* every connection is open */
+    after = tcpMemPages();
+    __atomic_store_n(&sink_bytes, 0, __ATOMIC_RELAXED);
+    pthread_barrier_wait(&ready);
+
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(clients[i].thread, NULL);
+	r->conns += clients[i].nconns;
+	r->ops += clients[i].ops;
+	r->bytes += clients[i].bytes;
+	if (clients[i].ns / 1e9 > r->secs)
+	    r->secs = clients[i].ns / 1e9;
+	MergeHist(r->hist, clients[i].hist);
+	CloseHist(clients[i].hist);
+    }
+
+    if (client_main == streamMain)
+	r->bytes = __atomic_load_n(&sink_bytes, __ATOMIC_RELAXED);
+
+	/* quiet connections only: stream's are full, connrate's come and go */
+    r->kb_per_conn = (client_main == pingPongMain) ? kbPerConn(before, after, r->conns) : -1;
+
+    pthread_barrier_destroy(&ready);
+    free(clients);
+
+    drainServers();
+}
+
+/*
+ * idle: connections that got data the other side never reads
+ */
+static void idle(Result *r, int conns)
+{
+    struct sockaddr_in	sin;
+    socklen_t		len = sizeof(sin);
+    int			*fds, listenfd, port, i, n;
+    long		before, after;
+    char		*buf;
+
+    fds = malloc(2 * conns * sizeof(int));
+    buf = calloc(1, RECV_SIZE);
+    if (fds == NULL || buf == NULL)
+	fail("malloc");
+
+    before = tcpMemPages();
+
+	/* its own listener, which accepts but never reads */
+    listenfd = CreateSocket();
+    if (listenfd < 0 || BindSocket(listenfd, 0) < 0 || ListenSocket(listenfd, LISTEN_QUEUE) < 0 ||
+	getsockname(listenfd, (struct sockaddr *) &sin, &len) < 0)
+	fail("listen");
+    port = ntohs(sin.sin_port);
+
+    for (i = 0; i < conns; i++) {
+	fds[2 * i] = connectLoopback(port);
+	fds[2 * i + 1] = AcceptSocket(listenfd);
+	if (fds[2 * i + 1] < 0)
+	    fail("accept");
+
+	fcntl(fds[2 * i], F_SETFL, O_NONBLOCK);
+	for (n = 0; n < IDLE_FILL; n += RECV_SIZE) {
+	    if (SendSocket(fds[2 * i], buf, RECV_SIZE) < 0)
+		break;		/* both ends' buffers are full */
+	}
+    }
+
+    after = tcpMemPages();
+
+    for (i = 0; i < 2 * conns; i++)
+	abortSocket(fds[i]);
+    CloseSocket(listenfd);
+    free(fds);
+    free(buf);
+
+    r->conns = conns;
+    r->kb_per_conn = kbPerConn(before, after, conns);
+}
+
+static void report(Result *r)
+{
+    double	ops_s = (r->secs > 0) ? r->ops / r->secs : 0;
+    double	mb_s = (r->secs > 0) ? r->bytes / r->secs / 1e6 : 0;
+    double	p50 = HistPercentile(r->hist, 50.0) / 1e3;
+    double	p99 = HistPercentile(r->hist, 99.0) / 1e3;
+    double	p999 = HistPercentile(r->hist, 99.9) / 1e3;
+    double	max = HistMax(r->hist) / 1e3;
+    double	mean = HistMean(r->hist) / 1e3;
+
+    if (json) {
+	fprintf(stdout,"{\"test\":\"%s\",\"profile\":\"%s\",\"size\":%d,\"connections\":%d,"
+		"\"threads\":%d,\"seconds\":%.3f,\"ops\":%lld,\"ops_per_sec\":%.1f,"
+		"\"mb_per_sec\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,"
+		"\"max_us\":%.2f,\"mean_us\":%.2f,\"kb_per_conn\":",
+		r->test,SocketProfileName(r->profile),msg_size,r->conns,nthreads,r->secs,
+		r->ops,ops_s,mb_s,p50,p99,p999,max,mean);
+	if (r->kb_per_conn >= 0)
+	    fprintf(stdout,"%.1f}\n",r->kb_per_conn);
+	else
+	    fprintf(stdout,"null}\n");
+    } else if (HistCount(r->hist) == 0) {
+	fprintf(stdout,"%-9s %-22s %6d %10s %9s %9s %9s %9s %9s %8.0f\n",r->test,
+		SocketProfileName(r->profile),r->conns,"-","-","-","-","-","-",r->kb_per_conn);
+    } else {
+	fprintf(stdout,"%-9s %-22s %6d %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f ",r->test,
+		SocketProfileName(r->profile),r->conns,ops_s,mb_s,p50,p99,p999,max);
+	if (r->kb_per_conn >= 0)
+	    fprintf(stdout,"%8.0f\n",r->kb_per_conn);
+	else
+	    fprintf(stdout,"%8s\n","-");
+    }
+    fflush(stdout);
+}
+
+/*
+ * is test in the comma separated list (NULL: all of them)
+ */
+static int wanted(char *tests, char *test)
+{
+    char	*p;
+    size_t	n = strlen(test);
+
+    if (tests == NULL)
+	return (1);
+
+    for (p = tests; (p = strstr(p, test)) != NULL; p += n) {
+	if ((p == tests || p[-1] == ',') && (p[n] == ',' || p[n] == '\0'))
+	    return (1);
+    }
+
+    return (0);
+}
+
+static void runProfile(int profile, char *tests)
+{
+    SockWorkers	*echo, *sink;
+    Result	r;
+    int		i, conns;
+    static struct {
+	char	*name;
+	void	*(*client_main)(void *);
+	int	conns;		/* 0: one per thread */
+    } suite[] = {
+	{ "pingpong", pingPongMain, 0 },
+	{ "stream", streamMain, 0 },
+	{ "connrate", connRateMain, 0 },
+	{ "manyconn", pingPongMain, MANY_CONNS },
+	{ "idle", NULL, IDLE_CONNS },
+    };
+
+	/* every socket from here on, the servers' listeners too, gets the profile */
+    SetDefaultSocketProfile(profile);
+
+    echo = StartWorkers(nthreads, base_port, LISTEN_QUEUE, serverAccept, NULL);
+    sink = StartWorkers(nthreads, base_port + 1, LISTEN_QUEUE, serverAccept, "sink");
+    if (echo == NULL || sink == NULL)
+	fail("StartWorkers");
+
+    for (i = 0; i < (int) (sizeof(suite) / sizeof(suite[0])); i++) {
+	if (!wanted(tests, suite[i].name))
+	    continue;
+
+	memset(&r, 0, sizeof(r));
+	r.test = suite[i].name;
+	r.profile = profile;
+	r.hist = CreateHist();
+	if (r.hist == NULL)
+	    fail("CreateHist");
+
+	conns = (nconns > 0) ? nconns : (suite[i].conns > 0) ? suite[i].conns : nthreads;
+	if (suite[i].client_main == NULL)
+	    idle(&r, conns);
+	else
+	    runClients(&r, suite[i].client_main, conns);
+
+	report(&r);
+	CloseHist(r.hist);
+    }
+
+    StopWorkers(echo);
+    StopWorkers(sink);
+}
+
+/*
+ * both ends of every connection are in this process
+ */
+static void raiseFileLimit(void)
+{
+    struct rlimit	rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char	*name, *tests = NULL;
+    int		profile = -1, c, p;
+
+    while (--argc > 0 && (*++argv)[0] == '-') {
+	while ((c = *++argv[0])) {
+	    switch (c) {
+		case 'j':
+		    json = 1;
+		    break;
+		case 'p':
+		    name = nextArg(&argc, &argv, "a profile name");
+		    if (strcmp(name, "all") == 0) {
+			profile = -1;
+			break;
+		    }
+		    profile = SocketProfileByName(name);
+		    if (profile < 0) {
+			fprintf(stderr,"unknown profile [%s]\n",name);
+			exit (EXIT_FAILURE);
+		    }
+		    break;
+		case 'x':
+		    tests = nextArg(&argc, &argv, "a list of tests");
+		    break;
+		case 's':
+		    msg_size = atoi(nextArg(&argc, &argv, "a message size"));
+		    break;
+		case 'c':
+		    nconns = atoi(nextArg(&argc, &argv, "a connection count"));
+		    break;
+		case 't':
+		    nthreads = atoi(nextArg(&argc, &argv, "a thread count"));
+		    break;
+		case 'd':
+		    seconds = atoi(nextArg(&argc, &argv, "a number of seconds"));
+		    break;
+		case 'P':
+		    base_port = atoi(nextArg(&argc, &argv, "a port"));
+		    break;
+		case 'h':
+		case 'u':
+		    fprintf(stderr,"%s",USAGE);
+		    exit (EXIT_SUCCESS);
+		    break;
+		default:
+		    fprintf(stderr,"unknown option [%c]\n",c);
+		    break;
+	    }
+	}
+    }
+
+    if (msg_size < 1 || nconns < 0 || nthreads < 1 || seconds < 1 || base_port < 1) {
+	fprintf(stderr,"%s",USAGE);
+	exit (EXIT_FAILURE);
+    }
+
+    raiseFileLimit();
+
+    if (!json) {
+	fprintf(stdout,"%d byte messages, %d thread%s, %d second%s per test, times in us\n\n",
+		msg_size,nthreads,(nthreads == 1) ? "" : "s",seconds,(seconds == 1) ? "" : "s");
+	fprintf(stdout,"%-9s %-22s %6s %10s %9s %9s %9s %9s %9s %8s\n","test","profile","conns",
+		"ops/s","MB/s","p50","p99","p99.9","max","KB/conn");
+    }
+
+    if (profile >= 0) {
+	runProfile(profile, tests);
+    } else {
+	for (p = SOCK_PROFILE_DEFAULT; p <= SOCK_PROFILE_MANY_IDLE; p++)
+	    runProfile(p, tests);
+    }
+
+    exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,245 @@
+/*
+ * Coroutine echo server (and client) for Steve's Simple Socket Library.
+ *
+ * (c) Copyright 2012, Steve Anderson.
+ *
+ *
+ * The same thing server -r -t does, written with the C++20 coroutine layer
+ * (ssockco.hpp): every connection is a straight-line coroutine, one reactor per
+ * thread runs all of them.
+ *
+ *	ssock_coecho [-t threads] port
+ *
+ * echoes everything back to whoever connects to port, and
+ *
+ *	ssock_coecho -c connections [-n round trips] [-s size] host port
+ *
+ * opens that many connections from one thread, sends size bytes and waits for
+ * them to come back, n times on each, and prints how long it all took.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ssockco.hpp"
+
+#define USAGE		"usage: ssock_coecho [-t threads] port\n" \
+			"       ssock_coecho -c connections [-n round trips] [-s size] host port\n"
+#define ECHO_SIZE	(16 * 1024)
+
+static int port = 0;
+
+static char *nextArg(int *argc, char ***argv, const char *what)
+{
+    char	*arg;
+
+    if (*argc < 2) {
+	fprintf(stderr,"option -%c needs %s\n",**argv[0],what);
+	exit (EXIT_FAILURE);
+    }
+    arg = *++(*argv);
+    --(*argc);
+    **argv += strlen(**argv) - 1;	/* consumed the whole argument */
+
+    return (arg);
+}
+
+/*
+ * one client: send back whatever it sends until it hangs up
+ */
+static ssock::Task<> echoClient(ssock::Socket s)
+{
+    char	buf[ECHO_SIZE];
+    ssize_t	n;
+
+    while ((n = co_await s.Read(buf)) > 0) {
+	if (co_await s.Write({buf, (size_t) n}) < 0)
+	    break;
+    }
+
+    if (n < 0)
+	fprintf(stderr,"ERROR : %s : error receiving from socket [%d] errno = %d\n",
+		__FILE__,s.Fd(),errno);
+}
+
+static ssock::Task<> acceptClients(ssock::Socket &listener)
+{
+    while (true) {
+	ssock::Socket	s = co_await listener.Accept();
+
+	/* out of descriptors Accept() waits for one, anything else won't go away */
+	if (!s) {
+	    fprintf(stderr,"ERROR : %s : error accepting on socket [%d] errno = %d\n",
+		    __FILE__,listener.Fd(),errno);
+	    exit (EXIT_FAILURE);
+	}
+	listener.GetReactor().Spawn(echoClient(std::move(s)));
+    }
+}
+
+static void *serverMain(void *arg)
+{
+    ssock::Reactor	reactor;
+    ssock::Socket	listener = ssock::Listen(reactor, port, SOMAXCONN, true);
+
+    if (!listener) {
+	fprintf(stderr,"ERROR : %s : error listening on [%d] errno = %d\n",__FILE__,port,errno);
+	exit (EXIT_FAILURE);
+    }
+
+    reactor.Spawn(acceptClients(listener));
+
+    if (reactor.Run() < 0) {
+	fprintf(stderr,"ERROR : %s : event loop failed errno = %d\n",__FILE__,errno);
+	exit (EXIT_FAILURE);
+    }
+
+    return (arg);
+}
+
+/*
+ * -c: read until all of buf is back, false if the connection broke
+ */
+static ssock::Task<bool> readAll(ssock::Socket &s, std::span<char> buf)
+{
+    size_t	got = 0;
+    ssize_t	n;
+
+    while (got < buf.size()) {
+	n = co_await s.Read(buf.subspan(got));
+	if (n <= 0)
+	    co_return false;
+	got += n;
+    }
+
+    co_return true;
+}
+
+typedef struct {
+    ssock::Reactor	*reactor;
+    const char		*host;
+    int			rounds;
+    int			size;
+    int			running;
+    long long		done;
+    int			failed;
+} Load;
+
+static ssock::Task<> loadConnection(Load *load)
+{
+    std::vector<char>	out(load->size, 'x'), in(load->size);
+    ssock::Socket	s = co_await ssock::Connect(*load->reactor, load->host, port);
+    int			i;
+
+    if (!s) {
+	fprintf(stderr,"ERROR : %s : error connecting to [%s] errno = %d\n",__FILE__,load->host,errno);
+	load->failed++;
+    }
+
+    for (i = 0; s && i < load->rounds; i++) {
+	if (co_await s.Write(out) < 0 || !co_await readAll(s, in)) {
+	    fprintf(stderr,"ERROR : %s : connection [%d] broke errno = %d\n",__FILE__,s.Fd(),errno);
+	    load->failed++;
+	    break;
+	}
+	load->done++;
+    }
+
+    if (--load->running == 0)
+	load->reactor->Stop();
+}
+
+static double nowSecs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * -c: all the connections at once from this thread
+ */
+static int runLoad(const char *host, int nconns, int rounds, int size)
+{
+    ssock::Reactor	reactor;
+    Load		load = { &reactor, host, rounds, size, nconns, 0, 0 };
+    double		start, secs;
+    int			i;
+
+    start = nowSecs();
+    for (i = 0; i < nconns; i++)
+	reactor.Spawn(loadConnection(&load));
+    if (load.running > 0 && reactor.Run() < 0) {
+	fprintf(stderr,"ERROR : %s : event loop failed errno = %d\n",__FILE__,errno);
+	return (-1);
+    }
+    secs = nowSecs() - start;
+
+    printf("%d connections, %lld round trips of %d bytes in %.3f s: %.0f round trips/s, %d failed\n",
+	   nconns,load.done,size,secs,load.done / secs,load.failed);
+
+    return ((load.failed > 0) ? -1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t		thread;
+    int			nthreads = 1, nconns = 0, rounds = 1000, size = 64, i;
+
+    while (--argc > 0 && (*++argv)[0] == '-') {
+	int	c;
+	while ((c = *++argv[0])) {
+	    switch (c) {
+		case 'c':
+		    nconns = atoi(nextArg(&argc, &argv, "a number of connections"));
+		    break;
+		case 'n':
+		    rounds = atoi(nextArg(&argc, &argv, "a number of round trips"));
+		    break;
+		case 's':
+		    size = atoi(nextArg(&argc, &argv, "a message size"));
+		    break;
+		case 't':
+		    nthreads = atoi(nextArg(&argc, &argv, "a thread count"));
+		    break;
+		case 'h':
+		case 'u':
+		    fprintf(stderr,USAGE);
+		    exit (EXIT_SUCCESS);
+		default:
+		    fprintf(stderr,"unknown option [%c]\n",c);
+		    fprintf(stderr,USAGE);
+		    exit (EXIT_FAILURE);
+	    }
+	}
+    }
+
+    if (argc < ((nconns > 0) ? 2 : 1) || nthreads <= 0 || size <= 0) {
+	fprintf(stderr,USAGE);
+	exit (EXIT_FAILURE);
+    }
+
+    if (nconns == 0) {
+	port = atoi(argv[0]);
+	fprintf(stderr,"echoing on port [%d] with %d threads\n",port,nthreads);
+	for (i = 1; i < nthreads; i++) {
+	    if (pthread_create(&thread, NULL, serverMain, NULL) != 0) {
+		fprintf(stderr,"ERROR : %s : error starting thread %d\n",__FILE__,i);
+		exit (EXIT_FAILURE);
+	    }
+	}
+	serverMain(NULL);
+	exit (EXIT_SUCCESS);
+    }
+
+    port = atoi(argv[1]);
+    exit ((runLoad(argv[0], nconns, rounds, size) < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
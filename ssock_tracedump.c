@@ -0,0 +1,223 @@
+/*
+ * Trace decoder for Steve's Simple Socket Library.
+ *
+ * (c) Copyright 2012, Steve Anderson.
+ *
+ *
+ * Reads the files DumpSockTrace() writes (server -T, or SSOCK_TRACE=file for any
+ * program using the library), puts the events of every thread, and of every file
+ * given, in time order, and prints them one per line:
+ *
+ *	   time(us)  +delta(us)      pid/tid  op            fd        size      result
+ *
+ * Times are from the first event shown, or with -a the raw CLOCK_MONOTONIC
+ * nanoseconds (the same clock on every process on one machine, so dumps from a
+ * server and its clients merge into one timeline). -f shows only one fd's events,
+ * -o only one kind ("read", "write", ...), -e only the failed calls.
+ *
+ * usage: ssock_tracedump [-a] [-e] [-f fd] [-o op] file ...
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define USAGE	"usage: ssock_tracedump [-a] [-e] [-f fd] [-o op] file ...\n"
+
+typedef struct {
+    SockTraceEvent	ev;
+    int			pid;
+    int			tid;
+    long long		seq;	/* keeps a thread's events in order when times tie */
+} TraceLine;
+
+static TraceLine	*lines = NULL;
+static long long	nlines = 0, maxlines = 0;
+
+static char *nextArg(int *argc, char ***argv, char *what)
+{
+    char	*arg;
+
+    if (*argc < 2) {
+	fprintf(stderr,"option -%c needs %s\n",**argv[0],what);
+	exit (EXIT_FAILURE);
+    }
+    arg = *++(*argv);
+    --(*argc);
+    **argv += strlen(**argv) - 1;	/* consumed the whole argument */
+
+    return (arg);
+}
+
+static void addLine(SockTraceEvent *ev, int pid, int tid)
+{
+    if (nlines == maxlines) {
+	maxlines = (maxlines > 0) ? maxlines * 2 : 65536;
+	lines = realloc(lines, maxlines * sizeof(TraceLine));
+	if (lines == NULL) {
+	    fprintf(stderr,"out of memory\n");
+	    exit (EXIT_FAILURE);
+	}
+    }
+
+    lines[nlines].ev = *ev;
+    lines[nlines].pid = pid;
+    lines[nlines].tid = tid;
+    lines[nlines].seq = nlines;
+    nlines++;
+}
+
+/*
+ * read every ring in a dump file
+ */
+static int readDump(char *path)
+{
+    SockTraceFileHeader	fh;
+    SockTraceRingHeader	rh;
+    SockTraceEvent	ev;
+    FILE		*fp;
+    int			r, i;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+	fprintf(stderr,"%s: %s\n",path,strerror(errno));
+	return (-1);
+    }
+
+    if (fread(&fh, sizeof(fh), 1, fp) != 1 || memcmp(fh.magic, SOCK_TRACE_MAGIC, sizeof(fh.magic)) != 0) {
+	fprintf(stderr,"%s: not a socket trace\n",path);
+	fclose(fp);
+	return (-1);
+    }
+
+    for (r = 0; r < fh.nrings; r++) {
+	if (fread(&rh, sizeof(rh), 1, fp) != 1)
+	    goto truncated;
+	if (rh.lost > 0)
+	    fprintf(stderr,"%s: thread %d: %lld older events were overwritten\n",path,rh.tid,rh.lost);
+	for (i = 0; i < rh.count; i++) {
+	    if (fread(&ev, sizeof(ev), 1, fp) != 1)
+		goto truncated;
+	    if (ev.op != 0)		/* 0: overwritten while it was being dumped */
+		addLine(&ev, fh.pid, rh.tid);
+	}
+    }
+
+    fclose(fp);
+    return (0);
+
+truncated:
+    fprintf(stderr,"%s: truncated, reading what is there\n",path);
+    fclose(fp);
+    return (0);
+}
+
+static int byTime(const void *a, const void *b)
+{
+    const TraceLine	*x = a, *y = b;
+
+    if (x->ev.ns != y->ev.ns)
+	return ((x->ev.ns < y->ev.ns) ? -1 : 1);
+
+    return ((x->seq < y->seq) ? -1 : (x->seq > y->seq));
+}
+
+static int opByName(char *name)
+{
+    int	op;
+
+    for (op = SOCK_TRACE_CREATE; op <= SOCK_TRACE_ACCEPT_BATCH; op++) {
+	if (strcmp(name, SockTraceOpName(op)) == 0)
+	    return (op);
+    }
+
+    return (atoi(name));	/* a number, for SOCK_TRACE_USER + n */
+}
+
+int main(int argc, char *argv[])
+{
+    TraceLine	*l;
+    long long	i, first = -1, prev = 0;
+    int		absolute = 0, errors_only = 0, only_fd = -1, only_op = 0, shown = 0;
+    char	name[16];
+
+    while (--argc > 0 && (*++argv)[0] == '-') {
+	int	c;
+	while ((c = *++argv[0])) {
+	    switch (c) {
+		case 'a':
+		    absolute = 1;
+		    break;
+		case 'e':
+		    errors_only = 1;
+		    break;
+		case 'f':
+		    only_fd = atoi(nextArg(&argc, &argv, "an fd"));
+		    break;
+		case 'o':
+		    only_op = opByName(nextArg(&argc, &argv, "an operation"));
+		    break;
+		case 'h':
+		case 'u':
+		    fprintf(stderr,USAGE);
+		    exit (EXIT_SUCCESS);
+		default:
+		    fprintf(stderr,"unknown option [%c]\n",c);
+		    fprintf(stderr,USAGE);
+		    exit (EXIT_FAILURE);
+	    }
+	}
+    }
+
+    if (argc < 1) {
+	fprintf(stderr,USAGE);
+	exit (EXIT_FAILURE);
+    }
+
+    for (; argc > 0; argc--, argv++) {
+	if (readDump(argv[0]) < 0)
+	    exit (EXIT_FAILURE);
+    }
+
+    qsort(lines, nlines, sizeof(TraceLine), byTime);
+
+    printf("%14s %11s %13s  %-12s %6s %10s %10s\n","time(us)","+delta(us)","pid/tid","op","fd","size","result");
+
+    for (i = 0; i < nlines; i++) {
+	l = &lines[i];
+	if ((only_fd >= 0 && l->ev.fd != only_fd && !(l->ev.op == SOCK_TRACE_ACCEPT && l->ev.result == only_fd)) ||
+	    (only_op != 0 && l->ev.op != only_op) ||
+	    (errors_only && l->ev.result >= 0))
+	    continue;
+
+	if (first < 0)
+	    first = prev = l->ev.ns;
+
+	if (l->ev.op >= SOCK_TRACE_USER)
+	    snprintf(name, sizeof(name), "user+%d", l->ev.op - SOCK_TRACE_USER);
+	else
+	    snprintf(name, sizeof(name), "%s", SockTraceOpName(l->ev.op));
+
+	if (absolute)
+	    printf("%14lld",l->ev.ns);
+	else
+	    printf("%14.3f",(l->ev.ns - first) / 1000.0);
+	printf(" %11.3f %6d/%-6d  %-12s %6d %10lld %10lld",(l->ev.ns - prev) / 1000.0,
+	       l->pid,l->tid,name,l->ev.fd,l->ev.size,l->ev.result);
+	if (l->ev.result < 0)
+	    printf("  %s",strerror(l->ev.err));
+	printf("\n");
+
+	prev = l->ev.ns;
+	shown++;
+    }
+
+    fprintf(stderr,"%d events\n",shown);
+    free(lines);
+
+    exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,157 @@
+/*
+ * ssockaccept.c
+ *
+ * The accept side of a busy server, for the simple socket library.
+ *
+ * AcceptSocket() takes one connection, throws away who it came from and hands back
+ * a blocking descriptor that a fork()/exec() would leak. That is fine for a server
+ * with a client now and then; one facing thousands of clients reconnecting at once
+ * wants more:
+ *
+ *	- AcceptPeerSocket() uses accept4() so the new socket comes back already
+ *	  non-blocking and close-on-exec (no fcntl() calls after), with its peer,
+ *	- AcceptBatchSocket() takes everything that is waiting, up to a limit, so
+ *	  a listener is emptied in one go on every wakeup,
+ *	- ShedSocket() refuses a connection that was already accepted, with a reset:
+ *	  the client gets an error straight away instead of its SYN being dropped
+ *	  by a full backlog and retried for seconds,
+ *	- SetDeferAcceptSocket() has the kernel hold a connection back until the
+ *	  client has sent something, so clients that connect and say nothing don't
+ *	  wake the server at all.
+ *
+ * The event loop (ssockevent.c) accepts with AcceptBatchSocket() and sheds with
+ * ShedSocket() once a loop has as many connections as SetAcceptLimitEventLoop() allows.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#define _GNU_SOURCE	/* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+/*
+ * accept one connection, non-blocking and close-on-exec (peer may be NULL)
+ */
+int AcceptPeerSocket(int sockfd, struct sockaddr_storage *peer)
+{
+    struct sockaddr_storage	addr;
+    socklen_t			addr_len = sizeof(addr);
+    long long			start;
+    int				newsockfd, profile;
+
+    if (peer == NULL)
+	peer = &addr;
+
+    start = SockStatStart();
+    newsockfd = accept4(sockfd, (struct sockaddr *) peer, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    SockStatEnd(SOCK_STAT_ACCEPT, sockfd, 0, newsockfd, start);
+
+    if (newsockfd < 0)
+	return (-1);
+
+	/* the new socket gets the listener's profile, like AcceptSocket() */
+    profile = GetSocketProfile(sockfd);
+    if (profile != SOCK_PROFILE_DEFAULT)
+	(void) SetSocketProfile(newsockfd, profile);
+    else
+	ForgetSocketProfile(newsockfd);
+
+    return (newsockfd);
+}
+
+/*
+ * accept up to max waiting connections, stops early when none are left
+ */
+int AcceptBatchSocket(int sockfd, int *fds, struct sockaddr_storage *peers, int max)
+{
+    int	n = 0;
+
+    if (fds == NULL || max <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    while (n < max) {
+	fds[n] = AcceptPeerSocket(sockfd, (peers != NULL) ? &peers[n] : NULL);
+	if (fds[n] < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;	/* that one gave up already, there may be more */
+	    break;
+	}
+	n++;
+    }
+
+    SockTrace(SOCK_TRACE_ACCEPT_BATCH, sockfd, max, (n > 0) ? n : -1);
+
+	/* nothing at all: -1 with accept()'s errno, EAGAIN if the queue was empty */
+    return ((n > 0) ? n : -1);
+}
+
+/*
+ * close with a reset, not a FIN: the client's next call fails with ECONNRESET
+ */
+int ShedSocket(int sockfd)
+{
+    struct linger	lg;
+
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    (void) setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+    return (CloseSocket(sockfd));
+}
+
+/*
+ * don't report a connection until data arrives on it (or seconds pass)
+ */
+int SetDeferAcceptSocket(int sockfd, int seconds)
+{
+    if (seconds < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    return (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)));
+}
+
+/*
+ * "1.2.3.4:5000", "[::1]:5000" or "unix" for logging
+ */
+char *SockAddrName(struct sockaddr_storage *addr, char *buffer, int buffer_sz)
+{
+    char	host[INET6_ADDRSTRLEN];
+
+    if (addr == NULL || buffer == NULL || buffer_sz <= 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    if (addr->ss_family == AF_INET) {
+	struct sockaddr_in	*in = (struct sockaddr_in *) addr;
+
+	inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+	snprintf(buffer, buffer_sz, "%s:%d", host, ntohs(in->sin_port));
+    } else if (addr->ss_family == AF_INET6) {
+	struct sockaddr_in6	*in6 = (struct sockaddr_in6 *) addr;
+
+	inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+	snprintf(buffer, buffer_sz, "[%s]:%d", host, ntohs(in6->sin6_port));
+    } else if (addr->ss_family == AF_UNIX) {
+	snprintf(buffer, buffer_sz, "unix");
+    } else {
+	snprintf(buffer, buffer_sz, "family %d", addr->ss_family);
+    }
+
+    return (buffer);
+}
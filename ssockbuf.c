@@ -0,0 +1,302 @@
+/*
+ * ssockbuf.c
+ *
+ * Pooled I/O buffers for the simple socket library.
+ *
+ * Buffers come in a few fixed size classes. Each thread keeps its own free list
+ * per class, so getting and returning a buffer is a couple of pointer moves with
+ * no lock, no malloc() and no memset(). When a thread's list runs dry (or grows
+ * too long) it trades a batch of buffers with a shared depot under a mutex, and
+ * new buffers are carved out of slabs, several at a time, only while the pool is
+ * under its memory limit.
+ *
+ * Buffers are reference counted so one received buffer can be handed to several
+ * consumers (say, queued for sending to several clients) and goes back to the pool
+ * when the last one lets go.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define BUF_CLASSES	(5)
+#define BUF_SLAB	(16)	/* buffers allocated together when the pool grows */
+#define BUF_CACHE_MAX	(64)	/* per thread, per class; half goes to the depot beyond that */
+#define BUF_BATCH	(32)	/* buffers moved between a thread and the depot at once */
+
+static const int buf_class_size[BUF_CLASSES] = { 256, 1024, 4096, 16384, 65536 };
+
+/*
+ * the shared depot
+ */
+static pthread_mutex_t	depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static SockBuf		*depot[BUF_CLASSES];
+static long long	pool_limit = 0;		/* 0 is no limit */
+static long long	pool_bytes = 0;		/* allocated so far, under depot_lock */
+
+/*
+ * per-thread free lists
+ */
+typedef struct {
+    SockBuf	*head[BUF_CLASSES];
+    int		count[BUF_CLASSES];
+} BufCache;
+
+static __thread BufCache	cache;
+static __thread int		cache_registered;
+static pthread_key_t		cache_key;
+static pthread_once_t		cache_once = PTHREAD_ONCE_INIT;
+
+static void cacheDestroy(void *unused);
+
+static void cacheKeyInit(void)
+{
+    pthread_key_create(&cache_key, cacheDestroy);
+}
+
+/*
+ * make sure this thread's free lists get flushed to the depot when it exits
+ */
+static void cacheRegister(void)
+{
+    pthread_once(&cache_once, cacheKeyInit);
+    pthread_setspecific(cache_key, &cache);	/* non-NULL, so the destructor runs */
+    cache_registered = 1;
+}
+
+static int sizeClass(int size)
+{
+    int	c;
+
+    for (c = 0; c < BUF_CLASSES; c++) {
+	if (size <= buf_class_size[c])
+	    return (c);
+    }
+
+    return (-1);
+}
+
+/*
+ * move up to n buffers of class c from this thread's list to the depot
+ */
+static void toDepot(int c, int n)
+{
+    SockBuf	*first, *last;
+    int		i;
+
+    first = last = cache.head[c];
+    if (first == NULL)
+	return;
+    for (i = 1; i < n && last->next != NULL; i++)
+	last = last->next;
+
+    cache.head[c] = last->next;
+    cache.count[c] -= i;
+
+    pthread_mutex_lock(&depot_lock);
+    last->next = depot[c];
+    depot[c] = first;
+    pthread_mutex_unlock(&depot_lock);
+}
+
+/*
+ * a thread is exiting, don't strand its buffers
+ */
+static void cacheDestroy(void *unused)
+{
+    int	c;
+
+    for (c = 0; c < BUF_CLASSES; c++) {
+	while (cache.head[c] != NULL)
+	    toDepot(c, BUF_BATCH);
+    }
+}
+
+/*
+ * refill this thread's list: from the depot if it has any, else a new slab
+ */
+static int refill(int c)
+{
+    SockBuf	*b, *last;
+    char	*slab;
+    size_t	stride;
+    int		i;
+
+    if (!cache_registered)
+	cacheRegister();
+
+    pthread_mutex_lock(&depot_lock);
+
+    if (depot[c] != NULL) {
+	b = last = depot[c];
+	for (i = 1; i < BUF_BATCH && last->next != NULL; i++)
+	    last = last->next;
+	depot[c] = last->next;
+	pthread_mutex_unlock(&depot_lock);
+
+	last->next = cache.head[c];
+	cache.head[c] = b;
+	cache.count[c] += i;
+	return (0);
+    }
+
+    stride = sizeof(SockBuf) + buf_class_size[c];
+    if (pool_limit > 0 && pool_bytes + (long long) (stride * BUF_SLAB) > pool_limit) {
+	pthread_mutex_unlock(&depot_lock);
+	errno = ENOBUFS;
+	return (-1);
+    }
+    pool_bytes += stride * BUF_SLAB;
+    pthread_mutex_unlock(&depot_lock);
+
+	/* slabs are never given back, the pool only grows up to its limit */
+    slab = malloc(stride * BUF_SLAB);
+    if (slab == NULL) {
+	pthread_mutex_lock(&depot_lock);
+	pool_bytes -= stride * BUF_SLAB;
+	pthread_mutex_unlock(&depot_lock);
+	errno = ENOMEM;
+	return (-1);
+    }
+
+    for (i = 0; i < BUF_SLAB; i++) {
+	b = (SockBuf *) (slab + i * stride);
+	b->data = (char *) (b + 1);
+	b->size = buf_class_size[c];
+	b->sclass = c;
+	b->next = cache.head[c];
+	cache.head[c] = b;
+    }
+    cache.count[c] += BUF_SLAB;
+
+    return (0);
+}
+
+/*
+ * cap the memory the pool may allocate (0 for no limit)
+ */
+int SetSockBufLimit(long long bytes)
+{
+    if (bytes < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&depot_lock);
+    pool_limit = bytes;
+    pthread_mutex_unlock(&depot_lock);
+
+    return (0);
+}
+
+/*
+ * get a buffer of at least size bytes, with one reference
+ */
+SockBuf *GetSockBuf(int size)
+{
+    SockBuf	*b;
+    int		c;
+
+    c = sizeClass(size);
+    if (size < 0 || c < 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    if (cache.head[c] == NULL && refill(c) < 0)
+	return (NULL);
+
+    b = cache.head[c];
+    cache.head[c] = b->next;
+    cache.count[c]--;
+
+    b->next = NULL;
+    b->len = 0;
+    b->refs = 1;
+
+    return (b);
+}
+
+/*
+ * take another reference
+ */
+void HoldSockBuf(SockBuf *b)
+{
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * drop a reference, the last one returns the buffer to (this thread's) pool
+ */
+void PutSockBuf(SockBuf *b)
+{
+    int	c;
+
+    if (b == NULL || __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+	return;
+
+    if (!cache_registered)
+	cacheRegister();
+
+    c = b->sclass;
+    b->next = cache.head[c];
+    cache.head[c] = b;
+    if (++cache.count[c] > BUF_CACHE_MAX)
+	toDepot(c, BUF_CACHE_MAX / 2);
+}
+
+/*
+ * receive into a pool buffer
+ */
+int RecvSockBuf(int sockfd, SockBuf **bp, int size)
+{
+    SockBuf	*b;
+    int		n;
+
+    if (bp == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    *bp = NULL;
+
+    b = GetSockBuf(size);
+    if (b == NULL)
+	return (-1);
+
+    n = RecvSocket(sockfd, b->data, b->size);
+    if (n <= 0) {
+	int	save = errno;
+
+	PutSockBuf(b);		/* nothing in it, straight back */
+	errno = save;
+	return (n);
+    }
+
+    b->len = n;
+    *bp = b;
+
+    return (n);
+}
+
+/*
+ * send a pool buffer's data (the caller still owns its reference)
+ */
+int SendSockBuf(int sockfd, SockBuf *b)
+{
+    if (b == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    return (SendSocket(sockfd, b->data, b->len));
+}
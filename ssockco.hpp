@@ -0,0 +1,695 @@
+/*
+ * ssockco.hpp
+ *
+ * C++20 coroutines on top of the simple socket library (header only).
+ *
+ * The C calls block, or with the event loop (ssockevent.c) turn a connection's
+ * logic inside out into callbacks. Here a connection is a coroutine instead: it
+ * reads like the blocking version, but every co_await that would block suspends
+ * just that coroutine, and one thread's reactor runs thousands of them:
+ *
+ *		ssock::Task<> echo(ssock::Socket s)
+ *		{
+ *		    char	buf[4096];
+ *		    ssize_t	n;
+ *
+ *		    while ((n = co_await s.Read(buf)) > 0)
+ *			if (co_await s.Write({buf, (size_t) n}) < 0)
+ *			    break;
+ *		}			// s is closed here
+ *
+ *		ssock::Task<> serve(ssock::Socket &listener)
+ *		{
+ *		    while (true) {
+ *			ssock::Socket	s = co_await listener.Accept();
+ *			if (s)
+ *			    listener.GetReactor().Spawn(echo(std::move(s)));
+ *		    }
+ *		}
+ *
+ *		ssock::Reactor	reactor;
+ *		ssock::Socket	listener = ssock::Listen(reactor, port);
+ *		reactor.Spawn(serve(listener));
+ *		reactor.Run();
+ *
+ * The pieces:
+ *
+ *	- Socket owns a descriptor (from CreateSocket(), AcceptPeerSocket() or
+ *	  anywhere else) and closes it when it goes, it can be moved but not copied,
+ *	- Read() and Write() take std::span buffers; Read() returns what one recv()
+ *	  got (0 at end of file), Write() returns once ALL of it is written,
+ *	- Accept() and Connect() give back a Socket, false if it failed,
+ *	- failures come back the way the C library reports them, -1 (or an empty
+ *	  Socket) with errno set; errno is set as the co_await returns, so it is
+ *	  still the operation's own even though other coroutines ran meanwhile,
+ *	- Task<T> is a coroutine returning T, started when it is co_awaited, or by
+ *	  Reactor::Spawn() to run on its own (an exception escaping a spawned task
+ *	  ends the program, like one escaping a std::thread).
+ *
+ * Each operation is an awaitable that lives in the awaiting coroutine's frame: it
+ * tries the call first, and only if that would block is it parked in the reactor's
+ * table (indexed by fd, one reader and one writer per socket) until the event loop
+ * says the socket is ready. Nothing is allocated per operation; a coroutine frame
+ * is allocated once per Task, and a socket is registered with the event loop once,
+ * the first time it would block.
+ *
+ * A reactor is one event loop and belongs to one thread. For more threads run a
+ * reactor in each, each with its own Listen(reactor, port, SOMAXCONN, true)
+ * listener on the same port (SO_REUSEPORT, as ssockworker.c does). Coroutines still suspended when their
+ * reactor is destroyed are never resumed (and their frames are not freed).
+ *
+ * The reactor is the library's event loop, so its timer wheel is there for timeouts:
+ * reactor.Timers().
+ *
+ * Build with -std=c++20 and link with libssock.a.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifndef __SSOCKCO_HPP__
+#define __SSOCKCO_HPP__
+
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <span>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ssocklib.h"
+
+namespace ssock {
+
+class Reactor;
+class Socket;
+
+namespace detail {
+
+/*
+ * an operation parked until its socket is ready: Attempt() is tried again on every
+ * readiness event, and returns false while the call would still block
+ */
+struct Op {
+    std::coroutine_handle<>	handle;
+    bool			(*Attempt)(Op *op);
+};
+
+template <typename T>
+struct TaskPromise;
+
+struct TaskPromiseBase {
+    std::coroutine_handle<>	cont;		/* whoever co_awaits the task */
+    std::exception_ptr		error;
+    bool			detached = false;
+
+    struct FinalAwaiter {
+	bool await_ready() noexcept { return false; }
+
+	template <typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+	{
+	    TaskPromiseBase	&p = h.promise();
+
+	    if (p.cont)
+		return (p.cont);	/* straight back to the awaiter, no stack growth */
+	    if (p.detached) {
+		if (p.error)
+		    std::terminate();
+		h.destroy();
+	    }
+	    return (std::noop_coroutine());
+	}
+
+	void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T>	value;
+
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    void return_void() noexcept {}
+};
+
+}	/* namespace detail */
+
+/*
+ * a coroutine returning T, it starts running when co_awaited (or spawned)
+ */
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+    struct promise_type : detail::TaskPromise<T> {
+	Task get_return_object()
+	{
+	    return (Task(std::coroutine_handle<promise_type>::from_promise(*this)));
+	}
+    };
+
+    Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    Task &operator=(Task &&other) noexcept
+    {
+	if (this != &other) {
+	    if (h_)
+		h_.destroy();
+	    h_ = std::exchange(other.h_, nullptr);
+	}
+	return (*this);
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+	if (h_)
+	    h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return (!h_ || h_.done()); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+	h_.promise().cont = awaiter;
+	return (h_);
+    }
+
+    T await_resume()
+    {
+	promise_type	&p = h_.promise();
+
+	if (p.error)
+	    std::rethrow_exception(p.error);
+	if constexpr (!std::is_void_v<T>)
+	    return (std::move(*p.value));
+    }
+
+private:
+    friend class Reactor;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+    std::coroutine_handle<promise_type> Release() noexcept { return (std::exchange(h_, nullptr)); }
+
+    std::coroutine_handle<promise_type>	h_;
+};
+
+/*
+ * one thread's event loop, resuming coroutines whose sockets became ready
+ */
+class Reactor {
+public:
+    Reactor() : loop_(CreateEventLoop())
+    {
+	if (loop_ == NULL)
+	    throw std::system_error(errno, std::generic_category(), "CreateEventLoop");
+    }
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+    ~Reactor() { CloseEventLoop(loop_); }
+
+    /*
+     * run a task on its own: it starts now and goes until its first co_await that
+     * blocks, and frees itself when it finishes
+     */
+    void Spawn(Task<> task)
+    {
+	std::coroutine_handle<Task<>::promise_type>	h = task.Release();
+
+	if (h) {
+	    h.promise().detached = true;
+	    h.resume();
+	}
+    }
+
+    /*
+     * dispatch events until Stop() (from a coroutine, or any other thread)
+     */
+    int Run() { return (RunEventLoop(loop_)); }
+    void Stop() { StopEventLoop(loop_); }
+
+    SockEventLoop *Loop() const { return (loop_); }
+    SockTimerWheel *Timers() const { return (EventLoopTimers(loop_)); }
+
+    /*
+     * park op until fd is ready (for the awaitables), false with errno set if the
+     * socket can't be watched
+     */
+    bool Wait(int fd, bool writing, detail::Op *op)
+    {
+	if (fd < 0) {
+	    errno = EBADF;
+	    return (false);
+	}
+
+	if ((size_t) fd >= waiters_.size())
+	    waiters_.resize(std::max((size_t) fd + 1, waiters_.size() * 2));
+
+	Waiters	&w = waiters_[fd];
+
+	if (!w.watched) {
+	    /* edge-triggered, and adding it reports whatever is already pending */
+	    if (AddEventLoop(loop_, fd, OnRead, OnWrite, this) < 0)
+		return (false);
+	    w.watched = true;
+	}
+
+	(writing ? w.writer : w.reader) = op;
+
+	return (true);
+    }
+
+    /*
+     * fd is being closed
+     */
+    void Forget(int fd)
+    {
+	if (fd < 0 || (size_t) fd >= waiters_.size() || !waiters_[fd].watched)
+	    return;
+
+	(void) RemoveEventLoop(loop_, fd);
+	waiters_[fd] = Waiters();
+    }
+
+private:
+    struct Waiters {
+	detail::Op	*reader = nullptr;
+	detail::Op	*writer = nullptr;
+	bool		watched = false;
+    };
+
+    static void OnRead(SockEventLoop *, int fd, void *arg)
+    {
+	static_cast<Reactor *>(arg)->Wake(fd, false);
+    }
+
+    static void OnWrite(SockEventLoop *, int fd, void *arg)
+    {
+	static_cast<Reactor *>(arg)->Wake(fd, true);
+    }
+
+public:
+    /*
+     * try the op parked on fd again, and resume it if it is done (a readiness
+     * event, or a retry timer's)
+     */
+    void Wake(int fd, bool writing)
+    {
+	detail::Op	*op;
+
+	if ((size_t) fd >= waiters_.size())
+	    return;
+
+	op = writing ? waiters_[fd].writer : waiters_[fd].reader;
+	if (op == nullptr || !(*op->Attempt)(op))
+	    return;	/* nobody waiting, or it would still block */
+
+	(writing ? waiters_[fd].writer : waiters_[fd].reader) = nullptr;
+	op->handle.resume();	/* may close fd, or grow waiters_ */
+    }
+
+private:
+    SockEventLoop		*loop_;
+    std::vector<Waiters>	waiters_;
+};
+
+namespace detail {
+
+/*
+ * the part every socket awaitable shares: try now, park if it would block
+ */
+template <typename Derived>
+struct IoAwaiter : Op {
+    Reactor	*reactor;
+    int		fd;
+    bool	writing;
+    long long	result = -1;
+    int		err = 0;
+
+    IoAwaiter(Reactor *r, int f, bool w) : reactor(r), fd(f), writing(w)
+    {
+	Attempt = &Derived::Try;
+    }
+
+    bool await_ready() noexcept { return (Derived::Try(this)); }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+	handle = h;
+	if (reactor->Wait(fd, writing, this))
+	    return (true);
+
+	result = -1;		/* can't wait for it, fail now */
+	err = errno;
+	return (false);
+    }
+
+    /*
+     * a finished call, false if it would block (EINTR is retried by the callers)
+     */
+    bool Done(long long n) noexcept
+    {
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return (false);
+	result = n;
+	err = (n < 0) ? errno : 0;
+	return (true);
+    }
+};
+
+struct ReadAwaiter : IoAwaiter<ReadAwaiter> {
+    std::span<char>	buf;
+
+    ReadAwaiter(Reactor *r, int f, std::span<char> b) : IoAwaiter(r, f, false), buf(b) {}
+
+    static bool Try(Op *op) noexcept
+    {
+	ReadAwaiter	*a = static_cast<ReadAwaiter *>(op);
+	int		n;
+
+	do {
+	    n = RecvSocket(a->fd, a->buf.data(), (int) a->buf.size());
+	} while (n < 0 && errno == EINTR);
+
+	return (a->Done(n));
+    }
+
+    ssize_t await_resume() noexcept
+    {
+	errno = err;
+	return ((ssize_t) result);
+    }
+};
+
+struct WriteAwaiter : IoAwaiter<WriteAwaiter> {
+    std::span<const char>	buf;
+    size_t			done = 0;
+
+    WriteAwaiter(Reactor *r, int f, std::span<const char> b) : IoAwaiter(r, f, true), buf(b) {}
+
+    static bool Try(Op *op) noexcept
+    {
+	WriteAwaiter	*a = static_cast<WriteAwaiter *>(op);
+	long long	start;
+	ssize_t		n;
+
+	while (a->done < a->buf.size()) {
+	    start = SockStatStart();
+	    n = send(a->fd, a->buf.data() + a->done, a->buf.size() - a->done, MSG_NOSIGNAL);
+	    SockStatEnd(SOCK_STAT_WRITE, a->fd, a->buf.size() - a->done, n, start);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n < 0)
+		return (a->Done(-1));	/* EAGAIN parks it with what is written so far */
+	    a->done += n;
+	}
+
+	return (a->Done((long long) a->done));
+    }
+
+    ssize_t await_resume() noexcept
+    {
+	errno = err;
+	return ((ssize_t) result);
+    }
+};
+
+/*
+ * out of descriptors (EMFILE, ENFILE) an accept stays parked, the connection
+ * queued, and is tried again this often until one frees up; the listener's next
+ * readiness event may never come, and failing makes the caller spin on it
+ */
+inline const int ACCEPT_RETRY_MS = 10;
+
+struct AcceptAwaiter : IoAwaiter<AcceptAwaiter> {
+    struct sockaddr_storage	*peer;
+    SockTimer			retry;
+    bool			full = false;
+
+    AcceptAwaiter(Reactor *r, int f, struct sockaddr_storage *p) : IoAwaiter(r, f, false), peer(p)
+    {
+	InitTimer(&retry, Retry, this);
+    }
+    AcceptAwaiter(const AcceptAwaiter &) = delete;	/* the timer points at it */
+    ~AcceptAwaiter() { CancelTimer(&retry); }
+
+    static bool Try(Op *op) noexcept
+    {
+	AcceptAwaiter	*a = static_cast<AcceptAwaiter *>(op);
+	int		n;
+
+	do {
+	    n = AcceptPeerSocket(a->fd, a->peer);
+	} while (n < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+	a->full = (n < 0 && (errno == EMFILE || errno == ENFILE));
+	if (a->full) {
+	    if (a->handle)	/* parked already: wait some more */
+		(void) ArmTimer(a->reactor->Timers(), &a->retry, ACCEPT_RETRY_MS);
+	    return (false);
+	}
+
+	return (a->Done(n));
+    }
+
+    bool await_suspend(std::coroutine_handle<> h) noexcept
+    {
+	if (!IoAwaiter::await_suspend(h))
+	    return (false);
+	if (full)
+	    (void) ArmTimer(reactor->Timers(), &retry, ACCEPT_RETRY_MS);
+	return (true);
+    }
+
+    static void Retry(SockTimer *, void *arg)
+    {
+	AcceptAwaiter	*a = static_cast<AcceptAwaiter *>(arg);
+
+	a->reactor->Wake(a->fd, false);
+    }
+
+    inline Socket await_resume() noexcept;
+};
+
+struct ConnectAwaiter : IoAwaiter<ConnectAwaiter> {
+    struct sockaddr_storage	addr;
+    long long			start = 0;
+    bool			started = false;
+
+    ConnectAwaiter(const ConnectAwaiter &) = delete;	/* owns fd until it resumes */
+    ConnectAwaiter(Reactor *r, const char *host, int port) : IoAwaiter(r, -1, true)
+    {
+	if (ResolveHost(const_cast<char *>(host), port, AF_UNSPEC, &addr, 1) < 0) {
+	    err = errno;
+	    return;
+	}
+	fd = CreateSocketFamily(addr.ss_family);
+	if (fd >= 0 && SetNonBlockSocket(fd) < 0) {
+	    (void) CloseSocket(fd);
+	    fd = -1;
+	}
+	if (fd < 0)
+	    err = errno;
+    }
+
+    ~ConnectAwaiter()
+    {
+	if (fd >= 0 && result < 0) {
+	    reactor->Forget(fd);
+	    (void) CloseSocket(fd);
+	}
+    }
+
+    static bool Try(Op *op) noexcept
+    {
+	ConnectAwaiter	*a = static_cast<ConnectAwaiter *>(op);
+	socklen_t	len = sizeof(int);
+	int		n, soerr = 0;
+
+	if (a->fd < 0) {
+	    a->result = -1;	/* resolving or creating the socket failed */
+	    return (true);
+	}
+
+	if (!a->started) {
+	    a->started = true;
+	    a->start = SockStatStart();
+	    do {
+		n = connect(a->fd, (struct sockaddr *) &a->addr, SockAddrLen(&a->addr));
+	    } while (n < 0 && errno == EINTR);
+	    if (n < 0 && errno == EINPROGRESS)
+		return (false);	/* writable once it is through, one way or the other */
+	} else {
+	    n = getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+	    if (n == 0 && soerr != 0) {
+		errno = soerr;
+		n = -1;
+	    }
+	}
+
+	SockStatEnd(SOCK_STAT_CONNECT, a->fd, 0, n, a->start);
+	a->result = n;
+	a->err = (n < 0) ? errno : 0;
+
+	return (true);
+    }
+
+    inline Socket await_resume() noexcept;
+};
+
+}	/* namespace detail */
+
+/*
+ * a socket descriptor owned by one reactor, closed with the object
+ */
+class Socket {
+public:
+    Socket() = default;
+
+    /*
+     * take over fd (made non-blocking, if it isn't already)
+     */
+    Socket(Reactor &reactor, int fd) : reactor_(&reactor), fd_(fd)
+    {
+	if (fd_ >= 0)
+	    (void) SetNonBlockSocket(fd_);
+    }
+
+    Socket(Socket &&other) noexcept : reactor_(other.reactor_), fd_(std::exchange(other.fd_, -1)) {}
+    Socket &operator=(Socket &&other) noexcept
+    {
+	if (this != &other) {
+	    (void) Close();
+	    reactor_ = other.reactor_;
+	    fd_ = std::exchange(other.fd_, -1);
+	}
+	return (*this);
+    }
+    Socket(const Socket &) = delete;
+    Socket &operator=(const Socket &) = delete;
+    ~Socket() { (void) Close(); }
+
+    explicit operator bool() const { return (fd_ >= 0); }
+    int Fd() const { return (fd_); }
+    Reactor &GetReactor() const { return (*reactor_); }
+
+    /*
+     * give up the descriptor without closing it (it stays non-blocking)
+     */
+    int Release()
+    {
+	if (fd_ >= 0)
+	    reactor_->Forget(fd_);
+	return (std::exchange(fd_, -1));
+    }
+
+    int Close()
+    {
+	if (fd_ < 0)
+	    return (0);
+	reactor_->Forget(fd_);
+	return (CloseSocket(std::exchange(fd_, -1)));
+    }
+
+    /*
+     * co_await: what one read got, 0 at end of file, -1 with errno set
+     */
+    detail::ReadAwaiter Read(std::span<char> buf) { return (detail::ReadAwaiter(reactor_, fd_, buf)); }
+
+    /*
+     * co_await: all of buf (buf.size()), or -1 with errno set
+     */
+    detail::WriteAwaiter Write(std::span<const char> buf) { return (detail::WriteAwaiter(reactor_, fd_, buf)); }
+
+    /*
+     * co_await: the next connection on a listener, empty with errno set if it
+     * failed; peer, if given, gets its address. Out of descriptors (EMFILE) it
+     * waits until one is closed, retrying every 10ms.
+     */
+    detail::AcceptAwaiter Accept(struct sockaddr_storage *peer = nullptr)
+    {
+	return (detail::AcceptAwaiter(reactor_, fd_, peer));
+    }
+
+private:
+    friend struct detail::AcceptAwaiter;
+    friend struct detail::ConnectAwaiter;
+
+    struct Adopt {};	/* already non-blocking, skip the fcntl() */
+    Socket(Reactor &reactor, int fd, Adopt) : reactor_(&reactor), fd_(fd) {}
+
+    Reactor	*reactor_ = nullptr;
+    int		fd_ = -1;
+};
+
+inline Socket detail::AcceptAwaiter::await_resume() noexcept
+{
+    CancelTimer(&retry);	/* a readiness event got there first */
+    errno = err;
+    return ((result < 0) ? Socket() : Socket(*reactor, (int) result, Socket::Adopt()));
+}
+
+inline Socket detail::ConnectAwaiter::await_resume() noexcept
+{
+    int	sockfd;
+
+    errno = err;
+    if (result < 0)
+	return (Socket());
+
+    sockfd = std::exchange(fd, -1);
+    return (Socket(*reactor, sockfd, Socket::Adopt()));
+}
+
+/*
+ * co_await: a connection to the first address host resolves to (through the
+ * library's DNS cache, which blocks on a name it hasn't seen before), empty with
+ * errno set if it failed
+ */
+inline detail::ConnectAwaiter Connect(Reactor &reactor, const char *host, int port)
+{
+    return (detail::ConnectAwaiter(&reactor, host, port));
+}
+
+/*
+ * a listening socket on port; reuse_port to have one per reactor (thread) on the
+ * same port. Empty with errno set if it fails.
+ */
+inline Socket Listen(Reactor &reactor, int port, int backlog = SOMAXCONN, bool reuse_port = false)
+{
+    int	fd, on = 1, save;
+
+    fd = CreateSocket();
+    if (fd < 0)
+	return (Socket());
+
+    if ((reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) ||
+	SetReuseAddrSocket(fd, 1) < 0 || BindSocket(fd, port) < 0 || ListenSocket(fd, backlog) < 0) {
+	save = errno;
+	(void) CloseSocket(fd);
+	errno = save;
+	return (Socket());
+    }
+
+    return (Socket(reactor, fd));
+}
+
+}	/* namespace ssock */
+
+#endif /* __SSOCKCO_HPP__ */
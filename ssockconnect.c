@@ -0,0 +1,282 @@
+/*
+ * ssockconnect.c
+ *
+ * Connecting with a deadline, and to dual stack (IPv4 + IPv6) hosts.
+ *
+ * ConnectSocket() calls a blocking connect(), so a host that doesn't answer holds
+ * the caller for the kernel's whole SYN retry period (minutes). Here the connect
+ * is non-blocking and waited for with poll() up to a caller supplied deadline.
+ *
+ * ConnectHostSocket() also creates the socket itself, so it can use any address
+ * the name resolves to. It races them "Happy Eyeballs" style (RFC 8305): the
+ * addresses are tried in the resolver's order with the families interleaved,
+ * each new attempt is started 250ms after the previous one unless that one has
+ * already failed, and the first connection to complete wins.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define CONNECT_MAX_ADDRS	(16)	/* addresses we are willing to race */
+#define CONNECT_DELAY_MS	(250)	/* RFC 8305 "connection attempt delay" */
+
+static long long nowMs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static int setBlocking(int fd, int blocking)
+{
+    int	flags;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+	return (-1);
+
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+
+    return (fcntl(fd, F_SETFL, flags));
+}
+
+/*
+ * milliseconds left before the deadline, -1 if there is none
+ */
+static int remaining(long long deadline)
+{
+    long long	left;
+
+    if (deadline < 0)
+	return (-1);
+
+    left = deadline - nowMs();
+
+    return ((left > 0) ? (int) left : 0);
+}
+
+/*
+ * connect an existing socket, giving up after timeout_ms
+ */
+int ConnectTimeoutSocket(int sockfd, char *host_name, int port, int timeout_ms)
+{
+    struct sockaddr_storage ss, addrs[CONNECT_MAX_ADDRS];
+    struct pollfd	pfd;
+    socklen_t		len = sizeof(ss);
+    long long		deadline;
+    long long		start = SockStatStart();
+    int			flags, i, n, naddrs, err = ETIMEDOUT;
+
+    deadline = (timeout_ms >= 0) ? nowMs() + timeout_ms : -1;
+
+    memset(&ss, 0, sizeof(ss));
+    if (getsockname(sockfd, (struct sockaddr *) &ss, &len) < 0)
+	return (-1);
+
+    naddrs = ResolveHost(host_name, port, ss.ss_family, addrs, CONNECT_MAX_ADDRS);
+    if (naddrs < 0)
+	return (-1);
+
+    flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || setBlocking(sockfd, 0) < 0)
+	return (-1);
+
+    for (i = 0; i < naddrs; i++) {
+	if (connect(sockfd, (struct sockaddr *) &addrs[i], SockAddrLen(&addrs[i])) == 0) {
+	    err = 0;
+	    break;
+	}
+	if (errno != EINPROGRESS) {
+	    err = errno;
+	    continue;		/* refused etc., next address */
+	}
+
+	pfd.fd = sockfd;
+	pfd.events = POLLOUT;
+	do {
+	    n = poll(&pfd, 1, remaining(deadline));
+	} while (n < 0 && errno == EINTR);
+
+	if (n == 0) {
+	    err = ETIMEDOUT;
+	    break;		/* out of time, no point trying the others */
+	}
+
+	len = sizeof(err);
+	if (n < 0 || getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	    err = errno;
+	if (err == 0 || remaining(deadline) == 0)
+	    break;
+    }
+
+    fcntl(sockfd, F_SETFL, flags);	/* back to how the caller had it */
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : ConnectTimeoutSocket(%d, %s, %d, %d) errno %d\n",__FILE__,
+	    sockfd,host_name,port,timeout_ms,err);
+#endif
+
+    errno = err;
+    SockStatEnd(SOCK_STAT_CONNECT, sockfd, 0, (err != 0) ? -1 : 0, start);
+
+    if (err != 0) {
+	errno = err;
+	return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * order the addresses for racing: alternate families, keeping the resolver's
+ * preference within each family and starting with its overall favourite
+ */
+static int interleave(struct sockaddr_storage *res, int nres, struct sockaddr_storage **out)
+{
+    struct sockaddr_storage *first[CONNECT_MAX_ADDRS], *other[CONNECT_MAX_ADDRS];
+    int			nfirst = 0, nother = 0, n = 0, i, j;
+
+    for (i = 0; i < nres; i++) {
+	if (res[i].ss_family == res[0].ss_family)
+	    first[nfirst++] = &res[i];
+	else
+	    other[nother++] = &res[i];
+    }
+
+    for (i = j = 0; (i < nfirst || j < nother) && n < CONNECT_MAX_ADDRS; ) {
+	if (i < nfirst)
+	    out[n++] = first[i++];
+	if (j < nother && n < CONNECT_MAX_ADDRS)
+	    out[n++] = other[j++];
+    }
+
+    return (n);
+}
+
+/*
+ * create a socket and connect it to host:port, racing its addresses
+ */
+int ConnectHostSocket(char *host_name, int port, int timeout_ms)
+{
+    struct sockaddr_storage res[CONNECT_MAX_ADDRS], *addrs[CONNECT_MAX_ADDRS];
+    struct pollfd	pfds[CONNECT_MAX_ADDRS];
+    socklen_t		len;
+    long long		deadline, next_start = 0;
+    int			nres, naddrs, next = 0, npending = 0, winner = -1, err = ETIMEDOUT;
+    int			i, n, fd, wait_ms, soerr;
+    long long		start = SockStatStart();
+
+    deadline = (timeout_ms >= 0) ? nowMs() + timeout_ms : -1;
+
+    nres = ResolveHost(host_name, port, AF_UNSPEC, res, CONNECT_MAX_ADDRS);
+    if (nres < 0)
+	return (-1);
+
+    naddrs = interleave(res, nres, addrs);
+
+    while (winner < 0) {
+	if (deadline >= 0 && remaining(deadline) == 0) {
+	    err = ETIMEDOUT;
+	    break;
+	}
+
+	/* time to start another attempt? */
+	if (next < naddrs && (npending == 0 || nowMs() >= next_start)) {
+	    fd = socket(addrs[next]->ss_family, SOCK_STREAM, 0);
+	    if (fd >= 0 && setBlocking(fd, 0) == 0 &&
+		(connect(fd, (struct sockaddr *) addrs[next], SockAddrLen(addrs[next])) == 0 ||
+		 errno == EINPROGRESS)) {
+		pfds[npending].fd = fd;
+		pfds[npending].events = POLLOUT;
+		npending++;
+	    } else {
+		err = errno;
+		if (fd >= 0)
+		    CloseSocket(fd);
+	    }
+	    next++;
+	    next_start = nowMs() + CONNECT_DELAY_MS;
+	    continue;		/* if that failed outright, start the next one right away */
+	}
+
+	if (npending == 0)
+	    break;		/* nothing left to try */
+
+	wait_ms = remaining(deadline);
+	if (next < naddrs) {
+	    n = (int) (next_start - nowMs());
+	    if (n < 0)
+		n = 0;
+	    if (wait_ms < 0 || n < wait_ms)
+		wait_ms = n;
+	}
+
+	n = poll(pfds, npending, wait_ms);
+	if (n < 0 && errno != EINTR) {
+	    err = errno;
+	    break;
+	}
+
+	for (i = 0; n > 0 && i < npending; i++) {
+	    if (pfds[i].revents == 0)
+		continue;
+
+	    len = sizeof(soerr);
+	    if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+		soerr = errno;
+
+	    if (soerr == 0) {
+		winner = pfds[i].fd;
+		pfds[i] = pfds[--npending];	/* keep the rest for closing */
+		break;
+	    }
+
+	    err = soerr;
+	    CloseSocket(pfds[i].fd);
+	    pfds[i--] = pfds[--npending];
+	    next_start = 0;	/* one failed, don't make the next one wait */
+	}
+    }
+
+    for (i = 0; i < npending; i++)
+	CloseSocket(pfds[i].fd);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : ConnectHostSocket(%s, %d, %d) returning %d errno %d\n",__FILE__,
+	    host_name,port,timeout_ms,winner,err);
+#endif
+
+    errno = err;
+    SockStatEnd(SOCK_STAT_CONNECT, winner, 0, winner, start);
+
+    if (winner < 0) {
+	errno = err;
+	return (-1);
+    }
+
+    setBlocking(winner, 1);	/* like a socket from CreateSocket() + ConnectSocket() */
+    if (GetDefaultSocketProfile() != SOCK_PROFILE_DEFAULT)
+	(void) SetSocketProfile(winner, GetDefaultSocketProfile());
+    else
+	ForgetSocketProfile(winner);
+
+    return (winner);
+}
@@ -0,0 +1,565 @@
+/*
+ * ssockdns.c
+ *
+ * Host name resolution cache for the simple socket library.
+ *
+ * Every connect used to look its host up with the system resolver: a DNS round
+ * trip (or an /etc/hosts parse) on the connect path, and after a deploy, when
+ * every client reconnects at once, a storm of identical queries. Here answers are
+ * kept per host name for a while:
+ *
+ *	- a fresh entry is answered from memory,
+ *	- an entry in use is refreshed by a background thread shortly before it
+ *	  expires, so a busy host never goes stale and callers never wait for it,
+ *	- should it expire anyway (the refresh failed: resolver down) the old
+ *	  addresses are still handed out, for up to DNS_MAX_STALE_MS, while the
+ *	  background thread keeps trying,
+ *	- failed lookups are remembered too (negative caching), for a shorter time,
+ *	  but not a resolver that couldn't answer yet (EAI_AGAIN, errno EAGAIN),
+ *	- any number of threads missing on the same name share one lookup.
+ *
+ * getaddrinfo() doesn't tell us the records' TTLs, so entries live for a fixed,
+ * settable time instead (SetDnsCache()).
+ *
+ * For testing, SetDnsHostsFile() makes the cache resolve from a hosts(5) style
+ * file instead of the system resolver.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define DNS_HOST_MAX		(256)
+#define DNS_MAX_ADDRS		(16)		/* addresses kept per name */
+#define DNS_BUCKETS		(256)
+#define DNS_MAX_ENTRIES		(1024)		/* beyond this the least recently used go */
+#define DNS_DEFAULT_TTL_MS	(30 * 1000)
+#define DNS_DEFAULT_NEG_TTL_MS	(5 * 1000)
+#define DNS_MAX_STALE_MS	(5 * 60 * 1000)	/* serve old answers this long past expiry */
+#define DNS_TICK_MS		(250)		/* how often the refresh thread looks around */
+
+typedef struct DnsEntry {
+    struct DnsEntry		*next;		/* hash chain */
+    char			host[DNS_HOST_MAX];
+    int				naddrs;		/* 0: negative entry, see err */
+    int				err;		/* errno of the failed lookup */
+    struct sockaddr_storage	addrs[DNS_MAX_ADDRS];	/* port 0 */
+    long long			expires_ms;
+    long long			refresh_ms;	/* when the background thread looks it up again */
+    long long			used_ms;	/* last handed out */
+    int				resolving;	/* a lookup for it is in flight */
+} DnsEntry;
+
+static pthread_mutex_t	dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	dns_done = PTHREAD_COND_INITIALIZER;	/* a lookup finished */
+static pthread_cond_t	dns_wake = PTHREAD_COND_INITIALIZER;	/* work for the thread */
+static pthread_once_t	dns_once = PTHREAD_ONCE_INIT;
+static DnsEntry		*dns_table[DNS_BUCKETS];
+static int		dns_count = 0;
+static int		dns_ttl_ms = DNS_DEFAULT_TTL_MS;	/* 0: no caching */
+static int		dns_neg_ttl_ms = DNS_DEFAULT_NEG_TTL_MS;
+static char		*dns_hosts_file = NULL;			/* NULL: system resolver */
+
+static long long nowMs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static unsigned int hashHost(char *host)
+{
+    unsigned int	h = 5381;
+
+    while (*host)
+	h = h * 33 + (unsigned char) tolower((unsigned char) *host++);
+
+    return (h % DNS_BUCKETS);
+}
+
+/*
+ * a numeric address needs no lookup (and no cache entry)
+ */
+static int parseNumeric(char *host, struct sockaddr_storage *ss)
+{
+    struct sockaddr_in	*sin = (struct sockaddr_in *) ss;
+    struct sockaddr_in6	*sin6 = (struct sockaddr_in6 *) ss;
+
+    memset(ss, 0, sizeof(*ss));
+
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+	sin->sin_family = AF_INET;
+	return (1);
+    }
+    if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+	sin6->sin6_family = AF_INET6;
+	return (1);
+    }
+
+    return (0);
+}
+
+/*
+ * look host up in a hosts(5) file: "address name [aliases...]", # comments
+ */
+static int lookupHostsFile(char *path, char *host, struct sockaddr_storage *addrs, int *err)
+{
+    FILE	*fp;
+    char	line[1024], *p, *addr, *name;
+    int		n = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+	*err = errno;
+	return (0);
+    }
+
+    while (n < DNS_MAX_ADDRS && fgets(line, sizeof(line), fp) != NULL) {
+	if ((p = strchr(line, '#')) != NULL)
+	    *p = '\0';
+	addr = strtok_r(line, " \t\r\n", &p);
+	if (addr == NULL)
+	    continue;
+	while ((name = strtok_r(NULL, " \t\r\n", &p)) != NULL) {
+	    if (strcasecmp(name, host) == 0) {
+		if (parseNumeric(addr, &addrs[n]))
+		    n++;
+		break;
+	    }
+	}
+    }
+
+    fclose(fp);
+
+    if (n == 0)
+	*err = EHOSTUNREACH;
+
+    return (n);
+}
+
+/*
+ * the actual lookup, called WITHOUT dns_lock held; returns the number of addresses
+ * (ports zeroed), or 0 with *err set
+ */
+static int lookupHost(char *host, char *hosts_file, struct sockaddr_storage *addrs, int *err)
+{
+    struct addrinfo	hints, *res, *ai;
+    int			n = 0, rc;
+
+    if (hosts_file != NULL)
+	return (lookupHostsFile(hosts_file, host, addrs, err));
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;	/* no AAAA records on an IPv4-only box */
+
+    rc = getaddrinfo(host, NULL, &hints, &res);
+    if (rc != 0) {
+	if (rc == EAI_SYSTEM)
+	    *err = errno;
+	else
+	    *err = (rc == EAI_AGAIN) ? EAGAIN : EHOSTUNREACH;	/* EAGAIN: try again, not cached */
+	return (0);
+    }
+
+	/* keep getaddrinfo()'s order, it is the preference order */
+    for (ai = res; ai != NULL && n < DNS_MAX_ADDRS; ai = ai->ai_next) {
+	if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+	    continue;
+	memset(&addrs[n], 0, sizeof(addrs[n]));
+	memcpy(&addrs[n], ai->ai_addr, ai->ai_addrlen);
+	n++;
+    }
+    freeaddrinfo(res);
+
+    if (n == 0)
+	*err = EHOSTUNREACH;
+
+    return (n);
+}
+
+/*
+ * dns_lock held from here down
+ */
+static DnsEntry *findEntry(char *host)
+{
+    DnsEntry	*e;
+
+    for (e = dns_table[hashHost(host)]; e != NULL; e = e->next) {
+	if (strcasecmp(e->host, host) == 0)
+	    return (e);
+    }
+
+    return (NULL);
+}
+
+static void unlinkEntry(DnsEntry *e)
+{
+    DnsEntry	**pp;
+
+    for (pp = &dns_table[hashHost(e->host)]; *pp != NULL; pp = &(*pp)->next) {
+	if (*pp == e) {
+	    *pp = e->next;
+	    dns_count--;
+	    return;
+	}
+    }
+}
+
+/*
+ * make room: drop the least recently used entry nobody is resolving
+ */
+static void evictEntry(void)
+{
+    DnsEntry	*e, *lru = NULL;
+    int		b;
+
+    for (b = 0; b < DNS_BUCKETS; b++) {
+	for (e = dns_table[b]; e != NULL; e = e->next) {
+	    if (!e->resolving && (lru == NULL || e->used_ms < lru->used_ms))
+		lru = e;
+	}
+    }
+
+    if (lru != NULL) {
+	unlinkEntry(lru);
+	free(lru);
+    }
+}
+
+static DnsEntry *addEntry(char *host)
+{
+    DnsEntry	*e;
+    unsigned int h;
+
+    if (dns_count >= DNS_MAX_ENTRIES)
+	evictEntry();
+
+    e = calloc(1, sizeof(DnsEntry));
+    if (e == NULL)
+	return (NULL);
+
+    strcpy(e->host, host);
+    h = hashHost(host);
+    e->next = dns_table[h];
+    dns_table[h] = e;
+    dns_count++;
+
+    return (e);
+}
+
+/*
+ * resolve e's name again and store the result, dropping dns_lock meanwhile
+ *
+ * A failed refresh of a good entry keeps the old addresses (and tries again
+ * after the negative TTL) rather than wiping them out.
+ */
+static void refreshEntry(DnsEntry *e)
+{
+    struct sockaddr_storage	addrs[DNS_MAX_ADDRS];
+    char			host[DNS_HOST_MAX], *hosts_file;
+    int				n, err = 0;
+
+    e->resolving = 1;
+    strcpy(host, e->host);
+    hosts_file = (dns_hosts_file != NULL) ? strdup(dns_hosts_file) : NULL;
+    pthread_mutex_unlock(&dns_lock);
+
+    n = lookupHost(host, hosts_file, addrs, &err);
+    free(hosts_file);
+
+    pthread_mutex_lock(&dns_lock);
+
+    if (n > 0) {
+	memcpy(e->addrs, addrs, n * sizeof(addrs[0]));
+	e->naddrs = n;
+	e->err = 0;
+	e->expires_ms = nowMs() + dns_ttl_ms;
+	e->refresh_ms = e->expires_ms - dns_ttl_ms / 4;	/* before anyone sees it expire */
+    } else if (e->naddrs > 0 && nowMs() - e->expires_ms < DNS_MAX_STALE_MS) {
+	e->refresh_ms = nowMs() + dns_neg_ttl_ms;	/* stay on the old answer for now */
+    } else {
+	e->naddrs = 0;
+	e->err = err;
+	e->expires_ms = e->refresh_ms = nowMs() + dns_neg_ttl_ms;
+	if (err == EAGAIN)
+	    e->expires_ms = e->refresh_ms = nowMs();	/* the server had no answer yet, no verdict to keep */
+    }
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : refreshed [%s] %d addresses, errno %d\n",__FILE__,host,n,err);
+#endif
+
+    e->resolving = 0;
+    pthread_cond_broadcast(&dns_done);
+}
+
+/*
+ * the refresh thread: re-resolve entries in use before they expire, and
+ * forget the ones nobody asked for in a while
+ */
+static void *dnsMain(void *unused)
+{
+    DnsEntry		*e, *next;
+    struct timespec	ts;
+    long long		now;
+    int			b, again;
+
+    pthread_mutex_lock(&dns_lock);
+
+    for (;;) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += DNS_TICK_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&dns_wake, &dns_lock, &ts);
+
+	/* refreshEntry() drops the lock, so start over after each one */
+	do {
+	    again = 0;
+	    now = nowMs();
+	    for (b = 0; b < DNS_BUCKETS && !again; b++) {
+		for (e = dns_table[b]; e != NULL; e = next) {
+		    next = e->next;
+		    if (e->resolving)
+			continue;
+
+		    if (now - e->used_ms > dns_ttl_ms + DNS_MAX_STALE_MS) {
+			unlinkEntry(e);		/* unused for ages */
+			free(e);
+			continue;
+		    }
+
+			/* keep good entries that are in use fresh */
+		    if (e->naddrs > 0 && now - e->used_ms < dns_ttl_ms && now >= e->refresh_ms) {
+			refreshEntry(e);
+			again = 1;
+			break;
+		    }
+		}
+	    }
+	} while (again);
+    }
+
+    pthread_mutex_unlock(&dns_lock);
+
+    return (NULL);
+}
+
+static void dnsStart(void)
+{
+    pthread_t	thread;
+
+    if (pthread_create(&thread, NULL, dnsMain, NULL) == 0)
+	pthread_detach(thread);
+	/* without the thread entries still work, they just get refreshed on demand */
+}
+
+/*
+ * copy the addresses of the wanted family out, with the port filled in
+ */
+static int copyOut(struct sockaddr_storage *from, int nfrom, int family, int port,
+		   struct sockaddr_storage *addrs, int max)
+{
+    int	i, n = 0;
+
+    for (i = 0; i < nfrom && n < max; i++) {
+	if (family != AF_UNSPEC && from[i].ss_family != family)
+	    continue;
+	addrs[n] = from[i];
+	if (from[i].ss_family == AF_INET6)
+	    ((struct sockaddr_in6 *) &addrs[n])->sin6_port = htons(port);
+	else
+	    ((struct sockaddr_in *) &addrs[n])->sin_port = htons(port);
+	n++;
+    }
+
+    if (n == 0)
+	errno = EHOSTUNREACH;	/* the name exists, but not in that family */
+
+    return (n);
+}
+
+/*
+ * look up host_name, from the cache when possible
+ */
+int ResolveHost(char *host_name, int port, int family, struct sockaddr_storage *addrs, int max)
+{
+    struct sockaddr_storage	found[DNS_MAX_ADDRS];
+    DnsEntry			*e;
+    long long			now;
+    int				n, err = 0;
+
+    if (host_name == NULL || addrs == NULL || max <= 0 ||
+	(family != AF_UNSPEC && family != AF_INET && family != AF_INET6)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (parseNumeric(host_name, &found[0])) {
+	n = copyOut(found, 1, family, port, addrs, max);
+	return ((n > 0) ? n : -1);
+    }
+
+    if (strlen(host_name) >= DNS_HOST_MAX) {
+	errno = ENAMETOOLONG;
+	return (-1);
+    }
+
+    pthread_once(&dns_once, dnsStart);
+    pthread_mutex_lock(&dns_lock);
+
+    if (dns_ttl_ms == 0) {
+	char	*hosts_file = (dns_hosts_file != NULL) ? strdup(dns_hosts_file) : NULL;
+
+	pthread_mutex_unlock(&dns_lock);
+	n = lookupHost(host_name, hosts_file, found, &err);
+	free(hosts_file);
+	if (n == 0) {
+	    errno = err;
+	    return (-1);
+	}
+	n = copyOut(found, n, family, port, addrs, max);
+	return ((n > 0) ? n : -1);
+    }
+
+    for (;;) {
+	e = findEntry(host_name);
+	if (e == NULL) {
+	    e = addEntry(host_name);
+	    if (e == NULL) {
+		pthread_mutex_unlock(&dns_lock);
+		errno = ENOMEM;
+		return (-1);
+	    }
+	    e->used_ms = nowMs();
+	    refreshEntry(e);	/* the first lookup of a name has to wait */
+	    break;
+	}
+
+	now = nowMs();
+	if (e->naddrs > 0 && now - e->expires_ms < DNS_MAX_STALE_MS) {
+	    if (now >= e->expires_ms && !e->resolving)
+		pthread_cond_signal(&dns_wake);		/* stale: refresh it, but don't wait */
+	    break;
+	}
+	if (e->naddrs == 0 && now < e->expires_ms)
+	    break;					/* known bad */
+	if (!e->resolving) {
+	    refreshEntry(e);				/* negative or long stale entry expired */
+	    break;
+	}
+	pthread_cond_wait(&dns_done, &dns_lock);	/* someone else is looking it up */
+	/* (and the entry may be gone by now, look again) */
+    }
+
+    e->used_ms = nowMs();
+    if (e->naddrs == 0) {
+	err = e->err;
+	pthread_mutex_unlock(&dns_lock);
+	errno = err;
+	return (-1);
+    }
+
+    n = copyOut(e->addrs, e->naddrs, family, port, addrs, max);
+    pthread_mutex_unlock(&dns_lock);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : ResolveHost(%s, %d, %d) returning %d\n",__FILE__,host_name,port,family,n);
+#endif
+
+    return ((n > 0) ? n : -1);
+}
+
+/*
+ * the length to pass to connect()/bind() with one of ResolveHost()'s addresses
+ */
+int SockAddrLen(struct sockaddr_storage *addr)
+{
+    return ((addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+}
+
+/*
+ * set how long answers are kept; ttl_ms 0 turns the cache off
+ */
+int SetDnsCache(int ttl_ms, int negative_ttl_ms)
+{
+    if (ttl_ms < 0 || negative_ttl_ms < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    dns_ttl_ms = ttl_ms;
+    dns_neg_ttl_ms = negative_ttl_ms;
+    pthread_mutex_unlock(&dns_lock);
+
+    return (0);
+}
+
+/*
+ * forget everything (entries being looked up right now finish first)
+ */
+void FlushDnsCache(void)
+{
+    DnsEntry	*e, **pp;
+    int		b;
+
+    pthread_mutex_lock(&dns_lock);
+
+    for (b = 0; b < DNS_BUCKETS; b++) {
+	for (pp = &dns_table[b]; (e = *pp) != NULL; ) {
+	    if (e->resolving) {
+		e->expires_ms = 0;	/* can't free it under the resolver, expire it */
+		pp = &e->next;
+		continue;
+	    }
+	    *pp = e->next;
+	    dns_count--;
+	    free(e);
+	}
+    }
+
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * resolve from a hosts(5) style file instead of the system resolver (NULL to go back)
+ */
+int SetDnsHostsFile(char *path)
+{
+    char	*copy = NULL;
+
+    if (path != NULL && (copy = strdup(path)) == NULL) {
+	errno = ENOMEM;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    free(dns_hosts_file);
+    dns_hosts_file = copy;
+    pthread_mutex_unlock(&dns_lock);
+
+    FlushDnsCache();	/* answers from the old source don't count */
+
+    return (0);
+}
@@ -0,0 +1,661 @@
+/*
+ * ssockevent.c
+ *
+ * Readiness-driven event loop for the simple socket library.
+ *
+ * Wraps Linux epoll so that a single server process can watch thousands of
+ * sockets at once instead of blocking in AcceptSocket()/RecvSocket() on one
+ * client at a time. All descriptors are registered edge-triggered and must be
+ * non-blocking; the callbacks are expected to read (or write) until the call
+ * returns -1 with errno == EAGAIN.
+ *
+ * StopEventLoop() may be called from any thread, it wakes the loop through an eventfd.
+ *
+ * Every loop has a timer wheel (ssocktimer.c): epoll_wait() sleeps no longer than
+ * the next timer, and the timers that are due run after each batch of events. An
+ * idle timeout is not re-armed on every event, that would be a wheel operation per
+ * read; the event just notes the time, and when the timer goes off it checks and
+ * re-arms itself for whatever is left if the socket was busy in the meantime.
+ *
+ * Listeners are emptied with AcceptBatchSocket() (ssockaccept.c), 64 at a time, and
+ * with SetAcceptLimitEventLoop() connections past the limit are shed as they come in.
+ * Out of descriptors (EMFILE/ENFILE), the loop closes a spare one it keeps open for
+ * the purpose, accepts and sheds, and takes the spare back, until the queue is
+ * empty: being edge-triggered, a listener left with connections waiting would never
+ * wake the loop again. Any other accept error retries the listener from a timer.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define EVENT_BATCH	(256)	/* max events pulled from the kernel per epoll_wait() */
+#define EVENT_MIN_FDS	(64)	/* initial size of the per-fd table */
+#define EVENT_TICK_MS	(1)	/* timer wheel resolution */
+#define ACCEPT_BATCH	(64)	/* connections accepted before the first is handed over */
+#define ACCEPT_RETRY_MS	(10)	/* a listener that failed to accept is drained again this soon */
+
+/*
+ * idle timeout of one socket, allocated the first time its fd gets one and kept
+ * for whatever socket gets that fd number next (the entry table moves, this doesn't)
+ */
+typedef struct {
+    SockTimer		timer;
+    SockEventLoop	*loop;
+    SockEventFunc	idle_fn;
+    int			fd;
+    int			ms;		/* 0: off */
+    long long		last;		/* TimerWheelNow() of the last event */
+} IdleTimer;
+
+/*
+ * a listener to drain again after an accept error, kept like IdleTimer
+ */
+typedef struct {
+    SockTimer		timer;
+    SockEventLoop	*loop;
+    int			fd;
+    unsigned int	gen;		/* of the listener it was armed for */
+} AcceptRetry;
+
+/*
+ * one of these per registered file descriptor, the table is indexed by fd
+ */
+typedef struct {
+    SockEventFunc	read_fn;	/* readable (or accept callback on a listener) */
+    SockEventFunc	write_fn;	/* writable */
+    void		*arg;
+    unsigned int	gen;		/* bumped on every add/remove, catches stale events */
+    int			active;
+    int			listening;
+    IdleTimer		*idle;
+    AcceptRetry		*retry;
+} EventEntry;
+
+struct SockEventLoop {
+    int			epfd;
+    int			wakefd;		/* eventfd poked by StopEventLoop() */
+    int			spare;		/* closed to accept (and shed) when out of fds */
+    int			stop;
+    int			nentries;
+    EventEntry		*entries;
+    SockTimerWheel	*timers;
+    int			nconns;		/* registered sockets that aren't listeners */
+    int			max_conns;	/* more than this are shed, 0: no limit */
+    long long		shed;
+    struct sockaddr_storage	*peer;	/* of the connection accept_fn is called for */
+    struct epoll_event	events[EVENT_BATCH];
+};
+
+/*
+ * epoll only hands back a 64-bit cookie, pack the fd and its generation in it
+ */
+#define EVENT_COOKIE(fd, gen)	(((unsigned long long) (gen) << 32) | (unsigned int) (fd))
+#define EVENT_FD(cookie)	((int) ((cookie) & 0xffffffffULL))
+#define EVENT_GEN(cookie)	((unsigned int) ((cookie) >> 32))
+#define EVENT_WAKE		(~0ULL)
+
+/*
+ * grow the per-fd table so that fd is a valid index
+ */
+static int growEntries(SockEventLoop *loop, int fd)
+{
+    EventEntry	*entries;
+    int		n;
+
+    if (fd < loop->nentries)
+	return (0);
+
+    n = (loop->nentries > 0) ? loop->nentries : EVENT_MIN_FDS;
+    while (n <= fd)
+	n *= 2;
+
+    entries = realloc(loop->entries, n * sizeof(EventEntry));
+    if (entries == NULL) {
+	errno = ENOMEM;
+	return (-1);
+    }
+    memset(&entries[loop->nentries], 0, (n - loop->nentries) * sizeof(EventEntry));
+
+    loop->entries = entries;
+    loop->nentries = n;
+
+    return (0);
+}
+
+static void retryAccept(SockTimer *t, void *arg);
+
+static int registerFd(SockEventLoop *loop, int fd, SockEventFunc read_fn,
+		      SockEventFunc write_fn, void *arg, int listening)
+{
+    struct epoll_event	ev;
+    EventEntry		*e;
+
+    if (loop == NULL || fd < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (growEntries(loop, fd) < 0)
+	return (-1);
+
+    e = &loop->entries[fd];
+    if (e->active) {
+	errno = EEXIST;
+	return (-1);
+    }
+
+    e->gen++;
+    if (e->idle != NULL)
+	e->idle->ms = 0;	/* the last socket's timeout doesn't carry over */
+    e->read_fn = read_fn;
+    e->write_fn = write_fn;
+    e->arg = arg;
+    e->listening = listening;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    if (!listening)
+	ev.events |= EPOLLOUT | EPOLLRDHUP;
+    ev.data.u64 = EVENT_COOKIE(fd, e->gen);
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+#ifdef DEBUG
+	fprintf(stderr,"ERROR : %s : epoll_ctl(ADD, %d) failed. errno = %d\n",
+		__FILE__, fd, errno);
+#endif
+	return (-1);
+    }
+
+    e->active = 1;
+    if (!listening)
+	loop->nconns++;
+
+    return (0);
+}
+
+/*
+ * put a socket into non-blocking mode
+ */
+int SetNonBlockSocket(int sockfd)
+{
+    int	flags, retval;
+
+    flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0)
+	return (-1);
+
+    retval = (flags & O_NONBLOCK) ? 0 : fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : SetNonBlockSocket(%d) returning %d\n",__FILE__,sockfd,retval);
+#endif
+
+    return (retval);
+}
+
+/*
+ * create an (empty) event loop
+ */
+SockEventLoop *CreateEventLoop(void)
+{
+    SockEventLoop	*loop;
+    struct epoll_event	ev;
+
+    loop = calloc(1, sizeof(SockEventLoop));
+    if (loop == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+#ifdef DEBUG
+	fprintf(stderr,"ERROR : %s : epoll_create1() failed. errno = %d\n",
+		__FILE__, errno);
+#endif
+	free(loop);
+	return (NULL);
+    }
+
+    loop->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);	/* -1 is survivable */
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = EVENT_WAKE;
+    if (loop->wakefd < 0 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) < 0 ||
+	(loop->timers = CreateTimerWheel(EVENT_TICK_MS)) == NULL) {
+	if (loop->wakefd >= 0)
+	    close(loop->wakefd);
+	if (loop->spare >= 0)
+	    close(loop->spare);
+	close(loop->epfd);
+	free(loop);
+	return (NULL);
+    }
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : CreateEventLoop() returning epoll fd %d\n",__FILE__,loop->epfd);
+#endif
+
+    return (loop);
+}
+
+/*
+ * tear down an event loop, registered sockets are NOT closed
+ */
+int CloseEventLoop(SockEventLoop *loop)
+{
+    int	retval, fd;
+
+    if (loop == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    close(loop->wakefd);
+    if (loop->spare >= 0)
+	close(loop->spare);
+    retval = close(loop->epfd);
+    CloseTimerWheel(loop->timers);
+    for (fd = 0; fd < loop->nentries; fd++) {
+	free(loop->entries[fd].idle);
+	free(loop->entries[fd].retry);
+    }
+    free(loop->entries);
+    free(loop);
+
+    return (retval);
+}
+
+/*
+ * watch a listening socket, accept_fn is called once for every new connection
+ */
+int AddListenEventLoop(SockEventLoop *loop, int sockfd, SockEventFunc accept_fn, void *arg)
+{
+    if (accept_fn == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (SetNonBlockSocket(sockfd) < 0)
+	return (-1);
+
+    return (registerFd(loop, sockfd, accept_fn, NULL, arg, 1));
+}
+
+/*
+ * watch a connected socket for readability and/or writability
+ */
+int AddEventLoop(SockEventLoop *loop, int sockfd, SockEventFunc read_fn,
+		 SockEventFunc write_fn, void *arg)
+{
+    if (SetNonBlockSocket(sockfd) < 0)
+	return (-1);
+
+    return (registerFd(loop, sockfd, read_fn, write_fn, arg, 0));
+}
+
+/*
+ * stop watching a socket (does not close it)
+ */
+int RemoveEventLoop(SockEventLoop *loop, int sockfd)
+{
+    EventEntry	*e;
+
+    if (loop == NULL || sockfd < 0 || sockfd >= loop->nentries ||
+	!loop->entries[sockfd].active) {
+	errno = ENOENT;
+	return (-1);
+    }
+
+    e = &loop->entries[sockfd];
+    e->active = 0;
+    if (!e->listening)
+	loop->nconns--;
+    e->gen++;		/* any events for this fd still in the batch are now stale */
+    if (e->idle != NULL) {
+	CancelTimer(&e->idle->timer);
+	e->idle->ms = 0;
+    }
+    if (e->retry != NULL)
+	CancelTimer(&e->retry->timer);
+
+    return (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sockfd, NULL));
+}
+
+/*
+ * an idle timer went off: if the socket was busy since it was armed, wait for
+ * the rest of its timeout, otherwise it has been idle for the whole of it
+ */
+static void idleExpired(SockTimer *t, void *arg)
+{
+    IdleTimer		*it = (IdleTimer *) arg;
+    SockEventLoop	*loop = it->loop;
+    EventEntry		*e = &loop->entries[it->fd];
+    long long		idle = TimerWheelNow(loop->timers) - it->last;
+
+    if (!e->active || it->ms == 0)
+	return;
+
+    if (idle < it->ms) {
+	(void) ArmTimer(loop->timers, t, (int) (it->ms - idle));
+	return;
+    }
+
+    (*it->idle_fn)(loop, it->fd, e->arg);
+}
+
+/*
+ * close (via idle_fn) a registered socket after ms without an event, 0 turns it off
+ */
+int SetIdleEventLoop(SockEventLoop *loop, int sockfd, int ms, SockEventFunc idle_fn)
+{
+    EventEntry	*e;
+    IdleTimer	*it;
+
+    if (loop == NULL || sockfd < 0 || ms < 0 || (ms > 0 && idle_fn == NULL)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (sockfd >= loop->nentries || !loop->entries[sockfd].active) {
+	errno = ENOENT;
+	return (-1);
+    }
+
+    e = &loop->entries[sockfd];
+    if (e->idle == NULL) {
+	if (ms == 0)
+	    return (0);
+	e->idle = malloc(sizeof(IdleTimer));
+	if (e->idle == NULL) {
+	    errno = ENOMEM;
+	    return (-1);
+	}
+	InitTimer(&e->idle->timer, idleExpired, e->idle);
+	e->idle->loop = loop;
+	e->idle->fd = sockfd;
+    }
+    it = e->idle;
+
+    it->ms = ms;
+    it->idle_fn = idle_fn;
+    it->last = TimerWheelNow(loop->timers);
+    if (ms == 0) {
+	CancelTimer(&it->timer);
+	return (0);
+    }
+
+    return (ArmTimer(loop->timers, &it->timer, ms));
+}
+
+/*
+ * the loop's timer wheel, for deadlines of your own; its timers run on the
+ * loop's thread, after the events
+ */
+SockTimerWheel *EventLoopTimers(SockEventLoop *loop)
+{
+    return ((loop != NULL) ? loop->timers : NULL);
+}
+
+/*
+ * out of descriptors: give up the spare for long enough to accept one connection
+ * and reset it, so it leaves the queue (0: shed one, -1: couldn't, errno says why)
+ */
+static int shedWithSpare(SockEventLoop *loop, int sockfd)
+{
+    int	fd, err;
+
+    if (loop->spare < 0) {
+	errno = EMFILE;
+	return (-1);
+    }
+
+    close(loop->spare);
+    fd = AcceptPeerSocket(sockfd, NULL);
+    err = errno;
+    if (fd >= 0) {
+	ShedSocket(fd);
+	__atomic_add_fetch(&loop->shed, 1, __ATOMIC_RELAXED);
+    }
+    loop->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    errno = err;
+    return ((fd >= 0) ? 0 : -1);
+}
+
+/*
+ * drain a listener again a little later (no edge is coming to do it)
+ */
+static void retryLater(SockEventLoop *loop, int sockfd, EventEntry *e)
+{
+    if (e->retry == NULL) {
+	e->retry = malloc(sizeof(AcceptRetry));
+	if (e->retry == NULL)
+	    return;	/* the next connection's edge will have to do */
+	InitTimer(&e->retry->timer, retryAccept, e->retry);
+	e->retry->loop = loop;
+	e->retry->fd = sockfd;
+    }
+    e->retry->gen = e->gen;
+    if (!TimerArmed(&e->retry->timer))
+	(void) ArmTimer(loop->timers, &e->retry->timer, ACCEPT_RETRY_MS);
+}
+
+/*
+ * accept every pending connection on a listener (edge-triggered, so drain it)
+ *
+ * Past the loop's connection limit the new ones are reset straight away, a client
+ * told no at once can go elsewhere (or back off), one left in a full backlog can't.
+ * Only EAGAIN means the queue is empty, see the top of the file for the rest.
+ */
+static void drainAccept(SockEventLoop *loop, int sockfd, EventEntry *e)
+{
+    SockEventFunc		accept_fn = e->read_fn;
+    void			*arg = e->arg;
+    unsigned int		gen = e->gen;
+    struct sockaddr_storage	peers[ACCEPT_BATCH];
+    int				fds[ACCEPT_BATCH], i, n, err, max_conns;
+
+	/* don't hold on to e, callbacks that add sockets may realloc the table */
+    while (loop->entries[sockfd].active && loop->entries[sockfd].gen == gen) {
+	n = AcceptBatchSocket(sockfd, fds, peers, ACCEPT_BATCH);
+	err = errno;	/* why it stopped short, before the callbacks change it */
+	if (n < 0)
+	    n = 0;
+
+	max_conns = __atomic_load_n(&loop->max_conns, __ATOMIC_RELAXED);
+	for (i = 0; i < n; i++) {
+	    if (max_conns > 0 && loop->nconns >= max_conns) {
+		ShedSocket(fds[i]);
+		__atomic_add_fetch(&loop->shed, 1, __ATOMIC_RELAXED);
+		continue;
+	    }
+	    loop->peer = &peers[i];
+	    (*accept_fn)(loop, fds[i], arg);
+	    loop->peer = NULL;
+	}
+
+	if (n == ACCEPT_BATCH)
+	    continue;	/* there may be more */
+	if (err == EAGAIN || err == EWOULDBLOCK)
+	    break;	/* took everything there was */
+	if (!loop->entries[sockfd].active || loop->entries[sockfd].gen != gen)
+	    break;	/* a callback removed the listener */
+
+	if (err == EMFILE || err == ENFILE) {
+	    if (shedWithSpare(loop, sockfd) == 0)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr,"%s : accept on [%d] failed errno = %d, retrying in %d ms\n",
+		__FILE__,sockfd,err,ACCEPT_RETRY_MS);
+#endif
+	retryLater(loop, sockfd, &loop->entries[sockfd]);
+	break;
+    }
+}
+
+/*
+ * the retry timer of a listener went off
+ */
+static void retryAccept(SockTimer *t, void *arg)
+{
+    AcceptRetry		*r = (AcceptRetry *) arg;
+    EventEntry		*e = &r->loop->entries[r->fd];
+
+    if (e->active && e->listening && e->gen == r->gen)
+	drainAccept(r->loop, r->fd, e);
+}
+
+/*
+ * shed new connections while the loop has max_conns (0: no limit)
+ */
+int SetAcceptLimitEventLoop(SockEventLoop *loop, int max_conns)
+{
+    if (loop == NULL || max_conns < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    __atomic_store_n(&loop->max_conns, max_conns, __ATOMIC_RELAXED);
+
+    return (0);
+}
+
+/*
+ * connections the loop has shed so far
+ */
+long long EventLoopShed(SockEventLoop *loop)
+{
+    return ((loop != NULL) ? __atomic_load_n(&loop->shed, __ATOMIC_RELAXED) : 0);
+}
+
+/*
+ * where the connection accept_fn was called for came from (only inside accept_fn)
+ */
+struct sockaddr_storage *EventLoopPeer(SockEventLoop *loop)
+{
+    return ((loop != NULL) ? loop->peer : NULL);
+}
+
+/*
+ * wait up to timeout_ms (-1 is forever) and dispatch one batch of events
+ */
+int PollEventLoop(SockEventLoop *loop, int timeout_ms)
+{
+    int			i, n, fd, next;
+    long long		now;
+    unsigned int	gen, events;
+    EventEntry		*e;
+
+    if (loop == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    next = NextTimerWheel(loop->timers);
+    if (next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+	timeout_ms = next;
+
+    n = epoll_wait(loop->epfd, loop->events, EVENT_BATCH, timeout_ms);
+    if (n < 0) {
+	if (errno == EINTR)
+	    return (0);
+	return (-1);
+    }
+
+    now = TimerWheelNow(loop->timers);	/* one clock read for the batch */
+
+    for (i = 0; i < n; i++) {
+	if (loop->events[i].data.u64 == EVENT_WAKE) {
+	    unsigned long long	count;
+
+	    if (read(loop->wakefd, &count, sizeof(count)) < 0)
+		;	/* already drained, nothing to do */
+	    continue;
+	}
+
+	fd = EVENT_FD(loop->events[i].data.u64);
+	gen = EVENT_GEN(loop->events[i].data.u64);
+	events = loop->events[i].events;
+
+	e = &loop->entries[fd];
+	if (!e->active || e->gen != gen)
+	    continue;	/* removed by an earlier callback in this batch */
+
+	if (e->listening) {
+	    drainAccept(loop, fd, e);
+	    continue;
+	}
+
+	if (e->idle != NULL && e->idle->ms > 0)
+	    e->idle->last = now;	/* not idle, see idleExpired() */
+
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && e->read_fn != NULL)
+	    (*e->read_fn)(loop, fd, e->arg);
+
+	/* the read callback may have removed fd (or the table may have moved) */
+	e = &loop->entries[fd];
+	if (!e->active || e->gen != gen)
+	    continue;
+
+	if ((events & (EPOLLOUT | EPOLLERR)) && e->write_fn != NULL)
+	    (*e->write_fn)(loop, fd, e->arg);
+    }
+
+    (void) RunTimerWheel(loop->timers);
+
+    return (n);
+}
+
+/*
+ * dispatch events until StopEventLoop() is called
+ */
+int RunEventLoop(SockEventLoop *loop)
+{
+    if (loop == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE)) {
+	if (PollEventLoop(loop, -1) < 0)
+	    return (-1);
+    }
+    loop->stop = 0;	/* so it can be run again */
+
+    return (0);
+}
+
+/*
+ * ask RunEventLoop() to return after the current batch (safe from any thread)
+ */
+void StopEventLoop(SockEventLoop *loop)
+{
+    unsigned long long	one = 1;
+
+    if (loop == NULL)
+	return;
+
+    __atomic_store_n(&loop->stop, 1, __ATOMIC_RELEASE);
+    if (write(loop->wakefd, &one, sizeof(one)) < 0)
+	;	/* counter is saturated, the loop is awake anyway */
+}
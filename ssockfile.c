@@ -0,0 +1,237 @@
+/*
+ * ssockfile.c
+ *
+ * Zero-copy file (and pipe) transfer for the simple socket library.
+ *
+ * Sending a file by read()ing it into a buffer and WriteSocket()ing the buffer
+ * copies every byte through user space twice. Here a regular file goes out with
+ * sendfile(), and anything else (pipes, character devices, and the receive side,
+ * socket to file) is moved with splice() through a pipe, so the data never leaves
+ * the kernel.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#define _GNU_SOURCE	/* splice(), F_SETPIPE_SZ, pipe2() */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define SPLICE_CHUNK	(1024 * 1024)	/* bytes per splice() (and the pipe size we ask for) */
+#define SENDFILE_CHUNK	(0x7ffff000)	/* the most sendfile() moves in one call on Linux */
+
+/*
+ * each thread keeps one pipe around for splicing, set up on first use
+ */
+static __thread int splice_pipe[2] = { -1, -1 };
+static pthread_key_t	pipe_key;
+static pthread_once_t	pipe_once = PTHREAD_ONCE_INIT;
+
+/*
+ * something went wrong mid-transfer, the pipe may hold data: start over next time
+ * (and a thread that exits closes its pipe)
+ */
+static void dropPipe(void)
+{
+    if (splice_pipe[0] < 0)
+	return;
+
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+    splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+static void pipeExit(void *unused)
+{
+    dropPipe();
+}
+
+static void pipeKeyInit(void)
+{
+    pthread_key_create(&pipe_key, pipeExit);
+}
+
+static int getPipe(void)
+{
+    if (splice_pipe[0] >= 0)
+	return (0);
+
+    if (pipe2(splice_pipe, O_CLOEXEC) < 0)
+	return (-1);
+
+    (void) fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);	/* best effort */
+
+    pthread_once(&pipe_once, pipeKeyInit);
+    pthread_setspecific(pipe_key, splice_pipe);	/* non-NULL, so the destructor runs */
+
+    return (0);
+}
+
+/*
+ * move up to count bytes from in to out through the pipe
+ *
+ * in_off/out_off are NULL for the side that isn't a (seekable) file. Like write(),
+ * an error after some data moved returns the short count, -1 only if nothing did.
+ * But if writing fails with data in the pipe that the input can't be rewound to
+ * read again (a socket, a pipe), that data is gone: -1 whatever moved before, so
+ * the caller can't take it for a clean end of input.
+ */
+static long long splicePipe(int in, loff_t *in_off, int out, loff_t *out_off,
+			    long long count, int sockfd)
+{
+    long long	done = 0, start;
+    ssize_t	n, m;
+    size_t	want;
+    int		err;
+
+    if (getPipe() < 0)
+	return (-1);
+
+    while (count < 0 || done < count) {
+	want = SPLICE_CHUNK;
+	if (count >= 0 && (long long) want > count - done)
+	    want = count - done;
+
+	start = SockStatStart();
+	n = splice(in, in_off, splice_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+	if (in == sockfd)
+	    SockStatEnd(SOCK_STAT_READ, sockfd, want, n, start);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN && in == sockfd && WaitSocket(in, POLLIN) == 0)
+		continue;
+	    return ((done > 0) ? done : -1);
+	}
+	if (n == 0)
+	    break;	/* EOF on the input */
+
+	/* drain the pipe completely before reading more */
+	while (n > 0) {
+	    start = SockStatStart();
+	    m = splice(splice_pipe[0], NULL, out, out_off, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+	    if (out == sockfd)
+		SockStatEnd(SOCK_STAT_WRITE, sockfd, n, m, start);
+	    if (m < 0) {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EAGAIN && out == sockfd && WaitSocket(out, POLLOUT) == 0)
+		    continue;
+		err = errno;
+		dropPipe();
+		errno = err;
+		if (in_off == NULL)
+		    return (-1);	/* errno says why, the rest of the stream is lost */
+		*in_off -= n;		/* never delivered, resume from there */
+		return ((done > 0) ? done : -1);
+	    }
+	    n -= m;
+	    done += m;
+	}
+    }
+
+    return (done);
+}
+
+/*
+ * send count bytes (-1 for "to EOF") of fd to the socket
+ */
+long long SendFileSocket(int sockfd, int fd, long long *offset, long long count)
+{
+    struct stat	st;
+    off_t	off;
+    loff_t	loff;
+    long long	done = 0, start;
+    ssize_t	n;
+    size_t	want;
+
+    if (fstat(fd, &st) < 0)
+	return (-1);
+
+    if (!S_ISREG(st.st_mode)) {
+	if (offset != NULL) {
+	    errno = ESPIPE;		/* pipes and sockets have no offset */
+	    return (-1);
+	}
+	return (splicePipe(fd, NULL, sockfd, NULL, count, sockfd));
+    }
+
+    off = (offset != NULL) ? (off_t) *offset : lseek(fd, 0, SEEK_CUR);
+    if (off < 0)
+	return (-1);
+
+    if (count < 0)
+	count = (st.st_size > off) ? st.st_size - off : 0;
+
+    while (done < count) {
+	want = (count - done > SENDFILE_CHUNK) ? SENDFILE_CHUNK : (size_t) (count - done);
+
+	start = SockStatStart();
+	n = sendfile(sockfd, fd, &off, want);
+	SockStatEnd(SOCK_STAT_WRITE, sockfd, want, n, start);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN && WaitSocket(sockfd, POLLOUT) == 0)
+		continue;
+	    if ((errno == EINVAL || errno == ENOSYS) && done == 0) {
+		/* this file system can't sendfile(), splice() can read it */
+		loff = off;
+		done = splicePipe(fd, &loff, sockfd, NULL, count, sockfd);
+		off = loff;
+		break;
+	    }
+	    if (done == 0)
+		done = -1;
+	    break;
+	}
+	if (n == 0)
+	    break;	/* file got shorter under us */
+	done += n;
+    }
+
+	/* report how far we got (even on error) so the caller can resume */
+    if (offset != NULL)
+	*offset = off;
+    else
+	lseek(fd, off, SEEK_SET);
+
+    return (done);
+}
+
+/*
+ * receive count bytes (-1 for "until the peer closes") from the socket into fd
+ */
+long long RecvFileSocket(int sockfd, int fd, long long *offset, long long count)
+{
+    struct stat	st;
+    loff_t	loff;
+    long long	done;
+
+    if (fstat(fd, &st) < 0)
+	return (-1);
+
+    if (!S_ISREG(st.st_mode) && offset != NULL) {
+	errno = ESPIPE;
+	return (-1);
+    }
+
+    if (offset == NULL)	/* pipe, or file at (and advancing) its file position */
+	return (splicePipe(sockfd, NULL, fd, NULL, count, sockfd));
+
+    loff = (loff_t) *offset;
+    done = splicePipe(sockfd, NULL, fd, &loff, count, sockfd);
+    *offset = loff;
+
+    return (done);
+}
@@ -0,0 +1,283 @@
+/*
+ * ssockframe.c
+ *
+ * Message framing for the simple socket library.
+ *
+ * A stream socket has no message boundaries: one send() can arrive as several
+ * recv()s, several sends as one recv. Here each message goes on the wire as a
+ * 4 byte length (network byte order) followed by that many bytes of payload.
+ *
+ * Sending writes the length and the payload with one sendmsg(), looping over short
+ * writes. Receiving reads as much as fits into a per-connection buffer with a
+ * single recv() and hands back pointers to the complete messages IN that buffer,
+ * so a burst of small messages costs one syscall and no copies. The only copy is
+ * moving a partial message to the front when it runs into the end of the buffer.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define FRAME_HDR	(4)		/* bytes of length in front of every message */
+#define FRAME_MIN_BUF	(64 * 1024)	/* read at least this much per recv() if we can */
+#define FRAME_BATCH	(64)		/* messages per writev() in SendMessagesSocket() */
+
+struct SockFramer {
+    char	*buf;
+    int		size;		/* allocated */
+    int		start;		/* first unconsumed byte */
+    int		end;		/* one past the last byte received */
+    int		max_msg;	/* biggest payload we accept */
+};
+
+/*
+ * read exactly buffer_sz bytes (or fail)
+ */
+int ReadFullSocket(int sockfd, char *buffer, int buffer_sz)
+{
+    int	n, done = 0;
+
+    while (done < buffer_sz) {
+	n = RecvSocket(sockfd, buffer + done, buffer_sz - done);
+	if (n == 0)
+	    break;	/* EOF, return what we got */
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EAGAIN || errno == EWOULDBLOCK) && WaitSocket(sockfd, POLLIN) == 0)
+		continue;
+	    return (-1);
+	}
+	done += n;
+    }
+
+    return (done);
+}
+
+/*
+ * write exactly buffer_sz bytes (or fail)
+ */
+int WriteFullSocket(int sockfd, char *buffer, int buffer_sz)
+{
+    int	n, done = 0;
+
+    while (done < buffer_sz) {
+	n = SendSocket(sockfd, buffer + done, buffer_sz - done);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EAGAIN || errno == EWOULDBLOCK) && WaitSocket(sockfd, POLLOUT) == 0)
+		continue;
+	    return (-1);
+	}
+	done += n;
+    }
+
+    return (done);
+}
+
+/*
+ * send one framed message, header and payload in (usually) one syscall
+ */
+int SendMessageSocket(int sockfd, char *buffer, int buffer_sz)
+{
+    unsigned int	hdr;
+    struct iovec	iov[2];
+
+    if (buffer_sz < 0 || (buffer_sz > 0 && buffer == NULL)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    hdr = htonl((unsigned int) buffer_sz);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = FRAME_HDR;
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = buffer_sz;
+
+	/* its sendmsg() calls are counted (and traced) in ssockiov.c */
+    if (WritevFullSocket(sockfd, iov, 2) < 0)
+	return (-1);
+
+    return (buffer_sz);
+}
+
+/*
+ * send n framed messages with one writev() (more only on short writes or past
+ * FRAME_BATCH), e.g. the answers to everything one read brought in
+ */
+int SendMessagesSocket(int sockfd, char **msgs, int *msg_sz, int n)
+{
+    unsigned int	hdr[FRAME_BATCH];
+    struct iovec	iov[2 * FRAME_BATCH];
+    int			i, k;
+
+    if (n < 0 || (n > 0 && (msgs == NULL || msg_sz == NULL))) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < n; i += k) {
+	for (k = 0; k < FRAME_BATCH && i + k < n; k++) {
+	    if (msg_sz[i + k] < 0 || (msg_sz[i + k] > 0 && msgs[i + k] == NULL)) {
+		errno = EINVAL;
+		return (-1);
+	    }
+	    hdr[k] = htonl((unsigned int) msg_sz[i + k]);
+	    iov[2 * k].iov_base = &hdr[k];
+	    iov[2 * k].iov_len = FRAME_HDR;
+	    iov[2 * k + 1].iov_base = msgs[i + k];
+	    iov[2 * k + 1].iov_len = msg_sz[i + k];
+	}
+
+	if (WritevFullSocket(sockfd, iov, 2 * k) < 0)
+	    return (-1);
+    }
+
+    return (n);
+}
+
+SockFramer *CreateFramer(int max_msg)
+{
+    SockFramer	*f;
+
+    if (max_msg <= 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    f = calloc(1, sizeof(SockFramer));
+    if (f == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+	/* room for the biggest message, and then some so small ones batch up */
+    f->size = max_msg + FRAME_HDR;
+    if (f->size < FRAME_MIN_BUF)
+	f->size = FRAME_MIN_BUF;
+    f->max_msg = max_msg;
+
+    f->buf = malloc(f->size);
+    if (f->buf == NULL) {
+	free(f);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    return (f);
+}
+
+int CloseFramer(SockFramer *f)
+{
+    if (f == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    free(f->buf);
+    free(f);
+
+    return (0);
+}
+
+/*
+ * hand back the next complete message already in the buffer, if any
+ */
+int NextMessageFramer(SockFramer *f, char **msg, int *msg_sz)
+{
+    unsigned int	len;
+    int			avail;
+
+    if (f == NULL || msg == NULL || msg_sz == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    avail = f->end - f->start;
+    if (avail < FRAME_HDR)
+	return (0);
+
+    memcpy(&len, f->buf + f->start, FRAME_HDR);	/* may be unaligned */
+    len = ntohl(len);
+    if (len > (unsigned int) f->max_msg) {
+	errno = EMSGSIZE;
+	return (-1);
+    }
+
+    if (avail < FRAME_HDR + (int) len)
+	return (0);
+
+    *msg = f->buf + f->start + FRAME_HDR;
+    *msg_sz = (int) len;
+
+    f->start += FRAME_HDR + len;
+    if (f->start == f->end)
+	f->start = f->end = 0;	/* empty, next recv starts at the front for free */
+
+    return (1);
+}
+
+/*
+ * how many bytes the partial message at f->start will take up once complete
+ */
+static int partialNeed(SockFramer *f)
+{
+    unsigned int	len;
+
+    if (f->end - f->start < FRAME_HDR)
+	return (FRAME_HDR);
+
+    memcpy(&len, f->buf + f->start, FRAME_HDR);
+
+    return (FRAME_HDR + (int) ntohl(len));	/* <= max_msg, NextMessageFramer() checked */
+}
+
+/*
+ * receive the next whole message
+ */
+int RecvMessageSocket(int sockfd, SockFramer *f, char **msg, int *msg_sz)
+{
+    int	n;
+
+    for (;;) {
+	n = NextMessageFramer(f, msg, msg_sz);
+	if (n != 0)
+	    return (n);
+
+	/* partial message won't fit before the end: slide it to the front, once */
+	if (f->start > 0 && f->start + partialNeed(f) > f->size) {
+	    memmove(f->buf, f->buf + f->start, f->end - f->start);
+	    f->end -= f->start;
+	    f->start = 0;
+	}
+
+	n = RecvSocket(sockfd, f->buf + f->end, f->size - f->end);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return (-1);	/* including EAGAIN on a non-blocking socket */
+	}
+
+	if (n == 0) {
+	    if (f->end != f->start) {
+		errno = EPROTO;		/* peer hung up in the middle of a message */
+		return (-1);
+	    }
+	    return (0);
+	}
+
+	f->end += n;
+    }
+}
@@ -0,0 +1,204 @@
+/*
+ * ssockhist.c
+ *
+ * Latency histograms for the simple socket library.
+ *
+ * An average hides exactly what matters about latency, the slow tail, and keeping
+ * every sample to sort afterwards costs memory in proportion to the run. So values
+ * are counted in an HDR (high dynamic range) histogram instead: buckets are powers
+ * of two, each split into 1024 linear sub-buckets, so every value from 1 up to 2^40
+ * is kept to about 3 significant digits (0.1%) in a fixed 250K of counts, and
+ * recording one is a couple of shifts and an increment.
+ *
+ * Values have no unit here, nanoseconds are what the library's users record. A
+ * histogram belongs to one thread: give each thread its own and MergeHist() them
+ * afterwards.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define SUB_BITS	(10)			/* 1024 sub-buckets per half bucket */
+#define SUB_HALF	(1 << SUB_BITS)
+#define SUB_MASK	((2LL << SUB_BITS) - 1)
+#define HIST_BUCKETS	(30)			/* 2048 << 29 == 2^40 */
+#define HIST_COUNTS	((HIST_BUCKETS + 1) * SUB_HALF)
+#define HIST_MAX	((1LL << 40) - 1)	/* bigger values are counted as this */
+
+struct SockHist {
+    long long	total;
+    long long	min;
+    long long	max;
+    long long	sum;
+    long long	counts[HIST_COUNTS];
+};
+
+/*
+ * where value is counted
+ */
+static int histIndex(long long value)
+{
+    int	bucket, sub;
+
+    bucket = 63 - __builtin_clzll(value | SUB_MASK) - SUB_BITS;	/* 0 below 2048 */
+    sub = (int) (value >> bucket);					/* 1024..2047, or 0..2047 */
+
+    return (((bucket + 1) << SUB_BITS) + sub - SUB_HALF);
+}
+
+/*
+ * the biggest value counted at index
+ */
+static long long histValue(int index)
+{
+    int		bucket = (index >> SUB_BITS) - 1;
+    long long	sub = (index & (SUB_HALF - 1)) + SUB_HALF;
+
+    if (bucket < 0) {
+	bucket = 0;
+	sub -= SUB_HALF;
+    }
+
+    return (((sub + 1) << bucket) - 1);
+}
+
+SockHist *CreateHist(void)
+{
+    SockHist	*h;
+
+    h = malloc(sizeof(SockHist));
+    if (h == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    ResetHist(h);
+
+    return (h);
+}
+
+void CloseHist(SockHist *h)
+{
+    free(h);
+}
+
+void ResetHist(SockHist *h)
+{
+    memset(h, 0, sizeof(SockHist));
+    h->min = -1;
+}
+
+int RecordHist(SockHist *h, long long value)
+{
+    return (RecordHistCount(h, value, 1));
+}
+
+/*
+ * count value n times
+ */
+int RecordHistCount(SockHist *h, long long value, long long n)
+{
+    if (h == NULL || value < 0 || n <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (value > HIST_MAX)
+	value = HIST_MAX;
+
+    h->counts[histIndex(value)] += n;
+    h->total += n;
+    h->sum += value * n;
+    if (h->min < 0 || value < h->min)
+	h->min = value;
+    if (value > h->max)
+	h->max = value;
+
+    return (0);
+}
+
+/*
+ * add everything src counted to dst
+ */
+int MergeHist(SockHist *dst, SockHist *src)
+{
+    int	i;
+
+    if (dst == NULL || src == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (src->total == 0)
+	return (0);
+
+    for (i = 0; i < HIST_COUNTS; i++)
+	dst->counts[i] += src->counts[i];
+
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (dst->min < 0 || src->min < dst->min)
+	dst->min = src->min;
+    if (src->max > dst->max)
+	dst->max = src->max;
+
+    return (0);
+}
+
+/*
+ * the value percentile (0..100) of everything counted is at or below
+ */
+long long HistPercentile(SockHist *h, double percentile)
+{
+    long long	want, seen = 0, value;
+    int		i;
+
+    if (h == NULL || h->total == 0)
+	return (0);
+
+    if (percentile >= 100.0)
+	return (h->max);
+
+    want = (long long) (percentile / 100.0 * h->total + 0.5);
+    if (want < 1)
+	want = 1;
+
+    for (i = 0; i < HIST_COUNTS; i++) {
+	seen += h->counts[i];
+	if (seen >= want) {
+	    value = histValue(i);
+	    return ((value < h->max) ? value : h->max);
+	}
+    }
+
+    return (h->max);
+}
+
+long long HistCount(SockHist *h)
+{
+    return ((h != NULL) ? h->total : 0);
+}
+
+long long HistMin(SockHist *h)
+{
+    return ((h != NULL && h->total > 0) ? h->min : 0);
+}
+
+long long HistMax(SockHist *h)
+{
+    return ((h != NULL) ? h->max : 0);
+}
+
+double HistMean(SockHist *h)
+{
+    return ((h != NULL && h->total > 0) ? (double) h->sum / h->total : 0.0);
+}
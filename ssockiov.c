@@ -0,0 +1,305 @@
+/*
+ * ssockiov.c
+ *
+ * Scatter-gather I/O for the simple socket library.
+ *
+ * Wrappers around writev()/readv() and sendmsg()/recvmsg() so a header and a
+ * payload in two places can go out (or come in) with one syscall and no staging
+ * copy, plus a "cork" that collects many small writes for a connection and
+ * flushes them with a single writev().
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define CORK_IOV	(64)		/* iovecs collected before a forced flush */
+#define CORK_ARENA	(16 * 1024)	/* small writes are copied in here */
+#define CORK_COPY_MAX	(512)		/* writes this small are copied, larger are referenced */
+
+struct SockCork {
+    int			sockfd;
+    int			flush_bytes;	/* flush once this much is queued */
+    int			bytes;		/* queued */
+    int			iovcnt;
+    struct iovec	iov[CORK_IOV];
+    int			arena_used;
+    char		arena[CORK_ARENA];
+};
+
+/*
+ * bytes in an iovec, for telling a short read or write from a full one
+ */
+static long long iovLen(struct iovec *iov, int iovcnt)
+{
+    long long	len = 0;
+    int		i;
+
+    for (i = 0; iov != NULL && i < iovcnt; i++)
+	len += iov[i].iov_len;
+
+    return (len);
+}
+
+/*
+ * gather write
+ */
+int WritevSocket(int sockfd, struct iovec *iov, int iovcnt)
+{
+    long long	start;
+    int		n;
+
+    start = SockStatStart();
+    n = writev(sockfd, iov, iovcnt);
+    SockStatEnd(SOCK_STAT_WRITE, sockfd, iovLen(iov, iovcnt), n, start);
+
+    return (n);
+}
+
+/*
+ * scatter read
+ */
+int ReadvSocket(int sockfd, struct iovec *iov, int iovcnt)
+{
+    long long	start;
+    int		n;
+
+    start = SockStatStart();
+    n = readv(sockfd, iov, iovcnt);
+    SockStatEnd(SOCK_STAT_READ, sockfd, iovLen(iov, iovcnt), n, start);
+
+    return (n);
+}
+
+/*
+ * gather send, ignores flags like SendSocket() does
+ */
+int SendmsgSocket(int sockfd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr	msg;
+    long long		start;
+    int			n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    start = SockStatStart();
+    n = sendmsg(sockfd, &msg, 0x0);
+    SockStatEnd(SOCK_STAT_WRITE, sockfd, iovLen(iov, iovcnt), n, start);
+
+    return (n);
+}
+
+/*
+ * scatter receive, ignores flags like RecvSocket() does
+ */
+int RecvmsgSocket(int sockfd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr	msg;
+    long long		start;
+    int			n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    start = SockStatStart();
+    n = recvmsg(sockfd, &msg, 0x0);
+    SockStatEnd(SOCK_STAT_READ, sockfd, iovLen(iov, iovcnt), n, start);
+
+    return (n);
+}
+
+/*
+ * like SendmsgSocket() but a dead peer is an EPIPE error, not a SIGPIPE
+ */
+static int sendIov(int sockfd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr	msg;
+    long long		start;
+    int			n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    start = SockStatStart();
+    n = (int) sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    SockStatEnd(SOCK_STAT_WRITE, sockfd, iovLen(iov, iovcnt), n, start);
+
+    return (n);
+}
+
+/*
+ * write all of iov, stepping through short writes (iov is modified)
+ */
+int WritevFullSocket(int sockfd, struct iovec *iov, int iovcnt)
+{
+    int	n, total = 0;
+
+    while (iovcnt > 0 && iov->iov_len == 0) {
+	iov++;
+	iovcnt--;
+    }
+
+    while (iovcnt > 0) {
+	n = sendIov(sockfd, iov, iovcnt);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (WaitSocket(sockfd, POLLOUT) == 0)
+		    continue;
+	    }
+	    return (-1);
+	}
+
+	total += n;
+	while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+
+    return (total);
+}
+
+SockCork *CreateCork(int sockfd, int flush_bytes)
+{
+    SockCork	*c;
+
+    if (sockfd < 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    c = malloc(sizeof(SockCork));
+    if (c == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    c->sockfd = sockfd;
+    c->flush_bytes = (flush_bytes > 0) ? flush_bytes : 64 * 1024;
+    c->bytes = 0;
+    c->iovcnt = 0;
+    c->arena_used = 0;
+
+    return (c);
+}
+
+/*
+ * send everything collected so far in one writev() (more only on short writes)
+ */
+int FlushCork(SockCork *c)
+{
+    int	n;
+
+    if (c == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (c->iovcnt == 0)
+	return (0);
+
+    n = WritevFullSocket(c->sockfd, c->iov, c->iovcnt);
+
+	/* on error whatever was queued is dropped, the connection is no good anyway */
+    c->bytes = 0;
+    c->iovcnt = 0;
+    c->arena_used = 0;
+
+    return (n);
+}
+
+/*
+ * queue a write
+ */
+int CorkWrite(SockCork *c, char *buffer, int buffer_sz)
+{
+    struct iovec	*last;
+    char		*p;
+
+    if (c == NULL || buffer_sz < 0 || (buffer_sz > 0 && buffer == NULL)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (buffer_sz == 0)
+	return (0);
+
+    if (buffer_sz <= CORK_COPY_MAX) {
+	if (c->arena_used + buffer_sz > CORK_ARENA && FlushCork(c) < 0)
+	    return (-1);
+
+	p = c->arena + c->arena_used;
+	memcpy(p, buffer, buffer_sz);
+	c->arena_used += buffer_sz;
+
+	/* back to back small writes just grow the last iovec */
+	last = (c->iovcnt > 0) ? &c->iov[c->iovcnt - 1] : NULL;
+	if (last != NULL && (char *) last->iov_base + last->iov_len == p) {
+	    last->iov_len += buffer_sz;
+	    goto queued;
+	}
+    } else {
+	p = buffer;	/* referenced: caller keeps it intact until the flush */
+    }
+
+    if (c->iovcnt == CORK_IOV) {
+	if (FlushCork(c) < 0)
+	    return (-1);
+	if (p != buffer) {
+	    /* the flush emptied the arena, copy again */
+	    memcpy(c->arena, buffer, buffer_sz);
+	    p = c->arena;
+	    c->arena_used = buffer_sz;
+	}
+    }
+
+    c->iov[c->iovcnt].iov_base = p;
+    c->iov[c->iovcnt].iov_len = buffer_sz;
+    c->iovcnt++;
+
+queued:
+    c->bytes += buffer_sz;
+    if (c->bytes >= c->flush_bytes && FlushCork(c) < 0)
+	return (-1);
+
+    return (buffer_sz);
+}
+
+/*
+ * flush and free the cork (the socket stays open)
+ */
+int CloseCork(SockCork *c)
+{
+    int	n;
+
+    if (c == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    n = FlushCork(c);
+    free(c);
+
+    return ((n < 0) ? -1 : 0);
+}
@@ -2,7 +2,7 @@
 /*
  * ssocklib.c
  * 
- * Simple unix TCP/IP socket library (does NOT do UDP packets)
+ * Simple unix TCP/IP socket library (UDP lives in ssockudp.c)
  *
  * The purpose of this simple library abstracts the "guts" of setting up and using sockets for simple
  * IPC, hiding all the unix kernal include files, data structures, and obscure option flags in here.
@@ -11,12 +11,11 @@
  *
  */
 
-#ifdef DEBUG
-#include <stdio.h>
-#endif
+#define _GNU_SOURCE	/* accept4() */
+
 #include <stdlib.h>
 #include <unistd.h>
-#include <strings.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -35,14 +34,32 @@ int CreateSocket(void)
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0); /* TCP/IP sockets only here for now */
 
-#ifdef DEBUG
-    fprintf(stderr,"%s : CreateSocket(void) returning %d\n",__FILE__,sockfd);
+    if (sockfd >= 0 && GetDefaultSocketProfile() != SOCK_PROFILE_DEFAULT)
+	(void) SetSocketProfile(sockfd, GetDefaultSocketProfile());	/* best effort */
+    else if (sockfd >= 0)
+	ForgetSocketProfile(sockfd);	/* closed with close() under an old profile? */
 
-    if (sockfd < 0) {
-        fprintf(stderr,"ERROR : %s : socket() creation failed. errno = %d\n",
-		__FILE__, errno);
-    }
-#endif
+    SockTrace(SOCK_TRACE_CREATE, sockfd, AF_INET, sockfd);
+
+    return (sockfd);
+}
+
+/*
+ * create a socket for a given address family (AF_INET, AF_INET6)
+ *
+ */
+int CreateSocketFamily(int family)
+{
+    int	sockfd;
+
+    sockfd = socket(family, SOCK_STREAM, 0);
+
+    if (sockfd >= 0 && GetDefaultSocketProfile() != SOCK_PROFILE_DEFAULT)
+	(void) SetSocketProfile(sockfd, GetDefaultSocketProfile());	/* best effort */
+    else if (sockfd >= 0)
+	ForgetSocketProfile(sockfd);	/* closed with close() under an old profile? */
+
+    SockTrace(SOCK_TRACE_CREATE, sockfd, family, sockfd);
 
     return (sockfd);
 }
@@ -55,16 +72,11 @@ int CloseSocket(int sockfd)
 {
     int retval;
 
+    ForgetSocketProfile(sockfd);	/* the fd number gets reused */
+    ForgetSocketStats(sockfd);
     retval = close(sockfd);
 
-#ifdef DEBUG
-    fprintf(stderr,"%s : CloseSocket(%d) returning %d\n",__FILE__,sockfd,retval);
-
-    if (retval < 0) {
-        fprintf(stderr,"ERROR : %s : close() socket failed. errno = %d\n",
-		__FILE__, errno);
-    }
-#endif
+    SockTrace(SOCK_TRACE_CLOSE, sockfd, 0, retval);
 
     return (retval);
 }
@@ -79,22 +91,33 @@ int CloseSocket(int sockfd)
 int BindSocket(int sockfd, int port)
 {
     int	retval;
-    struct sockaddr_in serv_addr;
-
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
+    struct sockaddr_storage	ss;
+    struct sockaddr_in		*serv_addr = (struct sockaddr_in *) &ss;
+    struct sockaddr_in6		*serv_addr6 = (struct sockaddr_in6 *) &ss;
+    socklen_t			len = sizeof(ss);
+
+	/* bind to the "any" address of whatever family the socket was created with */
+    memset(&ss, 0, sizeof(ss));
+    if (getsockname(sockfd, (struct sockaddr *) &ss, &len) < 0)
+	return (-1);
 
-    retval = bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
+    if (ss.ss_family == AF_INET6) {
+	memset(serv_addr6, 0, sizeof(*serv_addr6));
+	serv_addr6->sin6_family = AF_INET6;
+	serv_addr6->sin6_addr = in6addr_any;
+	serv_addr6->sin6_port = htons(port);
+	len = sizeof(*serv_addr6);
+    } else {
+	memset(serv_addr, 0, sizeof(*serv_addr));
+	serv_addr->sin_family = AF_INET;
+	serv_addr->sin_addr.s_addr = INADDR_ANY;
+	serv_addr->sin_port = htons(port);
+	len = sizeof(*serv_addr);
+    }
 
-#ifdef DEBUG
-    fprintf(stderr,"%s : BindSocket(%d, %d) returning %d\n",__FILE__,sockfd,port,retval);
+    retval = bind(sockfd, (struct sockaddr *) &ss, len);
 
-    if (retval < 0) {
-        fprintf(stderr,"ERROR : %s : socket bind(%d, %d) failed. errno = %d\n",
-		__FILE__, sockfd, port, errno);
-    }
-#endif
+    SockTrace(SOCK_TRACE_BIND, sockfd, port, retval);
 
     return (retval);
 }
@@ -102,30 +125,26 @@ int BindSocket(int sockfd, int port)
 /*
  * accept a connection on a socket
  *
- * (this call blocks if there are no connections waiting)
+ * (this call blocks if there are no connections waiting, see ssockaccept.c for
+ * one that doesn't and also returns the peer's address)
  *
  */
 int AcceptSocket(int sockfd)
 {
-    int		newsockfd, client_len;
-    struct	sockaddr_in client_addr;
-
-    client_len = sizeof(client_addr);
+    int		newsockfd, profile;
+    long long	start;
 
-#ifdef DEBUG
-    fprintf(stderr,"%s : AcceptSocket(%d) waiting...",__FILE__,sockfd);
-#endif
+	/* close-on-exec, so a child the server starts doesn't hold its clients open */
+    start = SockStatStart();
+    newsockfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+    SockStatEnd(SOCK_STAT_ACCEPT, sockfd, 0, newsockfd, start);
 
-    newsockfd = accept(sockfd, (struct sockaddr *) &client_addr, (socklen_t *) &client_len);
-
-#ifdef DEBUG
-    fprintf(stderr,"AcceptSocket(%d) returning %d\n",sockfd,newsockfd);
-
-    if (newsockfd < 0) {
-        fprintf(stderr,"ERROR : %s : socket accept(%d) failed. errno = %d\n",
-		__FILE__, sockfd, errno);
-    }
-#endif
+	/* the new socket gets the listener's profile (most options are inherited, not all) */
+    profile = (newsockfd >= 0) ? GetSocketProfile(sockfd) : SOCK_PROFILE_DEFAULT;
+    if (profile != SOCK_PROFILE_DEFAULT)
+	(void) SetSocketProfile(newsockfd, profile);
+    else if (newsockfd >= 0)
+	ForgetSocketProfile(newsockfd);
 
     return (newsockfd);
 }
@@ -138,69 +157,46 @@ int ListenSocket(int sockfd, int maxq)
 {
     int		retval;
 
-#ifdef DEBUG
-    fprintf(stderr,"%s : ListenSocket(%d, %d) waiting...",__FILE__,sockfd,retval);
-#endif
-
     retval = listen(sockfd, maxq);
 
-#ifdef DEBUG
-    fprintf(stderr,"ListenSocket(%d, %d) returning %d\n",sockfd,maxq,retval);
- 
-    if (retval < 0) {
-        fprintf(stderr,"ERROR : %s : socket listen(%d, %d) failed. errno = %d\n",
-		__FILE__, sockfd, maxq, errno);
-    }
-#endif
+    SockTrace(SOCK_TRACE_LISTEN, sockfd, maxq, retval);
 
     return (retval);
 }
 
 /*
  * connect to a socket at a host and port
+ *
+ * The name is looked up with getaddrinfo() (gethostbyname() is not thread-safe),
+ * restricted to the family the socket was created with.
  */
 int ConnectSocket(int sockfd, char *host_name, int port)
 {
-    int			retval;
-    struct hostent	*host;
-    struct sockaddr_in	host_addr;
-
-#ifdef DEBUG
-    fprintf(stderr,"%s : ConnectSocket(%d, %s, %d) getting host by name...",__FILE__,sockfd,host_name,port);
-#endif
-
-    host = gethostbyname(host_name);
-    if (host == NULL) {
-#ifdef DEBUG
-	fprintf(stderr,"ERROR : %s : host name [%s] does not exist.\n",
-		__FILE__, host_name);
-#endif
-	return (-1);
-    }
-
-#ifdef DEBUG
-    fprintf(stderr,"success!\n");
-#endif
+    int			retval, i, n;
+    long long		start;
+    struct sockaddr_storage ss, addrs[16];
+    socklen_t		len = sizeof(ss);
 
-    bzero((char *) &host_addr, sizeof(host_addr));
-    host_addr.sin_family = AF_INET;
-    bcopy((char *) host->h_addr, (char *) &host_addr.sin_addr.s_addr, host->h_length);
-    host_addr.sin_port = htons(port);
+    memset(&ss, 0, sizeof(ss));
+    if (getsockname(sockfd, (struct sockaddr *) &ss, &len) < 0)
+	return (-1);
 
-#ifdef DEBUG
-    fprintf(stderr,"%s : ConnectSocket() connecting...",__FILE__);
-#endif
+    if (ss.ss_family == AF_UNIX)
+	return (ConnectUnixSocket(sockfd, host_name));	/* the "host" is the socket's path */
 
-    retval = connect(sockfd, (struct sockaddr *) &host_addr, sizeof(host_addr));
+    n = ResolveHost(host_name, port, ss.ss_family, addrs, 16);	/* cached, see ssockdns.c */
+    if (n < 0)
+	return (-1);
 
-#ifdef DEBUG
-    if (retval < 0) {
-        fprintf(stderr,"ERROR : %s : socket connect(%d, %s, %d) failed. errno = %d\n",
-		__FILE__, sockfd, host_name, port, errno);
-    } else {
-        fprintf(stderr,"success! returning (%d)\n",retval);
+	/* a blocking socket can only try again after a refusal, not after a timeout */
+    retval = -1;
+    start = SockStatStart();
+    for (i = 0; i < n; i++) {
+	retval = connect(sockfd, (struct sockaddr *) &addrs[i], SockAddrLen(&addrs[i]));
+	if (retval == 0 || (errno != ECONNREFUSED && errno != ENETUNREACH && errno != EHOSTUNREACH))
+	    break;
     }
-#endif
+    SockStatEnd(SOCK_STAT_CONNECT, sockfd, 0, retval, start);
 
     return (retval);
 }
@@ -213,22 +209,12 @@ int ConnectSocket(int sockfd, char *host_name, int port)
  */
 int SendSocket(int sockfd, char *buffer, int buffer_sz)
 {
-    int n;
-
-#ifdef DEBUG
-    fprintf(stderr,"%s : SendSocket(%d, 0x%08x, %d) sending...",__FILE__, sockfd, buffer, buffer_sz);
-#endif
+    long long	start;
+    int		n;
 
+    start = SockStatStart();
     n = send(sockfd, (const void *) buffer, (size_t) buffer_sz, 0x0);
-
-#ifdef DEBUG
-    if (n < 0) {
-        fprintf(stderr,"ERROR : %s : socket send(%d, 0x%08x, %d) failed. errno = %d\n",
-		__FILE__, sockfd, buffer, buffer_sz, errno);
-    } else {
-        fprintf(stderr,"success! sent %d bytes\n",n);
-    }
-#endif
+    SockStatEnd(SOCK_STAT_WRITE, sockfd, buffer_sz, n, start);
 
     return (n);
 }
@@ -238,22 +224,12 @@ int SendSocket(int sockfd, char *buffer, int buffer_sz)
  */
 int RecvSocket(int sockfd, char *buffer, int buffer_sz)
 {
-    int n;
-
-#ifdef DEBUG
-    fprintf(stderr,"%s : RecvSocket(%d, 0x%08x, %d) receiving...",__FILE__, sockfd, buffer, buffer_sz);
-#endif
+    long long	start;
+    int		n;
 
+    start = SockStatStart();
     n = recv(sockfd, (void *) buffer, (size_t) buffer_sz, 0x0);
-
-#ifdef DEBUG
-    if (n < 0) {
-        fprintf(stderr,"ERROR : %s : socket recv(%d, 0x%08x, %d) failed. errno = %d\n",
-		__FILE__, sockfd, buffer, buffer_sz, errno);
-    } else {
-        fprintf(stderr,"success! received %d bytes\n",n);
-    }
-#endif
+    SockStatEnd(SOCK_STAT_READ, sockfd, buffer_sz, n, start);
 
     return (n);
 }
@@ -263,22 +239,12 @@ int RecvSocket(int sockfd, char *buffer, int buffer_sz)
  */
 int ReadSocket(int sockfd, char *buffer, int buffer_sz)
 {
-    int n;
-
-#ifdef DEBUG
-    fprintf(stderr,"%s : ReadSocket(%d, 0x%08x, %d) reading...",__FILE__, sockfd, buffer, buffer_sz);
-#endif
+    long long	start;
+    int		n;
 
+    start = SockStatStart();
     n = read(sockfd, buffer, buffer_sz);
-
-#ifdef DEBUG
-    if (n < 0) {
-        fprintf(stderr,"ERROR : %s : socket read(%d, 0x%08x, %d) failed. errno = %d\n",
-		__FILE__, sockfd, buffer, buffer_sz, errno);
-    } else {
-        fprintf(stderr,"success! read %d bytes\n",n);
-    }
-#endif
+    SockStatEnd(SOCK_STAT_READ, sockfd, buffer_sz, n, start);
 
     return (n);
 }
@@ -289,22 +255,12 @@ int ReadSocket(int sockfd, char *buffer, int buffer_sz)
  */
 int WriteSocket(int sockfd, char *buffer, int buffer_sz)
 {
-    int n;
-
-#ifdef DEBUG
-    fprintf(stderr,"%s : WriteSocket(%d, 0x%08x, %d) writing...",__FILE__, sockfd, buffer, buffer_sz);
-#endif
+    long long	start;
+    int		n;
 
+    start = SockStatStart();
     n = write(sockfd, buffer, buffer_sz);
-
-#ifdef DEBUG
-    if (n < 0) {
-        fprintf(stderr,"ERROR : %s : socket write(%d, 0x%08x, %d) failed. errno = %d\n",
-		__FILE__, sockfd, buffer, buffer_sz, errno);
-    } else {
-        fprintf(stderr,"success! wrote %d bytes\n",n);
-    }
-#endif
+    SockStatEnd(SOCK_STAT_WRITE, sockfd, buffer_sz, n, start);
 
     return (n);
 }
@@ -103,6 +103,7 @@
  * ridiculously long... it really only declares a handful of library functions:
  *
  *        int CreateSocket(void);
+ *        int CreateSocketFamily(int family);
  *        int CloseSocket(int fd);
  *        int BindSocket(int sockfd, int port);
  *        int AcceptSocket(int sockfd);
@@ -122,6 +123,10 @@
 #ifndef __SSOCKLIB_H__
 #define __SSOCKLIB_H__
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * Create a socket.
  *
@@ -132,6 +137,18 @@
  */
 extern int CreateSocket(void);
 
+/*
+ * Create a socket for a given address family, AF_INET (what CreateSocket() makes)
+ * or AF_INET6. BindSocket() and ConnectSocket() work with either.
+ *
+ * An AF_INET6 server socket also accepts IPv4 clients (unless the system is set
+ * up otherwise, see net.ipv6.bindv6only).
+ *
+ * Returns -1 if it fails, errno remains set.
+ *
+ */
+extern int CreateSocketFamily(int family);
+
 /*
  * Close a socket.
  *
@@ -149,6 +166,9 @@ extern int CloseSocket(int fd);
  *
  * This is called by the (logical) host, so only a port is needed.
  *
+ * Call SetReuseAddrSocket() first if a restarted server must be able to bind its
+ * port again while connections from its previous run are still in TIME_WAIT.
+ *
  * Returns 0 if successful, otherwise will return -1 and errno remains set.
  *
  */
@@ -157,7 +177,8 @@ extern int BindSocket(int sockfd, int port);
 /*
  * Accept a connection on a socket.
  *
- * This is a wrapper around the unix accept() call.
+ * This is a wrapper around the unix accept() call. The new socket is blocking and
+ * close-on-exec; AcceptPeerSocket() returns a non-blocking one and the peer's address.
  *
  * If successful, it returns a non-negative integer that is the file descriptor
  * for the socket. If it fails, it returns -1 and errno remains set.
@@ -182,6 +203,15 @@ extern int ListenSocket(int sockfd, int maxq);
  *
  * This is a wrapper around the unix connect() call.
  *
+ * The host name is looked up (through the cache, see ResolveHost(), and safe to
+ * call from several threads) for addresses of the socket's family, and they are
+ * tried in turn.
+ * For a Unix domain socket (CreateUnixSocket()) host_name is the socket's path and
+ * port is ignored.
+ *
+ * Note that connect() blocks until the server answers, or until the kernel gives
+ * up on it, which can take minutes. See ConnectTimeoutSocket().
+ *
  * If successful, 0 is returned. Otherwise -1 is returned and errno remains set.
  *
  */
@@ -227,6 +257,1666 @@ extern int SendSocket(int sockfd, char *buffer, int buffer_sz);
  */
 extern int RecvSocket(int sockfd, char *buffer, int buffer_sz);
 
+/*
+ * Event loop (see ssockevent.c)
+ *
+ * The calls above block, so a server built only from them handles one client at
+ * a time. The event loop lets one thread watch many sockets: register the listening
+ * socket with AddListenEventLoop() and each accepted connection with AddEventLoop(),
+ * then call RunEventLoop(). The loop calls you back when a socket is ready.
+ *
+ *                loop = CreateEventLoop();
+ *                fd = CreateSocket();
+ *                BindSocket(fd, port);
+ *                ListenSocket(fd, maxq);
+ *                AddListenEventLoop(loop, fd, on_accept, NULL);
+ *                RunEventLoop(loop);
+ *
+ *   with on_accept() calling AddEventLoop(loop, newfd, on_read, NULL, arg).
+ *
+ * Sockets are watched edge-triggered and are made non-blocking when registered, so a
+ * read callback must keep calling RecvSocket() (or ReadSocket()) until it returns -1
+ * with errno == EAGAIN, otherwise the rest of the data will not be reported again.
+ * Likewise the write callback is only called when the socket BECOMES writable.
+ *
+ * Call RemoveEventLoop() before closing a registered socket.
+ *
+ * For idle timeouts and deadlines see SetIdleEventLoop() and EventLoopTimers().
+ *
+ */
+
+typedef struct SockEventLoop SockEventLoop;
+
+/*
+ * Event callback. fd is the ready socket (for a listener, the newly accepted one),
+ * arg is whatever was passed in when the socket was registered.
+ */
+typedef void (*SockEventFunc)(SockEventLoop *loop, int fd, void *arg);
+
+/*
+ * Put a socket into non-blocking mode (a wrapper around fcntl()).
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int SetNonBlockSocket(int sockfd);
+
+/*
+ * Create an event loop.
+ *
+ * Returns NULL if it fails, errno remains set.
+ *
+ */
+extern SockEventLoop *CreateEventLoop(void);
+
+/*
+ * Destroy an event loop. Sockets still registered are NOT closed.
+ *
+ */
+extern int CloseEventLoop(SockEventLoop *loop);
+
+/*
+ * Register a listening socket (after BindSocket() and ListenSocket()).
+ *
+ * Every pending connection is accepted when the socket becomes readable and
+ * accept_fn is called once per connection with the new file descriptor.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int AddListenEventLoop(SockEventLoop *loop, int sockfd, SockEventFunc accept_fn, void *arg);
+
+/*
+ * Register a connected socket. read_fn is called when it becomes readable (or the
+ * peer hangs up), write_fn when it becomes writable. Either may be NULL.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int AddEventLoop(SockEventLoop *loop, int sockfd, SockEventFunc read_fn,
+			SockEventFunc write_fn, void *arg);
+
+/*
+ * Stop watching a socket. It is safe to call this (and then CloseSocket()) from
+ * inside a callback.
+ *
+ */
+extern int RemoveEventLoop(SockEventLoop *loop, int sockfd);
+
+/*
+ * Wait up to timeout_ms milliseconds (-1 waits forever) for events and dispatch them.
+ *
+ * Returns the number of events handled, or -1 if it fails (errno remains set).
+ *
+ */
+extern int PollEventLoop(SockEventLoop *loop, int timeout_ms);
+
+/*
+ * Dispatch events until StopEventLoop() is called (from a callback, or from any
+ * other thread).
+ *
+ * Returns 0 once stopped, or -1 if waiting for events failed (errno remains set).
+ *
+ */
+extern int RunEventLoop(SockEventLoop *loop);
+extern void StopEventLoop(SockEventLoop *loop);
+
+/*
+ * Batched I/O engine (see ssockuring.c)
+ *
+ * Every call above is one system call per operation. For small messages that
+ * overhead dominates, so this engine lets you QUEUE accepts, receives and sends,
+ * hand the whole batch to the kernel at once and then collect the completions:
+ *
+ *                ring = CreateUring(256, 1024, 4096);
+ *                QueueAcceptUring(ring, listenfd, 1, NULL);
+ *
+ *                while (1) {
+ *                    n = WaitUring(ring, events, 64, -1);
+ *                    for (i = 0; i < n; i++) {
+ *                        ... events[i].op, events[i].result ...
+ *                    }
+ *                }
+ *
+ * On Linux it runs on io_uring: with multishot set, one queued accept (or receive)
+ * keeps producing completions until it fails or the peer hangs up, so there is
+ * nothing to re-queue in the common case. Receives don't take a buffer, they are
+ * handed one of the engine's nbufs buffers of buffer_sz bytes; pass the bufid back
+ * to ReleaseUringBuffer() once you are done with the data.
+ *
+ * If io_uring (or the provided buffer rings it needs, Linux 5.19+) isn't there, the
+ * engine quietly runs the same queue on poll() and the normal AcceptSocket(),
+ * RecvSocket() and SendSocket() calls. UringIsNative() tells you which one you got.
+ * Setting SSOCK_NO_URING in the environment forces the fallback.
+ *
+ * A buffer passed to QueueSendUring() must stay untouched until its completion
+ * comes back.
+ *
+ * Before closing a socket, CancelUring() it and wait for the last event (more == 0)
+ * of every operation on it: an armed multishot accept or receive otherwise keeps
+ * the kernel holding the file, and its slot in the engine, after the close.
+ *
+ */
+
+typedef struct SockUring SockUring;
+
+#define SOCK_URING_ACCEPT	(1)
+#define SOCK_URING_RECV		(2)
+#define SOCK_URING_SEND		(3)
+
+typedef struct {
+    int		op;		/* SOCK_URING_ACCEPT, SOCK_URING_RECV or SOCK_URING_SEND */
+    int		fd;		/* the socket the operation was queued on */
+    int		result;		/* new fd, or bytes moved (0 is EOF on a recv), or -errno */
+    int		more;		/* 1 if the (multishot) operation is still queued */
+    char	*buffer;	/* recv: the data, result bytes long */
+    int		bufid;		/* recv: hand this back to ReleaseUringBuffer(), else -1 */
+    void	*arg;		/* as passed to Queue...Uring() */
+} SockUringEvent;
+
+/*
+ * Create the engine. entries is the submission queue depth, nbufs (rounded up to a
+ * power of two, at most 32768) receive buffers of buffer_sz bytes are set aside.
+ *
+ * Returns NULL if it fails, errno remains set.
+ *
+ */
+extern SockUring *CreateUring(int entries, int nbufs, int buffer_sz);
+extern int CloseUring(SockUring *ring);
+
+/*
+ * Returns 1 if the engine runs on io_uring, 0 if it fell back to poll().
+ *
+ */
+extern int UringIsNative(SockUring *ring);
+
+/*
+ * Queue an operation. Nothing is done until SubmitUring() or WaitUring().
+ *
+ * Returns 0 if queued, otherwise -1 and errno is set (EBUSY: too many operations
+ * outstanding, reap some completions first).
+ *
+ */
+extern int QueueAcceptUring(SockUring *ring, int sockfd, int multishot, void *arg);
+extern int QueueRecvUring(SockUring *ring, int sockfd, int multishot, void *arg);
+extern int QueueSendUring(SockUring *ring, int sockfd, char *buffer, int buffer_sz, void *arg);
+
+/*
+ * Cancel every operation queued on sockfd. Each still reports once more, from
+ * WaitUring(), with result -ECANCELED (a send that went out anyway: its result).
+ *
+ * Returns the number of operations cancelled, or -1 if it fails (errno remains set).
+ *
+ */
+extern int CancelUring(SockUring *ring, int sockfd);
+
+/*
+ * Hand everything queued to the kernel in one system call, without waiting.
+ *
+ */
+extern int SubmitUring(SockUring *ring);
+
+/*
+ * Submit anything queued, then wait up to timeout_ms milliseconds (-1 forever,
+ * 0 don't wait) for completions and copy up to max_events of them into events.
+ *
+ * Returns the number of events, or -1 if it fails (errno remains set).
+ *
+ */
+extern int WaitUring(SockUring *ring, SockUringEvent *events, int max_events, int timeout_ms);
+
+/*
+ * Give a receive buffer back to the engine.
+ *
+ * Returns 0, or -1 with errno EINVAL if bufid isn't out (given back twice).
+ *
+ */
+extern int ReleaseUringBuffer(SockUring *ring, int bufid);
+
+/*
+ * Worker threads (see ssockworker.c)
+ *
+ * One event loop runs on one core. To use more, StartWorkers() starts nthreads
+ * threads, each with its own listening socket on port (they share the port through
+ * SO_REUSEPORT, so the kernel load balances new connections between them), its own
+ * event loop, and pinned to its own core:
+ *
+ *                workers = StartWorkers(nthreads, port, maxq, on_accept, arg);
+ *                WaitWorkers(workers);
+ *
+ * on_accept() runs on the worker thread that accepted the connection, and the loop
+ * it is handed belongs to that thread. Register the new socket on THAT loop and it
+ * stays on the same thread for its lifetime, so per-connection state needs no locks.
+ * Anything shared through arg is seen by all workers at once, though.
+ *
+ */
+
+typedef struct SockWorkers SockWorkers;
+
+/*
+ * Create the listeners and start the workers.
+ *
+ * Returns NULL if any listener could not be set up (errno remains set), in which case
+ * no threads are running.
+ *
+ */
+extern SockWorkers *StartWorkers(int nthreads, int port, int maxq, SockEventFunc accept_fn, void *arg);
+
+/*
+ * The same with family AF_INET6 listeners (which take IPv4 clients as well), or AF_INET.
+ *
+ */
+extern SockWorkers *StartWorkersFamily(int nthreads, int family, int port, int maxq,
+				       SockEventFunc accept_fn, void *arg);
+
+/*
+ * Block until every worker has finished (normally never, unless stopped).
+ *
+ * Returns 0, or -1 if any worker's event loop failed.
+ *
+ */
+extern int WaitWorkers(SockWorkers *workers);
+
+/*
+ * Stop the workers, wait for them, and close their listeners and event loops.
+ *
+ */
+extern int StopWorkers(SockWorkers *workers);
+
+/*
+ * Exact-size I/O and message framing (see ssockframe.c)
+ *
+ * ReadSocket()/RecvSocket() return whatever one read happened to get, which with
+ * TCP is not necessarily what the other end sent in one go. These calls take care
+ * of short reads and writes for you (on non-blocking sockets too, they wait for the
+ * socket with poll()).
+ *
+ * For messages, SendMessageSocket() puts a 4 byte length in front of each one, and
+ * RecvMessageSocket() gives back exactly one whole message per call:
+ *
+ *                framer = CreateFramer(max_message_size);
+ *
+ *                while (RecvMessageSocket(fd, framer, &msg, &msg_sz) > 0) {
+ *                    ... msg_sz bytes at msg ...
+ *                }
+ *
+ *                CloseFramer(framer);
+ *
+ * Use one framer per connection. msg points INTO the framer's buffer (nothing is
+ * copied out) and stays valid until the next RecvMessageSocket() on that framer.
+ * Each recv() reads as much as fits, so when several messages arrive together the
+ * following calls return them without another syscall.
+ *
+ * With event loop (non-blocking) sockets, call RecvMessageSocket() until it returns
+ * -1 with errno == EAGAIN. Both ends must of course use the framed calls.
+ *
+ */
+
+typedef struct SockFramer SockFramer;
+
+/*
+ * Read (write) exactly buffer_sz bytes, retrying short reads (writes).
+ *
+ * Returns buffer_sz, fewer bytes if the peer closed the connection first (read
+ * only), or -1 if it fails and errno remains set.
+ *
+ */
+extern int ReadFullSocket(int sockfd, char *buffer, int buffer_sz);
+extern int WriteFullSocket(int sockfd, char *buffer, int buffer_sz);
+
+/*
+ * Send buffer_sz bytes as one message.
+ *
+ * Returns buffer_sz, or -1 if it fails and errno remains set.
+ *
+ */
+extern int SendMessageSocket(int sockfd, char *buffer, int buffer_sz);
+
+/*
+ * Send n messages (msgs[i], msg_sz[i] bytes each) in as few writes as possible,
+ * usually one: a pipelining server collects its answers to everything one read
+ * brought in (RecvMessageSocket(), then NextMessageFramer() until it returns 0)
+ * and sends them together.
+ *
+ * Returns n, or -1 if it fails and errno remains set.
+ *
+ */
+extern int SendMessagesSocket(int sockfd, char **msgs, int *msg_sz, int n);
+
+/*
+ * Create (destroy) the receive state for one connection. Messages longer than
+ * max_msg bytes are refused with EMSGSIZE.
+ *
+ */
+extern SockFramer *CreateFramer(int max_msg);
+extern int CloseFramer(SockFramer *framer);
+
+/*
+ * Receive one whole message, *msg and *msg_sz are set to it.
+ *
+ * Returns 1 for a message, 0 if the peer closed the connection (between messages),
+ * or -1 if it fails and errno remains set (EPROTO: closed mid-message, EMSGSIZE:
+ * message too big for the framer, EAGAIN: non-blocking and nothing complete yet).
+ *
+ */
+extern int RecvMessageSocket(int sockfd, SockFramer *framer, char **msg, int *msg_sz);
+
+/*
+ * Like RecvMessageSocket() but only looks at what is already buffered, never calls
+ * into the kernel. Returns 1 for a message, 0 if there is no complete one.
+ *
+ */
+extern int NextMessageFramer(SockFramer *framer, char **msg, int *msg_sz);
+
+/*
+ * Scatter-gather I/O (see ssockiov.c)
+ *
+ * WriteSocket() and friends take one contiguous buffer, so a header and a body
+ * that live in different places need either a copy or two syscalls. These take
+ * an array of struct iovec (#include <sys/uio.h>) and move all of it in one call:
+ *
+ *                iov[0].iov_base = header;  iov[0].iov_len = header_sz;
+ *                iov[1].iov_base = body;    iov[1].iov_len = body_sz;
+ *                n = WritevSocket(fd, iov, 2);
+ *
+ * Like the single buffer calls they return whatever the one syscall moved;
+ * WritevFullSocket() keeps going until everything is written.
+ *
+ * A cork collects the small writes for one connection and sends them together
+ * with one writev(), either when FlushCork() is called or when flush_bytes have
+ * piled up. Writes of up to 512 bytes are copied into the cork, so the caller can
+ * reuse the buffer right away; LARGER buffers are only referenced and must be left
+ * alone until the cork is flushed.
+ *
+ */
+
+struct iovec;
+typedef struct SockCork SockCork;
+
+/*
+ * Wrappers around writev(), readv(), sendmsg() and recvmsg() (flags are 0).
+ *
+ * Return the number of bytes moved, or -1 if they fail and errno remains set.
+ *
+ */
+extern int WritevSocket(int sockfd, struct iovec *iov, int iovcnt);
+extern int ReadvSocket(int sockfd, struct iovec *iov, int iovcnt);
+extern int SendmsgSocket(int sockfd, struct iovec *iov, int iovcnt);
+extern int RecvmsgSocket(int sockfd, struct iovec *iov, int iovcnt);
+
+/*
+ * Write ALL of iov, retrying short writes. The iov array is used up in the process.
+ *
+ * Returns the total number of bytes written, or -1 if it fails and errno remains set.
+ *
+ */
+extern int WritevFullSocket(int sockfd, struct iovec *iov, int iovcnt);
+
+/*
+ * Create a cork for sockfd, flushing automatically once flush_bytes are queued
+ * (0 picks a default of 64K).
+ *
+ */
+extern SockCork *CreateCork(int sockfd, int flush_bytes);
+
+/*
+ * Queue buffer_sz bytes. Returns buffer_sz, or -1 if an automatic flush failed.
+ *
+ */
+extern int CorkWrite(SockCork *cork, char *buffer, int buffer_sz);
+
+/*
+ * Send everything queued. Returns the number of bytes sent, or -1 (errno is set).
+ *
+ */
+extern int FlushCork(SockCork *cork);
+
+/*
+ * Flush and free the cork. The socket is NOT closed.
+ *
+ */
+extern int CloseCork(SockCork *cork);
+
+/*
+ * Zero-copy file transfer (see ssockfile.c)
+ *
+ * Sends (receives) a file or pipe over a socket without the data ever being
+ * copied into your program: regular files go out with sendfile(), everything
+ * else is moved with splice() through a pipe.
+ *
+ *                fd = open("artifact.tar", O_RDONLY);
+ *                n = SendFileSocket(sockfd, fd, NULL, -1);
+ *
+ * count is the number of bytes to move, -1 means up to end of file (or, for
+ * RecvFileSocket(), until the peer closes the connection).
+ *
+ * If offset is NULL the transfer starts at, and advances, fd's file position.
+ * Otherwise it starts at *offset, leaves the file position alone, and *offset is
+ * updated to just past the last byte moved. Pipes have no offset, so pass NULL.
+ *
+ * Returns the number of bytes moved. Like WriteSocket(), if something fails part
+ * way the short count is returned (call again to pick up where it stopped), and
+ * -1 with errno set only if nothing was moved at all. The exception: if writing
+ * fails (EFBIG, ENOSPC, EPIPE...) while moving from a socket or a pipe, what was
+ * read can't be read again; that returns -1 with errno set however much moved,
+ * and the connection is out of step and no good for more.
+ *
+ */
+extern long long SendFileSocket(int sockfd, int fd, long long *offset, long long count);
+extern long long RecvFileSocket(int sockfd, int fd, long long *offset, long long count);
+
+/*
+ * Zero-copy sends (see ssockzcopy.c)
+ *
+ * SendSocket() copies the buffer into the kernel. For large buffers (hundreds of
+ * KB) a zero-copy send lets the network stack use the pages in place instead, but
+ * then the buffer must be left ALONE until the kernel says it is done with it:
+ *
+ *                zc = CreateZeroCopy(fd, 0, NULL, NULL);
+ *
+ *                n = SendZeroCopy(zc, buffer, buffer_sz, &id, &held);
+ *                ...
+ *                while (held && !ZeroCopyDone(zc, id))
+ *                    ReapZeroCopy(zc, -1);
+ *                ... buffer may be reused now ...
+ *
+ * Each zero-copy send gets an id (counting up from 0). ReapZeroCopy() reads the
+ * kernel's completion reports; for each one it calls done_fn (if given) with the
+ * range of ids completed, and ZeroCopyDone() / PendingZeroCopy() answer from what
+ * has been reaped so far. Sends smaller than threshold bytes (0 picks 16K), and all
+ * sends on kernels without SO_ZEROCOPY, are ordinary copying sends; they set held
+ * to 0, get no id, and the buffer is free as soon as the call returns.
+ *
+ * Completions show up as an error condition on the socket, so in an event loop the
+ * socket's read callback is called for them; call ReapZeroCopy(zc, 0) there.
+ *
+ * copied is set in the callback when the kernel ended up copying the data anyway
+ * (loopback connections always do). Zero-copy then only adds overhead; it pays
+ * off on real NICs.
+ *
+ */
+
+typedef struct SockZeroCopy SockZeroCopy;
+
+typedef void (*SockZeroCopyFunc)(SockZeroCopy *zc, unsigned int first_id, unsigned int last_id,
+				 int copied, void *arg);
+
+/*
+ * Turn on zero-copy for sockfd. Returns NULL if out of memory; a kernel that can't
+ * do zero-copy is NOT an error, the sends just copy.
+ *
+ */
+extern SockZeroCopy *CreateZeroCopy(int sockfd, int threshold, SockZeroCopyFunc done_fn, void *arg);
+extern int CloseZeroCopy(SockZeroCopy *zc);
+
+/*
+ * Send like SendSocket() (including short sends). *held is 1 if the kernel has the
+ * buffer until send *id completes, 0 if the data was copied.
+ *
+ */
+extern int SendZeroCopy(SockZeroCopy *zc, char *buffer, int buffer_sz, unsigned int *id, int *held);
+
+/*
+ * Collect completion reports, waiting up to timeout_ms (-1 forever, 0 not at all)
+ * if there are none yet. Returns the number of reports, or -1 (errno is set).
+ *
+ */
+extern int ReapZeroCopy(SockZeroCopy *zc, int timeout_ms);
+
+/*
+ * 1 if send id has completed (its buffer can be reused), else 0.
+ *
+ */
+extern int ZeroCopyDone(SockZeroCopy *zc, unsigned int id);
+
+/*
+ * Number of zero-copy sends not yet completed.
+ *
+ */
+extern int PendingZeroCopy(SockZeroCopy *zc);
+
+/*
+ * Pooled buffers (see ssockbuf.c)
+ *
+ * Instead of a buffer on the stack that gets cleared before every read, get one
+ * from the library's pool. Buffers come in sizes of 256, 1K, 4K, 16K and 64K bytes
+ * (you get the smallest that fits), each thread has its own free lists so getting
+ * and putting back a buffer takes no lock and no malloc(), and buffers are NOT
+ * cleared: only the first len bytes mean anything.
+ *
+ *                while ((n = RecvSockBuf(fd, &buf, 4096)) > 0) {
+ *                    ... buf->len bytes at buf->data ...
+ *                    PutSockBuf(buf);
+ *                }
+ *
+ * A buffer starts with one reference. HoldSockBuf() adds one (e.g. for every
+ * connection you queue it to), PutSockBuf() drops one and the last drop returns
+ * the buffer to the pool; it may be put back from a different thread than the one
+ * that got it. SetSockBufLimit() caps the total memory the pool will allocate,
+ * past that GetSockBuf() fails with ENOBUFS until buffers come back.
+ *
+ */
+
+typedef struct SockBuf {
+    char		*data;		/* the buffer */
+    int			size;		/* its capacity */
+    int			len;		/* bytes of valid data in it */
+
+    /* library private */
+    int			refs;
+    int			sclass;
+    struct SockBuf	*next;
+} SockBuf;
+
+/*
+ * Get a buffer of at least size (at most 65536) bytes.
+ *
+ * Returns NULL if it fails, errno is set (ENOBUFS: the pool is at its limit).
+ *
+ */
+extern SockBuf *GetSockBuf(int size);
+extern void HoldSockBuf(SockBuf *buf);
+extern void PutSockBuf(SockBuf *buf);
+
+/*
+ * Limit the pool to about bytes of memory in total (0, the default, is no limit).
+ *
+ */
+extern int SetSockBufLimit(long long bytes);
+
+/*
+ * Get a buffer of at least size bytes and RecvSocket() into it.
+ *
+ * Returns like RecvSocket(). Only when it returns > 0 is *buf set (with buf->len
+ * being the number of bytes received), and then it is yours to PutSockBuf().
+ *
+ */
+extern int RecvSockBuf(int sockfd, SockBuf **buf, int size);
+
+/*
+ * SendSocket() buf->len bytes of buf. The caller keeps its reference.
+ *
+ */
+extern int SendSockBuf(int sockfd, SockBuf *buf);
+
+/*
+ * Client connection pool (see ssockpool.c)
+ *
+ * Connecting for every request costs a name lookup and a TCP handshake. A pool
+ * keeps connections to each host:port open between uses:
+ *
+ *                pool = CreateSockPool(8, 2, 30000);
+ *
+ *                fd = GetPoolSocket(pool, "server", 5000);
+ *                ... request / response on fd ...
+ *                PutPoolSocket(pool, fd, "server", 5000, 1);
+ *
+ * GetPoolSocket() returns an idle connection if there is one (checking first,
+ * without any network traffic, that the server hasn't closed it), otherwise it
+ * connects a new one with ConnectHostSocket(): the name comes from the DNS cache
+ * (so it follows the record's TTL) and every address it has is tried. At most max_per_dest connections per destination exist at once, beyond
+ * that GetPoolSocket() fails with EBUSY.
+ *
+ * Give the socket back with PutPoolSocket(); pass reusable = 0 if anything went
+ * wrong on it (or the exchange left unread data behind) and it is closed instead.
+ *
+ * A background thread closes idle connections that the server dropped or that
+ * sat unused for more than idle_timeout_ms (0: never), and reconnects so that
+ * min_idle connections to every destination used so far are ready to go.
+ *
+ * Connects give up with ETIMEDOUT after 3 seconds, SetSockPoolConnectTimeout()
+ * changes that for the whole pool.
+ *
+ */
+
+typedef struct SockPool SockPool;
+
+/*
+ * Create a pool (and start its thread).
+ *
+ * Returns NULL if it fails, errno remains set.
+ *
+ */
+extern SockPool *CreateSockPool(int max_per_dest, int min_idle, int idle_timeout_ms);
+
+/*
+ * Set the connect deadline in milliseconds (-1: wait as long as connect() does).
+ *
+ */
+extern int SetSockPoolConnectTimeout(SockPool *pool, int timeout_ms);
+
+/*
+ * Get a connected socket to host:port.
+ *
+ * Returns the socket, or -1 if it fails and errno remains set.
+ *
+ */
+extern int GetPoolSocket(SockPool *pool, char *host, int port);
+
+/*
+ * Return a socket from GetPoolSocket() to the pool.
+ *
+ */
+extern int PutPoolSocket(SockPool *pool, int fd, char *host, int port, int reusable);
+
+/*
+ * Stop the pool thread and close all idle connections. Sockets that are still
+ * handed out are left open.
+ *
+ */
+extern int CloseSockPool(SockPool *pool);
+
+/*
+ * Connecting with a deadline (see ssockconnect.c)
+ *
+ * ConnectTimeoutSocket() is ConnectSocket() but gives up with ETIMEDOUT after
+ * timeout_ms milliseconds (-1: no limit) instead of waiting for the kernel.
+ *
+ * ConnectHostSocket() creates the socket too, so it isn't stuck with one address
+ * family: it connects to whichever of host's IPv4 and IPv6 addresses answers first,
+ * starting a new attempt every 250ms while earlier ones are still pending (Happy
+ * Eyeballs), so one dead address costs a quarter of a second, not minutes.
+ *
+ *                fd = ConnectHostSocket("server", 5000, 2000);
+ *
+ * replaces CreateSocket() + ConnectSocket(). The socket it returns is an ordinary
+ * blocking one.
+ *
+ * In both the deadline covers the connecting, not the name lookup before it.
+ *
+ */
+
+/*
+ * Returns 0 if connected, otherwise -1 and errno remains set.
+ *
+ */
+extern int ConnectTimeoutSocket(int sockfd, char *host_name, int port, int timeout_ms);
+
+/*
+ * Returns the connected socket, or -1 if it fails and errno remains set.
+ *
+ */
+extern int ConnectHostSocket(char *host_name, int port, int timeout_ms);
+
+/*
+ * Host name lookups (see ssockdns.c)
+ *
+ * ConnectSocket(), ConnectTimeoutSocket(), ConnectHostSocket() and the connection
+ * pool all look host names up through a cache, so connecting to the same host
+ * again (or a thousand clients reconnecting at once) doesn't mean another trip to
+ * the resolver each time:
+ *
+ *	- answers are kept for a while (30 seconds unless SetDnsCache() says
+ *	  otherwise); the system resolver doesn't pass the records' TTLs on, so
+ *	  this is one fixed time for all names,
+ *	- a background thread looks names that are in use up again before they
+ *	  expire; if that fails the old answer is still used, for up to 5
+ *	  minutes, rather than failing connects because the DNS server is down,
+ *	- names that don't resolve are remembered as such (5 seconds by default),
+ *	- threads looking up the same name at the same time share one lookup.
+ *
+ * Numeric addresses ("127.0.0.1", "::1") skip all of that.
+ *
+ * ResolveHost() is the lookup itself, for a program that wants the addresses:
+ *
+ *		struct sockaddr_storage	addrs[8];
+ *
+ *		n = ResolveHost("server", 5000, AF_UNSPEC, addrs, 8);
+ *		for (i = 0; i < n; i++)
+ *			if (connect(fd, (struct sockaddr *) &addrs[i], SockAddrLen(&addrs[i])) == 0)
+ *				break;
+ *
+ * To test a program against names of your own, point the cache at a hosts(5)
+ * style file instead of the system resolver:
+ *
+ *		SetDnsHostsFile("./test.hosts");
+ *
+ */
+struct sockaddr_storage;
+
+/*
+ * Fills in up to max addresses (port set, family AF_INET, AF_INET6 or AF_UNSPEC
+ * for both) in the resolver's order of preference.
+ *
+ * Returns how many, or -1 if it fails and errno remains set (EHOSTUNREACH if the
+ * name doesn't resolve, or has no address of that family).
+ *
+ */
+extern int ResolveHost(char *host_name, int port, int family, struct sockaddr_storage *addrs, int max);
+
+/*
+ * The address length for connect() or bind().
+ *
+ */
+extern int SockAddrLen(struct sockaddr_storage *addr);
+
+/*
+ * How long answers (ttl_ms) and failures (negative_ttl_ms) are kept. A ttl_ms of
+ * 0 turns the cache off, every lookup goes to the resolver. A temporary failure
+ * (errno EAGAIN) isn't kept, the next lookup of the name tries again.
+ *
+ * Returns 0 if successful, -1 if it fails and errno remains set.
+ *
+ */
+extern int SetDnsCache(int ttl_ms, int negative_ttl_ms);
+
+/*
+ * Resolve names from this hosts(5) style file ("address name [aliases]" lines)
+ * instead of the system resolver; NULL goes back to the system resolver. Either
+ * way the cache is flushed.
+ *
+ * Returns 0 if successful, -1 if it fails and errno remains set.
+ *
+ */
+extern int SetDnsHostsFile(char *path);
+
+/*
+ * Forget all cached answers.
+ *
+ */
+extern void FlushDnsCache(void);
+
+/*
+ * UDP, datagrams in batches (see ssockudp.c)
+ *
+ * Everything above is TCP. For datagrams create the socket with
+ *
+ *		fd = CreateUdpSocket(AF_INET, port);
+ *
+ * (port 0 for a socket that only sends, the system picks one). ConnectSocket()
+ * works on it too, it sets the one address every datagram goes to.
+ *
+ * Datagrams are sent and received in batches, one system call for many packets.
+ * A batch is an array of SockDgrams, each with its own buffer and address:
+ *
+ *		SockDgram	*d = CreateDgrams(64, 2048);
+ *
+ *		n = RecvDgrams(fd, d, 64, -1);
+ *		for (i = 0; i < n; i++)
+ *			... d[i].data, d[i].len bytes from d[i].addr ...
+ *
+ * and to send, fill in data/len (and addr/addr_len, unless the socket was
+ * ConnectSocket()ed) and call SendDgrams(). The address of a received datagram
+ * can be sent straight back to, it is what ResolveHost() gives too.
+ *
+ * Big sends: set segment and any len, and the kernel cuts the buffer into segment
+ * sized datagrams on the way out (UDP GSO; done here where the kernel can't). One
+ * GSO send takes at most 64 segments and 64K, a bigger len goes as several. Big receives: after SetUdpGro(fd, 1) a received SockDgram
+ * may hold several datagrams from the same sender, one every segment bytes (the
+ * last may be shorter); segment is 0 when it holds just one.
+ *
+ */
+typedef struct SockDgram {
+    char			*data;
+    int				len;		/* bytes of datagram(s) at data */
+    int				size;		/* room at data */
+    int				segment;	/* GSO/GRO datagram size, 0 for one datagram */
+    struct sockaddr_storage	*addr;		/* sender / destination */
+    int				addr_len;	/* 0 (on send) for the connected address */
+} SockDgram;
+
+/*
+ * Returns the socket, or -1 if it fails and errno remains set.
+ *
+ */
+extern int CreateUdpSocket(int family, int port);
+
+/*
+ * Ask for coalesced receives (on = 1), see above.
+ *
+ * Returns 0 if successful, -1 if it fails (no GRO here) and errno remains set.
+ *
+ */
+extern int SetUdpGro(int sockfd, int on);
+
+/*
+ * count SockDgrams with size byte buffers; size must fit the biggest datagram
+ * expected (up to 64K with GRO). Free with CloseDgrams().
+ *
+ * Returns NULL if it fails and errno remains set.
+ *
+ */
+extern SockDgram *CreateDgrams(int count, int size);
+extern void CloseDgrams(SockDgram *d);
+
+/*
+ * Receive up to count datagrams. Waits up to timeout_ms (-1 for as long as it
+ * takes) for the first, then takes whatever else is already there.
+ *
+ * Returns how many, 0 if none came in time, or -1 if it fails and errno remains set.
+ *
+ */
+extern int RecvDgrams(int sockfd, SockDgram *d, int count, int timeout_ms);
+
+/*
+ * Send count datagrams.
+ *
+ * Returns how many went, fewer than count if the socket's buffer filled up
+ * (non-blocking sockets), or -1 if none did and errno remains set.
+ *
+ */
+extern int SendDgrams(int sockfd, SockDgram *d, int count);
+
+/*
+ * Unix domain sockets, same-host IPC (see ssockunix.c)
+ *
+ * Processes on the same machine don't need TCP/IP between them. A Unix domain
+ * socket is used exactly like a TCP one (ListenSocket(), AcceptSocket(),
+ * Read/Write/Send/RecvSocket(), the event loop, framing...), only it is named by
+ * a path instead of a host and port, and is a good deal cheaper:
+ *
+ *	server:	fd = CreateUnixSocket();
+ *		BindUnixSocket(fd, "/tmp/myserver");
+ *		ListenSocket(fd, 5);
+ *		newfd = AcceptSocket(fd);
+ *
+ *	client:	fd = CreateUnixSocket();
+ *		ConnectUnixSocket(fd, "/tmp/myserver");	(or ConnectSocket(fd, "/tmp/myserver", 0))
+ *
+ * A path starting with '@' is a Linux abstract name ("@myserver"): no file is
+ * created, and nothing needs cleaning up. A path names a file, which is left
+ * behind when the server exits; BindUnixSocket() removes such a leftover (if no
+ * server is answering on it).
+ *
+ * Open file descriptors can be handed to the other process, which gets its own
+ * descriptors for the same open files/sockets/pipes; at least one byte of data
+ * has to go with them.
+ *
+ */
+
+/*
+ * Returns the socket, or -1 if it fails and errno remains set.
+ *
+ */
+extern int CreateUnixSocket(void);
+
+/*
+ * Returns 0 if successful, -1 if it fails and errno remains set.
+ *
+ */
+extern int BindUnixSocket(int sockfd, char *path);
+extern int ConnectUnixSocket(int sockfd, char *path);
+
+/*
+ * Send nfds (up to 16) descriptors and buffer_sz (at least 1) bytes of data.
+ * The descriptors stay open here too, close them if you don't need them.
+ *
+ * Returns the number of bytes sent, -1 if it fails and errno remains set.
+ *
+ */
+extern int SendFdSocket(int sockfd, int *fds, int nfds, char *buffer, int buffer_sz);
+
+/*
+ * Receive data and the descriptors sent along with it. *nfds says how many fds
+ * has room for and comes back with how many were received (0 if the data came
+ * without any).
+ *
+ * Returns the number of bytes received, 0 if the peer closed, -1 if it fails
+ * and errno remains set.
+ *
+ */
+extern int RecvFdSocket(int sockfd, int *fds, int *nfds, char *buffer, int buffer_sz);
+
+/*
+ * Shared memory channels, same-host messaging without system calls (see ssockshm.c)
+ *
+ * Between processes on the same machine a message can go through memory both
+ * map instead of through the kernel: no system call and no kernel copy per
+ * message while both sides are busy, a few hundred nanoseconds end to end.
+ *
+ * A channel is set up over a connected Unix domain socket (see above), which
+ * must stay open as long as the channel is used. One side creates it, the other
+ * accepts it:
+ *
+ *	client:	fd = CreateUnixSocket();  ConnectUnixSocket(fd, "@md");
+ *		shm = CreateShmSocket(fd, 0);
+ *
+ *	server:	newfd = AcceptSocket(listenfd);
+ *		shm = AcceptShmSocket(newfd);
+ *
+ * and then either side can SendShm() and RecvShm() whole messages (like the
+ * framed calls: a message comes out exactly as it went in). A receiver with nothing
+ * to read spins briefly, then sleeps until the sender wakes it; a sender only
+ * waits if the receiver has fallen a whole ring behind.
+ *
+ * Each direction has its own ring of ring_size bytes (a power of 2, 0 for 1MB);
+ * a message can be up to half of that.
+ *
+ */
+typedef struct SockShm SockShm;
+
+/*
+ * Returns the channel, or NULL if it fails and errno remains set (EAFNOSUPPORT
+ * if sockfd isn't a Unix domain socket).
+ *
+ */
+extern SockShm *CreateShmSocket(int sockfd, int ring_size);
+extern SockShm *AcceptShmSocket(int sockfd);
+
+/*
+ * Returns buffer_sz, or -1 if it fails and errno remains set (EPIPE: the peer
+ * has gone, EMSGSIZE: too big for the ring).
+ *
+ */
+extern int SendShm(SockShm *shm, char *buffer, int buffer_sz);
+
+/*
+ * Waits up to timeout_ms (-1 for as long as it takes) for a message.
+ *
+ * Returns its size, 0 once the peer has closed and everything it sent has been
+ * read, or -1 if it fails and errno remains set (ETIMEDOUT, EPIPE if the peer
+ * died, EMSGSIZE if the message is bigger than buffer_sz: it is left in the ring,
+ * EPROTO if the ring holds garbage: the peer is broken, close it).
+ *
+ */
+extern int RecvShm(SockShm *shm, char *buffer, int buffer_sz, int timeout_ms);
+
+/*
+ * Closes this side of the channel (the socket is left alone).
+ *
+ */
+extern int CloseShm(SockShm *shm);
+
+/*
+ * Tuning profiles (see ssocktune.c)
+ *
+ * Instead of picking socket options one by one, give a socket a profile:
+ *
+ *	SOCK_PROFILE_LOW_LATENCY	request/response with small messages: Nagle
+ *					off, quick ACKs, little unsent data queued,
+ *					busy polling (where permitted)
+ *	SOCK_PROFILE_BULK		moving lots of data: Nagle on (the buffers are
+ *					left to the kernel's autotuning)
+ *	SOCK_PROFILE_MANY_IDLE		thousands of mostly quiet connections: 64K
+ *					buffers, keepalives (60s) to find dead peers
+ *	SOCK_PROFILE_DEFAULT		the system's defaults
+ *
+ *		fd = CreateSocket();
+ *		SetSocketProfile(fd, SOCK_PROFILE_LOW_LATENCY);
+ *		BindSocket(fd, port);
+ *		ListenSocket(fd, 5);
+ *		newfd = AcceptSocket(fd);	newfd is low latency too
+ *
+ * Sockets from AcceptSocket() (and so from the event loop and the workers) get
+ * their listener's profile. SetDefaultSocketProfile() gives every socket the
+ * library creates (CreateSocket(), ConnectHostSocket(), the pool...) a profile
+ * from the start. Setting SOCK_PROFILE_DEFAULT later doesn't undo a profile.
+ *
+ * ssock_bench runs its tests with each profile (or the one given with -p).
+ *
+ */
+#define SOCK_PROFILE_DEFAULT		(0)
+#define SOCK_PROFILE_LOW_LATENCY	(1)
+#define SOCK_PROFILE_BULK		(2)
+#define SOCK_PROFILE_MANY_IDLE		(3)
+
+/*
+ * Returns 0 if successful, -1 if an option could not be set and errno remains set
+ * (options that don't apply, TCP ones on a Unix domain socket say, are skipped).
+ *
+ */
+extern int SetSocketProfile(int sockfd, int profile);
+
+/*
+ * The socket's profile, the default one if it wasn't given one.
+ *
+ */
+extern int GetSocketProfile(int sockfd);
+
+/*
+ * CloseSocket() calls this; call it yourself for a socket closed with close().
+ *
+ */
+extern void ForgetSocketProfile(int sockfd);
+
+extern int SetDefaultSocketProfile(int profile);
+extern int GetDefaultSocketProfile(void);
+
+/*
+ * Profiles by name ("default", "low-latency", "bulk-throughput",
+ * "many-idle-connections"), for command line options. SocketProfileByName()
+ * returns -1 for an unknown name.
+ *
+ */
+extern int SocketProfileByName(char *name);
+extern char *SocketProfileName(int profile);
+
+/*
+ * TCP_CORK on (1) or off (0): while corked only full segments are sent, uncorking
+ * sends the rest. (SockCork, above, does the same in user space.)
+ *
+ * Returns 0 if successful, -1 if it fails and errno remains set.
+ *
+ */
+extern int CorkSocket(int sockfd, int on);
+
+/*
+ * TCP keepalive: probe a connection after idle_s seconds of silence, every
+ * interval_s seconds, and drop it after count probes go unanswered. Finds peers
+ * that vanished without a FIN (crashed, unplugged), which no read ever will.
+ * idle_s 0 turns keepalive off.
+ *
+ * Returns 0 if successful, -1 if it fails and errno remains set.
+ *
+ */
+extern int SetKeepAliveSocket(int sockfd, int idle_s, int interval_s, int count);
+
+/*
+ * SO_REUSEADDR, set before BindSocket(): a restarted server can bind its port
+ * again while connections from its previous run are still in TIME_WAIT. The
+ * server, the workers and the coroutine Listen() turn it on.
+ *
+ * Returns 0 if successful, -1 if it fails and errno remains set.
+ *
+ */
+extern int SetReuseAddrSocket(int sockfd, int on);
+
+/*
+ * Latency histograms (see ssockhist.c)
+ *
+ * An HDR histogram counts values from 0 to 2^40 (about 18 minutes in nanoseconds)
+ * to 3 significant digits in a fixed amount of memory, so a benchmark or a load
+ * generator can record every request and still report the tail:
+ *
+ *		h = CreateHist();
+ *		for each request
+ *		    RecordHist(h, end_ns - start_ns);
+ *		p99 = HistPercentile(h, 99.0);
+ *
+ * A histogram is not locked: one per thread, MergeHist() them for the totals.
+ *
+ */
+
+typedef struct SockHist SockHist;
+
+/*
+ * Returns NULL if it fails, errno remains set.
+ *
+ */
+extern SockHist *CreateHist(void);
+extern void CloseHist(SockHist *h);
+extern void ResetHist(SockHist *h);
+
+/*
+ * Count value (>= 0) once, or n times. Values over 2^40 are counted as 2^40.
+ *
+ * Returns 0 if successful, otherwise -1 and errno is set.
+ *
+ */
+extern int RecordHist(SockHist *h, long long value);
+extern int RecordHistCount(SockHist *h, long long value, long long n);
+
+/*
+ * Add everything counted in src to dst.
+ *
+ */
+extern int MergeHist(SockHist *dst, SockHist *src);
+
+/*
+ * The value that percentile (0 to 100) percent of the values are at or below,
+ * e.g. HistPercentile(h, 99.9); 100 is the exact maximum.
+ *
+ */
+extern long long HistPercentile(SockHist *h, double percentile);
+extern long long HistCount(SockHist *h);
+extern long long HistMin(SockHist *h);
+extern long long HistMax(SockHist *h);
+extern double HistMean(SockHist *h);
+
+/*
+ * Statistics (see ssockstats.c)
+ *
+ * AcceptSocket(), ConnectSocket() and the read and write calls (Read/Recv/Readv/
+ * RecvmsgSocket(), Write/Send/Writev/SendmsgSocket() and everything built on them)
+ * always count what they do, in per-thread counters that cost a few nanoseconds
+ * and no locks. Take a snapshot whenever you like, e.g. every few seconds from a
+ * thread of its own, and compare it with the last one for rates:
+ *
+ *		GetSockStats(&st);
+ *		accepts = st.op[SOCK_STAT_ACCEPT].calls;
+ *		read_p99_ns = SockStatPercentile(&st.op[SOCK_STAT_READ], 99.0);
+ *		resets = st.errnos[ECONNRESET];
+ *
+ * Calls are timed too (two clock reads each); SetSockStatsTiming(0) just counts.
+ *
+ */
+#define SOCK_STAT_ACCEPT	(0)
+#define SOCK_STAT_CONNECT	(1)
+#define SOCK_STAT_READ		(2)
+#define SOCK_STAT_WRITE		(3)
+#define SOCK_STAT_OPS		(4)
+
+#define SOCK_STAT_BUCKETS	(32)	/* latency[i] counts calls taking 2^i to 2^(i+1) ns */
+#define SOCK_STAT_ERRNOS	(134)	/* errnos[e] for e below this, errnos[0] for the rest */
+
+typedef struct {
+    long long	calls;
+    long long	bytes;		/* read or written */
+    long long	errors;		/* failed, not counting EAGAIN */
+    long long	eagain;		/* nothing to do on a non-blocking socket */
+    long long	partial;	/* read or wrote less than asked */
+    long long	eof;		/* read 0: the peer closed */
+    long long	ns;		/* time spent in the timed calls */
+    long long	latency[SOCK_STAT_BUCKETS];
+} SockOpStats;
+
+typedef struct {
+    SockOpStats	op[SOCK_STAT_OPS];
+    long long	errnos[SOCK_STAT_ERRNOS];	/* errors by errno */
+    int		threads;			/* threads counting right now */
+    long long	when_ns;			/* CLOCK_MONOTONIC of the snapshot */
+} SockStats;
+
+typedef struct {
+    long long	rx_calls;
+    long long	rx_bytes;
+    long long	tx_calls;
+    long long	tx_bytes;
+    long long	errors;
+    long long	eagain;
+} SockFdStats;
+
+/*
+ * Everything counted since the start (or the last ResetSockStats()).
+ *
+ * Returns 0 if successful, otherwise -1 and errno is set.
+ *
+ */
+extern int GetSockStats(SockStats *st);
+extern void ResetSockStats(void);
+extern void SetSockStatsTiming(int on);
+
+/*
+ * The time (ns) percentile (0 to 100) of an operation's calls took at most,
+ * to within a factor of two.
+ *
+ */
+extern long long SockStatPercentile(SockOpStats *op, double percentile);
+extern char *SockStatName(int op);
+
+/*
+ * One socket's bytes and calls each way since it was accepted. CloseSocket()
+ * clears them (ForgetSocketStats()); call that yourself after a plain close().
+ * They are counted without atomic adds, by the one thread expected to use the
+ * socket: one used by several threads at once may be a little short.
+ *
+ */
+extern int GetSocketStats(int sockfd, SockFdStats *fs);
+extern void ForgetSocketStats(int sockfd);
+
+/*
+ * Count a system call of your own with the library's: start = SockStatStart()
+ * before it, SockStatEnd(SOCK_STAT_..., fd, bytes asked, result, start) after
+ * (with errno still set from the call). errno is left alone.
+ *
+ */
+extern long long SockStatStart(void);
+extern void SockStatEnd(int op, int fd, long long asked, long long result, long long start);
+
+/*
+ * Tracing (ssocktrace.c)
+ *
+ * With tracing on, every library call that creates, binds, listens on, accepts,
+ * connects, reads, writes or closes a socket records a 32 byte binary event in a
+ * ring owned by the calling thread: no locks, no formatting, no I/O. The newest
+ * 64K events per thread are kept (SetSockTraceSize() to change that).
+ *
+ *	SetSockTrace(1);
+ *	...
+ *	DumpSockTrace("/tmp/server.trace");	(safe in a signal handler too)
+ *
+ * and "ssock_tracedump /tmp/server.trace" prints the threads merged into one
+ * timeline. SSOCK_TRACE=file in the environment traces from the start and dumps
+ * at exit, without touching the program.
+ *
+ * Events of your own go in with SockTrace(SOCK_TRACE_USER + n, ...).
+ *
+ */
+#define SOCK_TRACE_CREATE	(1)	/* size is the address family */
+#define SOCK_TRACE_BIND		(2)	/* size is the port */
+#define SOCK_TRACE_LISTEN	(3)	/* size is the backlog */
+#define SOCK_TRACE_ACCEPT	(4)	/* fd is the listener, result the new socket */
+#define SOCK_TRACE_CONNECT	(5)
+#define SOCK_TRACE_READ		(6)	/* size is the bytes asked for */
+#define SOCK_TRACE_WRITE	(7)
+#define SOCK_TRACE_CLOSE	(8)
+#define SOCK_TRACE_ACCEPT_BATCH	(9)	/* size is the most asked for, result how many */
+#define SOCK_TRACE_USER		(100)
+
+#define SOCK_TRACE_MAGIC	"SSTRACE1"
+
+typedef struct {
+    long long		ns;		/* CLOCK_MONOTONIC */
+    int			fd;
+    unsigned short	op;		/* SOCK_TRACE_..., 0 for an event lost while dumping */
+    unsigned short	err;		/* errno if result < 0 */
+    long long		size;
+    long long		result;
+} SockTraceEvent;
+
+/*
+ * A dump file: the header, then per thread a ring header and count events,
+ * oldest first.
+ *
+ */
+typedef struct {
+    char	magic[8];
+    int		pid;
+    int		nrings;
+} SockTraceFileHeader;
+
+typedef struct {
+    int		tid;
+    int		count;
+    long long	lost;		/* older events already overwritten */
+} SockTraceRingHeader;
+
+extern void SetSockTrace(int on);
+extern int SockTraceOn(void);
+extern int SetSockTraceSize(int events);
+
+/*
+ * Record an event (errno is kept, and recorded if result < 0). SockTraceAt()
+ * records even with tracing off, at ns (0 is now).
+ *
+ */
+extern void SockTrace(int op, int fd, long long size, long long result);
+extern void SockTraceAt(int op, int fd, long long size, long long result, long long ns);
+
+/*
+ * Write every thread's events to path.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int DumpSockTrace(char *path);
+extern char *SockTraceOpName(int op);
+
+/*
+ * Timers and deadlines (see ssocktimer.c)
+ *
+ * None of the basic calls has a timeout: a client that connects and says nothing
+ * holds RecvSocket() forever, a client that stops reading holds WriteSocket(). So:
+ *
+ * For an event loop server, an idle timeout per connection:
+ *
+ *                AddEventLoop(loop, fd, on_read, NULL, arg);
+ *                SetIdleEventLoop(loop, fd, 30000, on_idle);
+ *
+ * on_idle(loop, fd, arg) is called once fd has had no events for 30s; it would
+ * RemoveEventLoop() and CloseSocket() it. Being busy costs nothing (no timer is
+ * touched per event) and arming and cancelling are O(1), so this is fine for
+ * hundreds of thousands of connections.
+ *
+ * Timers of your own, e.g. a deadline for a request, go on the loop's wheel:
+ *
+ *                InitTimer(&conn->deadline, on_deadline, conn);
+ *                ArmTimer(EventLoopTimers(loop), &conn->deadline, 500);
+ *                ...
+ *                CancelTimer(&conn->deadline);	answered in time
+ *
+ * A SockTimer belongs to the caller (in the connection's own struct, typically)
+ * and must stay put while it is armed. A wheel is not thread-safe: use it from the
+ * thread that runs it (RunTimerWheel(), which an event loop does for you).
+ *
+ * For blocking sockets, SetSocketTimeouts() makes each read (write) call on the
+ * socket give up with EAGAIN after that long, and ReadTimeoutSocket() and
+ * WriteFullTimeoutSocket() take a deadline per call and fail with ETIMEDOUT.
+ * WriteFullSocket() and the other calls that wait out an EAGAIN fail with
+ * ETIMEDOUT too, once the socket has gone that long without any progress.
+ *
+ */
+typedef struct SockTimerWheel SockTimerWheel;
+typedef struct SockTimer SockTimer;
+
+typedef void (*SockTimerFunc)(SockTimer *timer, void *arg);
+
+struct SockTimer {			/* set up with InitTimer(), otherwise private */
+    SockTimer		*next;
+    SockTimer		*prev;
+    SockTimerWheel	*wheel;
+    unsigned long long	expires;
+    SockTimerFunc	fn;
+    void		*arg;
+};
+
+/*
+ * Idle timeout of a registered socket: idle_fn is called after ms without any
+ * event on it. 0 turns it off. Returns 0 if successful, otherwise -1 and errno
+ * remains set.
+ *
+ */
+extern int SetIdleEventLoop(SockEventLoop *loop, int sockfd, int ms, SockEventFunc idle_fn);
+extern SockTimerWheel *EventLoopTimers(SockEventLoop *loop);
+
+/*
+ * A wheel of its own (for code without an event loop), ticking every tick_ms
+ * (0 for the default of 1ms). Returns NULL if it fails, errno remains set.
+ *
+ */
+extern SockTimerWheel *CreateTimerWheel(int tick_ms);
+extern int CloseTimerWheel(SockTimerWheel *wheel);
+
+/*
+ * Arm (or re-arm) a timer to call fn(timer, arg) in ms milliseconds, and cancel
+ * it. Both O(1). A timer fires once; its callback may arm it again.
+ *
+ */
+extern void InitTimer(SockTimer *timer, SockTimerFunc fn, void *arg);
+extern int ArmTimer(SockTimerWheel *wheel, SockTimer *timer, int ms);
+extern void CancelTimer(SockTimer *timer);
+extern int TimerArmed(SockTimer *timer);
+
+/*
+ * Call every timer that is due. Returns how many were called, -1 if wheel is NULL.
+ * NextTimerWheel() is how long (ms) to sleep before calling it again, -1 if no
+ * timer is armed.
+ *
+ */
+extern int RunTimerWheel(SockTimerWheel *wheel);
+extern int NextTimerWheel(SockTimerWheel *wheel);
+extern long long TimerWheelNow(SockTimerWheel *wheel);
+
+/*
+ * Per-call deadlines on a blocking socket, applied by the kernel to each read
+ * (write) system call on it; the call fails with EAGAIN when it is up. 0 means none.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int SetSocketTimeouts(int sockfd, int read_ms, int write_ms);
+
+/*
+ * ReadSocket() and WriteFullSocket() with a deadline of timeout_ms.
+ *
+ * Returns what ReadSocket() (WriteFullSocket()) would, or -1 with errno ETIMEDOUT
+ * if the deadline passed first (some of a write may have been sent by then).
+ *
+ */
+extern int ReadTimeoutSocket(int sockfd, char *buffer, int buffer_sz, int timeout_ms);
+extern int WriteFullTimeoutSocket(int sockfd, char *buffer, int buffer_sz, int timeout_ms);
+
+/*
+ * Wait for sockfd to be readable (POLLIN) or writable (POLLOUT) after an EAGAIN,
+ * as the calls that keep going until everything is read or written do
+ * (ReadFullSocket(), WriteFullSocket(), WritevFullSocket(), SendMessagesSocket(),
+ * SendFileSocket()...). With a SetSocketTimeouts() timeout for that direction it
+ * waits no longer than that, and a blocking socket's EAGAIN already means the
+ * kernel waited that long.
+ *
+ * Returns 0 when it is ready, otherwise -1 and errno remains set (ETIMEDOUT if
+ * the timeout passed).
+ *
+ */
+extern int WaitSocket(int sockfd, short events);
+
+/*
+ * Write queues (see ssockqueue.c)
+ *
+ * A non-blocking WriteSocket() to a peer that reads slowly writes part of the
+ * buffer, or nothing; what then? A write queue per connection keeps the rest and
+ * sends it as the socket drains, and says when it is getting too long:
+ *
+ *                q = CreateWriteQueue(fd, 64 * 1024, 1024 * 1024, on_full, conn);
+ *                AddEventLoop(loop, fd, on_read, on_write, conn);
+ *
+ *   on_read:     ... QueueWrite(q, answer, len) for every request that came in ...
+ *                FlushWriteQueue(q);		one send for all of them
+ *   on_write:    FlushWriteQueue(q);		the socket drained, send some more
+ *   on_full:     over ? stop reading from conn : start again
+ *
+ * on_full(q, 1, conn) is called when more than the high watermark (1M here) is
+ * queued and on_full(q, 0, conn) when it is back down to the low one (64K): stop
+ * producing in between and one slow peer costs no more than that much memory, the
+ * kernel's flow control does the rest. Queueing past the high watermark still
+ * works; it's up to you to stop.
+ *
+ * Nothing is sent until FlushWriteQueue(), and it never blocks. A failed send
+ * (the peer went away) is remembered and every later call fails with its errno.
+ *
+ */
+typedef struct SockWriteQueue SockWriteQueue;
+
+typedef void (*SockQueueFunc)(SockWriteQueue *queue, int over, void *arg);
+
+/*
+ * Create (destroy) the queue of a connected socket, fn may be NULL. high 0 means
+ * no limit. CloseWriteQueue() drops whatever has not been sent.
+ *
+ * Returns NULL if it fails, errno remains set.
+ *
+ */
+extern SockWriteQueue *CreateWriteQueue(int sockfd, int low, int high, SockQueueFunc fn, void *arg);
+extern int CloseWriteQueue(SockWriteQueue *queue);
+
+/*
+ * Queue a copy of buffer_sz bytes, or a pooled buffer as it is (the queue takes
+ * the caller's reference and puts it back once sent).
+ *
+ * Returns the bytes queued, or -1 if it fails and errno remains set (ENOBUFS: the
+ * buffer pool is at its limit, or the errno of an earlier failed send). A failed
+ * QueueWrite() queues none of the buffer, so no half message is ever sent.
+ *
+ */
+extern int QueueWrite(SockWriteQueue *queue, char *buffer, int buffer_sz);
+extern int QueueSockBuf(SockWriteQueue *queue, SockBuf *buf);
+
+/*
+ * Send as much as the socket will take without blocking.
+ *
+ * Returns the bytes still queued (0: all sent), or -1 if the send failed and
+ * errno remains set.
+ *
+ */
+extern long long FlushWriteQueue(SockWriteQueue *queue);
+extern long long WriteQueueBytes(SockWriteQueue *queue);
+extern int WriteQueueFull(SockWriteQueue *queue);
+
+/*
+ * Accepting connections under load (see ssockaccept.c)
+ *
+ * A server that many clients connect to at once (after a restart, or when a load
+ * balancer moves them all) can lose connections before it sees them: the backlog
+ * given to ListenSocket() fills, the kernel drops SYNs, and the clients retry one,
+ * three, seven seconds later. Give the listener a real backlog (SOMAXCONN, the kernel
+ * caps it at net.core.somaxconn anyway), empty it completely on every wakeup, and
+ * refuse what can't be served with a reset rather than by leaving it queued:
+ *
+ *                ListenSocket(fd, SOMAXCONN);
+ *                SetDeferAcceptSocket(fd, 5);
+ *                AddListenEventLoop(loop, fd, on_accept, NULL);
+ *                SetAcceptLimitEventLoop(loop, 10000);
+ *
+ * The event loop accepts with AcceptBatchSocket(), so every socket on_accept() is
+ * handed is already non-blocking and close-on-exec, and EventLoopPeer() tells it
+ * where the connection came from. A loop with max_conns sockets registered (listeners
+ * not counted) resets new connections instead of calling on_accept(); remember to
+ * RemoveEventLoop() every connection you close, that is what the count goes by.
+ *
+ * Workers (ssockworker.c) take the same limit, split between them, with
+ * SetAcceptLimitWorkers(), and SetDeferAcceptWorkers() sets up their listeners.
+ *
+ */
+struct sockaddr_storage;
+
+/*
+ * accept4() a connection, non-blocking and close-on-exec. peer (may be NULL) gets
+ * the client's address.
+ *
+ * Returns the new socket, or -1 and errno remains set (EAGAIN: nothing waiting).
+ *
+ */
+extern int AcceptPeerSocket(int sockfd, struct sockaddr_storage *peer);
+
+/*
+ * Accept up to max waiting connections into fds[] (and peers[], if not NULL),
+ * stopping as soon as the listener has none left.
+ *
+ * Returns how many, or -1 if there were none (errno remains set, EAGAIN when the
+ * queue was simply empty).
+ *
+ */
+extern int AcceptBatchSocket(int sockfd, int *fds, struct sockaddr_storage *peers, int max);
+
+/*
+ * Close a connection with a reset (SO_LINGER 0): for refusing clients when over a
+ * limit, so they fail at once instead of waiting on a connection nobody serves.
+ *
+ */
+extern int ShedSocket(int sockfd);
+
+/*
+ * TCP_DEFER_ACCEPT on a listener: a connection is only accepted once the client has
+ * sent something, or after about seconds (0 turns it off). For protocols where
+ * the client speaks first.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int SetDeferAcceptSocket(int sockfd, int seconds);
+
+/*
+ * Put an address in buffer for printing ("10.0.0.1:5000", "[::1]:5000", "unix").
+ *
+ * Returns buffer, or NULL if an argument is bad.
+ *
+ */
+extern char *SockAddrName(struct sockaddr_storage *addr, char *buffer, int buffer_sz);
+
+/*
+ * Shed new connections while the loop has max_conns registered (0: no limit, the
+ * default). May be called from any thread.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set.
+ *
+ */
+extern int SetAcceptLimitEventLoop(SockEventLoop *loop, int max_conns);
+
+/*
+ * The number of connections a loop (or all the workers) have shed.
+ *
+ */
+extern long long EventLoopShed(SockEventLoop *loop);
+extern long long WorkersShed(SockWorkers *workers);
+
+/*
+ * The client address of the connection being accepted. Only valid inside the
+ * accept callback, NULL anywhere else.
+ *
+ */
+extern struct sockaddr_storage *EventLoopPeer(SockEventLoop *loop);
+
+/*
+ * Like SetAcceptLimitEventLoop() and SetDeferAcceptSocket(), for all the workers.
+ * Each worker gets an equal share of max_conns, the shares adding up to max_conns,
+ * so max_conns (unless 0, no limit) must be at least the number of workers.
+ *
+ * Returns 0 if successful, otherwise -1 and errno remains set (EINVAL for fewer
+ * than one connection per worker).
+ *
+ */
+extern int SetAcceptLimitWorkers(SockWorkers *workers, int max_conns);
+extern int SetDeferAcceptWorkers(SockWorkers *workers, int seconds);
+
+/*
+ * TLS, encrypted by the kernel where it can (see ssocktls.c)
+ *
+ * The handshake runs in OpenSSL; the record encryption is then handed to the
+ * kernel (kTLS), so the socket keeps working with the ordinary calls, sendfile()
+ * included, and the data is encrypted on its way out without another copy:
+ *
+ *                ctx = CreateTlsServerContext("server.pem", NULL);
+ *                ...
+ *                newfd = AcceptSocket(fd);
+ *                tls = StartTlsSocket(ctx, newfd, NULL, 5000);
+ *
+ *                n = ReadTls(tls, buffer, buffer_sz);
+ *                n = WriteTls(tls, buffer, n);
+ *                SendFileTls(tls, file_fd, NULL, -1);
+ *
+ *                CloseTls(tls);
+ *                CloseSocket(newfd);
+ *
+ * A client does the same with CreateTlsClientContext() and the server's name as
+ * host_name, after ConnectSocket().
+ *
+ * When the kernel can't take the session (no "tls" module, or a cipher it doesn't
+ * do) the calls encrypt in user space instead. TlsOffload() says which it is, and
+ * ONLY when it has SOCK_TLS_KERNEL_SEND may the socket be written with WriteSocket(),
+ * SendSocket(), SendFileSocket() and the rest directly. Read with ReadTls() in
+ * either case.
+ *
+ */
+
+typedef struct SockTlsContext SockTlsContext;
+typedef struct SockTls SockTls;
+
+#define SOCK_TLS_KERNEL_SEND	(1)	/* the kernel encrypts what is written */
+#define SOCK_TLS_KERNEL_RECV	(2)	/* the kernel decrypts what is read */
+
+/*
+ * Certificate (chain) and private key for a server, PEM files; key_file NULL if the
+ * key is in cert_file. A client's context takes the certificates it trusts, or
+ * NULL to accept any server (a self-signed test server, never in production).
+ *
+ * Returns NULL if it fails (ENOENT: a file can't be used), errno remains set.
+ *
+ */
+extern SockTlsContext *CreateTlsServerContext(char *cert_file, char *key_file);
+extern SockTlsContext *CreateTlsClientContext(char *ca_file);
+extern int CloseTlsContext(SockTlsContext *ctx);
+
+/*
+ * Kernel offload is tried by default, turn it off (on = 0) to measure against
+ * user space encryption. Applies to connections started after the call.
+ *
+ */
+extern int SetTlsKernelOffload(SockTlsContext *ctx, int on);
+
+/*
+ * Run the TLS handshake on a connected socket, for up to timeout_ms (-1: no limit).
+ * A client passes the name (or address) it connected to in host_name, the server's
+ * certificate has to match it if the context verifies.
+ *
+ * Returns NULL if it fails, errno remains set (ETIMEDOUT, ECONNRESET, EPROTO for
+ * a failed negotiation or verification).
+ *
+ */
+extern SockTls *StartTlsSocket(SockTlsContext *ctx, int sockfd, char *host_name, int timeout_ms);
+
+/*
+ * SOCK_TLS_KERNEL_SEND and/or SOCK_TLS_KERNEL_RECV, or 0 if it is all in user space.
+ *
+ */
+extern int TlsOffload(SockTls *tls);
+
+/*
+ * Read and write like ReadSocket() and WriteSocket(): 0 at the end of the
+ * connection, -1 with errno set on failure (EAGAIN on a non-blocking socket that
+ * isn't ready; call WriteTls() again with the same data then). WriteTls() writes
+ * everything on a blocking socket.
+ *
+ */
+extern int ReadTls(SockTls *tls, char *buffer, int buffer_sz);
+extern int WriteTls(SockTls *tls, char *buffer, int buffer_sz);
+
+/*
+ * SendFileSocket() for a TLS connection: zero-copy when the kernel encrypts, read
+ * and encrypted a record at a time when it doesn't.
+ *
+ */
+extern long long SendFileTls(SockTls *tls, int fd, long long *offset, long long count);
+
+/*
+ * Send close_notify and free the session. The socket is NOT closed.
+ *
+ */
+extern int CloseTls(SockTls *tls);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __SSOCKLIB_H__ */
 
 
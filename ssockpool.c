@@ -0,0 +1,385 @@
+/*
+ * ssockpool.c
+ *
+ * Client side connection pool for the simple socket library.
+ *
+ * A client that does CreateSocket() + ConnectSocket() + CloseSocket() for every
+ * short exchange pays for a name lookup and a TCP handshake each time. The pool
+ * keeps connected sockets per host:port and hands an idle one out instead. A
+ * socket is checked (with a non-blocking peek, no round trip) before it is
+ * reused, the number of connections per destination is capped, and a background
+ * thread closes idle sockets that died or sat too long and opens fresh ones to
+ * keep a few ready.
+ *
+ * New connections are made with ConnectHostSocket(): the name goes through the
+ * DNS cache (ssockdns.c), so a changed address is picked up once its TTL is out,
+ * and all of its addresses are raced, so one dead address doesn't take the
+ * destination down. Nothing slow happens under the pool lock, and every connect
+ * has a deadline (SetSockPoolConnectTimeout()).
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define POOL_HOST_MAX	(256)
+#define POOL_TICK_MS	(100)	/* how often the background thread looks around */
+#define POOL_CONNECT_MS	(3000)	/* default connect deadline */
+
+typedef struct {
+    int		fd;
+    long long	since_ms;	/* when it went idle */
+} IdleSock;
+
+typedef struct PoolDest {
+    struct PoolDest		*next;
+    char			host[POOL_HOST_MAX];
+    int				port;
+    int				reached;	/* connected once, worth keeping sockets ready for */
+    int				busy;		/* handed out */
+    int				connecting;	/* background connects in progress */
+    int				nidle;
+    IdleSock			*idle;		/* stack, most recently used on top */
+} PoolDest;
+
+struct SockPool {
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+    pthread_t		thread;
+    int			stop;
+    int			max_per_dest;
+    int			min_idle;
+    int			idle_timeout_ms;
+    int			connect_ms;
+    PoolDest		*dests;
+};
+
+static long long nowMs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * is an idle connection still good? (the server may have closed it meanwhile)
+ */
+static int sockAlive(int fd)
+{
+    char	c;
+    int		n;
+
+    n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return (1);	/* nothing to read: open and quiet, as it should be */
+
+	/* 0 is EOF, an error is an error, and unread data means a confused protocol */
+    return (0);
+}
+
+/*
+ * connect a new socket to dest, called WITHOUT the pool lock held (the lookup
+ * and the connect can both take a while)
+ */
+static int connectDest(PoolDest *d, int timeout_ms)
+{
+    return (ConnectHostSocket(d->host, d->port, timeout_ms));
+}
+
+/*
+ * find (or add) the entry for host:port, pool lock held
+ */
+static PoolDest *findDest(SockPool *p, char *host, int port, int create)
+{
+    PoolDest	*d;
+
+    for (d = p->dests; d != NULL; d = d->next) {
+	if (d->port == port && strcmp(d->host, host) == 0)
+	    return (d);
+    }
+
+    if (!create)
+	return (NULL);
+
+    if (strlen(host) >= POOL_HOST_MAX) {
+	errno = ENAMETOOLONG;
+	return (NULL);
+    }
+
+    d = calloc(1, sizeof(PoolDest));
+    if (d == NULL || (d->idle = calloc(p->max_per_dest, sizeof(IdleSock))) == NULL) {
+	free(d);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    strcpy(d->host, host);
+    d->port = port;
+    d->next = p->dests;
+    p->dests = d;
+
+    return (d);
+}
+
+/*
+ * the background thread: weed out dead/stale idle sockets, keep min_idle ready
+ */
+static void *poolMain(void *arg)
+{
+    SockPool		*p = (SockPool *) arg;
+    PoolDest		*d;
+    struct timespec	ts;
+    long long		now;
+    int			i, j, fd;
+
+    pthread_mutex_lock(&p->lock);
+
+    while (!p->stop) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += POOL_TICK_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+	if (p->stop)
+	    break;
+
+	now = nowMs();
+
+	for (d = p->dests; d != NULL; d = d->next) {
+	    for (i = j = 0; i < d->nidle; i++) {
+		if (!sockAlive(d->idle[i].fd) ||
+		    (p->idle_timeout_ms > 0 && now - d->idle[i].since_ms > p->idle_timeout_ms)) {
+		    CloseSocket(d->idle[i].fd);
+		    continue;
+		}
+		d->idle[j++] = d->idle[i];
+	    }
+	    d->nidle = j;
+
+	    /* top up, one connect at a time, without holding the lock over it */
+	    while (d->reached && d->nidle + d->connecting < p->min_idle &&
+		   d->busy + d->nidle + d->connecting < p->max_per_dest && !p->stop) {
+		d->connecting++;
+		pthread_mutex_unlock(&p->lock);
+		fd = connectDest(d, p->connect_ms);
+		pthread_mutex_lock(&p->lock);
+		d->connecting--;
+		if (fd < 0)
+		    break;	/* server down? try again next tick */
+		d->idle[d->nidle].fd = fd;
+		d->idle[d->nidle].since_ms = nowMs();
+		d->nidle++;
+	    }
+	}
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return (NULL);
+}
+
+SockPool *CreateSockPool(int max_per_dest, int min_idle, int idle_timeout_ms)
+{
+    SockPool	*p;
+
+    if (max_per_dest <= 0 || min_idle < 0 || min_idle > max_per_dest) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    p = calloc(1, sizeof(SockPool));
+    if (p == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    p->max_per_dest = max_per_dest;
+    p->min_idle = min_idle;
+    p->idle_timeout_ms = idle_timeout_ms;
+    p->connect_ms = POOL_CONNECT_MS;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    errno = pthread_create(&p->thread, NULL, poolMain, p);
+    if (errno != 0) {
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p);
+	return (NULL);
+    }
+
+    return (p);
+}
+
+/*
+ * how long a connect may take, for the pool's thread and GetPoolSocket() (-1: no limit)
+ */
+int SetSockPoolConnectTimeout(SockPool *p, int timeout_ms)
+{
+    if (p == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->connect_ms = timeout_ms;
+    pthread_mutex_unlock(&p->lock);
+
+    return (0);
+}
+
+/*
+ * get a connected socket to host:port
+ */
+int GetPoolSocket(SockPool *p, char *host, int port)
+{
+    PoolDest	*d;
+    int		fd, timeout_ms;
+
+    if (p == NULL || host == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    d = findDest(p, host, port, 1);
+    if (d == NULL) {
+	pthread_mutex_unlock(&p->lock);
+	return (-1);
+    }
+
+	/* most recently used first, it is the least likely to have timed out */
+    while (d->nidle > 0) {
+	fd = d->idle[--d->nidle].fd;
+	if (sockAlive(fd)) {
+	    d->busy++;
+	    pthread_mutex_unlock(&p->lock);
+#ifdef DEBUG
+	    fprintf(stderr,"%s : GetPoolSocket(%s, %d) reusing %d\n",__FILE__,host,port,fd);
+#endif
+	    return (fd);
+	}
+	CloseSocket(fd);
+    }
+
+    if (d->busy + d->connecting >= p->max_per_dest) {
+	pthread_mutex_unlock(&p->lock);
+	errno = EBUSY;
+	return (-1);
+    }
+
+    d->busy++;		/* reserve our slot before dropping the lock */
+    timeout_ms = p->connect_ms;
+    pthread_mutex_unlock(&p->lock);
+
+    fd = connectDest(d, timeout_ms);
+    if (fd < 0) {
+	int	save = errno;
+
+	pthread_mutex_lock(&p->lock);
+	d->busy--;
+	pthread_mutex_unlock(&p->lock);
+	errno = save;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    d->reached = 1;
+    pthread_mutex_unlock(&p->lock);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : GetPoolSocket(%s, %d) new connection %d\n",__FILE__,host,port,fd);
+#endif
+
+    return (fd);
+}
+
+/*
+ * give a socket back; reusable == 0 closes it (error, or the protocol can't reuse it)
+ */
+int PutPoolSocket(SockPool *p, int fd, char *host, int port, int reusable)
+{
+    PoolDest	*d;
+
+    if (p == NULL || host == NULL || fd < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    d = findDest(p, host, port, 0);
+    if (d == NULL) {
+	pthread_mutex_unlock(&p->lock);
+	errno = ENOENT;
+	return (-1);
+    }
+
+    if (d->busy > 0)
+	d->busy--;
+
+    if (reusable && !p->stop && d->nidle < p->max_per_dest) {
+	d->idle[d->nidle].fd = fd;
+	d->idle[d->nidle].since_ms = nowMs();
+	d->nidle++;
+	pthread_mutex_unlock(&p->lock);
+	return (0);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return (CloseSocket(fd));
+}
+
+/*
+ * close every idle socket and free the pool; sockets still handed out are
+ * the caller's to close
+ */
+int CloseSockPool(SockPool *p)
+{
+    PoolDest	*d, *next;
+    int		i;
+
+    if (p == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->thread, NULL);
+
+    for (d = p->dests; d != NULL; d = next) {
+	next = d->next;
+	for (i = 0; i < d->nidle; i++)
+	    CloseSocket(d->idle[i].fd);
+	free(d->idle);
+	free(d);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+
+    return (0);
+}
@@ -0,0 +1,349 @@
+/*
+ * ssockqueue.c
+ *
+ * Per-connection write queues for the simple socket library.
+ *
+ * WriteSocket() on a connection whose peer reads slowly either blocks (and with
+ * it a whole event loop thread) or writes part of the buffer and leaves the rest
+ * to the caller. A write queue takes what the caller has to send, whatever the
+ * socket can take right now, and sends it as the socket drains:
+ *
+ *	- QueueWrite() copies into pooled 16K buffers (ssockbuf.c), QueueSockBuf()
+ *	  queues a pooled buffer as it is, without a copy,
+ *	- FlushWriteQueue() sends as much as the socket takes, everything queued in
+ *	  one sendmsg() (up to 64 buffers), never blocking; call it once after a
+ *	  batch of queueing, and from the event loop's write callback,
+ *	- when the queue grows past its high watermark the caller is told (once),
+ *	  and again when it is back under the low watermark, so a producer can stop
+ *	  reading requests or generating data instead of queueing without limit.
+ *
+ * A queue belongs to one thread (the event loop's that owns the connection).
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define QUEUE_CHUNK	(16 * 1024)	/* QueueWrite() copies into buffers this big */
+#define QUEUE_IOV	(64)		/* buffers per sendmsg() */
+#define QUEUE_MIN_ENTS	(16)
+
+typedef struct {
+    SockBuf	*buf;
+    int		off;		/* sent so far */
+} QueueEntry;
+
+struct SockWriteQueue {
+    int			sockfd;
+    int			low;
+    int			high;
+    int			over;		/* above high, not yet back under low */
+    int			error;		/* errno of a failed send, then every call fails */
+    long long		bytes;		/* queued, not sent */
+    QueueEntry		*ents;		/* ring */
+    int			head;
+    int			count;
+    int			cap;
+    SockBuf		*fill;		/* the last entry, if QueueWrite() may add to it */
+    SockQueueFunc	fn;
+    void		*arg;
+};
+
+SockWriteQueue *CreateWriteQueue(int sockfd, int low, int high, SockQueueFunc fn, void *arg)
+{
+    SockWriteQueue	*q;
+
+    if (sockfd < 0 || low < 0 || high < low) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    q = calloc(1, sizeof(SockWriteQueue));
+    if (q == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    q->ents = malloc(QUEUE_MIN_ENTS * sizeof(QueueEntry));
+    if (q->ents == NULL) {
+	free(q);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    q->sockfd = sockfd;
+    q->low = low;
+    q->high = (high > 0) ? high : 0x7fffffff;
+    q->cap = QUEUE_MIN_ENTS;
+    q->fn = fn;
+    q->arg = arg;
+
+    return (q);
+}
+
+/*
+ * drop whatever is still queued and free the queue (the socket stays open)
+ */
+int CloseWriteQueue(SockWriteQueue *q)
+{
+    if (q == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    while (q->count > 0) {
+	PutSockBuf(q->ents[q->head].buf);
+	q->head = (q->head + 1) % q->cap;
+	q->count--;
+    }
+    free(q->ents);
+    free(q);
+
+    return (0);
+}
+
+/*
+ * tell the owner when the queue crosses a watermark
+ */
+static void checkMarks(SockWriteQueue *q)
+{
+    if (!q->over && q->bytes > q->high) {
+	q->over = 1;
+	if (q->fn != NULL)
+	    (*q->fn)(q, 1, q->arg);
+    } else if (q->over && q->bytes <= q->low) {
+	q->over = 0;
+	if (q->fn != NULL)
+	    (*q->fn)(q, 0, q->arg);
+    }
+}
+
+static int addEntry(SockWriteQueue *q, SockBuf *buf)
+{
+    QueueEntry	*ents;
+    int		i, cap;
+
+    if (q->count == q->cap) {
+	cap = q->cap * 2;
+	ents = malloc(cap * sizeof(QueueEntry));
+	if (ents == NULL) {
+	    errno = ENOMEM;
+	    return (-1);
+	}
+	for (i = 0; i < q->count; i++)
+	    ents[i] = q->ents[(q->head + i) % q->cap];
+	free(q->ents);
+	q->ents = ents;
+	q->cap = cap;
+	q->head = 0;
+    }
+
+    q->ents[(q->head + q->count) % q->cap].buf = buf;
+    q->ents[(q->head + q->count) % q->cap].off = 0;
+    q->count++;
+
+    return (0);
+}
+
+/*
+ * take back what a failed QueueWrite() queued: the entries it added after the
+ * first count, and what it appended to fill (which had fill_len bytes)
+ */
+static void unqueue(SockWriteQueue *q, int count, SockBuf *fill, int fill_len, int done)
+{
+    while (q->count > count) {
+	q->count--;
+	PutSockBuf(q->ents[(q->head + q->count) % q->cap].buf);
+    }
+    if (fill != NULL)
+	fill->len = fill_len;
+    q->fill = fill;
+    q->bytes -= done;
+}
+
+/*
+ * queue a copy of buffer_sz bytes (sent by the next FlushWriteQueue()), all of
+ * it or, if it fails, none of it
+ */
+int QueueWrite(SockWriteQueue *q, char *buffer, int buffer_sz)
+{
+    SockBuf	*b, *fill;
+    int		done = 0, n, count, fill_len, err;
+
+    if (q == NULL || buffer_sz < 0 || (buffer_sz > 0 && buffer == NULL)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (q->error != 0) {
+	errno = q->error;
+	return (-1);
+    }
+
+    count = q->count;
+    fill = q->fill;
+    fill_len = (fill != NULL) ? fill->len : 0;
+
+    while (done < buffer_sz) {
+	b = q->fill;
+	if (b == NULL || b->len == b->size) {
+	    b = GetSockBuf(QUEUE_CHUNK);	/* NULL, ENOBUFS: the pool is at its limit */
+	    if (b != NULL) {
+		b->len = 0;
+		if (addEntry(q, b) < 0) {
+		    err = errno;
+		    PutSockBuf(b);
+		    errno = err;
+		    b = NULL;
+		}
+	    }
+	    if (b == NULL) {
+		err = errno;
+		unqueue(q, count, fill, fill_len, done);	/* no half messages on the wire */
+		errno = err;
+		return (-1);
+	    }
+	    q->fill = b;
+	}
+
+	n = b->size - b->len;
+	if (n > buffer_sz - done)
+	    n = buffer_sz - done;
+	memcpy(b->data + b->len, buffer + done, n);
+	b->len += n;
+	done += n;
+	q->bytes += n;
+    }
+
+    checkMarks(q);
+
+    return (buffer_sz);
+}
+
+/*
+ * queue buf->len bytes of a pooled buffer without copying them; the queue takes
+ * over the caller's reference (HoldSockBuf() first to keep using it)
+ */
+int QueueSockBuf(SockWriteQueue *q, SockBuf *buf)
+{
+    if (q == NULL || buf == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (q->error != 0) {
+	errno = q->error;
+	return (-1);
+    }
+
+    if (buf->len == 0) {
+	PutSockBuf(buf);
+	return (0);
+    }
+
+    if (addEntry(q, buf) < 0)
+	return (-1);
+    q->fill = NULL;	/* not ours to add to */
+    q->bytes += buf->len;
+
+    checkMarks(q);
+
+    return (buf->len);
+}
+
+/*
+ * send as much as the socket takes without blocking, returns what is left queued
+ */
+long long FlushWriteQueue(SockWriteQueue *q)
+{
+    struct iovec	iov[QUEUE_IOV];
+    struct msghdr	msg;
+    QueueEntry		*e;
+    long long		start, asked;
+    int			i, n, left;
+
+    if (q == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (q->error != 0) {
+	errno = q->error;
+	return (-1);
+    }
+
+    while (q->count > 0) {
+	asked = 0;
+	for (i = 0; i < q->count && i < QUEUE_IOV; i++) {
+	    e = &q->ents[(q->head + i) % q->cap];
+	    iov[i].iov_base = e->buf->data + e->off;
+	    iov[i].iov_len = e->buf->len - e->off;
+	    asked += iov[i].iov_len;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = i;
+
+	start = SockStatStart();
+	n = sendmsg(q->sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	SockStatEnd(SOCK_STAT_WRITE, q->sockfd, asked, n, start);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;		/* full: the next writable event flushes again */
+	    q->error = errno;
+	    return (-1);
+	}
+
+	q->bytes -= n;
+	for (left = n; left > 0; ) {
+	    e = &q->ents[q->head];
+	    if (left < e->buf->len - e->off) {
+		e->off += left;
+		break;
+	    }
+	    left -= e->buf->len - e->off;
+	    if (e->buf == q->fill)
+		q->fill = NULL;
+	    PutSockBuf(e->buf);
+	    q->head = (q->head + 1) % q->cap;
+	    q->count--;
+	}
+
+	if (n < asked)
+	    break;		/* the socket took what it could */
+    }
+
+    if (q->count == 0)
+	q->head = 0;
+
+    checkMarks(q);
+
+    return (q->bytes);
+}
+
+long long WriteQueueBytes(SockWriteQueue *q)
+{
+    return ((q != NULL) ? q->bytes : 0);
+}
+
+/*
+ * 1 from crossing the high watermark until back under the low one
+ */
+int WriteQueueFull(SockWriteQueue *q)
+{
+    return ((q != NULL) ? q->over : 0);
+}
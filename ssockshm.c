@@ -0,0 +1,480 @@
+/*
+ * ssockshm.c
+ *
+ * Shared memory message channel for the simple socket library.
+ *
+ * Even a Unix domain socket costs a system call and a copy through the kernel per
+ * message. Two processes on the same machine can do without both: here they share
+ * a piece of memory holding two rings, one per direction. Each ring has exactly
+ * one writer and one reader, so no locks are needed, only the order of the stores
+ * (the writer fills in a message, then moves head; the reader copies it out, then
+ * moves tail).
+ *
+ * A reader with nothing to read spins for a little while (a message is usually a
+ * few microseconds away), then goes to sleep on an eventfd. It says so in the
+ * shared memory first, and a writer only calls into the kernel to wake it up when
+ * it has said so; a busy channel makes no system calls at all. The same goes for
+ * a writer waiting for room in a full ring.
+ *
+ * The channel is set up over an ordinary (Unix domain) socket: one side creates the
+ * memory and the eventfds and sends their descriptors across (SendFdSocket()), the
+ * other maps them and answers. The socket stays open for as long as the channel
+ * does, if it hangs up the peer is gone.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#define _GNU_SOURCE	/* memfd_create(), POLLRDHUP */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define SHM_MAGIC		(0x5353484dU)	/* "SSHM" */
+#define SHM_VERSION		(1)
+#define SHM_DEFAULT_RING	(1024 * 1024)
+#define SHM_MIN_RING		(4096)
+#define SHM_SPIN		(4000)		/* polls of the ring before sleeping */
+#define SHM_WRAP		(0xffffffffU)	/* record length: skip to the start of the ring */
+#define SHM_ALIGN(n)		(((n) + 7) & ~7ULL)
+
+#define CACHE_LINE		__attribute__((aligned(64)))
+
+/*
+ * one direction, in shared memory; head's line is only written by the writer
+ * and tail's only by the reader, so they don't bounce between the two cores
+ */
+typedef struct {
+    unsigned long long	head CACHE_LINE;	/* bytes ever written */
+    int			writer_waiting;		/* writer asleep, waiting for room */
+    unsigned long long	tail CACHE_LINE;	/* bytes ever read */
+    int			reader_waiting;		/* reader asleep, waiting for data */
+} ShmRing;
+
+typedef struct {
+    ShmRing		ring[2];	/* [0]: creator -> acceptor, [1]: acceptor -> creator */
+    int			closed[2] CACHE_LINE;	/* side has called CloseShm() */
+} ShmShared;
+
+typedef struct {
+    unsigned int	magic;
+    unsigned int	version;
+    unsigned int	ring_size;
+} ShmHello;
+
+struct SockShm {
+    ShmShared		*shared;
+    size_t		map_size;
+    int			side;		/* 0 created it, 1 accepted it */
+    int			sockfd;		/* the socket it was set up over */
+    int			my_efd;		/* we sleep on this */
+    int			peer_efd;	/* the peer sleeps on this */
+    unsigned int	ring_size;
+    ShmRing		*tx, *rx;
+    char		*tx_data, *rx_data;
+    unsigned long long	tx_tail_seen;	/* local copies of the other side's index, */
+    unsigned long long	rx_head_seen;	/* so we only touch its cache line when needed */
+};
+
+static void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * spinning only pays if the peer is running on another CPU at the same time
+ */
+static int spinCount(void)
+{
+    static int	spin = -1;
+
+    if (spin < 0)
+	spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN : 0;
+
+    return (spin);
+}
+
+static void wakePeer(SockShm *s)
+{
+    unsigned long long	one = 1;
+
+    (void) write(s->peer_efd, &one, sizeof(one));
+}
+
+/*
+ * wait until *watch moves away from seen, spinning first, then asleep
+ *
+ * Returns 1 to go and look again, 0 if timeout_ms passed, -1 if the peer is gone.
+ */
+static int waitShm(SockShm *s, int *waiting, unsigned long long *watch, unsigned long long seen,
+		   int timeout_ms)
+{
+    struct pollfd	pfd[2];
+    unsigned long long	count;
+    int			i, n, spin = spinCount();
+
+    for (i = 0; i < spin; i++) {
+	if (__atomic_load_n(watch, __ATOMIC_ACQUIRE) != seen)
+	    return (1);
+	cpuRelax();
+    }
+
+    if (timeout_ms == 0)
+	return ((__atomic_load_n(watch, __ATOMIC_ACQUIRE) != seen) ? 1 : 0);
+
+	/* say we're going to sleep, then look once more: the writer checks the flag after its store */
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(watch, __ATOMIC_SEQ_CST) != seen ||
+	__atomic_load_n(&s->shared->closed[1 - s->side], __ATOMIC_SEQ_CST)) {
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+	return (1);
+    }
+
+    pfd[0].fd = s->my_efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = s->sockfd;
+    pfd[1].events = POLLRDHUP;	/* the peer died without CloseShm() */
+
+    n = poll(pfd, 2, timeout_ms);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+    if (n < 0)
+	return ((errno == EINTR) ? 1 : -1);
+    if (n == 0)
+	return (0);
+
+    if (pfd[0].revents & POLLIN)
+	(void) read(s->my_efd, &count, sizeof(count));	/* non-blocking, resets it */
+
+    if ((pfd[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) &&
+	__atomic_load_n(watch, __ATOMIC_ACQUIRE) == seen) {
+	errno = EPIPE;
+	return (-1);
+    }
+
+    return (1);
+}
+
+/*
+ * set up both ends' pointers into the mapping
+ */
+static SockShm *mapShm(int sockfd, int side, int memfd, int my_efd, int peer_efd,
+		       unsigned int ring_size)
+{
+    SockShm	*s;
+    void	*p;
+    size_t	map_size = sizeof(ShmShared) + 2 * (size_t) ring_size;
+
+    p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED)
+	return (NULL);
+
+    s = calloc(1, sizeof(SockShm));
+    if (s == NULL) {
+	munmap(p, map_size);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    s->shared = (ShmShared *) p;
+    s->map_size = map_size;
+    s->side = side;
+    s->sockfd = sockfd;
+    s->my_efd = my_efd;
+    s->peer_efd = peer_efd;
+    s->ring_size = ring_size;
+    s->tx = &s->shared->ring[side];
+    s->rx = &s->shared->ring[1 - side];
+    s->tx_data = (char *) p + sizeof(ShmShared) + side * (size_t) ring_size;
+    s->rx_data = (char *) p + sizeof(ShmShared) + (1 - side) * (size_t) ring_size;
+
+    return (s);
+}
+
+/*
+ * the side that sets the channel up (usually the client)
+ */
+SockShm *CreateShmSocket(int sockfd, int ring_size)
+{
+    struct sockaddr_storage	ss;
+    socklen_t			len = sizeof(ss);
+    ShmHello			hello;
+    SockShm			*s = NULL;
+    char			ack;
+    int				fds[3] = { -1, -1, -1 }, i, n, save;
+
+    if (ring_size == 0)
+	ring_size = SHM_DEFAULT_RING;
+    if (ring_size < SHM_MIN_RING || (ring_size & (ring_size - 1)) != 0) {
+	errno = EINVAL;		/* a power of 2, so positions wrap with a mask */
+	return (NULL);
+    }
+
+    if (getsockname(sockfd, (struct sockaddr *) &ss, &len) < 0)
+	return (NULL);
+    if (ss.ss_family != AF_UNIX) {
+	errno = EAFNOSUPPORT;	/* the descriptors can only travel over a Unix socket */
+	return (NULL);
+    }
+
+    fds[0] = memfd_create("ssockshm", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);	/* wakes us */
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);	/* wakes the peer */
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0)
+	goto fail;
+
+    if (ftruncate(fds[0], sizeof(ShmShared) + 2 * (size_t) ring_size) < 0)
+	goto fail;		/* fresh memory, all zero: both rings empty */
+
+    s = mapShm(sockfd, 0, fds[0], fds[1], fds[2], ring_size);
+    if (s == NULL)
+	goto fail;
+
+    hello.magic = SHM_MAGIC;
+    hello.version = SHM_VERSION;
+    hello.ring_size = ring_size;
+
+    if (SendFdSocket(sockfd, fds, 3, (char *) &hello, sizeof(hello)) != sizeof(hello))
+	goto fail;
+    n = ReadFullSocket(sockfd, &ack, 1);
+    if (n != 1 || ack != 'K') {
+	if (n >= 0)
+	    errno = EPROTO;	/* hung up on us, or not an ssockshm peer */
+	goto fail;
+    }
+
+    close(fds[0]);		/* the mapping stays */
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : CreateShmSocket(%d, %d) ready\n",__FILE__,sockfd,ring_size);
+#endif
+
+    return (s);
+
+fail:
+    save = errno;
+    if (s != NULL) {
+	munmap(s->shared, s->map_size);
+	free(s);
+    }
+    for (i = 0; i < 3; i++) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+    }
+    errno = save;
+
+    return (NULL);
+}
+
+/*
+ * the other side: take the descriptors, map the memory, say yes
+ */
+SockShm *AcceptShmSocket(int sockfd)
+{
+    ShmHello	hello;
+    SockShm	*s = NULL;
+    struct stat	st;
+    int		fds[3], nfds = 3, n, i;
+
+    n = RecvFdSocket(sockfd, fds, &nfds, (char *) &hello, sizeof(hello));
+    if (n < 0)
+	return (NULL);
+
+    if (n != sizeof(hello) || nfds != 3 || hello.magic != SHM_MAGIC ||
+	hello.version != SHM_VERSION || hello.ring_size < SHM_MIN_RING ||
+	(hello.ring_size & (hello.ring_size - 1)) != 0 ||
+	fstat(fds[0], &st) < 0 ||
+	st.st_size < (off_t) (sizeof(ShmShared) + 2 * (size_t) hello.ring_size)) {
+	errno = EPROTO;
+    } else {
+	s = mapShm(sockfd, 1, fds[0], fds[2], fds[1], hello.ring_size);
+    }
+
+    if (s == NULL || WriteFullSocket(sockfd, "K", 1) != 1) {
+	n = errno;
+	if (s != NULL) {
+	    munmap(s->shared, s->map_size);
+	    free(s);
+	}
+	for (i = 0; i < nfds; i++)
+	    close(fds[i]);
+	errno = n;
+	return (NULL);
+    }
+
+    close(fds[0]);
+
+    return (s);
+}
+
+/*
+ * put one message in the ring, waiting for room if it's full
+ */
+int SendShm(SockShm *s, char *buffer, int buffer_sz)
+{
+    unsigned long long	head, need, skip;
+    unsigned int	pos, len;
+    int			n;
+
+    if (s == NULL || buffer_sz < 0 || (buffer_sz > 0 && buffer == NULL)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    need = SHM_ALIGN(sizeof(unsigned int) + (unsigned long long) buffer_sz);
+    if (need > s->ring_size / 2) {
+	errno = EMSGSIZE;
+	return (-1);
+    }
+
+    head = s->tx->head;		/* only we write it */
+    pos = head & (s->ring_size - 1);
+    skip = (pos + need > s->ring_size) ? s->ring_size - pos : 0;
+
+    while (head + skip + need - s->tx_tail_seen > s->ring_size) {
+	s->tx_tail_seen = __atomic_load_n(&s->tx->tail, __ATOMIC_ACQUIRE);
+	if (head + skip + need - s->tx_tail_seen <= s->ring_size)
+	    break;
+	if (__atomic_load_n(&s->shared->closed[1 - s->side], __ATOMIC_ACQUIRE)) {
+	    errno = EPIPE;
+	    return (-1);
+	}
+	n = waitShm(s, &s->tx->writer_waiting, &s->tx->tail, s->tx_tail_seen, -1);
+	if (n < 0)
+	    return (-1);
+    }
+
+    if (skip > 0) {
+	*(unsigned int *) (s->tx_data + pos) = SHM_WRAP;
+	head += skip;
+	pos = 0;
+    }
+
+    len = buffer_sz;
+    memcpy(s->tx_data + pos + sizeof(unsigned int), buffer, len);
+    *(unsigned int *) (s->tx_data + pos) = len;
+
+	/* publish, then see whether the reader went to sleep before it could see it */
+    __atomic_store_n(&s->tx->head, head + need, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->tx->reader_waiting, __ATOMIC_SEQ_CST))
+	wakePeer(s);
+
+    SockTrace(SOCK_TRACE_WRITE, s->sockfd, buffer_sz, buffer_sz);	/* no syscall to count, but trace it */
+    return (buffer_sz);
+}
+
+/*
+ * take one message out of the ring
+ */
+int RecvShm(SockShm *s, char *buffer, int buffer_sz, int timeout_ms)
+{
+    unsigned long long	tail;
+    unsigned int	pos, len;
+    int			n;
+
+    if (s == NULL || buffer_sz < 0 || (buffer_sz > 0 && buffer == NULL)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    tail = s->rx->tail;		/* only we write it */
+
+    for (;;) {
+	if (s->rx_head_seen == tail)
+	    s->rx_head_seen = __atomic_load_n(&s->rx->head, __ATOMIC_ACQUIRE);
+
+	if (s->rx_head_seen == tail) {
+	    if (__atomic_load_n(&s->shared->closed[1 - s->side], __ATOMIC_ACQUIRE)) {
+		s->rx_head_seen = __atomic_load_n(&s->rx->head, __ATOMIC_ACQUIRE);
+		if (s->rx_head_seen == tail) {
+		    SockTrace(SOCK_TRACE_READ, s->sockfd, buffer_sz, 0);
+		    return (0);		/* drained, and the peer has closed */
+		}
+		continue;
+	    }
+	    n = waitShm(s, &s->rx->reader_waiting, &s->rx->head, tail, timeout_ms);
+	    if (n < 0)
+		return (-1);
+	    if (n == 0) {
+		errno = ETIMEDOUT;
+		return (-1);
+	    }
+	    continue;
+	}
+
+	/* the peer can write anything in the ring, check before believing it */
+	if (s->rx_head_seen - tail > s->ring_size) {
+	    errno = EPROTO;
+	    return (-1);
+	}
+
+	pos = tail & (s->ring_size - 1);
+	len = __atomic_load_n((unsigned int *) (s->rx_data + pos), __ATOMIC_RELAXED);	/* read once */
+	if (len == SHM_WRAP) {
+	    tail += s->ring_size - pos;
+	    __atomic_store_n(&s->rx->tail, tail, __ATOMIC_SEQ_CST);
+	    if (__atomic_load_n(&s->rx->writer_waiting, __ATOMIC_SEQ_CST))
+		wakePeer(s);	/* that may be the room it was waiting for */
+	    continue;
+	}
+	break;
+    }
+
+    if ((unsigned long long) pos + sizeof(unsigned int) + len > s->ring_size ||
+	SHM_ALIGN(sizeof(unsigned int) + (unsigned long long) len) > s->rx_head_seen - tail) {
+	errno = EPROTO;		/* runs off the ring, or past what was published */
+	return (-1);
+    }
+
+    if (len > (unsigned int) buffer_sz) {
+	errno = EMSGSIZE;	/* left in the ring, try again with a bigger buffer */
+	return (-1);
+    }
+
+    memcpy(buffer, s->rx_data + pos + sizeof(unsigned int), len);
+
+    __atomic_store_n(&s->rx->tail, tail + SHM_ALIGN(sizeof(unsigned int) + len), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->rx->writer_waiting, __ATOMIC_SEQ_CST))
+	wakePeer(s);
+
+    SockTrace(SOCK_TRACE_READ, s->sockfd, buffer_sz, len);
+    return ((int) len);
+}
+
+/*
+ * tell the peer we're done (its RecvShm() returns 0 once drained) and unmap
+ */
+int CloseShm(SockShm *s)
+{
+    if (s == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    __atomic_store_n(&s->shared->closed[s->side], 1, __ATOMIC_SEQ_CST);
+    wakePeer(s);
+
+    munmap(s->shared, s->map_size);
+    close(s->my_efd);
+    close(s->peer_efd);
+    free(s);
+
+    return (0);
+}
@@ -0,0 +1,366 @@
+/*
+ * ssockstats.c
+ *
+ * Always-on statistics for the simple socket library.
+ *
+ * The library's accept, connect, read and write calls count what they do: calls,
+ * bytes, EAGAINs, short reads and writes, EOFs, errors by errno, and how long the
+ * system call took (a log2 histogram). The counters are kept per thread, in a slot
+ * of its own aligned to a cache line, and only the owning thread ever writes them,
+ * so counting is a few plain adds to memory that no other core touches: no locks,
+ * no atomic read-modify-writes, no cache line bouncing between threads.
+ *
+ * GetSockStats() adds the slots up. It reads counters other threads are updating,
+ * so a snapshot is not an instant, but every counter in it is one the thread had
+ * actually reached. ResetSockStats() doesn't clear anybody's slot (that would race
+ * with the owner), it remembers a baseline that later snapshots subtract.
+ *
+ * A thread's slot outlives the thread: its counts still belong in the totals, and
+ * the next new thread takes the slot over.
+ *
+ * Per socket there are just bytes and calls each way, plus errors and EAGAINs, in
+ * a table by fd. A connection belongs to one thread (its event loop's, its
+ * worker's), so these are single writer too, and each fd's counters have a cache
+ * line of their own: neighbouring fds are usually different workers' connections.
+ * A socket that several threads read or write at once may lose a count here and
+ * there; the per thread totals never do.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define FD_CHUNK	(4096)		/* per socket stats are allocated this many fds at a time */
+#define FD_CHUNKS	(1024)		/* so fds up to 4M */
+
+typedef struct StatSlot {
+    SockOpStats		op[SOCK_STAT_OPS];
+    long long		errnos[SOCK_STAT_ERRNOS];
+    struct StatSlot	*next;
+    int			in_use;
+} __attribute__((aligned(64))) StatSlot;
+
+static pthread_mutex_t	slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	slots_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	slot_key;
+static StatSlot		*slots = NULL;
+static SockStats	baseline;
+static int		timing = 1;
+
+static __thread StatSlot	*my_slot = NULL;
+
+typedef struct {
+    SockFdStats		s;
+} __attribute__((aligned(64))) FdSlot;
+
+static FdSlot		*fd_chunks[FD_CHUNKS];
+
+static char *op_names[SOCK_STAT_OPS] = { "accept", "connect", "read", "write" };
+
+static long long nowNs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+ * single writer: a relaxed load and store, not a locked add
+ */
+#define BUMP(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+static void slotExit(void *p)
+{
+    __atomic_store_n(&((StatSlot *) p)->in_use, 0, __ATOMIC_RELEASE);	/* free for the next thread */
+}
+
+static void slotsInit(void)
+{
+    pthread_key_create(&slot_key, slotExit);
+}
+
+/*
+ * this thread's slot: a free one if some thread has exited, else a new one
+ */
+static StatSlot *claimSlot(void)
+{
+    StatSlot	*s;
+
+    pthread_once(&slots_once, slotsInit);
+
+    pthread_mutex_lock(&slots_lock);
+    for (s = slots; s != NULL; s = s->next) {
+	if (!__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE))
+	    break;
+    }
+    if (s == NULL && posix_memalign((void **) &s, 64, sizeof(StatSlot)) == 0) {
+	memset(s, 0, sizeof(StatSlot));
+	s->next = slots;
+	slots = s;
+    }
+    if (s != NULL)
+	s->in_use = 1;
+    pthread_mutex_unlock(&slots_lock);
+
+    if (s != NULL)
+	pthread_setspecific(slot_key, s);
+
+    return (s);
+}
+
+/*
+ * the per socket stats for fd, allocated if need be (never freed)
+ */
+static SockFdStats *fdStats(int fd, int create)
+{
+    FdSlot	*chunk, *expected = NULL;
+    int		c = fd / FD_CHUNK;
+
+    if (fd < 0 || c >= FD_CHUNKS)
+	return (NULL);
+
+    chunk = __atomic_load_n(&fd_chunks[c], __ATOMIC_ACQUIRE);
+    if (chunk == NULL && create) {
+	if (posix_memalign((void **) &chunk, 64, FD_CHUNK * sizeof(FdSlot)) != 0)
+	    return (NULL);
+	memset(chunk, 0, FD_CHUNK * sizeof(FdSlot));
+	if (!__atomic_compare_exchange_n(&fd_chunks[c], &expected, chunk, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    free(chunk);		/* another thread got there first */
+	    chunk = expected;
+	}
+    }
+
+    return ((chunk != NULL) ? &chunk[fd % FD_CHUNK].s : NULL);
+}
+
+/*
+ * called before a system call: when it started, if calls are being timed
+ */
+long long SockStatStart(void)
+{
+    return (__atomic_load_n(&timing, __ATOMIC_RELAXED) ? nowNs() : 0);
+}
+
+/*
+ * called after: op on fd, asked for asked bytes, got result (errno set if < 0)
+ */
+void SockStatEnd(int op, int fd, long long asked, long long result, long long start)
+{
+    StatSlot	*s = my_slot;
+    SockOpStats	*o;
+    SockFdStats	*f;
+    long long	ns, now = 0;
+    int		err = errno, b;
+
+    if (op < 0 || op >= SOCK_STAT_OPS)
+	return;
+
+    if (start != 0)
+	now = nowNs();
+    if (SockTraceOn())			/* the trace gets the call too, see ssocktrace.c */
+	SockTraceAt(SOCK_TRACE_ACCEPT + op, fd, asked, result, now);
+
+    if (s == NULL && (s = my_slot = claimSlot()) == NULL) {
+	errno = err;
+	return;			/* out of memory, go uncounted */
+    }
+    o = &s->op[op];
+
+    BUMP(o->calls, 1);
+    if (result < 0 && (err == EAGAIN || err == EWOULDBLOCK)) {
+	BUMP(o->eagain, 1);
+    } else if (result < 0) {
+	BUMP(o->errors, 1);
+	BUMP(s->errnos[(err > 0 && err < SOCK_STAT_ERRNOS) ? err : 0], 1);
+    } else if (op == SOCK_STAT_READ || op == SOCK_STAT_WRITE) {
+	BUMP(o->bytes, result);
+	if (result == 0 && op == SOCK_STAT_READ)
+	    BUMP(o->eof, 1);
+	else if (result < asked)
+	    BUMP(o->partial, 1);
+    }
+
+    if (start != 0) {
+	ns = now - start;
+	b = (ns > 0) ? 63 - __builtin_clzll(ns) : 0;
+	BUMP(o->ns, ns);
+	BUMP(o->latency[(b < SOCK_STAT_BUCKETS) ? b : SOCK_STAT_BUCKETS - 1], 1);
+    }
+
+	/* per socket: written by the thread that owns the connection, no locked adds */
+    if (op == SOCK_STAT_ACCEPT && result >= 0 && (f = fdStats((int) result, 0)) != NULL) {
+	memset(f, 0, sizeof(*f));	/* a new connection on a recycled fd number */
+    } else if ((op == SOCK_STAT_READ || op == SOCK_STAT_WRITE) && (f = fdStats(fd, 1)) != NULL) {
+	if (result < 0 && (err == EAGAIN || err == EWOULDBLOCK))
+	    BUMP(f->eagain, 1);
+	else if (result < 0)
+	    BUMP(f->errors, 1);
+	else if (op == SOCK_STAT_READ) {
+	    BUMP(f->rx_calls, 1);
+	    BUMP(f->rx_bytes, result);
+	} else {
+	    BUMP(f->tx_calls, 1);
+	    BUMP(f->tx_bytes, result);
+	}
+    }
+
+    errno = err;
+}
+
+/*
+ * add up every slot (the caller holds slots_lock)
+ */
+static void sumSlots(SockStats *st)
+{
+    StatSlot	*s;
+    long long	*dst, *src;
+    int		i, j;
+
+    memset(st, 0, sizeof(*st));
+
+    for (s = slots; s != NULL; s = s->next) {
+	for (i = 0; i < SOCK_STAT_OPS; i++) {
+	    dst = (long long *) &st->op[i];
+	    src = (long long *) &s->op[i];
+	    for (j = 0; j < (int) (sizeof(SockOpStats) / sizeof(long long)); j++)
+		dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < SOCK_STAT_ERRNOS; i++)
+	    st->errnos[i] += __atomic_load_n(&s->errnos[i], __ATOMIC_RELAXED);
+	st->threads += __atomic_load_n(&s->in_use, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * everything counted since the last ResetSockStats()
+ */
+int GetSockStats(SockStats *st)
+{
+    long long	*dst, *base;
+    int		i, threads;
+
+    if (st == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    pthread_mutex_lock(&slots_lock);
+    sumSlots(st);
+    threads = st->threads;
+
+    dst = (long long *) st->op;
+    base = (long long *) baseline.op;
+    for (i = 0; i < (int) (sizeof(st->op) / (sizeof(long long))); i++)
+	dst[i] -= base[i];
+    for (i = 0; i < SOCK_STAT_ERRNOS; i++)
+	st->errnos[i] -= baseline.errnos[i];
+    pthread_mutex_unlock(&slots_lock);
+
+    st->threads = threads;
+    st->when_ns = nowNs();
+
+    return (0);
+}
+
+void ResetSockStats(void)
+{
+    pthread_mutex_lock(&slots_lock);
+    sumSlots(&baseline);
+    pthread_mutex_unlock(&slots_lock);
+}
+
+/*
+ * time the system calls (1, the default) or just count them (0)
+ */
+void SetSockStatsTiming(int on)
+{
+    __atomic_store_n(&timing, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * the time (ns) percentile (0..100) of op's timed calls took at most,
+ * to within a factor of 2
+ */
+long long SockStatPercentile(SockOpStats *op, double percentile)
+{
+    long long	total = 0, want, seen = 0;
+    int		i;
+
+    if (op == NULL)
+	return (0);
+
+    for (i = 0; i < SOCK_STAT_BUCKETS; i++)
+	total += op->latency[i];
+    if (total == 0)
+	return (0);
+
+    want = (long long) (percentile / 100.0 * total + 0.5);
+    if (want < 1)
+	want = 1;
+
+    for (i = 0; i < SOCK_STAT_BUCKETS; i++) {
+	seen += op->latency[i];
+	if (seen >= want)
+	    break;
+    }
+
+    return ((2LL << ((i < SOCK_STAT_BUCKETS) ? i : SOCK_STAT_BUCKETS - 1)) - 1);
+}
+
+char *SockStatName(int op)
+{
+    return ((op >= 0 && op < SOCK_STAT_OPS) ? op_names[op] : "unknown");
+}
+
+/*
+ * one socket's counters since it was accepted (or its fd last closed)
+ */
+int GetSocketStats(int sockfd, SockFdStats *fs)
+{
+    SockFdStats	*f;
+
+    if (fs == NULL || sockfd < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    f = fdStats(sockfd, 0);
+    if (f == NULL) {
+	memset(fs, 0, sizeof(*fs));
+	return (0);
+    }
+
+    fs->rx_calls = __atomic_load_n(&f->rx_calls, __ATOMIC_RELAXED);
+    fs->rx_bytes = __atomic_load_n(&f->rx_bytes, __ATOMIC_RELAXED);
+    fs->tx_calls = __atomic_load_n(&f->tx_calls, __ATOMIC_RELAXED);
+    fs->tx_bytes = __atomic_load_n(&f->tx_bytes, __ATOMIC_RELAXED);
+    fs->errors = __atomic_load_n(&f->errors, __ATOMIC_RELAXED);
+    fs->eagain = __atomic_load_n(&f->eagain, __ATOMIC_RELAXED);
+
+    return (0);
+}
+
+/*
+ * CloseSocket() clears the fd's counters, its number will be reused
+ */
+void ForgetSocketStats(int sockfd)
+{
+    SockFdStats	*f = fdStats(sockfd, 0);
+
+    if (f != NULL)
+	memset(f, 0, sizeof(*f));
+}
@@ -0,0 +1,485 @@
+/*
+ * ssocktimer.c
+ *
+ * Timers and deadlines for the simple socket library.
+ *
+ * A server with many connections needs a timer per connection (idle timeout) and
+ * often per operation (a read or write deadline), and nearly all of them are
+ * cancelled or pushed back before they go off. A sorted list or a heap makes each
+ * of those O(log n) or worse, so timers live in a hierarchical timing wheel:
+ *
+ *	- 4 levels of 256 slots; a timer goes into the slot of its expiry tick on
+ *	  level 0 if that is less than 256 ticks away, otherwise into a coarser
+ *	  level, and moves down ("cascades") as its time gets closer,
+ *	- each slot is a doubly linked list of timers the caller owns (SockTimer,
+ *	  usually a member of the caller's connection struct), so arming and
+ *	  cancelling are a couple of pointer writes: no search, no allocation,
+ *	- 4 x 256 slots of ticks cover 2^32 ticks, 49 days with 1ms ticks.
+ *
+ * The event loop (ssockevent.c) has a wheel of its own for idle timeouts.
+ *
+ * For blocking sockets there are per-operation deadlines as well: the kernel's own
+ * SO_RCVTIMEO/SO_SNDTIMEO (SetSocketTimeouts()), which the single read and write
+ * calls then honour, and ReadTimeoutSocket()/WriteFullTimeoutSocket() which poll()
+ * up to a deadline and fail with ETIMEDOUT.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define WHEEL_BITS	(8)
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	(4)
+#define WHEEL_SPAN	((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)	/* farthest a timer can be placed */
+
+struct SockTimerWheel {
+    unsigned long long	now;		/* the next tick to run */
+    long long		start_ns;	/* CLOCK_MONOTONIC of tick 0 */
+    int			tick_ms;
+    int			count;		/* timers armed */
+    SockTimer		slots[WHEEL_LEVELS][WHEEL_SLOTS];	/* list heads */
+};
+
+static long long nowNs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+ * the tick it is now, by the clock (the wheel may not have run up to it yet)
+ */
+static unsigned long long clockTick(SockTimerWheel *w)
+{
+    return ((unsigned long long) (nowNs() - w->start_ns) / (w->tick_ms * 1000000ULL));
+}
+
+static void listInit(SockTimer *head)
+{
+    head->next = head->prev = head;
+}
+
+static void listAdd(SockTimer *head, SockTimer *t)
+{
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void listDel(SockTimer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * put t in the slot for its expiry, relative to the tick the wheel is at
+ */
+static void place(SockTimerWheel *w, SockTimer *t)
+{
+    unsigned long long	expires = t->expires, delta;
+    int			level;
+
+    if (expires < w->now)
+	expires = w->now;	/* overdue: the next tick run */
+    delta = expires - w->now;
+    if (delta > WHEEL_SPAN) {
+	expires = w->now + WHEEL_SPAN;	/* parked at the far end, placed again when it cascades */
+	delta = WHEEL_SPAN;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+	if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+	    break;
+    }
+
+    listAdd(&w->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+    t->wheel = w;
+}
+
+/*
+ * move everything in one slot of level down to where it now belongs,
+ * returns the slot's index (0: time to cascade the next level too)
+ */
+static int cascade(SockTimerWheel *w, int level)
+{
+    SockTimer	list, *t;
+    int		index = (int) ((w->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    SockTimer	*head = &w->slots[level][index];
+
+    if (head->next == head)
+	return (index);
+
+	/* detach the slot first, place() may put a timer straight back into it */
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    listInit(head);
+
+    while ((t = list.next) != &list) {
+	listDel(t);
+	place(w, t);
+    }
+
+    return (index);
+}
+
+SockTimerWheel *CreateTimerWheel(int tick_ms)
+{
+    SockTimerWheel	*w;
+    int			i, j;
+
+    if (tick_ms < 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    w = malloc(sizeof(SockTimerWheel));
+    if (w == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    w->now = 0;
+    w->start_ns = nowNs();
+    w->tick_ms = (tick_ms > 0) ? tick_ms : 1;
+    w->count = 0;
+    for (i = 0; i < WHEEL_LEVELS; i++) {
+	for (j = 0; j < WHEEL_SLOTS; j++)
+	    listInit(&w->slots[i][j]);
+    }
+
+    return (w);
+}
+
+/*
+ * free the wheel, timers still armed on it are forgotten (not called)
+ */
+int CloseTimerWheel(SockTimerWheel *w)
+{
+    SockTimer	*head;
+    int		i, j;
+
+    if (w == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < WHEEL_LEVELS; i++) {
+	for (j = 0; j < WHEEL_SLOTS; j++) {
+	    head = &w->slots[i][j];
+	    while (head->next != head)
+		listDel(head->next);
+	}
+    }
+    free(w);
+
+    return (0);
+}
+
+void InitTimer(SockTimer *t, SockTimerFunc fn, void *arg)
+{
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/*
+ * (re)arm t to go off in ms, rounded up to a whole tick
+ */
+int ArmTimer(SockTimerWheel *w, SockTimer *t, int ms)
+{
+    if (w == NULL || t == NULL || t->fn == NULL || ms < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (t->next != NULL)
+	listDel(t);
+    else
+	w->count++;
+
+    t->expires = clockTick(w) + (ms + w->tick_ms - 1) / w->tick_ms;
+    place(w, t);
+
+    return (0);
+}
+
+void CancelTimer(SockTimer *t)
+{
+    if (t == NULL || t->next == NULL)
+	return;
+
+    listDel(t);
+    t->wheel->count--;
+}
+
+int TimerArmed(SockTimer *t)
+{
+    return (t != NULL && t->next != NULL);
+}
+
+/*
+ * run the wheel up to now: call every timer that is due, returns how many
+ */
+int RunTimerWheel(SockTimerWheel *w)
+{
+    SockTimer		list, *t, *head;
+    unsigned long long	tick;
+    int			fired = 0, level;
+
+    if (w == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    tick = clockTick(w);
+    if (w->count == 0) {
+	w->now = tick + 1;	/* nothing to run, just catch up */
+	return (0);
+    }
+
+    while (w->now <= tick) {
+	/* at the start of every lap of a level, bring the next level's slot down */
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+	    if (((w->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0 || cascade(w, level) != 0)
+		break;
+	}
+
+	head = &w->slots[0][w->now & WHEEL_MASK];
+	w->now++;	/* a timer re-armed from its callback lands in a later slot */
+	if (head->next == head)
+	    continue;
+
+	list.next = head->next;
+	list.prev = head->prev;
+	list.next->prev = &list;
+	list.prev->next = &list;
+	listInit(head);
+
+	while ((t = list.next) != &list) {
+	    listDel(t);
+	    w->count--;
+	    fired++;
+	    (*t->fn)(t, t->arg);	/* may free t, or arm it (or others) again */
+	}
+    }
+
+    return (fired);
+}
+
+/*
+ * ms until RunTimerWheel() may have something to do: exact within level 0's
+ * 256 ticks, after that the next cascade; -1 if nothing is armed
+ */
+int NextTimerWheel(SockTimerWheel *w)
+{
+    unsigned long long	tick, next;
+    int			i;
+
+    if (w == NULL || w->count == 0)
+	return (-1);
+
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+	next = w->now + i;
+	if ((next & WHEEL_MASK) == 0)
+	    break;		/* a cascade is due here */
+	if (w->slots[0][next & WHEEL_MASK].next != &w->slots[0][next & WHEEL_MASK])
+	    break;
+    }
+    next = w->now + i;
+
+    tick = clockTick(w);
+    if (next <= tick)
+	return (0);
+
+    return ((int) ((next - tick) * w->tick_ms));
+}
+
+/*
+ * ms since the wheel was created (by the wheel's clock, in whole ticks)
+ */
+long long TimerWheelNow(SockTimerWheel *w)
+{
+    return ((w != NULL) ? (long long) clockTick(w) * w->tick_ms : 0);
+}
+
+/*
+ * kernel enforced per-call deadlines on a blocking socket, 0 means none
+ */
+int SetSocketTimeouts(int sockfd, int read_ms, int write_ms)
+{
+    struct timeval	tv;
+
+    if (read_ms < 0 || write_ms < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    tv.tv_sec = read_ms / 1000;
+    tv.tv_usec = (read_ms % 1000) * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+	return (-1);
+
+    tv.tv_sec = write_ms / 1000;
+    tv.tv_usec = (write_ms % 1000) * 1000;
+
+    return (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)));
+}
+
+/*
+ * wait for sockfd until deadline_ns: 1 ready, 0 timed out, -1 error
+ */
+static int waitUntil(int sockfd, short events, long long deadline_ns)
+{
+    struct pollfd	pfd;
+    long long		left;
+    int			n;
+
+    for (;;) {
+	left = deadline_ns - nowNs();
+	if (left <= 0)
+	    return (0);
+
+	pfd.fd = sockfd;
+	pfd.events = events;
+	pfd.revents = 0;
+	n = poll(&pfd, 1, (int) ((left + 999999) / 1000000));
+	if (n < 0 && errno == EINTR)
+	    continue;
+
+	return (n);
+    }
+}
+
+/*
+ * wait out an EAGAIN on sockfd, no longer than its SO_RCVTIMEO (POLLIN) or
+ * SO_SNDTIMEO (POLLOUT) if it has one: 0 ready, -1 with ETIMEDOUT if that passed
+ */
+int WaitSocket(int sockfd, short events)
+{
+    struct pollfd	pfd;
+    struct timeval	tv;
+    socklen_t		len = sizeof(tv);
+    long long		ms = -1;
+    int			flags, n;
+
+    memset(&tv, 0, sizeof(tv));
+    if (getsockopt(sockfd, SOL_SOCKET, (events & POLLIN) ? SO_RCVTIMEO : SO_SNDTIMEO, &tv, &len) == 0 &&
+	(tv.tv_sec > 0 || tv.tv_usec > 0)) {
+	    /* a blocking socket only says EAGAIN once the kernel has waited that long */
+	flags = fcntl(sockfd, F_GETFL, 0);
+	if (flags >= 0 && (flags & O_NONBLOCK) == 0) {
+	    errno = ETIMEDOUT;
+	    return (-1);
+	}
+	ms = tv.tv_sec * 1000LL + (tv.tv_usec + 999) / 1000;
+    }
+
+    if (ms >= 0)
+	n = waitUntil(sockfd, events, nowNs() + ms * 1000000LL);
+    else {
+	pfd.fd = sockfd;
+	pfd.events = events;
+	do {
+	    n = poll(&pfd, 1, -1);
+	} while (n < 0 && errno == EINTR);
+    }
+    if (n < 0)
+	return (-1);
+    if (n == 0) {
+	errno = ETIMEDOUT;
+	return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * read whatever comes first, like ReadSocket(), but give up after timeout_ms
+ */
+int ReadTimeoutSocket(int sockfd, char *buffer, int buffer_sz, int timeout_ms)
+{
+    long long	deadline = nowNs() + timeout_ms * 1000000LL, start;
+    int		n;
+
+    if (buffer == NULL || buffer_sz < 0 || timeout_ms < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (;;) {
+	start = SockStatStart();
+	n = recv(sockfd, buffer, buffer_sz, MSG_DONTWAIT);
+	SockStatEnd(SOCK_STAT_READ, sockfd, buffer_sz, n, start);
+	if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+	    return (n);
+
+	n = waitUntil(sockfd, POLLIN, deadline);
+	if (n < 0)
+	    return (-1);
+	if (n == 0) {
+	    errno = ETIMEDOUT;
+	    return (-1);
+	}
+    }
+}
+
+/*
+ * write all of buffer, like WriteFullSocket(), but give up after timeout_ms
+ * (some of it may have been sent by then)
+ */
+int WriteFullTimeoutSocket(int sockfd, char *buffer, int buffer_sz, int timeout_ms)
+{
+    long long	deadline = nowNs() + timeout_ms * 1000000LL, start;
+    int		n, done = 0;
+
+    if ((buffer == NULL && buffer_sz > 0) || buffer_sz < 0 || timeout_ms < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    while (done < buffer_sz) {
+	start = SockStatStart();
+	n = send(sockfd, buffer + done, buffer_sz - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+	SockStatEnd(SOCK_STAT_WRITE, sockfd, buffer_sz - done, n, start);
+	if (n >= 0) {
+	    done += n;
+	    continue;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    return (-1);
+
+	n = waitUntil(sockfd, POLLOUT, deadline);
+	if (n < 0)
+	    return (-1);
+	if (n == 0) {
+	    errno = ETIMEDOUT;
+	    return (-1);
+	}
+    }
+
+    return (done);
+}
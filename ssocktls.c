@@ -0,0 +1,503 @@
+/*
+ * ssocktls.c
+ *
+ * TLS for the simple socket library, with the encryption done by the kernel.
+ *
+ * A TLS library normally encrypts in user space: every byte sent is copied into
+ * its buffer, encrypted there and written, so sendfile() and the other zero-copy
+ * paths are lost, and a core spends as much time on the crypto as on the rest.
+ * Linux can do the record layer itself (kTLS, the "tls" TCP_ULP): the handshake
+ * still runs in OpenSSL, which then hands the session keys to the socket, and
+ * from then on write(), send() and sendfile() on that socket put out TLS records,
+ * and read() takes them in, decrypted by the kernel (or the NIC, if it can).
+ *
+ * So after StartTlsSocket():
+ *
+ *	- with the send side in the kernel (TlsOffload() & SOCK_TLS_KERNEL_SEND),
+ *	  WriteSocket(), SendSocket(), WritevSocket() and SendFileSocket() work on
+ *	  the socket as they are, encrypted, and SendFileTls() is SendFileSocket(),
+ *	- without it (no "tls" module, a cipher the kernel doesn't do) everything
+ *	  has to go through WriteTls() and SendFileTls(), which then encrypt in
+ *	  user space: slower, but the same bytes on the wire,
+ *	- reads go through ReadTls() either way; OpenSSL reads straight from the
+ *	  kernel when the receive side is offloaded too, and deals with the records
+ *	  that aren't data (alerts, TLS 1.3 key updates) that a plain read() can't.
+ *
+ * Servers send no TLS 1.3 session tickets, so a client's kernel receive side isn't
+ * handed a handshake record right after the handshake.
+ *
+ * Built on OpenSSL 3 (-DHAVE_OPENSSL, see the Makefile). Without it every call fails
+ * with ENOTSUP.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "ssocklib.h"
+
+#ifdef HAVE_OPENSSL
+
+#define TLS_CHUNK	(16 * 1024)	/* one full TLS record of file data per SSL_write() */
+
+struct SockTlsContext {
+    SSL_CTX	*ctx;
+    int		server;
+};
+
+struct SockTls {
+    SSL		*ssl;
+    int		sockfd;
+    int		offload;	/* SOCK_TLS_KERNEL_SEND | SOCK_TLS_KERNEL_RECV */
+};
+
+static long long nowMs(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * turn an OpenSSL failure into what a socket call would have said: 0 at the end of
+ * the connection, otherwise -1 and errno
+ */
+static int tlsError(SSL *ssl, int r)
+{
+    int	save = errno;
+
+    switch (SSL_get_error(ssl, r)) {
+	case SSL_ERROR_ZERO_RETURN:
+	    return (0);		/* close_notify, or (IGNORE_UNEXPECTED_EOF) a plain FIN */
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    errno = EAGAIN;	/* non-blocking socket, try again when it is ready */
+	    break;
+	case SSL_ERROR_SYSCALL:
+	    errno = (save != 0) ? save : ECONNRESET;
+	    break;
+	default:
+#ifdef DEBUG
+	    ERR_print_errors_fp(stderr);
+#endif
+	    errno = EPROTO;	/* bad record, failed verification, ... */
+	    break;
+    }
+    ERR_clear_error();
+
+    return (-1);
+}
+
+static SockTlsContext *createContext(int server)
+{
+    SockTlsContext	*c;
+
+    c = calloc(1, sizeof(SockTlsContext));
+    if (c == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    c->server = server;
+    c->ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if (c->ctx == NULL) {
+	free(c);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    SSL_CTX_set_min_proto_version(c->ctx, TLS1_2_VERSION);	/* what kTLS does */
+    SSL_CTX_set_options(c->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(c->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    return (c);
+}
+
+/*
+ * a server's certificate and key (PEM); key_file NULL if it is in cert_file too
+ */
+SockTlsContext *CreateTlsServerContext(char *cert_file, char *key_file)
+{
+    SockTlsContext	*c;
+
+    if (cert_file == NULL) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    c = createContext(1);
+    if (c == NULL)
+	return (NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(c->ctx, cert_file) != 1 ||
+	SSL_CTX_use_PrivateKey_file(c->ctx, (key_file != NULL) ? key_file : cert_file,
+				    SSL_FILETYPE_PEM) != 1 ||
+	SSL_CTX_check_private_key(c->ctx) != 1) {
+#ifdef DEBUG
+	ERR_print_errors_fp(stderr);
+#endif
+	ERR_clear_error();
+	CloseTlsContext(c);
+	errno = ENOENT;
+	return (NULL);
+    }
+
+    SSL_CTX_set_num_tickets(c->ctx, 0);	/* see the comment at the top */
+
+    return (c);
+}
+
+/*
+ * a client's trusted certificates (PEM), NULL to take any server (testing only)
+ */
+SockTlsContext *CreateTlsClientContext(char *ca_file)
+{
+    SockTlsContext	*c;
+
+    c = createContext(0);
+    if (c == NULL)
+	return (NULL);
+
+    if (ca_file != NULL) {
+	if (SSL_CTX_load_verify_locations(c->ctx, ca_file, NULL) != 1) {
+	    ERR_clear_error();
+	    CloseTlsContext(c);
+	    errno = ENOENT;
+	    return (NULL);
+	}
+	SSL_CTX_set_verify(c->ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    return (c);
+}
+
+/*
+ * on by default; off to compare against user space encryption
+ */
+int SetTlsKernelOffload(SockTlsContext *c, int on)
+{
+    if (c == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (on)
+	SSL_CTX_set_options(c->ctx, SSL_OP_ENABLE_KTLS);
+    else
+	SSL_CTX_clear_options(c->ctx, SSL_OP_ENABLE_KTLS);
+
+    return (0);
+}
+
+int CloseTlsContext(SockTlsContext *c)
+{
+    if (c == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    SSL_CTX_free(c->ctx);
+    free(c);
+
+    return (0);
+}
+
+/*
+ * run the handshake on a connected socket, up to timeout_ms (-1: no limit)
+ */
+SockTls *StartTlsSocket(SockTlsContext *c, int sockfd, char *host_name, int timeout_ms)
+{
+    struct pollfd	pfd;
+    struct in6_addr	addr;
+    SockTls		*t;
+    long long		deadline;
+    int			flags, r, wait_ms, save;
+
+    if (c == NULL || sockfd < 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    t = calloc(1, sizeof(SockTls));
+    if (t == NULL || (t->ssl = SSL_new(c->ctx)) == NULL) {
+	free(t);
+	errno = ENOMEM;
+	return (NULL);
+    }
+    t->sockfd = sockfd;
+
+    if (SSL_set_fd(t->ssl, sockfd) != 1)
+	goto fail;
+
+    if (c->server) {
+	SSL_set_accept_state(t->ssl);
+    } else {
+	SSL_set_connect_state(t->ssl);
+	if (host_name != NULL) {
+	    /* the server's certificate must be for this name (or address) */
+	    if (inet_pton(AF_INET, host_name, &addr) == 1 || inet_pton(AF_INET6, host_name, &addr) == 1) {
+		if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(t->ssl), host_name) != 1)
+		    goto fail;
+	    } else if (SSL_set_tlsext_host_name(t->ssl, host_name) != 1 ||
+		       SSL_set1_host(t->ssl, host_name) != 1) {
+		goto fail;
+	    }
+	}
+    }
+
+	/* non-blocking for the handshake, so the deadline holds */
+    flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || ((flags & O_NONBLOCK) == 0 && fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0))
+	goto fail;
+
+    deadline = (timeout_ms >= 0) ? nowMs() + timeout_ms : 0;
+    while ((errno = 0, r = SSL_do_handshake(t->ssl)) != 1) {
+	if (tlsError(t->ssl, r) == 0)
+	    errno = ECONNRESET;	/* hung up in the middle of it */
+	if (errno != EAGAIN)
+	    break;
+
+	wait_ms = (timeout_ms >= 0) ? (int) (deadline - nowMs()) : -1;
+	if (timeout_ms >= 0 && wait_ms <= 0) {
+	    errno = ETIMEDOUT;
+	    break;
+	}
+	pfd.fd = sockfd;
+	pfd.events = SSL_want_write(t->ssl) ? POLLOUT : POLLIN;
+	if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+	    break;
+    }
+
+    save = errno;
+    if ((flags & O_NONBLOCK) == 0)
+	(void) fcntl(sockfd, F_SETFL, flags);
+    errno = save;
+    if (r != 1)
+	goto fail;
+
+	/* what OpenSSL managed to hand to the kernel */
+    if (BIO_get_ktls_send(SSL_get_wbio(t->ssl)))
+	t->offload |= SOCK_TLS_KERNEL_SEND;
+    if (BIO_get_ktls_recv(SSL_get_rbio(t->ssl)))
+	t->offload |= SOCK_TLS_KERNEL_RECV;
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : StartTlsSocket(%d) %s %s, kernel send %s, receive %s\n",__FILE__,sockfd,
+	    SSL_get_version(t->ssl),SSL_get_cipher_name(t->ssl),
+	    (t->offload & SOCK_TLS_KERNEL_SEND) ? "on" : "off",(t->offload & SOCK_TLS_KERNEL_RECV) ? "on" : "off");
+#endif
+
+    return (t);
+
+fail:
+    save = errno;
+    SSL_free(t->ssl);
+    free(t);
+    errno = (save != 0) ? save : EPROTO;
+
+    return (NULL);
+}
+
+int TlsOffload(SockTls *t)
+{
+    return ((t != NULL) ? t->offload : 0);
+}
+
+int ReadTls(SockTls *t, char *buffer, int buffer_sz)
+{
+    long long	start;
+    int		n;
+
+    if (t == NULL || buffer == NULL || buffer_sz < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    start = SockStatStart();
+    errno = 0;
+    n = SSL_read(t->ssl, buffer, buffer_sz);
+    if (n <= 0)
+	n = tlsError(t->ssl, n);
+    SockStatEnd(SOCK_STAT_READ, t->sockfd, buffer_sz, n, start);
+
+    return (n);
+}
+
+/*
+ * all of buffer on a blocking socket; non-blocking, -1 EAGAIN means call again
+ * with the same buffer_sz once the socket is writable
+ */
+int WriteTls(SockTls *t, char *buffer, int buffer_sz)
+{
+    long long	start;
+    int		n;
+
+    if (t == NULL || buffer == NULL || buffer_sz < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (buffer_sz == 0)
+	return (0);
+
+    start = SockStatStart();
+    errno = 0;
+    n = SSL_write(t->ssl, buffer, buffer_sz);
+    if (n <= 0 && tlsError(t->ssl, n) == 0) {
+	errno = EPIPE;
+	n = -1;
+    } else if (n <= 0) {
+	n = -1;
+    }
+    SockStatEnd(SOCK_STAT_WRITE, t->sockfd, buffer_sz, n, start);
+
+    return (n);
+}
+
+/*
+ * like SendFileSocket(), encrypted: zero-copy when the kernel does the records,
+ * read and encrypted here a record at a time when it doesn't
+ */
+long long SendFileTls(SockTls *t, int fd, long long *offset, long long count)
+{
+    char	buffer[TLS_CHUNK];
+    long long	done = 0;
+    off_t	off;
+    ssize_t	n = 0;
+
+    if (t == NULL || fd < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (t->offload & SOCK_TLS_KERNEL_SEND)
+	return (SendFileSocket(t->sockfd, fd, offset, count));
+
+    off = (offset != NULL) ? (off_t) *offset : lseek(fd, 0, SEEK_CUR);
+
+    while (count < 0 || done < count) {
+	n = (count < 0 || count - done > TLS_CHUNK) ? TLS_CHUNK : (ssize_t) (count - done);
+	n = (off >= 0) ? pread(fd, buffer, n, off) : read(fd, buffer, n);	/* a pipe has no offset */
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;	/* the end of the file (or a read error, reported below) */
+
+	if (WriteTls(t, buffer, (int) n) < 0) {
+	    n = -1;
+	    break;
+	}
+	done += n;
+	if (off >= 0)
+	    off += n;
+    }
+
+	/* report how far we got (even on error) so the caller can resume */
+    if (offset != NULL)
+	*offset = off;
+    else if (off >= 0)
+	lseek(fd, off, SEEK_SET);
+
+    return ((n < 0 && done == 0) ? -1 : done);
+}
+
+/*
+ * tell the peer we are done (close_notify, not waiting for its answer) and free
+ * the session; the socket is left open
+ */
+int CloseTls(SockTls *t)
+{
+    if (t == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    (void) SSL_shutdown(t->ssl);
+    ERR_clear_error();
+    SSL_free(t->ssl);
+    free(t);
+
+    return (0);
+}
+
+#else	/* !HAVE_OPENSSL */
+
+SockTlsContext *CreateTlsServerContext(char *cert_file, char *key_file)
+{
+    errno = ENOTSUP;
+    return (NULL);
+}
+
+SockTlsContext *CreateTlsClientContext(char *ca_file)
+{
+    errno = ENOTSUP;
+    return (NULL);
+}
+
+int SetTlsKernelOffload(SockTlsContext *c, int on)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+int CloseTlsContext(SockTlsContext *c)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+SockTls *StartTlsSocket(SockTlsContext *c, int sockfd, char *host_name, int timeout_ms)
+{
+    errno = ENOTSUP;
+    return (NULL);
+}
+
+int TlsOffload(SockTls *t)
+{
+    return (0);
+}
+
+int ReadTls(SockTls *t, char *buffer, int buffer_sz)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+int WriteTls(SockTls *t, char *buffer, int buffer_sz)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+long long SendFileTls(SockTls *t, int fd, long long *offset, long long count)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+int CloseTls(SockTls *t)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+#endif	/* HAVE_OPENSSL */
@@ -0,0 +1,294 @@
+/*
+ * ssocktrace.c
+ *
+ * Binary event tracing for the simple socket library.
+ *
+ * The DEBUG fprintf()s this library used to have were useless just where tracing
+ * is needed most: every line is formatted and written synchronously, all threads
+ * queue up on stdio's lock, and the timing changes so much that races go away
+ * while it is on. So instead each thread records small fixed-size binary events
+ * (time, fd, operation, size, result, errno) into a ring of its own:
+ *
+ *	- only the owning thread writes its ring, so no locks and no atomics beyond
+ *	  publishing the new head,
+ *	- an event is 32 bytes stored, no formatting; when tracing is off the cost
+ *	  is one load and a branch,
+ *	- a ring keeps the last events (64K by default) and overwrites the oldest.
+ *
+ * DumpSockTrace() writes every ring to a file, using nothing but open()/write(),
+ * so it can be called from a signal handler (a server can dump itself on a
+ * signal while it keeps running). ssock_tracedump decodes one or more dumps and
+ * merges the threads into one timeline.
+ *
+ * Setting SSOCK_TRACE=file in the environment turns tracing on from the start
+ * and dumps to file when the program exits.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#define _GNU_SOURCE	/* syscall(SYS_gettid) */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "ssocklib.h"
+
+#define TRACE_EVENTS	(65536)		/* per thread, a power of 2 */
+
+typedef struct TraceRing {
+    unsigned long long	head;		/* events ever recorded; the owner publishes it */
+    int			tid;
+    int			in_use;
+    int			size;		/* a power of 2 */
+    struct TraceRing	*next;
+    SockTraceEvent	*events;
+} TraceRing;
+
+static pthread_mutex_t	rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	rings_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	ring_key;
+static TraceRing	*rings = NULL;		/* only ever pushed on the front */
+static int		ring_size = TRACE_EVENTS;
+static int		tracing = 0;
+static char		exit_path[256];
+
+static __thread TraceRing	*my_ring = NULL;
+
+static void ringExit(void *p)
+{
+    __atomic_store_n(&((TraceRing *) p)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void ringsInit(void)
+{
+    pthread_key_create(&ring_key, ringExit);
+}
+
+/*
+ * this thread's ring: one a finished thread left behind, or a new one
+ */
+static TraceRing *claimRing(void)
+{
+    TraceRing	*r;
+
+    pthread_once(&rings_once, ringsInit);
+
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r != NULL; r = r->next) {
+	if (!__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE))
+	    break;
+    }
+    if (r == NULL && (r = calloc(1, sizeof(TraceRing))) != NULL) {
+	r->size = ring_size;
+	r->events = malloc(r->size * sizeof(SockTraceEvent));
+	if (r->events == NULL) {
+	    free(r);
+	    r = NULL;
+	} else {
+	    r->next = rings;
+	    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);	/* DumpSockTrace() walks without the lock */
+	}
+    }
+    if (r != NULL) {
+	r->tid = (int) syscall(SYS_gettid);
+	__atomic_store_n(&r->head, 0, __ATOMIC_RELEASE);	/* the last owner's events are gone */
+	r->in_use = 1;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (r != NULL)
+	pthread_setspecific(ring_key, r);
+
+    return (r);
+}
+
+/*
+ * record an event (with the current errno if result < 0), ns 0 means now
+ */
+void SockTraceAt(int op, int fd, long long size, long long result, long long ns)
+{
+    TraceRing		*r = my_ring;
+    SockTraceEvent	*e;
+    struct timespec	ts;
+    int			err = errno;
+
+    if (r == NULL && (r = my_ring = claimRing()) == NULL) {
+	errno = err;
+	return;
+    }
+
+    if (ns == 0) {
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    e = &r->events[r->head & (r->size - 1)];
+    e->ns = ns;
+    e->fd = fd;
+    e->op = (unsigned short) op;
+    e->err = (result < 0) ? (unsigned short) err : 0;
+    e->size = size;
+    e->result = result;
+
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+    errno = err;
+}
+
+void SockTrace(int op, int fd, long long size, long long result)
+{
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+	SockTraceAt(op, fd, size, result, 0);
+}
+
+int SockTraceOn(void)
+{
+    return (__atomic_load_n(&tracing, __ATOMIC_RELAXED));
+}
+
+void SetSockTrace(int on)
+{
+    __atomic_store_n(&tracing, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * events per thread ring, for rings created after this (rounded up to a power of 2)
+ */
+int SetSockTraceSize(int events)
+{
+    int	n = 64;
+
+    if (events <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    while (n < events && n < (1 << 24))
+	n *= 2;
+    ring_size = n;
+
+    return (0);
+}
+
+static int writeAll(int fd, void *buf, size_t len)
+{
+    char	*p = buf;
+    ssize_t	n;
+
+    while (len > 0) {
+	n = write(fd, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return (-1);
+	p += n;
+	len -= n;
+    }
+
+    return (0);
+}
+
+/*
+ * write every ring to path, oldest event first (async-signal-safe)
+ *
+ * Rings are read while their threads keep writing: an event the owner may have
+ * been overwriting during the copy is written with op 0 (and skipped by readers),
+ * never half old, half new.
+ */
+int DumpSockTrace(char *path)
+{
+    SockTraceFileHeader	fh;
+    SockTraceRingHeader	rh;
+    SockTraceEvent	chunk[256];
+    TraceRing		*r;
+    unsigned long long	head, first, i, after;
+    int			fd, n, j, k, err;
+
+    if (path == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+	return (-1);
+
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, SOCK_TRACE_MAGIC, sizeof(fh.magic));
+    fh.pid = (int) getpid();
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+	fh.nrings++;
+    if (writeAll(fd, &fh, sizeof(fh)) < 0)
+	goto fail;
+
+    n = 0;
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL && n < fh.nrings; r = r->next, n++) {
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = (head > (unsigned long long) r->size) ? head - r->size : 0;
+
+	rh.tid = r->tid;
+	rh.count = (int) (head - first);
+	rh.lost = (long long) first;
+	if (writeAll(fd, &rh, sizeof(rh)) < 0)
+	    goto fail;
+
+	for (i = first; i < head; i += k) {
+	    for (k = 0; k < 256 && i + k < head; k++)
+		chunk[k] = r->events[(i + k) & (r->size - 1)];
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    after = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	    for (j = 0; j < k; j++) {
+		if (i + j + r->size <= after)	/* the owner got round to this slot again */
+		    chunk[j].op = 0;
+	    }
+	    if (writeAll(fd, chunk, k * sizeof(SockTraceEvent)) < 0)
+		goto fail;
+	}
+    }
+
+    return (close(fd));
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return (-1);
+}
+
+static void dumpAtExit(void)
+{
+    (void) DumpSockTrace(exit_path);
+}
+
+/*
+ * SSOCK_TRACE=file: trace from the start, dump at exit
+ */
+__attribute__((constructor)) static void traceFromEnv(void)
+{
+    char	*path = getenv("SSOCK_TRACE");
+
+    if (path == NULL || path[0] == '\0' || strlen(path) >= sizeof(exit_path))
+	return;
+
+    strcpy(exit_path, path);
+    SetSockTrace(1);
+    atexit(dumpAtExit);
+}
+
+char *SockTraceOpName(int op)
+{
+    static char	*names[] = { "?", "create", "bind", "listen", "accept", "connect",
+			     "read", "write", "close", "accept-batch" };
+
+    if (op >= SOCK_TRACE_USER)
+	return ("user");
+
+    return ((op > 0 && op < (int) (sizeof(names) / sizeof(names[0]))) ? names[op] : "?");
+}
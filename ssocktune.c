@@ -0,0 +1,272 @@
+/*
+ * ssocktune.c
+ *
+ * Socket tuning profiles for the simple socket library.
+ *
+ * A TCP socket's defaults are a compromise, and the options that move it one way
+ * or the other (Nagle, delayed ACKs, buffer sizes, how much unsent data may pile
+ * up, busy polling, keepalives) are easy to get subtly wrong one setsockopt() at
+ * a time. So here they come as a few named profiles:
+ *
+ *	low-latency		small messages, answered right away: no Nagle, quick
+ *				ACKs, little unsent data queued, busy polling
+ *	bulk-throughput		big transfers: Nagle on, and the buffers left to the
+ *				kernel's autotuning (fixed 4MB ones measured slower
+ *				on loopback than the autotuned defaults)
+ *	many-idle-connections	lots of mostly quiet sockets: small buffers so none
+ *				of them grows big, keepalives to find dead peers
+ *
+ * A profile is applied to a socket with SetSocketProfile(), and remembered: the
+ * sockets AcceptSocket() returns get their listener's profile. SetDefaultSocketProfile()
+ * picks the profile that every socket the library creates starts with.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define LEAVE	(-1)		/* option not set by the profile, the system default stays */
+
+typedef struct {
+    char	*name;
+    int		nodelay;	/* TCP_NODELAY */
+    int		quickack;	/* TCP_QUICKACK */
+    int		sndbuf;		/* SO_SNDBUF, fixing it turns off the kernel's autotuning */
+    int		rcvbuf;		/* SO_RCVBUF, likewise */
+    int		notsent_lowat;	/* TCP_NOTSENT_LOWAT */
+    int		busy_poll_us;	/* SO_BUSY_POLL */
+    int		keepalive_s;	/* SO_KEEPALIVE + TCP_KEEPIDLE */
+} Profile;
+
+static const Profile profiles[] = {
+    { "default",	       LEAVE, LEAVE, LEAVE,	      LEAVE,	       LEAVE, LEAVE, LEAVE },
+    { "low-latency",	       1,     1,     LEAVE,	      LEAVE,	       16384, 50,    LEAVE },
+    { "bulk-throughput",       0,     LEAVE, LEAVE,	      LEAVE,	       LEAVE, LEAVE, LEAVE },
+    { "many-idle-connections", 1,     LEAVE, 64 * 1024,	      64 * 1024,       16384, LEAVE, 60 },
+};
+
+#define NPROFILES	((int) (sizeof(profiles) / sizeof(profiles[0])))
+
+#define FD_CHUNK	(4096)		/* profiles are remembered this many fds at a time */
+#define FD_CHUNKS	(1024)		/* so fds up to 4M */
+
+/*
+ * which profile each socket has (by fd), 0 for "the default", profile + 1 otherwise
+ *
+ * Every create, accept and close looks here, from every worker thread at once, so
+ * there is no lock: a byte per fd, read and written with atomic loads and stores,
+ * in chunks that are added (compare and swap) and never freed or moved.
+ */
+static unsigned char	*fd_chunks[FD_CHUNKS];
+static int		default_profile = SOCK_PROFILE_DEFAULT;
+
+static unsigned char *profileSlot(int fd, int create)
+{
+    unsigned char	*chunk, *expected = NULL;
+    int			c = fd / FD_CHUNK;
+
+    if (fd < 0 || c >= FD_CHUNKS)
+	return (NULL);
+
+    chunk = __atomic_load_n(&fd_chunks[c], __ATOMIC_ACQUIRE);
+    if (chunk == NULL && create) {
+	chunk = calloc(FD_CHUNK, 1);
+	if (chunk == NULL)
+	    return (NULL);	/* accepted sockets get the default then */
+	if (!__atomic_compare_exchange_n(&fd_chunks[c], &expected, chunk, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    free(chunk);		/* another thread got there first */
+	    chunk = expected;
+	}
+    }
+
+    return ((chunk != NULL) ? &chunk[fd % FD_CHUNK] : NULL);
+}
+
+static void rememberProfile(int sockfd, int profile)
+{
+    unsigned char	*p = profileSlot(sockfd, 1);
+
+    if (p != NULL)
+	__atomic_store_n(p, profile + 1, __ATOMIC_RELAXED);
+}
+
+static int setOpt(int sockfd, int level, int opt, int value)
+{
+    if (value == LEAVE)
+	return (0);
+
+    return (setsockopt(sockfd, level, opt, &value, sizeof(value)));
+}
+
+/*
+ * apply profile to a socket and remember it for the sockets accepted from it
+ *
+ * TCP options are skipped for other sockets (Unix domain, UDP), and busy polling
+ * is best effort: raising it takes CAP_NET_ADMIN.
+ */
+int SetSocketProfile(int sockfd, int profile)
+{
+    const Profile	*p;
+    socklen_t		len;
+    int			proto = 0, err = 0;
+
+    if (profile < 0 || profile >= NPROFILES) {
+	errno = EINVAL;
+	return (-1);
+    }
+    p = &profiles[profile];
+
+    len = sizeof(proto);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_PROTOCOL, &proto, &len) < 0)
+	return (-1);
+
+    if (setOpt(sockfd, SOL_SOCKET, SO_SNDBUF, p->sndbuf) < 0 ||
+	setOpt(sockfd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf) < 0)
+	err = errno;
+
+#ifdef SO_BUSY_POLL
+    if (setOpt(sockfd, SOL_SOCKET, SO_BUSY_POLL, p->busy_poll_us) < 0 && errno != EPERM)
+	err = errno;
+#endif
+
+    if (proto == IPPROTO_TCP) {
+	if (setOpt(sockfd, IPPROTO_TCP, TCP_NODELAY, p->nodelay) < 0 ||
+	    setOpt(sockfd, IPPROTO_TCP, TCP_QUICKACK, p->quickack) < 0)
+	    err = errno;
+#ifdef TCP_NOTSENT_LOWAT
+	if (setOpt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat) < 0)
+	    err = errno;
+#endif
+	if (p->keepalive_s != LEAVE &&
+	    (setOpt(sockfd, SOL_SOCKET, SO_KEEPALIVE, 1) < 0 ||
+	     setOpt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, p->keepalive_s) < 0 ||
+	     setOpt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, 10) < 0 ||
+	     setOpt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, 5) < 0))
+	    err = errno;
+    }
+
+    rememberProfile(sockfd, profile);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : SetSocketProfile(%d, %s) errno %d\n",__FILE__,sockfd,p->name,err);
+#endif
+
+    if (err != 0) {
+	errno = err;
+	return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * the profile a socket has, or the default if it was never given one
+ */
+int GetSocketProfile(int sockfd)
+{
+    unsigned char	*p = profileSlot(sockfd, 0);
+    int			n;
+
+    n = (p != NULL) ? __atomic_load_n(p, __ATOMIC_RELAXED) : 0;
+
+    return ((n != 0) ? n - 1 : GetDefaultSocketProfile());
+}
+
+/*
+ * the socket is being closed, its fd number will be reused
+ */
+void ForgetSocketProfile(int sockfd)
+{
+    unsigned char	*p = profileSlot(sockfd, 0);
+
+    if (p != NULL && __atomic_load_n(p, __ATOMIC_RELAXED) != 0)
+	__atomic_store_n(p, 0, __ATOMIC_RELAXED);	/* don't dirty the line if clear */
+}
+
+int SetDefaultSocketProfile(int profile)
+{
+    if (profile < 0 || profile >= NPROFILES) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    __atomic_store_n(&default_profile, profile, __ATOMIC_RELAXED);
+
+    return (0);
+}
+
+int GetDefaultSocketProfile(void)
+{
+    return (__atomic_load_n(&default_profile, __ATOMIC_RELAXED));
+}
+
+/*
+ * "low-latency" -> SOCK_PROFILE_LOW_LATENCY, for command line options
+ */
+int SocketProfileByName(char *name)
+{
+    int	i;
+
+    for (i = 0; name != NULL && i < NPROFILES; i++) {
+	if (strcmp(profiles[i].name, name) == 0)
+	    return (i);
+    }
+
+    errno = EINVAL;
+    return (-1);
+}
+
+char *SocketProfileName(int profile)
+{
+    if (profile < 0 || profile >= NPROFILES)
+	return ("unknown");
+
+    return (profiles[profile].name);
+}
+
+/*
+ * TCP_CORK: hold partial segments until uncorked (or 200ms pass)
+ */
+int CorkSocket(int sockfd, int on)
+{
+    return (setOpt(sockfd, IPPROTO_TCP, TCP_CORK, on ? 1 : 0));
+}
+
+/*
+ * SO_REUSEADDR: bind a port that still has connections in TIME_WAIT
+ */
+int SetReuseAddrSocket(int sockfd, int on)
+{
+    return (setOpt(sockfd, SOL_SOCKET, SO_REUSEADDR, on ? 1 : 0));
+}
+
+int SetKeepAliveSocket(int sockfd, int idle_s, int interval_s, int count)
+{
+    if (idle_s < 0 || (idle_s > 0 && (interval_s <= 0 || count <= 0))) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (idle_s == 0)
+	return (setOpt(sockfd, SOL_SOCKET, SO_KEEPALIVE, 0));
+
+    if (setOpt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, idle_s) < 0 ||
+	setOpt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, interval_s) < 0 ||
+	setOpt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, count) < 0)
+	return (-1);
+
+    return (setOpt(sockfd, SOL_SOCKET, SO_KEEPALIVE, 1));
+}
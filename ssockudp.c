@@ -0,0 +1,406 @@
+/*
+ * ssockudp.c
+ *
+ * UDP (datagram) sockets for the simple socket library.
+ *
+ * One datagram per send()/recv() means one system call per packet, which is what
+ * limits a busy datagram service. So datagrams here go in batches: an array of
+ * SockDgrams is received with a single recvmmsg() and sent with a single sendmmsg().
+ *
+ * On top of that, on Linux,
+ *
+ *	- a send can be one big buffer the kernel cuts into equal datagrams (UDP GSO,
+ *	  UDP_SEGMENT), one trip down the stack for up to 64 packets,
+ *	- a receiving socket can ask for GRO (UDP_GRO), the kernel then hands over
+ *	  a run of same-sized datagrams from one sender as one buffer.
+ *
+ * Both are only used where the kernel has them; without GSO a segmented send is
+ * split here, and without GRO every datagram simply arrives on its own.
+ *
+ * The sender's address is received straight into each SockDgram's own address
+ * storage (recvmmsg() writes it there), nothing is copied afterwards.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#define _GNU_SOURCE	/* recvmmsg(), sendmmsg() */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define UDP_BATCH	(64)		/* datagrams per recvmmsg()/sendmmsg() */
+#define UDP_GSO_MAX	(64)		/* segments the kernel takes in one GSO send... */
+#define UDP_GSO_BYTES	(65507)		/* ...and bytes: it is still one IPv4 datagram */
+
+#ifndef SOL_UDP
+#define SOL_UDP		(17)
+#endif
+
+static int gso_broken = 0;	/* the kernel said no to UDP_SEGMENT once, stop asking (atomic) */
+
+/*
+ * the most one GSO send of segment sized datagrams can carry, whole segments only
+ */
+static int gsoBytes(int segment)
+{
+    int	n = UDP_GSO_BYTES / segment;
+
+    return (((n > UDP_GSO_MAX) ? UDP_GSO_MAX : n) * segment);
+}
+
+/*
+ * create a datagram socket, bound to port unless port is 0
+ */
+int CreateUdpSocket(int family, int port)
+{
+    struct sockaddr_storage	ss;
+    struct sockaddr_in		*sin = (struct sockaddr_in *) &ss;
+    struct sockaddr_in6		*sin6 = (struct sockaddr_in6 *) &ss;
+    int				fd;
+
+    if (family != AF_INET && family != AF_INET6) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    fd = socket(family, SOCK_DGRAM, 0);
+    if (fd < 0)
+	return (-1);
+    ForgetSocketProfile(fd);	/* the number may have been a profiled socket's */
+    if (port == 0)
+	return (fd);
+
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET6) {
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_addr = in6addr_any;
+	sin6->sin6_port = htons(port);
+    } else {
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_ANY);
+	sin->sin_port = htons(port);
+    }
+
+    if (bind(fd, (struct sockaddr *) &ss, SockAddrLen(&ss)) < 0) {
+	int	save = errno;
+
+	CloseSocket(fd);
+	errno = save;
+	return (-1);
+    }
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : CreateUdpSocket(%d, %d) returning %d\n",__FILE__,family,port,fd);
+#endif
+
+    return (fd);
+}
+
+/*
+ * let the kernel coalesce received datagrams (UDP GRO)
+ */
+int SetUdpGro(int sockfd, int on)
+{
+#ifdef UDP_GRO
+    return (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)));
+#else
+    errno = ENOPROTOOPT;
+    return (-1);
+#endif
+}
+
+/*
+ * count datagrams, each with size bytes of buffer and room for an address,
+ * all in one allocation
+ */
+SockDgram *CreateDgrams(int count, int size)
+{
+    SockDgram			*d;
+    struct sockaddr_storage	*addrs;
+    char			*data;
+    int				i;
+
+    if (count <= 0 || size <= 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    d = malloc(count * (sizeof(SockDgram) + sizeof(struct sockaddr_storage) + size));
+    if (d == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    addrs = (struct sockaddr_storage *) (d + count);
+    data = (char *) (addrs + count);
+
+    for (i = 0; i < count; i++) {
+	d[i].data = data + i * size;
+	d[i].len = 0;
+	d[i].size = size;
+	d[i].segment = 0;
+	d[i].addr = &addrs[i];
+	d[i].addr_len = 0;
+    }
+
+    return (d);
+}
+
+void CloseDgrams(SockDgram *d)
+{
+    free(d);
+}
+
+/*
+ * bytes in the first n of msgs: asked for (the iovecs), or moved (msg_len)
+ */
+static long long mmsgBytes(struct mmsghdr *msgs, int n, int moved)
+{
+    long long	bytes = 0;
+    int		i;
+
+    for (i = 0; i < n; i++)
+	bytes += moved ? msgs[i].msg_len : msgs[i].msg_hdr.msg_iov->iov_len;
+
+    return (bytes);
+}
+
+/*
+ * receive up to count datagrams with as few system calls as possible
+ *
+ * Waits up to timeout_ms (-1 forever) for the first one, then takes whatever
+ * else is already queued.
+ */
+int RecvDgrams(int sockfd, SockDgram *d, int count, int timeout_ms)
+{
+    struct mmsghdr	msgs[UDP_BATCH];
+    struct iovec	iov[UDP_BATCH];
+    union {
+	char		buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr	align;
+    }			control[UDP_BATCH];
+    struct cmsghdr	*cm;
+    struct pollfd	pfd;
+    long long		start;
+    int			flags, batch, done = 0, i, n;
+
+    if (d == NULL || count <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    if (timeout_ms >= 0) {
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, timeout_ms);
+	if (n <= 0)
+	    return (n);		/* 0: nothing came */
+    }
+
+    while (done < count) {
+	batch = (count - done > UDP_BATCH) ? UDP_BATCH : count - done;
+
+	memset(msgs, 0, batch * sizeof(msgs[0]));
+	for (i = 0; i < batch; i++) {
+	    iov[i].iov_base = d[done + i].data;
+	    iov[i].iov_len = d[done + i].size;
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	    msgs[i].msg_hdr.msg_name = d[done + i].addr;
+	    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	    msgs[i].msg_hdr.msg_control = control[i].buf;
+	    msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+	}
+
+	/* block for the first datagram only, after that take what's there */
+	flags = (done == 0 && timeout_ms < 0) ? MSG_WAITFORONE : MSG_DONTWAIT;
+
+	start = SockStatStart();
+	n = recvmmsg(sockfd, msgs, batch, flags, NULL);
+	SockStatEnd(SOCK_STAT_READ, sockfd, mmsgBytes(msgs, batch, 0),
+		    (n < 0) ? -1 : mmsgBytes(msgs, n, 1), start);
+	if (n < 0) {
+	    if (errno == EINTR && done == 0)
+		continue;
+	    if (done > 0 || (errno == EAGAIN && timeout_ms >= 0))
+		break;		/* the queue is empty (or we got something and then an error) */
+	    return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+	    SockDgram	*g = &d[done + i];
+
+	    g->len = msgs[i].msg_len;
+	    g->addr_len = msgs[i].msg_hdr.msg_namelen;
+	    g->segment = 0;
+#ifdef UDP_GRO
+	    for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL;
+		 cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+		    memcpy(&g->segment, CMSG_DATA(cm), sizeof(int));
+		    if (g->segment >= g->len)
+			g->segment = 0;	/* just the one datagram */
+		}
+	    }
+#else
+	    (void) cm;
+#endif
+	}
+	done += n;
+
+	if (n < batch)
+	    break;		/* the queue is empty */
+    }
+
+    return (done);
+}
+
+/*
+ * no GSO: send a segmented datagram one segment at a time
+ */
+static int sendSegments(int sockfd, SockDgram *g)
+{
+    long long	start;
+    int		off, n, len;
+
+    for (off = 0; off < g->len; off += g->segment) {
+	len = (g->len - off > g->segment) ? g->segment : g->len - off;
+	start = SockStatStart();
+	if (g->addr != NULL && g->addr_len > 0)
+	    n = sendto(sockfd, g->data + off, len, MSG_NOSIGNAL,
+		       (struct sockaddr *) g->addr, g->addr_len);
+	else
+	    n = send(sockfd, g->data + off, len, MSG_NOSIGNAL);
+	SockStatEnd(SOCK_STAT_WRITE, sockfd, len, n, start);
+	if (n < 0)
+	    return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * a segmented datagram too big for one GSO send: as many GSO sends as it takes,
+ * or one send per segment where there is no GSO
+ */
+static int sendSplit(int sockfd, SockDgram *g)
+{
+    SockDgram	part = *g;
+    int		chunk, off;
+
+    chunk = gsoBytes(g->segment);
+    if (__atomic_load_n(&gso_broken, __ATOMIC_RELAXED) || chunk <= g->segment)
+	return (sendSegments(sockfd, g));
+
+    for (off = 0; off < g->len; off += chunk) {
+	part.data = g->data + off;
+	part.len = (g->len - off > chunk) ? chunk : g->len - off;
+	if (SendDgrams(sockfd, &part, 1) != 1)
+	    return (-1);	/* fits one GSO send now, or goes by sendSegments() */
+    }
+
+    return (0);
+}
+
+/*
+ * send count datagrams with as few system calls as possible
+ */
+int SendDgrams(int sockfd, SockDgram *d, int count)
+{
+    struct mmsghdr	msgs[UDP_BATCH];
+    struct iovec	iov[UDP_BATCH];
+    union {
+	char		buf[CMSG_SPACE(sizeof(unsigned short))];
+	struct cmsghdr	align;
+    }			control[UDP_BATCH];
+    struct cmsghdr	*cm;
+    SockDgram		*g;
+    long long		start;
+    int			batch, done = 0, i, n;
+
+    if (d == NULL || count <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    while (done < count) {
+	batch = (count - done > UDP_BATCH) ? UDP_BATCH : count - done;
+
+	memset(msgs, 0, batch * sizeof(msgs[0]));
+	for (i = 0; i < batch; i++) {
+	    g = &d[done + i];
+
+	    if (g->segment > 0 && g->len > g->segment &&
+		(__atomic_load_n(&gso_broken, __ATOMIC_RELAXED) || g->len > gsoBytes(g->segment))) {
+		batch = i;	/* can't go in this batch, sendSplit() it below */
+		break;
+	    }
+
+	    iov[i].iov_base = g->data;
+	    iov[i].iov_len = g->len;
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	    if (g->addr != NULL && g->addr_len > 0) {
+		msgs[i].msg_hdr.msg_name = g->addr;
+		msgs[i].msg_hdr.msg_namelen = g->addr_len;
+	    }
+#ifdef UDP_SEGMENT
+	    if (g->segment > 0 && g->len > g->segment) {
+		msgs[i].msg_hdr.msg_control = control[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+		cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+		*(unsigned short *) CMSG_DATA(cm) = (unsigned short) g->segment;
+	    }
+#else
+	    (void) cm;
+	    (void) control;
+#endif
+	}
+
+	if (batch == 0) {
+	    if (sendSplit(sockfd, &d[done]) < 0)
+		return ((done > 0) ? done : -1);
+	    done++;
+	    continue;
+	}
+
+	start = SockStatStart();
+	n = sendmmsg(sockfd, msgs, batch, MSG_NOSIGNAL);
+	SockStatEnd(SOCK_STAT_WRITE, sockfd, mmsgBytes(msgs, batch, 0),
+		    (n < 0) ? -1 : mmsgBytes(msgs, n, 1), start);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if ((errno == EIO || errno == EINVAL || errno == ENOPROTOOPT) &&
+		!__atomic_load_n(&gso_broken, __ATOMIC_RELAXED) && msgs[0].msg_hdr.msg_control != NULL) {
+		/* no GSO here (e.g. no checksum offload), split ourselves */
+		__atomic_store_n(&gso_broken, 1, __ATOMIC_RELAXED);
+		continue;
+	    }
+	    return ((done > 0) ? done : -1);
+	}
+	done += n;
+
+	if (n < batch)
+	    break;		/* socket buffer full; the caller sends the rest later */
+    }
+
+    return (done);
+}
@@ -0,0 +1,251 @@
+/*
+ * ssockunix.c
+ *
+ * Unix domain (AF_UNIX) stream sockets for the simple socket library.
+ *
+ * Two processes on the same machine talking over TCP pay for the whole loopback
+ * TCP/IP stack: checksums, segmentation, ACKs, congestion control. A Unix domain
+ * socket is the same byte stream, read and written with the same calls, but the
+ * kernel just moves the data across.
+ *
+ * Sockets are named by a file system path, or, on Linux, by a name in the abstract
+ * namespace (written here with a leading '@'), which is not a file: nothing to
+ * clean up, and it goes away with the last socket using it.
+ *
+ * Unix sockets can also carry open file descriptors from one process to the other
+ * (SCM_RIGHTS), see SendFdSocket()/RecvFdSocket().
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+#define UNIX_MAX_FDS	(16)	/* descriptors per SendFdSocket() */
+
+/*
+ * fill in a sockaddr_un, '@' makes it an abstract name
+ */
+static int unixAddr(char *path, struct sockaddr_un *sun, socklen_t *len)
+{
+    size_t	n;
+
+    if (path == NULL || path[0] == '\0') {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    n = strlen(path);
+    if (n >= sizeof(sun->sun_path)) {
+	errno = ENAMETOOLONG;
+	return (-1);
+    }
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, n);
+
+    if (path[0] == '@') {
+	sun->sun_path[0] = '\0';	/* abstract: no file, and the length is exact */
+	*len = offsetof(struct sockaddr_un, sun_path) + n;
+    } else {
+	*len = sizeof(*sun);
+    }
+
+    return (0);
+}
+
+int CreateUnixSocket(void)
+{
+    int	sockfd;
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sockfd >= 0 && GetDefaultSocketProfile() != SOCK_PROFILE_DEFAULT)
+	(void) SetSocketProfile(sockfd, GetDefaultSocketProfile());	/* the buffer sizes */
+    else if (sockfd >= 0)
+	ForgetSocketProfile(sockfd);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : CreateUnixSocket(void) returning %d\n",__FILE__,sockfd);
+#endif
+
+    return (sockfd);
+}
+
+/*
+ * bind to path; a socket file left behind by a server that is gone is removed first
+ */
+int BindUnixSocket(int sockfd, char *path)
+{
+    struct sockaddr_un	sun;
+    struct stat		st;
+    socklen_t		len;
+    int			probe, retval;
+
+    if (unixAddr(path, &sun, &len) < 0)
+	return (-1);
+
+    if (path[0] != '@' && stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+	/* only if nobody answers on it, never pull a live server's socket away */
+	probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe >= 0) {
+	    if (connect(probe, (struct sockaddr *) &sun, len) < 0 && errno == ECONNREFUSED)
+		unlink(path);
+	    close(probe);
+	}
+    }
+
+    retval = bind(sockfd, (struct sockaddr *) &sun, len);
+
+#ifdef DEBUG
+    if (retval < 0) {
+        fprintf(stderr,"ERROR : %s : socket bind(%d, %s) failed. errno = %d\n",
+		__FILE__, sockfd, path, errno);
+    }
+#endif
+
+    return (retval);
+}
+
+int ConnectUnixSocket(int sockfd, char *path)
+{
+    struct sockaddr_un	sun;
+    socklen_t		len;
+    int			retval;
+
+    if (unixAddr(path, &sun, &len) < 0)
+	return (-1);
+
+    retval = connect(sockfd, (struct sockaddr *) &sun, len);
+
+#ifdef DEBUG
+    if (retval < 0) {
+        fprintf(stderr,"ERROR : %s : socket connect(%d, %s) failed. errno = %d\n",
+		__FILE__, sockfd, path, errno);
+    }
+#endif
+
+    return (retval);
+}
+
+/*
+ * send nfds descriptors along with buffer_sz (at least 1) bytes of data
+ */
+int SendFdSocket(int sockfd, int *fds, int nfds, char *buffer, int buffer_sz)
+{
+    struct msghdr	msg;
+    struct iovec	iov;
+    struct cmsghdr	*cm;
+    union {
+	char		buf[CMSG_SPACE(UNIX_MAX_FDS * sizeof(int))];
+	struct cmsghdr	align;
+    }			control;
+    long long		start;
+    int			n;
+
+    if (fds == NULL || nfds <= 0 || nfds > UNIX_MAX_FDS || buffer == NULL || buffer_sz <= 0) {
+	errno = EINVAL;		/* descriptors only travel with at least one byte */
+	return (-1);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buffer;
+    iov.iov_len = buffer_sz;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+
+    do {
+	start = SockStatStart();
+	n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+	SockStatEnd(SOCK_STAT_WRITE, sockfd, buffer_sz, n, start);
+    } while (n < 0 && errno == EINTR);
+
+    return (n);
+}
+
+/*
+ * receive data and any descriptors that came with it (*nfds in: room, out: got)
+ */
+int RecvFdSocket(int sockfd, int *fds, int *nfds, char *buffer, int buffer_sz)
+{
+    struct msghdr	msg;
+    struct iovec	iov;
+    struct cmsghdr	*cm;
+    union {
+	char		buf[CMSG_SPACE(UNIX_MAX_FDS * sizeof(int))];
+	struct cmsghdr	align;
+    }			control;
+    long long		start;
+    int			n, i, got, room;
+
+    if (fds == NULL || nfds == NULL || *nfds < 0 || buffer == NULL || buffer_sz <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    room = *nfds;
+    *nfds = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buffer;
+    iov.iov_len = buffer_sz;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+	start = SockStatStart();
+	n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+	SockStatEnd(SOCK_STAT_READ, sockfd, buffer_sz, n, start);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+	return (-1);
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+	if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+	    continue;
+
+	got = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (i = 0; i < got; i++) {
+	    int	fd;
+
+	    memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+	    if (*nfds < room)
+		fds[(*nfds)++] = fd;
+	    else
+		close(fd);	/* more than the caller has room for, don't leak them */
+	}
+    }
+
+#ifdef DEBUG
+    if (msg.msg_flags & MSG_CTRUNC)
+	fprintf(stderr,"%s : RecvFdSocket(%d) descriptors were dropped\n",__FILE__,sockfd);
+#endif
+
+    return (n);
+}
@@ -0,0 +1,908 @@
+/*
+ * ssockuring.c
+ *
+ * Batched, queue-based I/O engine for the simple socket library.
+ *
+ * Instead of one blocking syscall per AcceptSocket()/RecvSocket()/SendSocket(),
+ * accepts, receives and sends are queued, handed to the kernel in a single
+ * io_uring_enter() and their completions reaped in batches. Accepts and receives
+ * can be multishot (one request keeps producing completions), and receives pick
+ * their buffer from a ring of buffers provided up front, so nothing has to be
+ * allocated or posted per receive.
+ *
+ * When the kernel (or the build host) has no io_uring, or is too old for
+ * provided buffer rings, the same API is run on top of poll() and the ordinary
+ * AcceptSocket()/RecvSocket()/SendSocket() calls.
+ *
+ * No liburing here, the ring is set up and driven with the raw syscalls.
+ *
+ * CancelUring() takes back everything queued on a socket (on io_uring, with one
+ * IORING_OP_ASYNC_CANCEL for the fd). An op's slot is only reused once its last
+ * completion is in, so a cancelled op still reports once, with -ECANCELED.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "ssocklib.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_IO_URING	1
+#endif
+
+#define URING_BGID	(0)	/* the one provided buffer group we register */
+#define URING_CANCEL	(~0ULL)	/* user_data of our cancel requests, their completions are dropped */
+
+/*
+ * one queued operation, the index of the slot is the io_uring user_data
+ */
+typedef struct {
+    int		op;		/* SOCK_URING_ACCEPT/RECV/SEND, 0 if slot is free */
+    int		fd;
+    int		persistent;	/* caller asked for multishot: keep it armed */
+    int		multishot;	/* armed as a kernel multishot request */
+    int		starved;	/* recv waiting for a buffer to be released */
+    int		queued;		/* fallback: waiting to be run */
+    int		cancelled;	/* CancelUring(): report -ECANCELED when it's done */
+    char	*buffer;	/* send only */
+    int		buffer_sz;
+    void	*arg;
+    int		next_free;
+} UringOp;
+
+struct SockUring {
+    int		native;		/* 1 if running on io_uring, 0 for the poll() fallback */
+
+    UringOp	*ops;
+    int		nops;
+    int		free_op;
+
+    char	*bufs;		/* nbufs * buffer_sz receive buffers */
+    int		nbufs;
+    int		buffer_sz;
+    unsigned char *buf_held;	/* 1 while the caller has the buffer, catches double releases */
+
+    /* fallback: stack of free receive buffer ids */
+    int		*free_bufs;
+    int		nfree_bufs;
+    struct pollfd *pfds;
+    int		*pfd_ops;
+
+#ifdef HAVE_IO_URING
+    int		ring_fd;
+    unsigned int features;
+    int		pending;	/* SQEs filled in but not yet submitted */
+    int		nstarved;	/* multishot receives parked on -ENOBUFS */
+    int		no_multi_accept;
+    int		no_multi_recv;
+
+    void	*sq_ptr, *cq_ptr;
+    size_t	sq_sz, cq_sz;
+    struct io_uring_sqe *sqes;
+    size_t	sqes_sz;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned int *cq_head, *cq_tail, *cq_mask, cq_entries;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    size_t	br_sz;
+    unsigned short br_tail;
+#endif
+};
+
+/*
+ * op slot allocation
+ */
+static int allocOp(SockUring *ring, int op, int fd, void *arg)
+{
+    int		i;
+    UringOp	*o;
+
+    if (ring->free_op < 0) {
+	errno = EBUSY;
+	return (-1);
+    }
+
+    i = ring->free_op;
+    o = &ring->ops[i];
+    ring->free_op = o->next_free;
+
+    memset(o, 0, sizeof(UringOp));
+    o->op = op;
+    o->fd = fd;
+    o->arg = arg;
+
+    return (i);
+}
+
+static void freeOp(SockUring *ring, int i)
+{
+    ring->ops[i].op = 0;
+    ring->ops[i].next_free = ring->free_op;
+    ring->free_op = i;
+}
+
+#ifdef HAVE_IO_URING
+
+static int uringSetup(unsigned int entries, struct io_uring_params *p)
+{
+    return ((int) syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uringEnter(int fd, unsigned int to_submit, unsigned int min_complete,
+		      unsigned int flags, void *arg, size_t argsz)
+{
+    return ((int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static int uringRegister(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return ((int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/*
+ * hand a receive buffer (back) to the kernel
+ */
+static void addRingBuffer(SockUring *ring, int bufid)
+{
+    struct io_uring_buf	*b;
+
+    b = &ring->br->bufs[ring->br_tail & (ring->nbufs - 1)];
+    b->addr = (unsigned long) (ring->bufs + (size_t) bufid * ring->buffer_sz);
+    b->len = ring->buffer_sz;
+    b->bid = bufid;
+    ring->br_tail++;
+}
+
+static void publishRingBuffers(SockUring *ring)
+{
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void unmapRing(SockUring *ring)
+{
+    if (ring->br != NULL) {
+	munmap(ring->br, ring->br_sz);
+	ring->br = NULL;
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+	munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+	munmap(ring->cq_ptr, ring->cq_sz);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+	munmap(ring->sq_ptr, ring->sq_sz);
+    if (ring->ring_fd >= 0)
+	close(ring->ring_fd);
+
+    ring->sqes = NULL;
+    ring->sq_ptr = ring->cq_ptr = NULL;
+    ring->ring_fd = -1;
+}
+
+/*
+ * set up the io_uring and register the provided buffer ring
+ *
+ * Returns 0 on success, -1 if the kernel can't do what we need (caller falls back).
+ */
+static int mapRing(SockUring *ring, int entries)
+{
+    struct io_uring_params	p;
+    struct io_uring_buf_reg	reg;
+    int				i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;		/* multishot ops post many completions per SQE */
+
+    ring->ring_fd = uringSetup(entries, &p);
+    if (ring->ring_fd < 0)
+	return (-1);
+
+    ring->features = p.features;
+    ring->sq_entries = p.sq_entries;
+    ring->cq_entries = p.cq_entries;
+
+    ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_sz > ring->sq_sz)
+	    ring->sq_sz = ring->cq_sz;
+	ring->cq_sz = ring->sq_sz;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+	goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	ring->cq_ptr = ring->sq_ptr;
+    } else {
+	ring->cq_ptr = mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED)
+	    goto fail;
+    }
+
+    ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+	goto fail;
+
+    ring->sq_head = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+	/* the provided buffer ring must be page aligned, mmap gives us that */
+    ring->br_sz = ring->nbufs * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_sz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+	ring->br = NULL;
+	goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->br;
+    reg.ring_entries = ring->nbufs;
+    reg.bgid = URING_BGID;
+    if (uringRegister(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	goto fail;	/* pre-5.19 kernel */
+
+    ring->br_tail = 0;
+    for (i = 0; i < ring->nbufs; i++)
+	addRingBuffer(ring, i);
+    publishRingBuffers(ring);
+
+    return (0);
+
+fail:
+#ifdef DEBUG
+    fprintf(stderr,"%s : io_uring setup failed (errno = %d), using fallback\n",__FILE__,errno);
+#endif
+    unmapRing(ring);
+    return (-1);
+}
+
+/*
+ * submit everything queued so far, optionally waiting for min_complete completions
+ */
+static int enterRing(SockUring *ring, unsigned int min_complete, int timeout_ms)
+{
+    struct io_uring_getevents_arg	arg;
+    struct __kernel_timespec		ts;
+    unsigned int			flags = 0;
+    int					n;
+
+    if (min_complete > 0)
+	flags |= IORING_ENTER_GETEVENTS;
+
+    if (min_complete > 0 && timeout_ms >= 0 && (ring->features & IORING_FEAT_EXT_ARG)) {
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+	arg.ts = (unsigned long) &ts;
+	flags |= IORING_ENTER_EXT_ARG;
+	n = uringEnter(ring->ring_fd, ring->pending, min_complete, flags, &arg, sizeof(arg));
+    } else {
+	n = uringEnter(ring->ring_fd, ring->pending, min_complete, flags, NULL, 0);
+    }
+
+    if (n >= 0) {
+	ring->pending -= n;
+    } else if (errno == ETIME || errno == EINTR) {
+	return (0);	/* timed out or interrupted, not an error */
+    } else if (errno == EBUSY) {
+	return (0);	/* CQ overflowed, the caller reaps and we submit again next time */
+    }
+
+    return (n);
+}
+
+static struct io_uring_sqe *getSqe(SockUring *ring)
+{
+    unsigned int	tail, head;
+    struct io_uring_sqe	*sqe;
+
+    tail = *ring->sq_tail;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->sq_entries) {
+	/* SQ is full, flush the batch to the kernel first */
+	if (enterRing(ring, 0, 0) < 0)
+	    return (NULL);
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries) {
+	    errno = EBUSY;
+	    return (NULL);
+	}
+    }
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return (sqe);
+}
+
+/*
+ * (re)arm an op on the ring
+ */
+static int armOp(SockUring *ring, int i)
+{
+    UringOp		*o = &ring->ops[i];
+    struct io_uring_sqe	*sqe;
+
+    sqe = getSqe(ring);
+    if (sqe == NULL)
+	return (-1);
+
+    sqe->fd = o->fd;
+    sqe->user_data = i;
+
+    switch (o->op) {
+	case SOCK_URING_ACCEPT:
+	    sqe->opcode = IORING_OP_ACCEPT;
+	    o->multishot = o->persistent && !ring->no_multi_accept;
+	    if (o->multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	    break;
+	case SOCK_URING_RECV:
+	    sqe->opcode = IORING_OP_RECV;
+	    sqe->flags = IOSQE_BUFFER_SELECT;
+	    sqe->buf_group = URING_BGID;
+	    o->multishot = o->persistent && !ring->no_multi_recv;
+	    if (o->multishot)
+		sqe->ioprio = IORING_RECV_MULTISHOT;	/* len must be 0 */
+	    else
+		sqe->len = ring->buffer_sz;
+	    break;
+	case SOCK_URING_SEND:
+	    sqe->opcode = IORING_OP_SEND;
+	    sqe->addr = (unsigned long) o->buffer;
+	    sqe->len = o->buffer_sz;
+	    sqe->msg_flags = MSG_NOSIGNAL;
+	    break;
+    }
+
+    return (0);
+}
+
+/*
+ * a completion for a cancelled op: nobody wants what it brought in, only to
+ * hear when it is over (a send reports what it really did, it may have gone out)
+ */
+static int reapCancelled(SockUring *ring, int i, struct io_uring_cqe *cqe, SockUringEvent *ev)
+{
+    UringOp	*o = &ring->ops[i];
+
+    if (o->op == SOCK_URING_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+	addRingBuffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	publishRingBuffers(ring);
+    }
+    if (o->op == SOCK_URING_ACCEPT && cqe->res >= 0)
+	(void) CloseSocket(cqe->res);		/* got in before the cancel */
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+	return (0);
+
+    ev->op = o->op;
+    ev->fd = o->fd;
+    ev->result = (o->op == SOCK_URING_SEND && cqe->res != -ECANCELED) ? cqe->res : -ECANCELED;
+    ev->more = 0;
+    ev->buffer = NULL;
+    ev->bufid = -1;
+    ev->arg = o->arg;
+    freeOp(ring, i);
+
+    return (1);
+}
+
+/*
+ * cancel everything on sockfd the kernel has, ops parked without a buffer
+ * aren't in the kernel, a NOP brings their last completion instead
+ */
+static int cancelNative(SockUring *ring, int sockfd)
+{
+    struct io_uring_sqe	*sqe;
+    int			i;
+
+    for (i = 0; i < ring->nops; i++) {
+	if (ring->ops[i].op == 0 || ring->ops[i].fd != sockfd || !ring->ops[i].starved)
+	    continue;
+	ring->ops[i].starved = 0;
+	ring->nstarved--;
+	sqe = getSqe(ring);
+	if (sqe == NULL)
+	    return (-1);
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = i;
+    }
+
+    sqe = getSqe(ring);
+    if (sqe == NULL)
+	return (-1);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = sockfd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_CANCEL;
+
+    return (0);
+}
+
+/*
+ * turn one CQE into (at most) one event, re-arming persistent ops as needed
+ *
+ * Returns 1 if ev was filled in, 0 if the completion was swallowed.
+ */
+static int reapCqe(SockUring *ring, struct io_uring_cqe *cqe, SockUringEvent *ev)
+{
+    int		i, more, res;
+    UringOp	*o;
+
+    if (cqe->user_data == URING_CANCEL)
+	return (0);	/* the ops it cancelled report for themselves */
+
+    i = (int) cqe->user_data;
+    o = &ring->ops[i];
+    more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    res = cqe->res;
+
+    if (o->cancelled)
+	return (reapCancelled(ring, i, cqe, ev));
+
+    if (o->multishot && res == -EINVAL && !more) {
+	/* kernel knows io_uring but not this multishot flavour, go single-shot */
+	if (o->op == SOCK_URING_ACCEPT)
+	    ring->no_multi_accept = 1;
+	else
+	    ring->no_multi_recv = 1;
+	if (armOp(ring, i) == 0)
+	    return (0);
+	res = -errno;
+    }
+
+    ev->op = o->op;
+    ev->fd = o->fd;
+    ev->result = res;
+    ev->arg = o->arg;
+    ev->buffer = NULL;
+    ev->bufid = -1;
+
+    if (o->op == SOCK_URING_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+	ev->bufid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	ev->buffer = ring->bufs + (size_t) ev->bufid * ring->buffer_sz;
+	ring->buf_held[ev->bufid] = 1;
+    }
+
+    if (more) {
+	ev->more = 1;
+	return (1);
+    }
+
+	/* the kernel is done with this request, does the caller still want it? */
+    if (o->persistent && o->op == SOCK_URING_RECV && res == -ENOBUFS) {
+	o->starved = 1;		/* re-armed once a buffer comes back */
+	ring->nstarved++;
+	ev->more = 1;
+	return (0);
+    }
+
+    if (o->persistent &&
+	((o->op == SOCK_URING_ACCEPT && (res >= 0 || res == -ECONNABORTED || res == -EINTR)) ||
+	 (o->op == SOCK_URING_RECV && res > 0))) {
+	if (armOp(ring, i) == 0) {
+	    ev->more = 1;
+	    return (1);
+	}
+    }
+
+    ev->more = 0;
+    freeOp(ring, i);
+
+    return (1);
+}
+
+static int waitNative(SockUring *ring, SockUringEvent *events, int max_events, int timeout_ms)
+{
+    unsigned int	head, tail;
+    int			n = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail && timeout_ms != 0) {
+	if (enterRing(ring, 1, timeout_ms) < 0)
+	    return (-1);
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    } else if (ring->pending > 0) {
+	if (enterRing(ring, 0, 0) < 0)
+	    return (-1);
+    }
+
+    while (n < max_events) {
+	if (head == tail) {
+	    /* re-arming may have completed something already, have one more look */
+	    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	    if (head == tail)
+		break;
+	}
+	n += reapCqe(ring, &ring->cqes[head & *ring->cq_mask], &events[n]);
+	head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	/* re-arms queued while reaping go out with the next batch */
+    if (ring->pending > 0 && enterRing(ring, 0, 0) < 0)
+	return (-1);
+
+    return (n);
+}
+
+#endif /* HAVE_IO_URING */
+
+/*
+ * fallback: run whatever queued ops poll() says are ready
+ */
+static int waitFallback(SockUring *ring, SockUringEvent *events, int max_events, int timeout_ms)
+{
+    int		i, j, nfds = 0, n = 0, r, bufid;
+    UringOp	*o;
+
+	/* cancelled ops were never in flight, they are over right away */
+    for (i = 0; i < ring->nops && n < max_events; i++) {
+	o = &ring->ops[i];
+	if (o->op == 0 || !o->cancelled)
+	    continue;
+	events[n].op = o->op;
+	events[n].fd = o->fd;
+	events[n].result = -ECANCELED;
+	events[n].more = 0;
+	events[n].buffer = NULL;
+	events[n].bufid = -1;
+	events[n].arg = o->arg;
+	freeOp(ring, i);
+	n++;
+    }
+    if (n > 0)
+	timeout_ms = 0;		/* have those, don't wait for more */
+
+    for (i = 0; i < ring->nops; i++) {
+	o = &ring->ops[i];
+	if (o->op == 0 || !o->queued || o->cancelled)
+	    continue;
+	if (o->op == SOCK_URING_RECV && ring->nfree_bufs == 0)
+	    continue;		/* nowhere to put the data until a buffer is released */
+	ring->pfds[nfds].fd = o->fd;
+	ring->pfds[nfds].events = (o->op == SOCK_URING_SEND) ? POLLOUT : POLLIN;
+	ring->pfds[nfds].revents = 0;
+	ring->pfd_ops[nfds] = i;
+	nfds++;
+    }
+
+    if (nfds == 0 && timeout_ms < 0) {
+	errno = EAGAIN;		/* nothing could ever complete */
+	return (-1);
+    }
+
+    r = poll(ring->pfds, nfds, timeout_ms);
+    if (r < 0)
+	return ((errno == EINTR || n > 0) ? n : -1);
+
+    for (j = 0; j < nfds && n < max_events; j++) {
+	if (ring->pfds[j].revents == 0)
+	    continue;
+
+	i = ring->pfd_ops[j];
+	o = &ring->ops[i];
+
+	events[n].op = o->op;
+	events[n].fd = o->fd;
+	events[n].arg = o->arg;
+	events[n].buffer = NULL;
+	events[n].bufid = -1;
+
+	switch (o->op) {
+	    case SOCK_URING_ACCEPT:
+		r = AcceptSocket(o->fd);
+		break;
+	    case SOCK_URING_RECV:
+		if (ring->nfree_bufs == 0)
+		    continue;
+		bufid = ring->free_bufs[--ring->nfree_bufs];
+		r = RecvSocket(o->fd, ring->bufs + (size_t) bufid * ring->buffer_sz, ring->buffer_sz);
+		if (r > 0) {
+		    events[n].bufid = bufid;
+		    events[n].buffer = ring->bufs + (size_t) bufid * ring->buffer_sz;
+		    ring->buf_held[bufid] = 1;
+		} else {
+		    ring->free_bufs[ring->nfree_bufs++] = bufid;
+		}
+		break;
+	    default:
+		r = SendSocket(o->fd, o->buffer, o->buffer_sz);
+		break;
+	}
+
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	    continue;	/* spurious wakeup, leave it queued */
+
+	events[n].result = (r < 0) ? -errno : r;
+
+	if (o->persistent && (r > 0 || (o->op == SOCK_URING_ACCEPT && r == 0))) {
+	    events[n].more = 1;
+	} else {
+	    events[n].more = 0;
+	    freeOp(ring, i);
+	}
+	n++;
+    }
+
+    return (n);
+}
+
+static int queueOp(SockUring *ring, int op, int sockfd, int multishot,
+		   char *buffer, int buffer_sz, void *arg)
+{
+    int	i;
+
+    if (ring == NULL || sockfd < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    i = allocOp(ring, op, sockfd, arg);
+    if (i < 0)
+	return (-1);
+
+    ring->ops[i].persistent = multishot;
+    ring->ops[i].buffer = buffer;
+    ring->ops[i].buffer_sz = buffer_sz;
+
+#ifdef HAVE_IO_URING
+    if (ring->native) {
+	if (armOp(ring, i) < 0) {
+	    freeOp(ring, i);
+	    return (-1);
+	}
+	return (0);
+    }
+#endif
+
+    ring->ops[i].queued = 1;
+
+    return (0);
+}
+
+/*
+ * create the engine
+ */
+SockUring *CreateUring(int entries, int nbufs, int buffer_sz)
+{
+    SockUring	*ring;
+    int		i, n;
+
+	/* the provided buffer ring needs a power of two, at most 32K buffers */
+    if (entries <= 0 || nbufs <= 0 || nbufs > 32768 || buffer_sz <= 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+    for (n = 1; n < nbufs; n <<= 1)
+	;
+    nbufs = n;
+
+    ring = calloc(1, sizeof(SockUring));
+    if (ring == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    ring->nbufs = nbufs;
+    ring->buffer_sz = buffer_sz;
+    ring->nops = entries * 4;
+    ring->ops = calloc(ring->nops, sizeof(UringOp));
+    ring->bufs = malloc((size_t) nbufs * buffer_sz);
+    ring->free_bufs = malloc(nbufs * sizeof(int));
+    ring->buf_held = calloc(nbufs, 1);
+    ring->pfds = malloc(ring->nops * sizeof(struct pollfd));
+    ring->pfd_ops = malloc(ring->nops * sizeof(int));
+    if (ring->ops == NULL || ring->bufs == NULL || ring->free_bufs == NULL || ring->buf_held == NULL ||
+	ring->pfds == NULL || ring->pfd_ops == NULL) {
+	CloseUring(ring);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    for (i = 0; i < ring->nops; i++)
+	ring->ops[i].next_free = i + 1;
+    ring->ops[ring->nops - 1].next_free = -1;
+    ring->free_op = 0;
+
+    for (i = 0; i < nbufs; i++)
+	ring->free_bufs[i] = nbufs - 1 - i;
+    ring->nfree_bufs = nbufs;
+
+#ifdef HAVE_IO_URING
+    ring->ring_fd = -1;
+    if (getenv("SSOCK_NO_URING") == NULL && mapRing(ring, entries) == 0)
+	ring->native = 1;
+#endif
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : CreateUring(%d, %d, %d) using %s\n",__FILE__,entries,nbufs,buffer_sz,
+	    ring->native ? "io_uring" : "poll() fallback");
+#endif
+
+    return (ring);
+}
+
+int CloseUring(SockUring *ring)
+{
+    if (ring == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring->native)
+	unmapRing(ring);
+#endif
+
+    free(ring->ops);
+    free(ring->bufs);
+    free(ring->free_bufs);
+    free(ring->buf_held);
+    free(ring->pfds);
+    free(ring->pfd_ops);
+    free(ring);
+
+    return (0);
+}
+
+int UringIsNative(SockUring *ring)
+{
+    return (ring != NULL && ring->native);
+}
+
+int QueueAcceptUring(SockUring *ring, int sockfd, int multishot, void *arg)
+{
+    return (queueOp(ring, SOCK_URING_ACCEPT, sockfd, multishot, NULL, 0, arg));
+}
+
+int QueueRecvUring(SockUring *ring, int sockfd, int multishot, void *arg)
+{
+    return (queueOp(ring, SOCK_URING_RECV, sockfd, multishot, NULL, 0, arg));
+}
+
+int QueueSendUring(SockUring *ring, int sockfd, char *buffer, int buffer_sz, void *arg)
+{
+    if (buffer == NULL || buffer_sz < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    return (queueOp(ring, SOCK_URING_SEND, sockfd, 0, buffer, buffer_sz, arg));
+}
+
+/*
+ * take back every operation queued on sockfd, before it is closed
+ */
+int CancelUring(SockUring *ring, int sockfd)
+{
+    int	i, n = 0;
+
+    if (ring == NULL || sockfd < 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < ring->nops; i++) {
+	if (ring->ops[i].op != 0 && ring->ops[i].fd == sockfd && !ring->ops[i].cancelled) {
+	    ring->ops[i].cancelled = 1;
+	    n++;
+	}
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring->native && n > 0 && cancelNative(ring, sockfd) < 0)
+	return (-1);
+#endif
+
+    return (n);
+}
+
+/*
+ * push everything queued to the kernel in one syscall
+ */
+int SubmitUring(SockUring *ring)
+{
+    if (ring == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring->native && ring->pending > 0)
+	return (enterRing(ring, 0, 0));
+#endif
+
+    return (0);
+}
+
+/*
+ * submit anything pending and collect up to max_events completions
+ */
+int WaitUring(SockUring *ring, SockUringEvent *events, int max_events, int timeout_ms)
+{
+    if (ring == NULL || events == NULL || max_events <= 0) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring->native)
+	return (waitNative(ring, events, max_events, timeout_ms));
+#endif
+
+    return (waitFallback(ring, events, max_events, timeout_ms));
+}
+
+/*
+ * give a receive buffer back once the caller is done with the data in it
+ */
+int ReleaseUringBuffer(SockUring *ring, int bufid)
+{
+    int	i;
+
+    if (ring == NULL || bufid < 0 || bufid >= ring->nbufs || !ring->buf_held[bufid]) {
+	errno = EINVAL;		/* not one of ours, or given back already */
+	return (-1);
+    }
+    ring->buf_held[bufid] = 0;
+
+#ifdef HAVE_IO_URING
+    if (ring->native) {
+	addRingBuffer(ring, bufid);
+	publishRingBuffers(ring);
+
+	/* wake up any multishot receive that ran dry */
+	for (i = 0; ring->nstarved > 0 && i < ring->nops; i++) {
+	    if (ring->ops[i].op == SOCK_URING_RECV && ring->ops[i].starved) {
+		ring->ops[i].starved = 0;
+		ring->nstarved--;
+		if (armOp(ring, i) < 0)
+		    return (-1);
+	    }
+	}
+	return (0);
+    }
+#endif
+
+    ring->free_bufs[ring->nfree_bufs++] = bufid;
+    (void) i;
+
+    return (0);
+}
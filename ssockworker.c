@@ -0,0 +1,307 @@
+/*
+ * ssockworker.c
+ *
+ * Multi-threaded server support for the simple socket library.
+ *
+ * Starts N worker threads, each with its OWN listening socket bound to the same
+ * port with SO_REUSEPORT and its own event loop, pinned to a core. The kernel
+ * spreads incoming connections across the listeners, so there is no shared accept
+ * queue or lock between the workers, and a connection stays on the thread (and
+ * core) that accepted it.
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#define _GNU_SOURCE	/* pthread_setaffinity_np(), CPU_SET() */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+#include "ssocklib.h"
+
+typedef struct {
+    SockWorkers		*workers;
+    int			index;
+    int			listenfd;
+    SockEventLoop	*loop;
+    pthread_t		thread;
+    int			started;
+    int			result;
+} Worker;
+
+struct SockWorkers {
+    int			nworkers;
+    int			ncpus;
+    SockEventFunc	accept_fn;
+    void		*arg;
+    Worker		*w;
+};
+
+/*
+ * create, bind and listen a SO_REUSEPORT socket
+ */
+static int reusePortListener(int family, int port, int maxq)
+{
+    int	sockfd, on = 1;
+
+    sockfd = CreateSocketFamily(family);
+    if (sockfd < 0)
+	return (-1);
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+	SetReuseAddrSocket(sockfd, 1) < 0 ||
+	BindSocket(sockfd, port) < 0 ||
+	ListenSocket(sockfd, maxq) < 0) {
+	int	save = errno;
+
+	CloseSocket(sockfd);
+	errno = save;
+	return (-1);
+    }
+
+    return (sockfd);
+}
+
+static void *workerMain(void *p)
+{
+    Worker	*w = (Worker *) p;
+    cpu_set_t	cpus;
+
+	/* pinning is best effort, we may be in a cpuset that doesn't allow it */
+    CPU_ZERO(&cpus);
+    CPU_SET(w->index % w->workers->ncpus, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : worker %d running on listener %d cpu %d\n",__FILE__,
+	    w->index, w->listenfd, w->index % w->workers->ncpus);
+#endif
+
+    w->result = RunEventLoop(w->loop);
+
+    return (NULL);
+}
+
+/*
+ * tear down whatever StartWorkers() got around to setting up
+ */
+static void freeWorkers(SockWorkers *ws)
+{
+    int	i;
+
+    for (i = 0; i < ws->nworkers; i++) {
+	if (ws->w[i].loop != NULL)
+	    CloseEventLoop(ws->w[i].loop);
+	if (ws->w[i].listenfd >= 0)
+	    CloseSocket(ws->w[i].listenfd);
+    }
+
+    free(ws->w);
+    free(ws);
+}
+
+/*
+ * start nthreads workers listening on port
+ */
+SockWorkers *StartWorkers(int nthreads, int port, int maxq, SockEventFunc accept_fn, void *arg)
+{
+    return (StartWorkersFamily(nthreads, AF_INET, port, maxq, accept_fn, arg));
+}
+
+/*
+ * the same, on AF_INET or AF_INET6 listeners
+ */
+SockWorkers *StartWorkersFamily(int nthreads, int family, int port, int maxq,
+				SockEventFunc accept_fn, void *arg)
+{
+    SockWorkers	*ws;
+    int		i, save;
+
+    if (nthreads <= 0 || accept_fn == NULL || (family != AF_INET && family != AF_INET6)) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    ws = calloc(1, sizeof(SockWorkers));
+    if (ws == NULL || (ws->w = calloc(nthreads, sizeof(Worker))) == NULL) {
+	free(ws);
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    ws->nworkers = nthreads;
+    ws->accept_fn = accept_fn;
+    ws->arg = arg;
+    ws->ncpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (ws->ncpus <= 0)
+	ws->ncpus = 1;
+
+    for (i = 0; i < nthreads; i++)
+	ws->w[i].listenfd = -1;
+
+	/* set up every listener before starting any thread, so errors come back here */
+    for (i = 0; i < nthreads; i++) {
+	Worker	*w = &ws->w[i];
+
+	w->workers = ws;
+	w->index = i;
+
+	w->listenfd = reusePortListener(family, port, maxq);
+	if (w->listenfd < 0)
+	    goto fail;
+
+	w->loop = CreateEventLoop();
+	if (w->loop == NULL)
+	    goto fail;
+
+	if (AddListenEventLoop(w->loop, w->listenfd, accept_fn, arg) < 0)
+	    goto fail;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	errno = pthread_create(&ws->w[i].thread, NULL, workerMain, &ws->w[i]);
+	if (errno != 0) {
+	    save = errno;
+	    StopWorkers(ws);
+	    errno = save;
+	    return (NULL);
+	}
+	ws->w[i].started = 1;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : StartWorkers(%d, %d, %d) started\n",__FILE__,nthreads,port,maxq);
+#endif
+
+    return (ws);
+
+fail:
+    save = errno;
+#ifdef DEBUG
+    fprintf(stderr,"ERROR : %s : StartWorkers() worker %d setup failed. errno = %d\n",
+	    __FILE__, i, save);
+#endif
+    freeWorkers(ws);
+    errno = save;
+
+    return (NULL);
+}
+
+/*
+ * wait for all the workers to finish (they only do if stopped or an error occurs)
+ */
+int WaitWorkers(SockWorkers *ws)
+{
+    int	i, retval = 0;
+
+    if (ws == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < ws->nworkers; i++) {
+	if (!ws->w[i].started)
+	    continue;
+	pthread_join(ws->w[i].thread, NULL);
+	ws->w[i].started = 0;
+	if (ws->w[i].result < 0)
+	    retval = -1;
+    }
+
+    return (retval);
+}
+
+/*
+ * admission control for all the workers: max_conns in total, split evenly (0: off)
+ *
+ * The shares add up to max_conns exactly, the first max_conns % nworkers workers
+ * taking one more. A share can't be 0, that would be no limit, so max_conns below
+ * nworkers is EINVAL. Each worker counts only its own connections, so with
+ * SO_REUSEPORT spreading them unevenly one worker may shed some before the total
+ * is reached, but together they never take more than it.
+ */
+int SetAcceptLimitWorkers(SockWorkers *ws, int max_conns)
+{
+    int	i, each;
+
+    if (ws == NULL || max_conns < 0 || (max_conns > 0 && max_conns < ws->nworkers)) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < ws->nworkers; i++) {
+	each = max_conns / ws->nworkers + (i < max_conns % ws->nworkers);
+	if (SetAcceptLimitEventLoop(ws->w[i].loop, each) < 0)
+	    return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * TCP_DEFER_ACCEPT on every worker's listener
+ */
+int SetDeferAcceptWorkers(SockWorkers *ws, int seconds)
+{
+    int	i;
+
+    if (ws == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < ws->nworkers; i++) {
+	if (SetDeferAcceptSocket(ws->w[i].listenfd, seconds) < 0)
+	    return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * connections shed by all the workers so far
+ */
+long long WorkersShed(SockWorkers *ws)
+{
+    long long	total = 0;
+    int		i;
+
+    for (i = 0; ws != NULL && i < ws->nworkers; i++)
+	total += EventLoopShed(ws->w[i].loop);
+
+    return (total);
+}
+
+/*
+ * stop all workers, wait for them, then close their listeners and loops
+ *
+ * Connections the workers accepted are left alone, they belong to the caller.
+ */
+int StopWorkers(SockWorkers *ws)
+{
+    int	i, retval;
+
+    if (ws == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    for (i = 0; i < ws->nworkers; i++) {
+	if (ws->w[i].started)
+	    StopEventLoop(ws->w[i].loop);
+    }
+
+    retval = WaitWorkers(ws);
+    freeWorkers(ws);
+
+    return (retval);
+}
@@ -0,0 +1,243 @@
+/*
+ * ssockzcopy.c
+ *
+ * Zero-copy sends for the simple socket library.
+ *
+ * SendSocket() copies the whole buffer into the kernel. For big buffers the
+ * socket can instead be told (SO_ZEROCOPY + MSG_ZEROCOPY) to send straight out of
+ * user memory. The catch is that the buffer must not be touched until the kernel
+ * is done with it, which it reports later through the socket's error queue. This
+ * file numbers each zero-copy send, reads those reports and tells the caller which
+ * buffers are free again.
+ *
+ * Small sends aren't worth the page pinning and the notification, below a
+ * threshold they go out with a plain send().
+ *
+ * (c) Copyright 2012, Steve Anderson
+ *
+ */
+
+#ifdef DEBUG
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "ssocklib.h"
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY	1
+#endif
+
+#define ZC_DEFAULT_THRESHOLD	(16 * 1024)	/* below this copying is cheaper */
+
+struct SockZeroCopy {
+    int			sockfd;
+    int			enabled;	/* SO_ZEROCOPY took */
+    int			threshold;
+    unsigned int	next_id;	/* id the kernel gives the next zero-copy send */
+    unsigned int	done_upto;	/* every id below this has completed */
+    unsigned int	copied;		/* completions where the kernel copied after all */
+    SockZeroCopyFunc	done_fn;
+    void		*arg;
+};
+
+SockZeroCopy *CreateZeroCopy(int sockfd, int threshold, SockZeroCopyFunc done_fn, void *arg)
+{
+    SockZeroCopy	*z;
+#ifdef HAVE_ZEROCOPY
+    int			on = 1;
+#endif
+
+    if (sockfd < 0) {
+	errno = EINVAL;
+	return (NULL);
+    }
+
+    z = calloc(1, sizeof(SockZeroCopy));
+    if (z == NULL) {
+	errno = ENOMEM;
+	return (NULL);
+    }
+
+    z->sockfd = sockfd;
+    z->threshold = (threshold > 0) ? threshold : ZC_DEFAULT_THRESHOLD;
+    z->done_fn = done_fn;
+    z->arg = arg;
+
+#ifdef HAVE_ZEROCOPY
+	/* old kernels say no, then every send is simply a copying one */
+    z->enabled = (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+#endif
+
+#ifdef DEBUG
+    fprintf(stderr,"%s : CreateZeroCopy(%d, %d) zero-copy %s\n",__FILE__,sockfd,z->threshold,
+	    z->enabled ? "enabled" : "not available");
+#endif
+
+    return (z);
+}
+
+int CloseZeroCopy(SockZeroCopy *z)
+{
+    if (z == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    free(z);
+
+    return (0);
+}
+
+/*
+ * send, zero-copy if the buffer is big enough
+ *
+ * Whether it was is told apart in *held, not with a special id: the kernel's
+ * counter is 32 bits and goes through every value, any id is a real one.
+ */
+int SendZeroCopy(SockZeroCopy *z, char *buffer, int buffer_sz, unsigned int *id, int *held)
+{
+    long long	start;
+    int		n;
+
+    if (z == NULL || id == NULL || held == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    *id = 0;
+    *held = 0;
+
+#ifdef HAVE_ZEROCOPY
+    if (z->enabled && buffer_sz >= z->threshold) {
+	start = SockStatStart();
+	n = send(z->sockfd, buffer, buffer_sz, MSG_ZEROCOPY | MSG_NOSIGNAL);
+	SockStatEnd(SOCK_STAT_WRITE, z->sockfd, buffer_sz, n, start);
+	if (n > 0) {
+	    *id = z->next_id++;
+	    *held = 1;
+	    return (n);
+	}
+	if (n < 0 && errno != ENOBUFS)
+	    return (-1);
+	/* ENOBUFS: out of optmem for notifications, this one gets copied */
+    }
+#endif
+
+    start = SockStatStart();
+    n = send(z->sockfd, buffer, buffer_sz, MSG_NOSIGNAL);
+    SockStatEnd(SOCK_STAT_WRITE, z->sockfd, buffer_sz, n, start);
+
+    return (n);
+}
+
+/*
+ * read the completion notifications off the error queue
+ */
+int ReapZeroCopy(SockZeroCopy *z, int timeout_ms)
+{
+#ifdef HAVE_ZEROCOPY
+    struct pollfd		pfd;
+    struct msghdr		msg;
+    struct cmsghdr		*cm;
+    struct sock_extended_err	*serr;
+    char			control[128];
+    unsigned int		lo, hi;
+    int				copied, count = 0;
+#endif
+
+    if (z == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+#ifdef HAVE_ZEROCOPY
+    if (!z->enabled || z->done_upto == z->next_id)
+	return (0);	/* nothing outstanding */
+
+    if (timeout_ms != 0) {
+	pfd.fd = z->sockfd;
+	pfd.events = 0;		/* POLLERR is always reported */
+	if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+	    return (-1);
+    }
+
+    for (;;) {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(z->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		break;
+	    return ((count > 0) ? count : -1);
+	}
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+	    if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+		  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+		continue;
+
+	    serr = (struct sock_extended_err *) CMSG_DATA(cm);
+	    if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		continue;
+
+	    /* one notification covers the range of sends [lo, hi] */
+	    lo = serr->ee_info;
+	    hi = serr->ee_data;
+	    copied = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+	    if (copied)
+		z->copied += hi - lo + 1;
+
+	    /* TCP completes in order, so this is a running high water mark */
+	    if ((int) (hi + 1 - z->done_upto) > 0)
+		z->done_upto = hi + 1;
+
+	    if (z->done_fn != NULL)
+		(*z->done_fn)(z, lo, hi, copied, z->arg);
+	    count++;
+	}
+    }
+
+    return (count);
+#else
+    (void) timeout_ms;
+    return (0);
+#endif
+}
+
+/*
+ * has the send with this id completed (is its buffer free)?
+ */
+int ZeroCopyDone(SockZeroCopy *z, unsigned int id)
+{
+    if (z == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    return ((int) (z->done_upto - id) > 0);
+}
+
+/*
+ * how many zero-copy sends are still holding on to their buffers
+ */
+int PendingZeroCopy(SockZeroCopy *z)
+{
+    if (z == NULL) {
+	errno = EINVAL;
+	return (-1);
+    }
+
+    return ((int) (z->next_id - z->done_upto));
+}